@@ -0,0 +1,111 @@
+#!/usr/bin/env python2
+"""
+SC-Controller - CemuHook server benchmark
+
+Starts DSU server on random local port, connects simulated clients
+subscribed to all slots and measures how fast can motion data frames be
+sent to them. Clients are reading data in between frames, so nothing is
+dropped by kernel.
+
+If path to another build of libcemuhook.so (version 2 or newer) is
+given, it's measured as well.
+
+Usage: python2 benchmarks/cemuhook.py [clients] [frames] [reference_libcemuhook.so]
+"""
+import os, sys, time, struct, socket, resource, zlib, ctypes
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), ".."))
+from scc.cemuhook_server import CemuhookServer, MessageType
+from scc.tools import find_library
+from ctypes import c_int, c_bool, c_char_p, c_size_t, c_uint8
+
+SLOTS = 2
+FRAMES_PER_READ = 16
+
+
+def load(lib):
+	lib.cemuhook_data_recieved.argtypes = [ c_int, c_char_p, c_int, c_char_p, c_size_t ]
+	lib.cemuhook_data_recieved.restype = None
+	lib.cemuhook_feed.argtypes = [ c_int, c_int, CemuhookServer.C_DATA_T ]
+	lib.cemuhook_feed.restype = c_bool
+	lib.cemuhook_set_slot.argtypes = [ c_int, c_bool, CemuhookServer.C_MAC_T, c_uint8 ]
+	lib.cemuhook_set_slot.restype = c_bool
+	lib.cemuhook_socket_enable.restype = c_bool
+	return lib
+
+
+def make_request():
+	""" Returns DSUC_PADDATAREQ message asking for all slots """
+	payload = struct.pack("<BB6s", 0, 0, b"\0" * 6)
+	msg = b"DSUC" + struct.pack("<HHII", 1001, len(payload) + 4, 0, 1)
+	msg += struct.pack("<I", MessageType.DSUC_PADDATAREQ) + payload
+	crc = zlib.crc32(msg) & 0xFFFFFFFF
+	return msg[0:8] + struct.pack("<I", crc) + msg[12:]
+
+
+def drain(clients):
+	count = 0
+	for c in clients:
+		try:
+			while True:
+				c.recv(1024)
+				count += 1
+		except socket.error:
+			pass
+	return count
+
+
+def measure(lib, client_count, frames):
+	lib.cemuhook_socket_enable()
+	server = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+	server.bind(("127.0.0.1", 0))
+	for slot in xrange(SLOTS):
+		lib.cemuhook_set_slot(slot, True, CemuhookServer.C_MAC_T(2, 0, 0, 0, 0, slot), 5)
+	
+	clients, request = [], make_request()
+	for i in xrange(client_count):
+		c = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+		c.setblocking(False)
+		c.sendto(request, server.getsockname())
+		message, (ip, port) = server.recvfrom(1024)
+		lib.cemuhook_data_recieved(server.fileno(), ip, port, message, len(message))
+		clients.append(c)
+	
+	data = CemuhookServer.C_DATA_T(0, 0, 0, 1.0, 2.0, 3.0)
+	fd, feed = server.fileno(), lib.cemuhook_feed
+	elapsed, cpu, received = 0.0, 0.0, 0
+	for i in xrange(0, frames, FRAMES_PER_READ):
+		usage = resource.getrusage(resource.RUSAGE_SELF)
+		start = time.time()
+		for j in xrange(FRAMES_PER_READ):
+			for slot in xrange(SLOTS):
+				feed(fd, slot, data)
+		elapsed += time.time() - start
+		end_usage = resource.getrusage(resource.RUSAGE_SELF)
+		cpu += ((end_usage.ru_utime + end_usage.ru_stime)
+				- (usage.ru_utime + usage.ru_stime))
+		received += drain(clients)
+	
+	for slot in xrange(SLOTS):
+		lib.cemuhook_set_slot(slot, False, CemuhookServer.C_MAC_T(), 0)
+	server.close()
+	for c in clients:
+		c.close()
+	
+	frames = (frames / FRAMES_PER_READ) * FRAMES_PER_READ * SLOTS
+	return frames, frames * client_count / elapsed, cpu * 1000000.0 / frames, received
+
+
+def main(client_count=8, frames=20000, reference=None):
+	client_count, frames = int(client_count), int(frames)
+	libs = [ ("current", load(find_library("libcemuhook"))) ]
+	if reference:
+		libs.append(("reference", load(ctypes.CDLL(reference))))
+	print "%s clients, %s slots" % (client_count, SLOTS)
+	for name, lib in libs:
+		sent, pps, cpu, received = measure(lib, client_count, frames)
+		print "%-10s %9.0f packets/s %7.2f us CPU per frame, %s of %s packets recieved" % (
+			name, pps, cpu, received, sent * client_count)
+
+
+if __name__ == "__main__":
+	main(*sys.argv[1:])
@@ -0,0 +1,167 @@
+#!/usr/bin/env python2
+"""
+SC-Controller - HID decoder benchmark
+
+Measures how many reports per second can hiddrv.c decode with decoders
+that hiddrv and ds4drv generate. To not measure ctypes overhead, decoder
+source is compiled together with small loop calling decode() directly.
+
+If path to another version of hiddrv.c is given, it's measured as well and
+results of both are compared. For example:
+	git show <older commit>:scc/drivers/hiddrv.c > /tmp/hiddrv.c
+	python2 benchmarks/hiddrv.py 100000 /tmp/hiddrv.c
+
+Then, cost of decoding same reports through ctypes is measured, calling
+decode for every report and decode_many with batches of reports, as
+HIDController does when more of them arrive at once.
+
+Usage: python2 benchmarks/hiddrv.py [reports] [reference_hiddrv.c]
+"""
+import os, sys, time, random, ctypes, tempfile, subprocess, sysconfig
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), ".."))
+from scc.drivers.hiddrv import HIDController, HIDDecoder, HIDDecoderPtr, _lib
+from scc.drivers.ds4drv import DS4Controller
+
+SOURCE = os.path.join(os.path.dirname(__file__), "..", "scc", "drivers", "hiddrv.c")
+HARNESS = r"""
+#include "%s"
+#include <time.h>
+
+double bench(struct HIDDecoder* dec, const char* reports, size_t size, size_t count) {
+	struct timespec start, end;
+	size_t i;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i=0; i<count; i++)
+		decode(dec, reports + i * size);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+"""
+REPORT_SIZE = 64
+BATCH_SIZES = ( 2, 4, 8 )
+
+
+# Common USB gamepad: 4 8-bit axes, hatswitch and 12 buttons
+GAMEPAD_DESCRIPTOR = [ 0x05, 0x01, 0x09, 0x05, 0xA1, 0x01,
+	0x15, 0x00, 0x26, 0xFF, 0x00, 0x75, 0x08, 0x95, 0x04,
+	0x09, 0x30, 0x09, 0x31, 0x09, 0x32, 0x09, 0x35, 0x81, 0x02,
+	0x05, 0x01, 0x09, 0x39, 0x15, 0x00, 0x25, 0x07, 0x75, 0x04,
+	0x95, 0x01, 0x81, 0x42, 0x05, 0x09, 0x19, 0x01, 0x29, 0x0C,
+	0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x0C, 0x81, 0x02,
+	0xC0 ]
+
+# Same as GUI generates for such gamepad
+GAMEPAD_CONFIG = {
+	"axes": {
+		"0": { "axis": "stick_x", "min": 0, "max": 255, "deadzone": 2 },
+		"1": { "axis": "stick_y", "min": 255, "max": 0, "deadzone": 2 },
+		"2": { "axis": "rpad_x", "min": 0, "max": 255, "deadzone": 2 },
+		"3": { "axis": "rpad_y", "min": 255, "max": 0, "deadzone": 2 },
+		"4": { "axis": "lpad_x", "min": -32768, "max": 32767 },
+	},
+	"buttons": { str(288 + i): b for (i, b) in enumerate((
+		"A", "B", "X", "Y", "LB", "RB", "LT", "RT", "BACK", "START",
+		"STICKPRESS", "RPAD" )) },
+}
+
+
+def make_decoders():
+	""" Returns list of (name, HIDDecoder) tuples """
+	rv = []
+	
+	c = HIDController.__new__(HIDController)
+	c._build_hid_decoder(GAMEPAD_DESCRIPTOR, None, 64)
+	rv.append(("hiddrv, no config", c._decoder))
+	
+	c = HIDController.__new__(HIDController)
+	c._build_hid_decoder(GAMEPAD_DESCRIPTOR, GAMEPAD_CONFIG, 64)
+	rv.append(("hiddrv, gamepad config", c._decoder))
+	
+	c = DS4Controller.__new__(DS4Controller)
+	c._load_hid_descriptor(None, 64, 0, 0, False)
+	rv.append(("ds4drv", c._decoder))
+	return rv
+
+
+def make_reports(count):
+	random.seed(0)
+	reports, report = [], [ 0x80 ] * REPORT_SIZE
+	for i in xrange(count):
+		# Change few bytes at time, as real controller does
+		for j in xrange(random.randint(1, 4)):
+			report[random.randint(0, REPORT_SIZE - 1)] = random.randint(0, 255)
+		reports.append(b"".join([ chr(x) for x in report ]))
+	return reports
+
+
+def build(source):
+	""" Compiles decoder source with benchmark loop and loads it """
+	tmp = tempfile.mkdtemp()
+	c_file, so_file = os.path.join(tmp, "bench.c"), os.path.join(tmp, "bench.so")
+	file(c_file, "w").write(HARNESS % (os.path.abspath(source),))
+	subprocess.check_call([ "cc", "-O2", "-shared", "-fPIC", "-w",
+		"-I", sysconfig.get_paths()["include"], c_file, "-o", so_file ])
+	lib = ctypes.CDLL(so_file)
+	lib.bench.restype = ctypes.c_double
+	lib.bench.argtypes = [ HIDDecoderPtr, ctypes.c_char_p, ctypes.c_size_t, ctypes.c_size_t ]
+	lib.decode.restype = ctypes.c_bool
+	lib.decode.argtypes = [ HIDDecoderPtr, ctypes.c_char_p ]
+	return lib
+
+
+def measure(lib, decoder, reports):
+	""" Returns (reports per second, list of decoded states) """
+	states = []
+	for r in reports[0:1000]:
+		lib.decode(ctypes.byref(decoder), r)
+		states.append(bytearray(decoder.state))
+	data = b"".join(reports)
+	elapsed = min([ lib.bench(ctypes.byref(decoder), data, REPORT_SIZE, len(reports))
+		for x in xrange(5) ])
+	return len(reports) / elapsed, states
+
+
+def main(count=1000000, reference=None):
+	count = int(count)
+	reports = make_reports(count)
+	lib = build(SOURCE)
+	ref_lib = build(reference) if reference else None
+	print "%s reports" % (count,)
+	for name, decoder in make_decoders():
+		copy = HIDDecoder.from_buffer_copy(decoder)
+		rate, states = measure(lib, decoder, reports)
+		line = "%-24s %6.1fM reports/s" % (name, rate / 1000000.0)
+		if ref_lib:
+			ref_rate, ref_states = measure(ref_lib, copy, reports)
+			line += "   reference %6.1fM reports/s  %s" % (ref_rate / 1000000.0,
+				"same output" if states == ref_states else "OUTPUT DIFFERS")
+		print line
+	
+	print "Through ctypes:"
+	reports = reports[0:100000]
+	for name, decoder in make_decoders():
+		print "%-24s %6.1fM reports/s one by one" % (name,
+			measure_ctypes(decoder, reports, 1) / 1000000.0),
+		for batch in BATCH_SIZES:
+			print "  %6.1fM by %s" % (
+				measure_ctypes(decoder, reports, batch) / 1000000.0, batch),
+		print
+
+
+def measure_ctypes(decoder, reports, batch):
+	""" Returns reports per second decoded through ctypes """
+	ref = ctypes.byref(decoder)
+	if batch == 1:
+		start = time.time()
+		for r in reports:
+			_lib.decode(ref, r)
+	else:
+		batches = [ b"".join(reports[i:i+batch]) for i in xrange(0, len(reports), batch) ]
+		start = time.time()
+		for b in batches:
+			_lib.decode_many(ref, b, REPORT_SIZE, len(b) / REPORT_SIZE)
+	return len(reports) / (time.time() - start)
+
+
+if __name__ == "__main__":
+	main(*sys.argv[1:])
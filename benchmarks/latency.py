@@ -0,0 +1,291 @@
+#!/usr/bin/env python2
+"""
+SC-Controller - End-to-end latency benchmark
+
+Feeds synthetic reports at fixed rate through whole input pipeline:
+decoder (sc_dongle, sc_by_bt.c or hiddrv.c) -> Mapper.input ->
+Scheduler.run -> generate_events, for every shipped profile.
+
+Virtual devices are created as usual, but libuinput gets pipe instead of
+/dev/uinput, so real uinput_write_events writes input_events into it.
+Time of every write is recorded and latency is measured from moment when
+report was passed to decoder to first write caused by it. CPU time is
+taken from getrusage, so time spent waiting for next report is not
+counted.
+
+Results are printed as table and, with -o, saved as JSON, so they can be
+compared between releases.
+
+Usage: python2 benchmarks/latency.py [-r 250,500,1000] [-n reports]
+		[-d dongle,bt,hid] [-o results.json] [profile.sccprofile ...]
+"""
+import os, sys, time, glob, json, math, fcntl, struct, ctypes, resource
+import argparse, tempfile, logging
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), ".."))
+from scc.lib.trace import mono_time_us
+from scc.drivers.replay import FakeUSBDevice, FakeUSBHandle, FakeHIDRaw, Responses
+from scc.drivers import sc_dongle, sc_by_bt
+from scc.drivers.hiddrv import HIDController
+from scc.constants import DAEMON_VERSION
+from scc.parser import ActionParser
+from scc.profile import Profile
+from scc.tools import find_library
+from replay import FakeDaemon
+import scc.uinput
+
+PROFILES = os.path.join(os.path.dirname(__file__), "..", "default_profiles")
+INPUT_EVENT_SIZE = ctypes.sizeof(scc.uinput.InputEvent)
+WARMUP = 100
+PERCENTILES = ( 50, 99, 99.9 )
+
+# Common USB gamepad: 4 8-bit axes, hatswitch and 12 buttons
+GAMEPAD_DESCRIPTOR = [ 0x05, 0x01, 0x09, 0x05, 0xA1, 0x01,
+	0x15, 0x00, 0x26, 0xFF, 0x00, 0x75, 0x08, 0x95, 0x04,
+	0x09, 0x30, 0x09, 0x31, 0x09, 0x32, 0x09, 0x35, 0x81, 0x02,
+	0x05, 0x01, 0x09, 0x39, 0x15, 0x00, 0x25, 0x07, 0x75, 0x04,
+	0x95, 0x01, 0x81, 0x42, 0x05, 0x09, 0x19, 0x01, 0x29, 0x0C,
+	0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x0C, 0x81, 0x02,
+	0xC0 ]
+GAMEPAD_CONFIG = {
+	"axes": {
+		"0": { "axis": "stick_x", "min": 0, "max": 255, "deadzone": 2 },
+		"1": { "axis": "stick_y", "min": 255, "max": 0, "deadzone": 2 },
+		"2": { "axis": "rpad_x", "min": 0, "max": 255, "deadzone": 2 },
+		"3": { "axis": "rpad_y", "min": 255, "max": 0, "deadzone": 2 },
+	},
+	"buttons": { "288": "A", "289": "B", "290": "X", "291": "Y" },
+}
+
+
+class UInputSink(object):
+	"""
+	Stand-in for libuinput. Every device gets write end of same pipe
+	instead of /dev/uinput and everything else is passed to real library.
+	"""
+	
+	def __init__(self):
+		self._lib = find_library("libuinput")
+		self._r, self._w = os.pipe()
+		fcntl.fcntl(self._r, fcntl.F_SETFL, os.O_NONBLOCK)
+		self.writes = []
+	
+	
+	def __getattr__(self, name):
+		return getattr(self._lib, name)
+	
+	
+	def uinput_init(self, *a):
+		return self._w
+	
+	
+	def uinput_destroy(self, fd):
+		pass
+	
+	
+	def uinput_set_delay_period(self, *a):
+		pass
+	
+	
+	def uinput_write_events(self, fd, events, count):
+		r = self._lib.uinput_write_events(fd, events, count)
+		self.writes.append(mono_time_us())
+		return r
+	
+	
+	def drain(self):
+		""" Reads everything written so far. Returns number of events """
+		size = 0
+		try:
+			while True:
+				size += len(os.read(self._r, 65536))
+		except OSError:
+			pass
+		return size // INPUT_EVENT_SIZE
+
+
+def motion(i):
+	""" Returns (x, y, buttons_pressed) for i-th report """
+	a = i * 0.01
+	return math.sin(a), math.cos(a), (i // 50) % 2 == 1
+
+
+def setup_dongle(daemon):
+	""" Steam Controller connected over dongle """
+	serial = struct.pack(">xBx12s49x", 10, b"BENCHMARK0")
+	handle = FakeUSBHandle(Responses([ ("controlRead", bytearray(serial)) ]))
+	dongle = sc_dongle.Dongle(FakeUSBDevice({
+		"vendor": sc_dongle.VENDOR_ID, "product": sc_dongle.PRODUCT_ID,
+		"bus": 1, "port": 1, "address": 2,
+		"interfaces": [ [ {
+			"number": 0, "class": 3, "subclass": 0, "protocol": 0,
+			"endpoints": [ ],
+		} ] ],
+	}), handle, daemon)
+	transfer = [ t for t in handle.transfers
+		if t.endpoint == sc_dongle.FIRST_ENDPOINT ][0]
+	
+	def feed(i):
+		x, y, pressed = motion(i)
+		x, y = int(x * 30000), int(y * 30000)
+		buttons = 0x18000000 | (0x8000 if pressed else 0)
+		transfer.complete(struct.pack(sc_dongle.TUP_FORMAT,
+			1, sc_dongle.SCStatus.INPUT, i & 0xFFFF, buttons,
+			0, 0, x, y, y, x, x // 10, y // 10, 0, 0, 0, 0, 0))
+		dongle.flush()
+	
+	# First report makes dongle to add controller and ask for serial
+	feed(0)
+	return feed
+
+
+def setup_bt(daemon):
+	""" Steam Controller connected over bluetooth """
+	hidraw = FakeHIDRaw(Responses([ ("getName", "SteamController"),
+		("getPhysicalAddress", "00:11:22:33:44:55") ]))
+	controller = sc_by_bt.SCByBt(sc_by_bt.Driver(daemon, {}),
+		"/sys/benchmark", hidraw)
+	
+	def feed(i):
+		# type 0x0390 = BUTTON | STICK | LPAD | RPAD
+		x, y, pressed = motion(i)
+		x, y = int(x * 30000), int(y * 30000)
+		packet = struct.pack("<BBH3shhhhhh", 3, 0, 0x0390,
+			b"\x80\x00\x00" if pressed else b"\0\0\0", x, y, x, y, y, x)
+		hidraw.write(packet.ljust(sc_by_bt.PACKET_SIZE, b"\0"))
+		controller._input()
+	
+	return feed
+
+
+def setup_hid(daemon):
+	""" Generic USB gamepad handled by hiddrv """
+	handle = FakeUSBHandle(Responses([ ("getRawDescriptor", GAMEPAD_DESCRIPTOR) ]))
+	cwd = os.getcwd()
+	# HIDController dumps descriptor into working directory
+	os.chdir(tempfile.gettempdir())
+	try:
+		controller = HIDController(FakeUSBDevice({
+			"vendor": 0xDEAD, "product": 0xBEEF, "bus": 1, "port": 1, "address": 3,
+			"interfaces": [ [ {
+				"number": 0, "class": 3, "subclass": 0, "protocol": 0,
+				"endpoints": [ ( 0x81, 3, 64 ) ],
+			} ] ],
+		}), daemon, handle, None, GAMEPAD_CONFIG)
+	finally:
+		os.chdir(cwd)
+	transfer = handle.transfers[0]
+	padding = b"\0" * (controller._packet_size - 6)
+	
+	def feed(i):
+		x, y, pressed = motion(i)
+		x, y = int(x * 127 + 128), int(y * 127 + 128)
+		transfer.complete(struct.pack("<BBBBH", x, y, y, x,
+			0x0F | (0x10 if pressed else 0)) + padding)
+		controller.flush()
+	
+	return feed
+
+
+DECODERS = {
+	"dongle": setup_dongle,
+	"bt": setup_bt,
+	"hid": setup_hid,
+}
+
+
+def percentile(values, p):
+	if not values:
+		return None
+	return values[min(len(values) - 1, int(math.ceil(p / 100.0 * len(values))) - 1)]
+
+
+def measure(sink, profile_filename, decoder, rate, count):
+	profile = Profile(ActionParser()).load(profile_filename)
+	profile.compress()
+	daemon = FakeDaemon(profile, virtual_devices=True, enable_gyro=True)
+	feed = DECODERS[decoder](daemon)
+	scheduler = daemon.scheduler
+	interval = 1.0 / rate
+	latencies, events, silent = [], 0, 0
+	
+	for i in xrange(1, WARMUP):
+		feed(i)
+		scheduler.run()
+	sink.drain()
+	
+	usage = resource.getrusage(resource.RUSAGE_SELF)
+	cpu = usage.ru_utime + usage.ru_stime
+	deadline = time.time()
+	for i in xrange(WARMUP, WARMUP + count):
+		delay = deadline - time.time()
+		if delay > 0:
+			time.sleep(delay)
+		deadline += interval
+		del sink.writes[:]
+		t0 = mono_time_us()
+		feed(i)
+		scheduler.run()
+		if sink.writes:
+			latencies.append(sink.writes[0] - t0)
+		else:
+			silent += 1
+		events += sink.drain()
+	usage = resource.getrusage(resource.RUSAGE_SELF)
+	cpu = usage.ru_utime + usage.ru_stime - cpu
+	
+	latencies.sort()
+	rv = {
+		"profile": os.path.basename(profile_filename),
+		"decoder": decoder,
+		"rate": rate,
+		"reports": count,
+		"reports_without_events": silent,
+		"events": events,
+		"cpu_us_per_report": cpu * 1000000.0 / count,
+	}
+	for p in PERCENTILES:
+		rv["p%s_us" % (str(p).replace(".", ""),)] = percentile(latencies, p)
+	return rv
+
+
+def main():
+	parser = argparse.ArgumentParser(description="SC-Controller latency benchmark")
+	parser.add_argument("-r", "--rates", default="250,500,1000",
+		help="comma separated report rates, in Hz")
+	parser.add_argument("-n", "--reports", type=int, default=2000,
+		help="number of reports measured for every combination")
+	parser.add_argument("-d", "--decoders", default=",".join(sorted(DECODERS)),
+		help="comma separated decoders to use")
+	parser.add_argument("-o", "--output", help="file to save JSON results to")
+	parser.add_argument("profiles", nargs="*",
+		default=sorted(glob.glob(os.path.join(PROFILES, "*.sccprofile"))))
+	args = parser.parse_args()
+	logging.basicConfig(level=logging.ERROR)
+	
+	sink = UInputSink()
+	scc.uinput.find_library = lambda name: sink
+	results = []
+	print "%-44s %-6s %5s %8s %8s %8s %10s" % ("profile", "input", "Hz",
+		"p50 us", "p99 us", "p999 us", "cpu us/r")
+	for profile in args.profiles:
+		for decoder in args.decoders.split(","):
+			for rate in [ int(x) for x in args.rates.split(",") ]:
+				r = measure(sink, profile, decoder, rate, args.reports)
+				results.append(r)
+				print "%-44s %-6s %5s %8s %8s %8s %10.1f" % (
+					r["profile"][0:44], decoder, rate,
+					r["p50_us"], r["p99_us"], r["p999_us"],
+					r["cpu_us_per_report"])
+				sys.stdout.flush()
+	
+	if args.output:
+		json.dump({
+			"version": DAEMON_VERSION,
+			"time": int(time.time()),
+			"reports": args.reports,
+			"results": results,
+		}, open(args.output, "w"), indent=4, sort_keys=True)
+
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,108 @@
+#!/usr/bin/env python2
+"""
+SC-Controller - Mapper benchmark
+
+Measures how long Mapper.input takes per report with shipped profiles and
+with profile that binds only few inputs, for Steam Controller and for
+generic gamepad with separate stick. Virtual devices are not created,
+so time spent writing events is not measured.
+
+If path to another version of mapper.py is given, it's measured as well and
+results of both are compared. For example:
+	git show <older commit>:scc/mapper.py > /tmp/mapper.py
+	python2 benchmarks/mapper.py 100000 /tmp/mapper.py
+
+Usage: python2 benchmarks/mapper.py [reports] [reference_mapper.py]
+"""
+import os, sys, imp, math, glob, time, logging
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), ".."))
+from scc.constants import SCButtons, ControllerFlags
+from scc.drivers.fake import FakeController
+from scc.parser import ActionParser
+from scc.scheduler import Scheduler
+from scc.profile import Profile
+from scc.mapper import Mapper
+from collections import namedtuple
+
+PROFILES = os.path.join(os.path.dirname(__file__), "..", "default_profiles")
+ControllerInput = namedtuple('ControllerInput',
+	'buttons ltrig rtrig stick_x stick_y lpad_x lpad_y rpad_x rpad_y '
+	'gpitch groll gyaw q1 q2 q3 q4 cpad_x cpad_y'
+)
+# Only A, B and right trigger are bound
+FEW_INPUTS = {
+	"buttons" : { "A" : { "action" : "button(Keys.KEY_ENTER)" },
+				  "B" : { "action" : "button(Keys.KEY_ESC)" } },
+	"trigger_right" : { "action" : "button(Keys.BTN_LEFT)" },
+}
+CONTROLLERS = (
+	( "sc", 0 ),
+	( "gamepad", ControllerFlags.SEPARATE_STICK | ControllerFlags.HAS_RSTICK
+		| ControllerFlags.HAS_DPAD ),
+)
+
+
+def load_profiles():
+	import json, StringIO
+	rv = []
+	for filename in sorted(glob.glob(os.path.join(PROFILES, "*.sccprofile"))):
+		p = Profile(ActionParser()).load(filename)
+		p.compress()
+		rv.append((os.path.basename(filename).split(".")[0], p))
+	p = Profile(ActionParser())
+	p.load_fileobj(StringIO.StringIO(json.dumps(FEW_INPUTS)))
+	p.compress()
+	rv.append(("few inputs", p))
+	return rv
+
+
+def generate(count):
+	"""
+	Generates reports with stick moving all the time, right pad touched and
+	moving in half of them, trigger pulled and A pressed from time to time.
+	"""
+	rv = []
+	for i in xrange(0, count):
+		a = i * 0.01
+		x, y = int(math.sin(a) * 30000), int(math.cos(a) * 30000)
+		buttons = int(SCButtons.A) if (i // 50) % 2 else 0
+		if (i // 100) % 2:
+			buttons |= SCButtons.RPADTOUCH
+		rv.append(ControllerInput(buttons, 0, (i * 5) % 256 if (i // 200) % 2 else 0,
+			x, y, 0, 0, y, x, 0, 0, 0, 0, 0, 0, 0, 0, 0))
+	return rv
+
+
+def measure(mapper_class, profile, flags, reports):
+	controller = FakeController(0)
+	controller.flags = flags
+	mapper = mapper_class(profile, Scheduler(),
+		keyboard=None, mouse=None, gamepad=None)
+	mapper.set_controller(controller)
+	old_state = reports[-1]
+	start = time.time()
+	for state in reports:
+		mapper.input(controller, old_state, state)
+		old_state = state
+	return (time.time() - start) * 1000000.0 / len(reports)
+
+
+def main(count=100000, reference=None):
+	logging.basicConfig(level=logging.ERROR)
+	reports = generate(int(count))
+	classes = [ ("current", Mapper) ]
+	if reference:
+		classes.append(("reference", imp.load_source("reference_mapper", reference).Mapper))
+	print "%-28s %-8s %s" % ("Profile", "Flags", "   ".join(
+		"%s us/report" % (name,) for (name, c) in classes))
+	for pname, profile in load_profiles():
+		for cname, flags in CONTROLLERS:
+			times = [ measure(c, profile, flags, reports) for (name, c) in classes ]
+			print "%-28s %-8s %s%s" % (pname[0:28], cname,
+				"   ".join("%18.2f" % (t,) for t in times),
+				"   (%+.0f%%)" % ((times[0] / times[1] - 1.0) * 100.0,)
+				if len(times) > 1 else "")
+
+
+if __name__ == "__main__":
+	main(*sys.argv[1:])
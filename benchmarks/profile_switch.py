@@ -0,0 +1,101 @@
+#!/usr/bin/env python2
+"""
+SC-Controller - Profile switch benchmark
+
+Measures how long it takes to switch mapper to another profile, the way
+daemon does it, when profile is parsed on switch and when it's taken from
+ProfileCache that loaded it ahead. Besides shipped profiles, large profile
+with modeshifts on every button and few menus is generated and measured.
+
+Usage: python2 benchmarks/profile_switch.py [repeats]
+"""
+import os, sys, json, glob, time, tempfile, logging
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), ".."))
+from scc.parser import TalkingActionParser
+from scc.profile_cache import ProfileCache
+from scc.drivers.fake import FakeController
+from scc.scheduler import Scheduler
+from scc.constants import SCButtons
+from scc.profile import Profile
+from scc.mapper import Mapper
+
+PROFILES = os.path.join(os.path.dirname(__file__), "..", "default_profiles")
+BASE_PROFILE = os.path.join(PROFILES, "XBox Controller.sccprofile")
+LARGE_MENUS = 8
+LARGE_MENU_ITEMS = 30
+
+
+def generate_large(filename):
+	""" Writes profile with modeshift on every button and few menus """
+	data = json.loads(open(BASE_PROFILE, "r").read())
+	keys = [ "KEY_%s" % (chr(ord("A") + i),) for i in xrange(0, 26) ]
+	for i, b in enumerate(SCButtons):
+		if b.name in data["buttons"] or b.name in ("C", "LPADTOUCH", "RPADTOUCH"):
+			continue
+		data["buttons"][b.name] = { "action" : "mode(A, button(Keys.%s), "
+			"B, button(Keys.%s), X, hold(button(Keys.%s), button(Keys.%s)), "
+			"button(Keys.%s))" % tuple(keys[(i + j) % len(keys)] for j in xrange(5)) }
+	data["menus"] = {
+		"menu%s" % (m,) : [
+			{ "id" : "item%s" % (i,), "name" : "Item %s" % (i,),
+			  "action" : "mode(LB, button(Keys.%s), button(Keys.%s))" % (
+				keys[i % len(keys)], keys[(i + m) % len(keys)]) }
+			for i in xrange(0, LARGE_MENU_ITEMS) ]
+		for m in xrange(0, LARGE_MENUS)
+	}
+	file(filename, "w").write(json.dumps(data))
+
+
+def switch(mapper, profile):
+	""" Does same thing with mapper as SCCDaemon._set_profile """
+	mapper.cancel_all()
+	mapper.release_virtual_buttons()
+	mapper.set_profile(profile)
+
+
+def measure_parsed(mapper, filename, repeats):
+	start = time.time()
+	for i in xrange(0, repeats):
+		p = Profile(TalkingActionParser())
+		p.load(filename).compress()
+		switch(mapper, p)
+	return (time.time() - start) * 1000.0 / repeats
+
+
+def measure_cached(mapper, filename, repeats):
+	cache, total = ProfileCache(), 0.0
+	cache.prewarm([ filename ])
+	for i in xrange(0, repeats):
+		# Waiting for background thread is not measured, as daemon
+		# switches to profile long after it's loaded
+		cache.wait()
+		start = time.time()
+		switch(mapper, cache.load(filename))
+		total += time.time() - start
+	cache.wait()
+	assert cache.hits == repeats
+	return total * 1000.0 / repeats
+
+
+def main(repeats=20):
+	logging.basicConfig(level=logging.ERROR)
+	repeats = int(repeats)
+	large = tempfile.mktemp(suffix=".sccprofile")
+	generate_large(large)
+	mapper = Mapper(Profile(TalkingActionParser()), Scheduler(),
+		keyboard=None, mouse=None, gamepad=None)
+	mapper.set_controller(FakeController(0))
+	profiles = sorted(glob.glob(os.path.join(PROFILES, "*.sccprofile")))
+	try:
+		print "%-40s %12s %12s" % ("Profile", "parsed ms", "cached ms")
+		for filename in profiles + [ large ]:
+			name = "generated large" if filename == large else os.path.basename(filename)
+			print "%-40s %12.3f %12.3f" % (name[0:40],
+				measure_parsed(mapper, filename, repeats),
+				measure_cached(mapper, filename, repeats))
+	finally:
+		os.unlink(large)
+
+
+if __name__ == "__main__":
+	main(*sys.argv[1:])
@@ -0,0 +1,130 @@
+#!/usr/bin/env python2
+"""
+SC-Controller - Input trace replay benchmark
+
+Replays input trace recorded with SCC_TRACE=<file> as fast as possible,
+through same drivers, decoders and Mapper with given profile, but without
+virtual devices, and measures how long it takes.
+
+If no trace is given, synthetic one is generated, with Steam Controller
+connected over dongle moving stick, both pads and gyro and pressing buttons.
+
+Usage: python2 benchmarks/replay.py [trace|-] [profile] [repeats]
+"""
+import os, sys, time, math, struct, tempfile, logging
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), ".."))
+from scc.lib.trace import TraceWriter, RecordKind
+from scc.drivers.replay import Replay
+from scc.drivers import usb, sc_dongle
+from scc.parser import ActionParser
+from scc.scheduler import Scheduler
+from scc.profile import Profile
+from scc.poller import Poller
+from scc.mapper import Mapper
+
+DEFAULT_PROFILE = os.path.join(os.path.dirname(__file__), "..",
+	"default_profiles", "Desktop.sccprofile")
+SYNTHETIC_INPUTS = 100000
+
+
+class FakeDeviceMonitor(object):
+	def add_callback(self, *a): pass
+	def add_remove_callback(self, *a): pass
+
+
+class FakeDaemon(object):
+	"""
+	Provides just enough of SCCDaemon for drivers to work. Also used by
+	latency benchmark, which needs virtual devices and gyro enabled.
+	"""
+	
+	def __init__(self, profile, virtual_devices=False, enable_gyro=False):
+		self.profile = profile
+		self.virtual_devices = virtual_devices
+		self.enable_gyro = enable_gyro
+		self.poller = Poller()
+		self.scheduler = Scheduler()
+		self.monitor = FakeDeviceMonitor()
+		self.controllers = []
+	
+	def get_poller(self): return self.poller
+	def get_scheduler(self): return self.scheduler
+	def get_device_monitor(self): return self.monitor
+	def get_active_ids(self): return [ c.get_id() for c in self.controllers ]
+	def add_error(self, *a): pass
+	def remove_error(self, *a): pass
+	def add_mainloop(self, *a, **b): pass
+	def add_on_exit(self, *a): pass
+	
+	def add_controller(self, c):
+		if self.virtual_devices:
+			mapper = Mapper(self.profile, self.scheduler, gamepad=True)
+		else:
+			mapper = Mapper(self.profile, self.scheduler,
+				keyboard=None, mouse=None, gamepad=False)
+		mapper.set_controller(c)
+		c.set_mapper(mapper)
+		if self.enable_gyro and self.profile.gyro:
+			c.set_gyro_enabled(True)
+		self.controllers.append(c)
+	
+	def remove_controller(self, c):
+		if c in self.controllers:
+			self.controllers.remove(c)
+
+
+def generate(filename, count):
+	""" Writes trace with Steam Controller connected over dongle """
+	writer = TraceWriter(filename)
+	source = writer.add_source({
+		"type": "usb", "vendor": sc_dongle.VENDOR_ID,
+		"product": sc_dongle.PRODUCT_ID, "bus": 1, "port": 1, "address": 2,
+		"interfaces": [ [ {
+			"number": i, "class": 3, "subclass": 0, "protocol": 0,
+			"endpoints": [ ( 0x80 | (sc_dongle.FIRST_ENDPOINT + i), 3, 64 ) ],
+		} ] for i in xrange(0, 4) ]
+	})
+	source.response("controlRead", bytearray(struct.pack(">xBx12s49x",
+		10, b"BENCHMARK0")))
+	endpoint = chr(sc_dongle.FIRST_ENDPOINT)
+	for i in xrange(0, count):
+		a = i * 0.01
+		x, y = int(math.sin(a) * 30000), int(math.cos(a) * 30000)
+		buttons = (1 << 15) if (i // 50) % 2 else 0
+		buttons |= 0x18000000		# lpad and rpad touched
+		source.input(endpoint + struct.pack(sc_dongle.TUP_FORMAT,
+			1, sc_dongle.SCStatus.INPUT, i & 0xFFFF, buttons,
+			0, 0, x, y, y, x, x // 10, y // 10, 0, 0, 0, 0, 0))
+		source.flush()
+	writer.close()
+
+
+def main(filename=None, profile_filename=DEFAULT_PROFILE, repeats=3):
+	logging.basicConfig(level=logging.ERROR)
+	tmp = None
+	if filename in (None, "-"):
+		tmp = filename = tempfile.mktemp(suffix=".scctrace")
+		generate(filename, SYNTHETIC_INPUTS)
+	profile = Profile(ActionParser()).load(profile_filename)
+	profile.compress()
+	daemon = FakeDaemon(profile)
+	usb.init(daemon, {})
+	sc_dongle.init(daemon, {})
+	try:
+		print "Trace:   %s" % (filename if not tmp else "synthetic",)
+		print "Profile: %s" % (os.path.basename(profile_filename),)
+		for i in xrange(0, int(repeats)):
+			replay = Replay(daemon, filename, speed=0)
+			start = time.time()
+			count = replay.run()
+			t = time.time() - start
+			print "%8i inputs in %.3fs, %.1f us per input, %.0f inputs/s" % (
+				count, t, t * 1000000.0 / max(1, count), count / t)
+			replay.reader.close()
+	finally:
+		if tmp:
+			os.unlink(tmp)
+
+
+if __name__ == "__main__":
+	main(*sys.argv[1:])
@@ -0,0 +1,61 @@
+#!/usr/bin/env python2
+"""
+SC-Controller - Scheduler benchmark
+
+Measures cost of schedule / cancel_task / run with large number of pending
+tasks, as created by turbo, hold / doubleclick modifiers and macros.
+
+Usage: python2 benchmarks/scheduler.py [pending_tasks] [operations]
+"""
+import os, sys, time, random
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), ".."))
+from scc.scheduler import Scheduler
+
+NOOP = lambda *a: None
+
+
+def measure(name, count, fn):
+	start = time.time()
+	fn()
+	elapsed = time.time() - start
+	print "%-28s %8.3f us/op" % (name, elapsed * 1000000.0 / count)
+
+
+def main(pending=10000, operations=100000):
+	random.seed(0)
+	s = Scheduler()
+	for i in xrange(pending):
+		s.schedule(60 + random.random() * 60, NOOP)
+	print "%s pending tasks, %s operations" % (len(s), operations)
+	
+	tasks = []
+	def schedule():
+		for i in xrange(operations):
+			tasks.append(s.schedule(60 + random.random() * 60, NOOP))
+	measure("schedule", operations, schedule)
+	
+	def cancel_task():
+		for t in tasks:
+			s.cancel_task(t)
+	measure("cancel_task", operations, cancel_task)
+	
+	def schedule_and_cancel():
+		for i in xrange(operations):
+			s.cancel_task(s.schedule(0.02, NOOP))
+	measure("schedule + cancel_task", operations, schedule_and_cancel)
+	
+	def task_cancel():
+		for i in xrange(operations):
+			s.schedule(0.02, NOOP).cancel()
+	measure("schedule + Task.cancel", operations, task_cancel)
+	
+	def run():
+		for i in xrange(operations):
+			s.schedule(0, NOOP)
+			s.run()
+	measure("schedule + run", operations, run)
+	assert len(s) == pending
+
+
+if __name__ == "__main__":
+	main(*[ int(x) for x in sys.argv[1:] ])
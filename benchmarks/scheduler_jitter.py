@@ -0,0 +1,58 @@
+#!/usr/bin/env python2
+"""
+SC-Controller - Scheduler jitter benchmark
+
+Emulates daemon mainloop with periodic polling (as when controller is
+connected) and busy work between polls, then prints how late were tasks
+repeating every 'interval' executed, in normal and in precise mode.
+
+Usage: python2 benchmarks/scheduler_jitter.py [tasks] [interval_ms] [load_ms]
+"""
+import os, sys, time
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), ".."))
+from scc.scheduler import Scheduler
+from scc.poller import Poller
+
+PERIODIC_INTERVAL = 0.01
+
+
+def busy(seconds):
+	end = time.time() + seconds
+	while time.time() < end:
+		pass
+
+
+def measure(precise, tasks, interval, load):
+	p, s = Poller(), Scheduler()
+	p.set_wake_callback(s.update_time)
+	if precise and not s.enable_precise(p):
+		print "precise mode not available"
+		return
+	remaining = [ tasks ]
+	
+	def repeat():
+		remaining[0] -= 1
+		if remaining[0] > 0:
+			s.schedule(interval, repeat)
+	
+	s.schedule(interval, repeat)
+	while remaining[0] > 0:
+		timeout = s.get_timeout(PERIODIC_INTERVAL)
+		p.poll(timeout, timer=timeout < PERIODIC_INTERVAL)
+		s.run()
+		busy(load)
+	
+	print "%s mode:" % ("precise" if precise else "normal",)
+	for bound, count in s.get_jitter_histogram():
+		print "  < %8gus %6s" % (bound * 1000000, count)
+
+
+def main(tasks=500, interval_ms=7, load_ms=2):
+	print "%s tasks every %sms, %sms of work per mainloop iteration" % (
+		tasks, interval_ms, load_ms)
+	for precise in (False, True):
+		measure(precise, tasks, interval_ms / 1000.0, load_ms / 1000.0)
+
+
+if __name__ == "__main__":
+	main(*[ int(x) for x in sys.argv[1:] ])
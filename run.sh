@@ -1,10 +1,11 @@
 #!/bin/bash
-C_MODULES=(uinput hiddrv sc_by_bt remotepad cemuhook)
-C_VERSION_uinput=9
-C_VERSION_hiddrv=5
-C_VERSION_sc_by_bt=3
+C_MODULES=(uinput hiddrv sc_by_bt remotepad cemuhook native_mapper)
+C_VERSION_uinput=12
+C_VERSION_hiddrv=8
+C_VERSION_sc_by_bt=5
 C_VERSION_remotepad=1
-C_VERSION_cemuhook=1
+C_VERSION_cemuhook=4
+C_VERSION_native_mapper=1
 
 function rebuild_c_modules() {
 	echo "lib$1.so is outdated or missing, building one"
@@ -4,10 +4,22 @@
  * Accepts all connections from clients and sends data captured
  * by 'cemuhook' actions to them.
  *
+ * Every controller with 'cemuhook' action gets one of MAX_SLOTS slots and
+ * clients recieve data only for slots (or controller MACs) they asked for.
+ *
+ * Motion data packet for every slot is prepared only once per frame from
+ * template. For each client, only packet number is changed and CRC is
+ * adjusted using precomputed tables, then all packets are sent at once.
+ *
+ * Drivers that decode input in C can also feed slot directly using
+ * MotionSink returned by cemuhook_get_sink, so motion data is sent with
+ * timestamp of moment when it was read from device.
+ *
  * This code is also used as library in Python code in master branch.
  */
 
 #define LOG_TAG "CemuHook"
+#define _GNU_SOURCE 1	// sendmmsg
 #ifndef PYTHON
 	#include "scc/utils/logging.h"
 	#include "scc/utils/strbuilder.h"
@@ -21,6 +33,7 @@
 	#undef LOG_TAG
 	#define LOG_TAG "CemuHook     "
 	#include "c_branch.h"
+	#include "drivers/scc_future.h"
 #endif	// PYTHON
 #ifdef _WIN32
 	#error "Implement me!"
@@ -38,26 +51,29 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
-#include <zlib.h>
+#include <time.h>
 
 #define BUFFER_SIZE					1024
 #define MAX_PROTO_VERSION			1001
 #define CLIENT_TIMEOUT				(5 * 1000)
-#define CEMUHOOK_MODULE_VERSION		1
-typedef struct CEHClient {
-	struct sockaddr_in	address;
-	monotime_t			last_seen;
-	uint32_t			next_packet_no;
-} CEHClient;
-static uint32_t next_id = 1;
-#ifndef PYTHON
-static LIST_TYPE(CEHClient) clients;
-static int sock;
-#else
-#define CLIENT_LIMIT				10
-static CEHClient clients[CLIENT_LIMIT];
-#endif
+#define MAX_SLOTS					4
+#define HEADER_SIZE					20
+#define PAD_DATA_SIZE				80
+#define CEMUHOOK_MODULE_VERSION		4
+// Same as CemuHookAction.MAGIC_GYRO
+#define MAGIC_GYRO					(2000.0 / (double)STICK_PAD_MAX)
 
+typedef enum {
+	DSU_REQ_ALL =		0x00,
+	DSU_REQ_BY_ID =		0x01,
+	DSU_REQ_BY_MAC =	0x02,
+} PadDataRequestFlags;
+
+typedef struct CEHSlot {
+	bool				connected;
+	uint8_t				mac[6];
+	uint8_t				battery;
+} CEHSlot;
 
 typedef enum {
 	DSUC_VERSIONREQ =	0x100000,
@@ -128,49 +144,221 @@ struct __attribute__((packed)) Message {
 	};
 };
 
-static void send_msg(int fd, struct sockaddr_in* target, struct Message* msg, MessageType type, uint16_t payload_size) {
-	size_t size = 20 + payload_size;
+typedef struct CEHClient {
+	struct sockaddr_in	address;
+	monotime_t			last_seen;
+	// When client last asked for data of all slots or of each slot. 0 = never
+	monotime_t			all_requested;
+	monotime_t			slot_requested[MAX_SLOTS];
+	uint32_t			next_packet_no[MAX_SLOTS];
+	// Packet being sent to client
+	struct Message		packet;
+} CEHClient;
+
+typedef struct CEHSink {
+	MotionSink			sink;
+	int					fd;
+	int					slot;
+} CEHSink;
+
+static uint32_t server_id = 0;
+static CEHSlot slots[MAX_SLOTS];
+// Pad data messages with everything but motion data and packet number filled
+static struct Message templates[MAX_SLOTS];
+static CEHSink sinks[MAX_SLOTS];
+// Batch of messages sent by single sendmmsg call. Grows as needed
+static struct mmsghdr* batch = NULL;
+static struct iovec* batch_iov = NULL;
+static size_t batch_alloc = 0;
+#ifndef PYTHON
+static LIST_TYPE(CEHClient) clients;
+static int sock;
+#else
+static CEHClient* clients = NULL;		// Grows as needed
+static size_t client_count = 0;
+static size_t client_alloc = 0;
+#endif
+
+// Slicing-by-8 CRC32 tables, same polynomial as zlib uses
+static uint32_t crc_table[8][256];
+// Value XOR-ed to CRC of pad data message when packet_number byte at
+// given position is set to given value instead of zero
+static uint32_t packet_number_crc[4][256];
+#define PACKET_NUMBER_OFFSET		(HEADER_SIZE + sizeof(struct PortInfo))
+
+
+static uint32_t crc32_fast(const void* data, size_t size) {
+	const uint8_t* p = (const uint8_t*)data;
+	uint32_t crc = 0xFFFFFFFF;
+	uint32_t one, two;
+	while (size >= 8) {
+		memcpy(&one, p, 4);
+		memcpy(&two, p + 4, 4);
+		one ^= crc;
+		crc = crc_table[7][one & 0xFF] ^ crc_table[6][(one >> 8) & 0xFF]
+			^ crc_table[5][(one >> 16) & 0xFF] ^ crc_table[4][one >> 24]
+			^ crc_table[3][two & 0xFF] ^ crc_table[2][(two >> 8) & 0xFF]
+			^ crc_table[1][(two >> 16) & 0xFF] ^ crc_table[0][two >> 24];
+		p += 8;
+		size -= 8;
+	}
+	while (size--)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+	return ~crc;
+}
+
+static void crc_init(void) {
+	uint32_t i, j, crc;
+	uint8_t zeros[HEADER_SIZE + PAD_DATA_SIZE];
+	for (i=0; i<256; i++) {
+		crc = i;
+		for (j=0; j<8; j++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : (crc >> 1);
+		crc_table[0][i] = crc;
+	}
+	for (i=0; i<256; i++) {
+		for (j=1; j<8; j++)
+			crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^ crc_table[0][crc_table[j - 1][i] & 0xFF];
+	}
+	// CRC32 is affine, so crc(a ^ b) == crc(a) ^ crc(b) ^ crc(zeros)
+	memset(zeros, 0, sizeof(zeros));
+	crc = crc32_fast(zeros, sizeof(zeros));
+	for (i=0; i<4; i++) {
+		for (j=0; j<256; j++) {
+			zeros[PACKET_NUMBER_OFFSET + i] = j;
+			packet_number_crc[i][j] = crc32_fast(zeros, sizeof(zeros)) ^ crc;
+		}
+		zeros[PACKET_NUMBER_OFFSET + i] = 0;
+	}
+}
+
+static void initialize(void) {
+	if (server_id == 0) {
+		crc_init();
+		server_id = (((uint32_t)time(NULL)) ^ ((uint32_t)getpid() << 16)) | 1;
+	}
+}
+
+
+static void fill_header(struct Message* msg, MessageType type, uint16_t payload_size) {
 	memcpy(msg->header, "DSUS", 4);
 	msg->protocol_version = MAX_PROTO_VERSION;
 	msg->packet_size = 4 + payload_size;
 	msg->message_type = type;
-	msg->msg_id = next_id ++;
+	msg->msg_id = server_id;
 	msg->crc = 0;
-	
-	uLong crc = crc32(0, (const Bytef*)msg, size);
-	msg->crc = crc;
+}
+
+static void send_msg(int fd, struct sockaddr_in* target, struct Message* msg, MessageType type, uint16_t payload_size) {
+	size_t size = HEADER_SIZE + payload_size;
+	fill_header(msg, type, payload_size);
+	msg->crc = crc32_fast(msg, size);
 	
 	ssize_t r = sendto(fd, (char*)msg, size, 0, (struct sockaddr*)target, sizeof(struct sockaddr_in));
 	if (r < 0) LERROR("sendto failed: " SOCKETERROR);
 }
 
-static void fill_port_info(struct PortInfo* pi, uint16_t id, uint8_t active) {
-	static uint8_t mac[6] = { 0x05, 0x0C, 0x0C, 0x00, 0x00, 0x01 };
+static void fill_port_info(struct PortInfo* pi, uint8_t id, uint8_t active) {
+	memset(pi, 0, sizeof(struct PortInfo));
 	pi->pad_id = id;
-	pi->state = (id == 0) ? 0x02 : 0x00;	// Connected : Disconnected
-	pi->connection_type = 0x01;				// Usb
-	pi->model = 0x02;						// DS4
-	pi->battery = 0x04;						// High
-	pi->active = active;
-	memcpy(pi->mac, mac, 5);
-	pi->mac[5] = 1 + id;
+	if ((id < MAX_SLOTS) && slots[id].connected) {
+		pi->state = 0x02;						// Connected
+		pi->connection_type = 0x01;				// Usb
+		pi->model = 0x02;						// DS4
+		pi->battery = slots[id].battery;
+		pi->active = active;
+		memcpy(pi->mac, slots[id].mac, 6);
+	}
+	// Everything else stays zero for disconnected slot
 }
 
-static void send_gyro_data(int fd, CEHClient* target, uint16_t id, float data[6], uint64_t timestamp) {
-	struct Message out;
-	memset(&out, 0, sizeof(struct Message));
-	fill_port_info(&out.pad_data.pad_info, id, 1);
-	memcpy(&out.pad_data.accel, data, sizeof(float) * 6);
-	out.pad_data.motion_timestamp = timestamp * 1000;
-	out.pad_data.packet_number = target->next_packet_no ++;
-	send_msg(fd, &target->address, &out, DSUS_PADDATARSP, 80);
-	// DEBUG("Sent data to (0x%x)", target->address.sin_port);
+static void build_template(uint8_t slot) {
+	struct Message* tpl = &templates[slot];
+	memset(tpl, 0, sizeof(struct Message));
+	fill_header(tpl, DSUS_PADDATARSP, PAD_DATA_SIZE);
+	fill_port_info(&tpl->pad_data.pad_info, slot, 1);
+}
+
+/** Makes sure that batch has space for at least 'count' messages */
+static bool batch_reserve(size_t count) {
+	if (count <= batch_alloc)
+		return true;
+	size_t alloc = (batch_alloc == 0) ? 8 : batch_alloc * 2;
+	while (alloc < count) alloc *= 2;
+	struct mmsghdr* new_batch = realloc(batch, sizeof(struct mmsghdr) * alloc);
+	if (new_batch == NULL) return false;
+	batch = new_batch;
+	struct iovec* new_iov = realloc(batch_iov, sizeof(struct iovec) * alloc);
+	if (new_iov == NULL) return false;
+	batch_iov = new_iov;
+	batch_alloc = alloc;
+	return true;
+}
+
+/**
+ * Prepares copy of template with packet number and CRC updated for client
+ * and adds it to batch at given index.
+ */
+static void batch_add(size_t index, CEHClient* c, uint8_t slot, uint32_t template_crc) {
+	uint32_t number = c->next_packet_no[slot] ++;
+	memcpy(&c->packet, &templates[slot], HEADER_SIZE + PAD_DATA_SIZE);
+	c->packet.pad_data.packet_number = number;
+	c->packet.crc = template_crc
+			^ packet_number_crc[0][number & 0xFF]
+			^ packet_number_crc[1][(number >> 8) & 0xFF]
+			^ packet_number_crc[2][(number >> 16) & 0xFF]
+			^ packet_number_crc[3][number >> 24];
+	
+	batch_iov[index].iov_base = &c->packet;
+	batch_iov[index].iov_len = HEADER_SIZE + PAD_DATA_SIZE;
+	memset(&batch[index], 0, sizeof(struct mmsghdr));
+	batch[index].msg_hdr.msg_name = &c->address;
+	batch[index].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	batch[index].msg_hdr.msg_iovlen = 1;
+}
+
+static void batch_send(int fd, size_t count) {
+	size_t sent = 0;
+	size_t i;
+	// Set only now, as batch_iov may have been moved while batch was filled
+	for (i=0; i<count; i++)
+		batch[i].msg_hdr.msg_iov = &batch_iov[i];
+	while (sent < count) {
+		int r = sendmmsg(fd, batch + sent, count - sent, 0);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			LERROR("sendmmsg failed: " SOCKETERROR);
+			return;
+		}
+		sent += r;
+	}
+}
+
+static inline bool same_address(const struct sockaddr_in* a, const struct sockaddr_in* b) {
+	return (a->sin_port == b->sin_port) && (a->sin_addr.s_addr == b->sin_addr.s_addr);
+}
+
+/** Returns true if client asked for data of slot recently enough */
+static inline bool is_subscribed(const CEHClient* c, uint8_t slot, monotime_t t) {
+	return ((c->all_requested != 0) && (t <= c->all_requested + CLIENT_TIMEOUT))
+		|| ((c->slot_requested[slot] != 0) && (t <= c->slot_requested[slot] + CLIENT_TIMEOUT));
+}
+
+/** Returns slot with controller that has given MAC address or -1 */
+static int find_slot_by_mac(const uint8_t mac[6]) {
+	int i;
+	for (i=0; i<MAX_SLOTS; i++) {
+		if (slots[i].connected && (memcmp(slots[i].mac, mac, 6) == 0))
+			return i;
+	}
+	return -1;
 }
 
 static void parse_message(int fd, const char* buffer, size_t size, struct sockaddr_in* source) {
 	struct Message* msg = (struct Message*)&buffer[0];
 	struct Message out;
-	int i, x;
+	int i;
+	size_t x;
 	if ((size < 20) || (buffer[0] != 'D') || (buffer[1]!='S') || (buffer[2] != 'U') || (buffer[3] != 'C')) {
 		WARN("Recieved invalid message: Invalid header");
 		return;
@@ -199,46 +387,49 @@ static void parse_message(int fd, const char* buffer, size_t size, struct sockad
 		}
 		break;
 	case DSUC_PADDATAREQ: {
-		if (!((msg->pad_data_req.flags == 0)
-			|| (((msg->pad_data_req.flags & 0x01) != 0) && (msg->pad_data_req.id == 0)))) {
-				// Only querying by ID and querying for 1st controller is supported
-				WARN("Refusing request: flags=%x id=%x mac=%x:%x:%x:%x:%x:%x",
-						msg->pad_data_req.flags, msg->pad_data_req.id,
-						msg->pad_data_req.mac[0],
-						msg->pad_data_req.mac[1],
-						msg->pad_data_req.mac[2],
-						msg->pad_data_req.mac[3],
-						msg->pad_data_req.mac[4],
-						msg->pad_data_req.mac[5]
-				);
-				break;
+		monotime_t t = mono_time_ms();
+		int by_id = -1, by_mac = -1;
+		if ((msg->pad_data_req.flags & DSU_REQ_BY_ID) && (msg->pad_data_req.id < MAX_SLOTS))
+			by_id = msg->pad_data_req.id;
+		if (msg->pad_data_req.flags & DSU_REQ_BY_MAC)
+			by_mac = find_slot_by_mac(msg->pad_data_req.mac);
+		if ((msg->pad_data_req.flags != DSU_REQ_ALL) && (by_id < 0) && (by_mac < 0)) {
+			DEBUG("Ignoring request for unknown pad: flags=%x id=%x mac=%x:%x:%x:%x:%x:%x",
+					msg->pad_data_req.flags, msg->pad_data_req.id,
+					msg->pad_data_req.mac[0],
+					msg->pad_data_req.mac[1],
+					msg->pad_data_req.mac[2],
+					msg->pad_data_req.mac[3],
+					msg->pad_data_req.mac[4],
+					msg->pad_data_req.mac[5]
+			);
+			break;
 		}
 		CEHClient* c = NULL;
 #ifdef PYTHON
-		for (x=0; x<CLIENT_LIMIT; x++) {
-			if (clients[x].address.sin_port == 0)
-				continue;
+		for (x=0; x<client_count; x++) {
 			CEHClient* i = &clients[x];
 #else
 		FOREACH_IN(CEHClient*, i, clients) {
 #endif
-			if (i->address.sin_port == source->sin_port) {
-				// Server listens only on localhost, so it should be safe to assume IP matches
+			if (same_address(&i->address, source)) {
 				c = i;
 				break;
 			}
 		}
 		if (c == NULL) {
 #ifdef PYTHON
-			for (x=0; x<CLIENT_LIMIT; x++) {
-				if (clients[x].address.sin_port == 0) {
-					c = &clients[x];
+			if (client_count >= client_alloc) {
+				size_t alloc = (client_alloc == 0) ? 4 : client_alloc * 2;
+				CEHClient* new_clients = realloc(clients, sizeof(CEHClient) * alloc);
+				if (new_clients == NULL) {
+					WARN("Out of memory");
+					break;
 				}
+				clients = new_clients;
+				client_alloc = alloc;
 			}
-			if (c == NULL) {
-				WARN("Client limit reached");
-				break;
-			}
+			c = &clients[client_count ++];
 #else
 			c = malloc(sizeof(CEHClient));
 			if ((c == NULL) || (!list_allocate(clients, 1))) {
@@ -248,11 +439,19 @@ static void parse_message(int fd, const char* buffer, size_t size, struct sockad
 			}
 			list_add(clients, c);
 #endif
+			memset(c, 0, sizeof(CEHClient));
 			memcpy(&c->address, source, sizeof(struct sockaddr_in));
-			c->next_packet_no = mono_time_ms() & 0xFFFFFFFF;
+			for (x=0; x<MAX_SLOTS; x++)
+				c->next_packet_no[x] = t & 0xFFFFFFFF;
 			DEBUG("New client (0x%x) added", c->address.sin_port);
 		}
-		c->last_seen = mono_time_ms();
+		c->last_seen = t;
+		if (msg->pad_data_req.flags == DSU_REQ_ALL)
+			c->all_requested = t;
+		if (by_id >= 0)
+			c->slot_requested[by_id] = t;
+		if (by_mac >= 0)
+			c->slot_requested[by_mac] = t;
 		break;
 	}
 	default:
@@ -261,38 +460,118 @@ static void parse_message(int fd, const char* buffer, size_t size, struct sockad
 	}
 }
 
+/**
+ * Sends motion data of controller in given slot to every client
+ * that asked for it. 'timestamp' is in microseconds.
+ */
+static bool feed_slot(int fd, int slot, const float data[6], uint64_t timestamp) {
+	if ((slot < 0) || (slot >= MAX_SLOTS) || !slots[slot].connected)
+		return false;
+	monotime_t t = timestamp / 1000;
+	struct Message* tpl = &templates[slot];
+	memcpy(&tpl->pad_data.accel, data, sizeof(float) * 6);
+	tpl->pad_data.motion_timestamp = timestamp;
+	// Template has zero packet number, batch_add adjusts CRC for real one
+	uint32_t template_crc = crc32_fast(tpl, HEADER_SIZE + PAD_DATA_SIZE);
+	size_t count = 0;
 #ifdef PYTHON
-bool cemuhook_feed(int fd, int index, float data[6]) {
-#else
-bool sccd_cemuhook_feed(int index, float data[6]) {
-	const int fd = sock;
-#endif
-	monotime_t t = mono_time_ms();
-#ifdef PYTHON
-	int x;
-	for (x=0; x<CLIENT_LIMIT; x++) {
+	size_t x = 0;
+	while (x < client_count) {
 		CEHClient* c = &clients[x];
-		if (c->address.sin_port == 0)
+		if ((t > c->last_seen + CLIENT_TIMEOUT) || (t < c->last_seen)) {
+			DEBUG("Dropping client (0x%x)", c->address.sin_port);
+			// Last client is moved in place of dropped one
+			*c = clients[-- client_count];
 			continue;
+		}
+		x++;
 #else
 	ListIterator it = iter_get(clients);
 	if (it == NULL) return false;	// OOM
 	while (iter_has_next(it)) {
 		CEHClient* c = iter_next(it);
-#endif
 		if ((t > c->last_seen + CLIENT_TIMEOUT) || (t < c->last_seen)) {
 			DEBUG("Dropping client (0x%x)", c->address.sin_port);
-			c->address.sin_port = 0;
-#ifndef PYTHON
 			iter_remove(it);
+			continue;
+		}
 #endif
-		} else {
-			send_gyro_data(fd, c, 0, data, (uint64_t)t);
+		if (is_subscribed(c, slot, t)) {
+			if (!batch_reserve(count + 1)) {
+				WARN("Out of memory");
+				break;
+			}
+			batch_add(count ++, c, slot, template_crc);
 		}
 	}
 #ifndef PYTHON
 	iter_free(it);
 #endif
+	if (count > 0)
+		batch_send(fd, count);
+	return true;
+}
+
+#ifdef PYTHON
+bool cemuhook_feed(int fd, int slot, float data[6]) {
+	return feed_slot(fd, slot, data, mono_time_us());
+}
+#else
+bool sccd_cemuhook_feed(int slot, float data[6]) {
+	return feed_slot(sock, slot, data, mono_time_us());
+}
+#endif
+
+static void sink_motion(MotionSink* s, const struct GyroInput* gyro, uint64_t timestamp) {
+	CEHSink* sink = (CEHSink*)s;
+	// Converted in same way as CemuHookAction does it
+	float data[6] = {
+		0, 0, 0,
+		gyro->gpitch * MAGIC_GYRO,
+		-gyro->gyaw * MAGIC_GYRO,
+		-gyro->groll * MAGIC_GYRO,
+	};
+	feed_slot(sink->fd, sink->slot, data, timestamp);
+}
+
+/**
+ * Returns MotionSink that driver can use to feed data to given slot
+ * directly. Returned pointer is valid for entire life of process.
+ */
+#ifdef PYTHON
+MotionSink* cemuhook_get_sink(int fd, int slot) {
+#else
+MotionSink* sccd_cemuhook_get_sink(int slot) {
+	const int fd = sock;
+#endif
+	if ((slot < 0) || (slot >= MAX_SLOTS))
+		return NULL;
+	sinks[slot].sink.motion = sink_motion;
+	sinks[slot].fd = fd;
+	sinks[slot].slot = slot;
+	return &sinks[slot].sink;
+}
+
+/**
+ * Marks slot as (dis)connected and sets MAC address and battery level
+ * reported to clients. 'mac' may be NULL when slot is disconnected.
+ */
+#ifdef PYTHON
+bool cemuhook_set_slot(int slot, bool connected, const uint8_t* mac, uint8_t battery) {
+#else
+bool sccd_cemuhook_set_slot(int slot, bool connected, const uint8_t* mac, uint8_t battery) {
+#endif
+	if ((slot < 0) || (slot >= MAX_SLOTS))
+		return false;
+	initialize();
+	memset(&slots[slot], 0, sizeof(CEHSlot));
+	if (connected) {
+		slots[slot].connected = true;
+		slots[slot].battery = battery;
+		if (mac != NULL)
+			memcpy(slots[slot].mac, mac, 6);
+	}
+	build_template(slot);
 	return true;
 }
 
@@ -302,19 +581,19 @@ const int cemuhook_module_version(void) {
 	return CEMUHOOK_MODULE_VERSION;
 }
 
-void cemuhook_data_recieved(int fd, int port, const char* buffer, size_t size) {
+void cemuhook_data_recieved(int fd, const char* ip, int port, const char* buffer, size_t size) {
 	struct sockaddr_in source;
 	source.sin_family = AF_INET;
-	source.sin_addr.s_addr = inet_addr("127.0.0.1");
+	source.sin_addr.s_addr = inet_addr(ip);
 	source.sin_port = htons(port);
 	
 	parse_message(fd, buffer, size, &source);
 }
 
 bool cemuhook_socket_enable() {
-	int i;
-	for (i=0; i<CLIENT_LIMIT; i++)
-		clients[i].address.sin_port = 0;
+	initialize();
+	client_count = 0;
+	memset(slots, 0, sizeof(slots));
 	// listening is done in python
 	return true;
 }
@@ -337,6 +616,7 @@ static void on_data_recieved(Daemon* d, int fd, void* userdata) {
 
 
 bool sccd_cemuhook_socket_enable() {
+	initialize();
 	clients = list_new(CEHClient, 4);
 	if (clients == NULL)
 		// This may be enabled at random time, so I can't just crash here
@@ -347,7 +627,7 @@ bool sccd_cemuhook_socket_enable() {
 	server_addr.sin_family = AF_INET;
 	server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
 	server_addr.sin_port = htons(26760);
-	
+
 #ifdef _WIN32
 	WSADATA wsaData;
 	int err = WSAStartup(MAKEWORD(2, 2), &wsaData);
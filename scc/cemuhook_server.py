@@ -4,17 +4,25 @@ SC-Controller - Daemon - CemuHookUDP motion provider
 
 Accepts all connections from clients and sends data captured
 by 'cemuhook' actions to them.
+
+Every controller that feeds data gets one of MAX_SLOTS slots, first come,
+first served. Slot is freed when controller is disconnected.
+
+When 'cemuhook' is used directly as gyro action and driver decodes input
+in C, driver is told to feed slot by itself and data coming through mapper
+are ignored. That is undone as soon as profile changes.
 """
 from __future__ import unicode_literals
 from scc.tools import find_library
 from scc.lib.enum import IntEnum
-from ctypes import c_uint32, c_int, c_bool, c_char_p, c_size_t, c_float
-from ctypes import create_string_buffer
-import logging, socket
+from ctypes import c_uint32, c_uint8, c_int, c_bool, c_char_p, c_size_t, c_float, c_void_p
+import logging, socket, zlib
 log = logging.getLogger("CemuHook")
 
 BUFFER_SIZE = 1024
 PORT = 26760
+MAX_SLOTS = 4
+BATTERY_NA = 0x00
 
 
 class MessageType(IntEnum):
@@ -28,13 +36,22 @@ class MessageType(IntEnum):
 
 class CemuhookServer:
 	C_DATA_T = c_float * 6
+	C_MAC_T = c_uint8 * 6
 	
 	def __init__(self, daemon):
 		self._lib = find_library('libcemuhook')
-		self._lib.cemuhook_data_recieved.argtypes = [ c_int, c_int, c_char_p, c_size_t ]
+		self._lib.cemuhook_data_recieved.argtypes = [ c_int, c_char_p, c_int, c_char_p, c_size_t ]
 		self._lib.cemuhook_data_recieved.restype = None
 		self._lib.cemuhook_feed.argtypes = [ c_int, c_int, CemuhookServer.C_DATA_T ]
-		self._lib.cemuhook_feed.restype = None
+		self._lib.cemuhook_feed.restype = c_bool
+		self._lib.cemuhook_set_slot.argtypes = [ c_int, c_bool, CemuhookServer.C_MAC_T, c_uint8 ]
+		self._lib.cemuhook_set_slot.restype = c_bool
+		self._lib.cemuhook_get_sink.argtypes = [ c_int, c_int ]
+		self._lib.cemuhook_get_sink.restype = c_void_p
+		self._slots = [ None ] * MAX_SLOTS		# controller in each slot
+		self._slot_of = {}						# controller -> slot
+		self._native = {}						# controller -> mapper, for natively fed slots
+		self._warned = False
 		self._lib.cemuhook_socket_enable.argtypes = []
 		self._lib.cemuhook_socket_enable.restype = c_bool
 		
@@ -54,13 +71,94 @@ class CemuhookServer:
 	def on_data_recieved(self, fd, event_type):
 		if fd != self.socket.fileno(): return
 		message, (ip, port) = self.socket.recvfrom(BUFFER_SIZE)
-		buffer = create_string_buffer(BUFFER_SIZE)
-		self._lib.cemuhook_data_recieved(fd, port, message, len(message), buffer)
+		self._lib.cemuhook_data_recieved(fd, ip.encode("ascii"), port, message, len(message))
+	
+	
+	@staticmethod
+	def get_mac(controller):
+		"""
+		Returns MAC address reported for controller. If controller ID looks
+		like one (as with controllers connected by bluetooth), it is used.
+		Otherwise, locally administered address is generated from ID.
+		"""
+		id = str(controller.get_id()).replace(":", "").lower()
+		if len(id) == 12 and all([ c in "0123456789abcdef" for c in id ]):
+			return [ int(id[i:i+2], 16) for i in xrange(0, 12, 2) ]
+		crc = zlib.crc32(str(controller.get_id())) & 0xFFFFFFFF
+		return [ 0x02, 0x5c ] + [ (crc >> (8 * i)) & 0xFF for i in xrange(4) ]
+	
+	
+	def _allocate_slot(self, controller):
+		""" Returns slot assigned to controller, or None if all are taken """
+		if controller in self._slot_of:
+			return self._slot_of[controller]
+		if None not in self._slots:
+			if not self._warned:
+				log.warning("All %s slots are used, ignoring data from %s",
+					MAX_SLOTS, controller)
+				self._warned = True
+			return None
+		slot = self._slots.index(None)
+		battery = getattr(controller, "get_battery_level", lambda: None)()
+		self._lib.cemuhook_set_slot(slot, True,
+			CemuhookServer.C_MAC_T(*CemuhookServer.get_mac(controller)),
+			BATTERY_NA if battery is None else battery)
+		self._slots[slot] = controller
+		self._slot_of[controller] = slot
+		log.debug("Assigned slot %s to %s", slot, controller)
+		return slot
+	
+	
+	def controller_removed(self, controller):
+		""" Frees slot used by controller, if any """
+		self._detach(controller)
+		if controller in self._slot_of:
+			slot = self._slot_of.pop(controller)
+			self._slots[slot] = None
+			self._lib.cemuhook_set_slot(slot, False, CemuhookServer.C_MAC_T(), 0)
+			self._warned = False
+			log.debug("Freed slot %s", slot)
+	
+	
+	def attach(self, mapper):
+		"""
+		Makes driver of controller used by mapper feed its slot directly,
+		if driver supports it. Should be called only when 'cemuhook' is
+		gyro action of profile.
+		"""
+		controller = mapper.get_controller()
+		if controller is None or controller in self._native:
+			return
+		slot = self._allocate_slot(controller)
+		if slot is None:
+			return
+		if controller.set_motion_sink(self._lib.cemuhook_get_sink(self.socket.fileno(), slot)):
+			self._native[controller] = mapper
+			mapper.add_profile_listener(self._profile_changed)
+			log.debug("%s feeds slot %s directly", controller, slot)
+	
+	
+	def _detach(self, controller):
+		if controller in self._native:
+			mapper = self._native.pop(controller)
+			mapper.remove_profile_listener(self._profile_changed)
+			controller.set_motion_sink(None)
+	
+	
+	def _profile_changed(self, mapper):
+		# Profile may now use different gyro action or no action at all.
+		# If it's still 'cemuhook', attach is called again by next feed.
+		for controller in [ c for c in self._native if self._native[c] is mapper ]:
+			self._detach(controller)
 	
 	
-	def feed(self, data):
-		c_data = CemuhookServer.C_DATA_T()
-		c_data[3:6] = data[0:3]
-		self._lib.cemuhook_feed(self.socket.fileno(), 0, c_data)
+	def feed(self, controller, data):
+		if controller is None or controller in self._native:
+			return
+		slot = self._allocate_slot(controller)
+		if slot is not None:
+			c_data = CemuhookServer.C_DATA_T()
+			c_data[3:6] = data[0:3]
+			self._lib.cemuhook_feed(self.socket.fileno(), slot, c_data)
 
 
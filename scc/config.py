@@ -34,10 +34,15 @@ class Config(object):
 			"sc_by_bt": True,
 			"steamdeck": True,
 			"fake": False,			# Used for developement
+			"replay": False,		# Used for developement, see drivers/replay.py
 			"hiddrv": True,
 			"evdevdrv": True,
 			"ds4drv": True,			# At least one of hiddrv or evdevdrv has to be enabled as well
 		},
+		"precise_scheduler": False,	# If True, timerfd is used to execute scheduled
+									# tasks (macros, turbo) on time, at cost of more wakeups
+		"worker_processes": False,	# If True, input of every controller is mapped
+									# by separate process. See scc/worker.py
 		"fix_xinput" : True,		# If True, attempt is done to deatach emulated controller 
 									# from 'Virtual core pointer' core device.
 		"gui": {
@@ -77,6 +82,8 @@ class Config(object):
 		# ~/.config/scc can ask daemon to send notifications about all
 		# (or only some) inputs.
 		# This enables GUI to display which physical button was pressed to user.
+		# Daemon also publishes state of every controller to memory-mapped
+		# file that OSD can read without asking daemon (see shared_state.py)
 		"enable_sniffing" : False,
 		# Style and colors used by OSD
 		"osd_style": "Classic.gtkstyle.css",
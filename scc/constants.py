@@ -132,6 +132,15 @@ class ControllerFlags(IntEnum):
 	IS_DECK =			1 << 6	# Very special case
 
 
+# Values of input report, in order used when report is copied to worker
+# process or sent to client as snapshot. Drivers that don't report some of
+# them (for example, only Deck has 'rstick_x') are sending zeros instead
+INPUT_FIELDS = ( "buttons", "ltrig", "rtrig", "stick_x", "stick_y",
+	"lpad_x", "lpad_y", "rpad_x", "rpad_y", "gpitch", "groll", "gyaw",
+	"q1", "q2", "q3", "q4", "cpad_x", "cpad_y", "rstick_x", "rstick_y",
+	"dpad_x", "dpad_y" )
+
+
 STICK_PAD_MIN = -32768
 STICK_PAD_MAX = 32767
 STICK_PAD_MIN_HALF = STICK_PAD_MIN / 3
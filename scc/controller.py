@@ -14,6 +14,17 @@ class Controller(object):
 	Derived class should implement every method from here.
 	"""
 	flags = 0
+	# Maps stage names used by scc.stats to methods where driver spends time
+	# receiving and decoding input. Methods are looked up when instrumentation
+	# is enabled, so only those called through instance attribute can be listed
+	STATS_STAGES = {}
+	# Reports merged into one before reaching mapper and reports lost
+	# because of transfer errors. Drivers increment those as it happens
+	coalesced_reports = 0
+	dropped_reports = 0
+	# SharedState where daemon publishes input of controller, if enabled.
+	# See scc/shared_state.py
+	shared_state = None
 	
 	def __init__(self):
 		global next_id
@@ -43,6 +54,36 @@ class Controller(object):
 		return self._id
 	
 	
+	def get_battery_level(self):
+		"""
+		Returns battery level in format used by CemuHookUDP protocol
+		(0x01 - dying to 0x05 - full, 0xEE charging, 0xEF charged)
+		or None if it's not known.
+		"""
+		return None
+	
+	
+	def get_input(self):
+		"""
+		Returns latest input report as it was read from device, for
+		controllers that don't pass every report to mapper unchanged, for
+		example because some inputs are handled by native mapper and masked
+		out. Returns None if mapper gets reports as they are.
+		"""
+		return None
+	
+	
+	def set_motion_sink(self, sink):
+		"""
+		Sets pointer to MotionSink (see drivers/scc_future.h) that driver
+		should feed with gyro data directly, or None to stop doing so.
+		
+		Returns False if driver doesn't decode input natively
+		and so cannot do this.
+		"""
+		return False
+	
+	
 	def get_gui_config_file(self):
 		"""
 		Returns file name of json file that GUI can use to load more data about
@@ -110,7 +151,7 @@ class Controller(object):
 	def disconnected(self):
 		""" Called from daemon after controller is disconnected """
 		pass
-	
+
 
 class HapticData(object):
 	""" Simple container to hold haptic feedback settings """
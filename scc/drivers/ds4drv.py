@@ -6,9 +6,9 @@ Extends HID driver with DS4-specific options.
 """
 
 from scc.drivers.hiddrv import BUTTON_COUNT, ButtonData, AxisType, AxisData
-from scc.drivers.hiddrv import HIDController, HIDDecoder, hiddrv_test
+from scc.drivers.hiddrv import HIDController, HIDDecoder, hiddrv_test, _lib
 from scc.drivers.hiddrv import AxisMode, AxisDataUnion, AxisModeData
-from scc.drivers.hiddrv import HatswitchModeData, _lib
+from scc.drivers.hiddrv import HatswitchModeData
 from scc.drivers.evdevdrv import HAVE_EVDEV, EvdevController, get_axes
 from scc.drivers.evdevdrv import get_evdev_devices_from_syspath
 from scc.drivers.evdevdrv import make_new_device
@@ -16,7 +16,7 @@ from scc.drivers.usb import register_hotplug_device
 from scc.constants import SCButtons, ControllerFlags
 from scc.constants import STICK_PAD_MIN, STICK_PAD_MAX
 from scc.tools import init_logging, set_logging_level
-import sys, logging, ctypes
+import sys, logging
 log = logging.getLogger("DS4")
 
 VENDOR_ID = 0x054c
@@ -49,6 +49,32 @@ class DS4Controller(HIDController):
 			| ControllerFlags.SEPARATE_STICK
 			| ControllerFlags.NO_GRIPS
 	)
+	# Byte holding touchpad state; highest bit is set while not touched
+	TOUCH_BYTE = 35
+	
+	
+	def __init__(self, *a, **b):
+		HIDController.__init__(self, *a, **b)
+		self._decode = self._decode_touch
+	
+	
+	def _decode_touch(self, decoder, data, report_size, count):
+		"""
+		Wraps decode_many. CPADTOUCH is not decoded from report, but set
+		by decoded(), so it's removed from state before decoding, not to be
+		counted as released every time, and put back to old_state after.
+		Touch changing is reported as change on its own.
+		"""
+		touched = self._decoder.state.buttons & SCButtons.CPADTOUCH
+		self._decoder.state.buttons &= ~SCButtons.CPADTOUCH
+		changed = _lib.decode_many(decoder, data, report_size, count)
+		self._decoder.old_state.buttons |= touched
+		last = data[(count - 1) * report_size:]
+		if changed or bool(touched) != (not ord(last[self.TOUCH_BYTE]) >> 7):
+			return True
+		# decoded() is not called, so touch has to be put back here
+		self._decoder.state.buttons |= touched
+		return False
 	
 	
 	def _load_hid_descriptor(self, config, max_size, vid, pid, test_mode):
@@ -126,18 +152,15 @@ class DS4Controller(HIDController):
 		self._packet_size = 64
 	
 	
-	def input(self, endpoint, data):
+	def decoded(self, last_report):
 		# Special override for CPAD touch button
-		if _lib.decode(ctypes.byref(self._decoder), data):
-			if self.mapper:
-				if ord(data[35]) >> 7:
-					# cpad is not touched
-					self._decoder.state.buttons &= ~SCButtons.CPADTOUCH
-				else:
-					self._decoder.state.buttons |= SCButtons.CPADTOUCH
-				self.mapper.input(self,
-						self._decoder.old_state, self._decoder.state)
-
+		if ord(last_report[self.TOUCH_BYTE]) >> 7:
+			# cpad is not touched
+			self._decoder.state.buttons &= ~SCButtons.CPADTOUCH
+		else:
+			self._decoder.state.buttons |= SCButtons.CPADTOUCH
+		HIDController.decoded(self, last_report)
+	
 	
 	def get_gyro_enabled(self):
 		# Cannot be actually turned off, so it's always active
@@ -10,6 +10,7 @@ from scc.constants import STICK_PAD_MIN, STICK_PAD_MAX, TRIGGER_MIN, TRIGGER_MAX
 from scc.constants import SCButtons, ControllerFlags
 from scc.controller import Controller
 from scc.paths import get_config_path
+from scc.lib.trace import RecordingInputDevice, get_recorder
 from scc.tools import clamp
 
 
@@ -407,6 +408,11 @@ class EvdevDriver(object):
 			except Exception, e:
 				log.exception(e)
 				return False
+			recorder = get_recorder()
+			if recorder:
+				dev = RecordingInputDevice(dev, recorder.add_source({
+					"type": "evdev", "name": dev.name, "fn": dev.fn,
+					"config_file": config_file, "config": config }))
 			try:
 				controller = EvdevController(self.daemon, dev, config_file.decode("utf-8"), config)
 			except Exception, e:
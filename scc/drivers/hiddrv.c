@@ -3,9 +3,10 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <limits.h>
-#define CLAMP(min, x, max) x
+#include <string.h>
+#include "scc_future.h"
 
-#define HIDDRV_MODULE_VERSION 5
+#define HIDDRV_MODULE_VERSION 8
 PyObject* module;
 
 #define AXIS_COUNT 17
@@ -105,6 +106,31 @@ struct ButtonData {
 };
 
 
+/**
+ * Single operation of compiled decoder. Every enabled AxisData is compiled
+ * into one of those, with everything that can be computed in advance
+ * already computed.
+ */
+struct DecoderOp {
+	enum AxisMode mode;
+	uint32_t byte_offset;
+	uint8_t shift;			// bit_offset
+	uint8_t read_size;		// number of bytes to read, 1, 2, 4 or 8
+	uint8_t target;			// index in HIDControllerInput.axes
+	uint8_t _padding;
+	uint32_t mask;			// applied to value after shift
+	uint32_t button;		// OR-ed to buttons when axis is not centered
+	float scale;
+	float offset;
+	float deadzone;
+	float clamp_max;
+	int32_t min;
+	int32_t max;
+	uint32_t bit1;			// DPAD only
+	uint32_t bit2;			// DPAD only
+};
+
+
 struct HIDDecoder {
 	struct AxisData axes[AXIS_COUNT];
 	struct ButtonData buttons;
@@ -112,160 +138,262 @@ struct HIDDecoder {
 	
 	struct HIDControllerInput old_state;
 	struct HIDControllerInput state;
+	
+	// Following is generated by compile_decoder from configuration above
+	bool compiled;
+	uint8_t op_count;
+	uint8_t button_read_size;
+	uint8_t button_lut_count;
+	struct DecoderOp ops[AXIS_COUNT];
+	uint32_t button_lut[BUTTON_COUNT / 8][256];
+	
+	// Buttons pressed and released by any report decoded by last call
+	uint32_t pressed;
+	uint32_t released;
+	// mono_time_us() when reports were handed to decode_many
+	uint64_t timestamp;
+	// If set, gets gyro data from every decode_many call
+	MotionSink* motion_sink;
 };
 
 
-union Value {
-	uint8_t  u8;
-	uint16_t u16;
-	int16_t  s16;
-	uint32_t u32;
-	uint64_t u64;
-};
+/** Directions of hatswitch positions. 1 is max, -1 min, 8-15 centered */
+static const int8_t HAT_X[16] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+static const int8_t HAT_Y[16] = { 1, 1, 0, -1, -1, -1, 0, 1 };
 
 
-static union Value grab_value(const char* data, const size_t byte_offset, uint8_t bit_offset) {
-	union Value val = *((union Value*)(data + byte_offset));
-	val.u64 = val.u64 >> bit_offset;
-	return val;
+/** Returns smallest of 1, 2, 4 or 8 bytes covering 'bits' bits */
+static uint8_t read_size_for(size_t bits) {
+	if (bits <= 8) return 1;
+	if (bits <= 16) return 2;
+	if (bits <= 32) return 4;
+	return 8;
 }
 
 
-static int grab_with_size(const uint8_t size, const char* data, const size_t byte_offset, uint8_t bit_offset) {
-	union Value val = grab_value(data, byte_offset, bit_offset);
-	// if (size == 16)
-	// 	printf(" => %i\n", (int)val.u16);
-	switch (size) {
-		case 16: return val.u16;
-		case 32: return val.u32;
-		case 64: return val.u64;
-		default: return val.u8;
+/**
+ * Reads up to 8 bytes from unaligned position and shifts them so value
+ * starts at lowest bit. Reads of constant size are compiled to single
+ * load where platform allows it.
+ */
+static inline uint64_t grab_value(const char* data, uint32_t byte_offset,
+			uint8_t read_size, uint8_t shift) {
+	uint8_t u8;
+	uint16_t u16;
+	uint32_t u32;
+	uint64_t u64;
+	data += byte_offset;
+	switch (read_size) {
+		case 1: memcpy(&u8, data, 1); return u8 >> shift;
+		case 2: memcpy(&u16, data, 2); return u16 >> shift;
+		case 4: memcpy(&u32, data, 4); return u32 >> shift;
+		default: memcpy(&u64, data, 8); return u64 >> shift;
 	}
 }
 
 
-bool decode(struct HIDDecoder* dec, const char* data) {
-	size_t i;
-	memcpy(&(dec->old_state), &(dec->state), sizeof(struct HIDControllerInput));
-	dec->state.buttons = 0;
-	// Axes
+/**
+ * Compiles axis and button configuration into list of operations and
+ * button lookup tables used by decode.
+ * Has to be called again every time configuration is changed.
+ */
+void compile_decoder(struct HIDDecoder* dec) {
+	size_t i, j, bits;
+	uint8_t n = 0;
 	for (i=0; i<AXIS_COUNT; i++) {
-		union Value value;
-		float fval;
-		switch (dec->axes[i].mode) {
+		struct AxisData* axis = &dec->axes[i];
+		struct DecoderOp* op = &dec->ops[n];
+		memset(op, 0, sizeof(struct DecoderOp));
+		op->mode = axis->mode;
+		op->byte_offset = axis->byte_offset;
+		op->shift = axis->bit_offset;
+		op->target = i;
+		switch (axis->mode) {
+			case AXIS:
+			case AXIS_NO_SCALE:
+				switch (axis->size) {
+					case 16: bits = 16; op->mask = 0xFFFF; break;
+					case 32:
+					case 64: bits = 32; op->mask = 0xFFFFFFFF; break;
+					default: bits = 8; op->mask = 0xFF; break;
+				}
+				op->read_size = read_size_for(op->shift + bits);
+				op->button = axis->data.axis.button;
+				op->scale = axis->data.axis.scale;
+				op->offset = axis->data.axis.offset;
+				op->deadzone = axis->data.axis.deadzone;
+				op->clamp_max = axis->data.axis.clamp_max;
+				break;
+			case DPAD:
+				bits = 0;
+				if (axis->data.dpad.button1 < 32) {
+					op->bit1 = 1u << axis->data.dpad.button1;
+					bits = axis->data.dpad.button1 + 1;
+				}
+				if (axis->data.dpad.button2 < 32) {
+					op->bit2 = 1u << axis->data.dpad.button2;
+					if (axis->data.dpad.button2 + 1 > bits)
+						bits = axis->data.dpad.button2 + 1;
+				}
+				op->read_size = read_size_for(op->shift + bits);
+				op->button = axis->data.dpad.button;
+				op->min = axis->data.dpad.min;
+				op->max = axis->data.dpad.max;
+				break;
+			case HATSWITCH:
+				if (i + 1 >= AXIS_COUNT)
+					// Hatswitch sets two axes and there is no space for 2nd one
+					continue;
+				op->read_size = read_size_for(op->shift + 4);
+				op->mask = 0b1111;
+				op->button = axis->data.hatswitch.button;
+				op->min = axis->data.hatswitch.min;
+				op->max = axis->data.hatswitch.max;
+				break;
+			case DS4ACCEL:
+			case DS4GYRO:
+				op->read_size = read_size_for(op->shift + 16);
+				op->mask = 0xFFFF;
+				break;
+			case DS4TOUCHPAD:
+				op->read_size = read_size_for(op->shift + 16);
+				op->mask = 0x0FFF;
+				break;
+			default:
+				// Disabled or unknown
+				continue;
+		}
+		n++;
+	}
+	dec->op_count = n;
+	
+	// Buttons are translated using one table for every byte of input
+	memset(dec->button_lut, 0, sizeof(dec->button_lut));
+	dec->button_lut_count = 0;
+	if (dec->buttons.enabled) {
+		for (i=0; i<BUTTON_COUNT; i++) {
+			if (dec->buttons.button_map[i] < 32) {
+				uint32_t bit = 1u << dec->buttons.button_map[i];
+				for (j=0; j<256; j++) {
+					if ((j >> (i % 8)) & 1)
+						dec->button_lut[i / 8][j] |= bit;
+				}
+				dec->button_lut_count = i / 8 + 1;
+			}
+		}
+	}
+	dec->button_read_size = read_size_for(dec->buttons.bit_offset + dec->button_lut_count * 8);
+	dec->compiled = true;
+}
+
+
+/** Decodes single report into dec->state. Doesn't touch dec->old_state */
+static void decode_report(struct HIDDecoder* dec, const char* data) {
+	const struct DecoderOp* op = dec->ops;
+	const struct DecoderOp* end = dec->ops + dec->op_count;
+	int32_t* axes = dec->state.axes;
+	uint32_t buttons = 0;
+	uint64_t value;
+	float fval;
+	int hat;
+	
+	for (; op<end; op++) {
+		value = grab_value(data, op->byte_offset, op->read_size, op->shift);
+		switch (op->mode) {
 			case AXIS:
-				fval = ((grab_with_size(dec->axes[i].size,
-						data, dec->axes[i].byte_offset, dec->axes[i].bit_offset)
-							* dec->axes[i].data.axis.scale)
-							+ dec->axes[i].data.axis.offset
-				);
-				if ((fval >= -dec->axes[i].data.axis.deadzone) && (fval <= dec->axes[i].data.axis.deadzone)) {
-						dec->state.axes[i] = 0;
+				fval = (int)(value & op->mask) * op->scale + op->offset;
+				if ((fval >= -op->deadzone) && (fval <= op->deadzone)) {
+					axes[op->target] = 0;
 				} else {
-					dec->state.buttons |= dec->axes[i].data.dpad.button;
-					dec->state.axes[i] = CLAMP(
-		 				dec->axes[i].data.axis.clamp_min,
-		 				fval * dec->axes[i].data.axis.clamp_max,
-		 				dec->axes[i].data.axis.clamp_max
-					);
+					buttons |= op->button;
+					axes[op->target] = fval * op->clamp_max;
 				}
 				break;
 			case AXIS_NO_SCALE:
-				dec->state.axes[i] = grab_with_size(dec->axes[i].size,
-					data, dec->axes[i].byte_offset, dec->axes[i].bit_offset);
+				axes[op->target] = (int)(value & op->mask);
 				break;
 			case DPAD:
-				value = grab_value(data, dec->axes[i].byte_offset,
-					dec->axes[i].bit_offset);
-				if ((value.u32 >> dec->axes[i].data.dpad.button1) & 1) {
-					dec->state.buttons |= dec->axes[i].data.dpad.button;
-					dec->state.axes[i] = dec->axes[i].data.dpad.min;
-				} else if ((value.u32 >> dec->axes[i].data.dpad.button2) & 1) {
-					dec->state.buttons |= dec->axes[i].data.dpad.button;
-					dec->state.axes[i] = dec->axes[i].data.dpad.max;
+				if (value & op->bit1) {
+					buttons |= op->button;
+					axes[op->target] = op->min;
+				} else if (value & op->bit2) {
+					buttons |= op->button;
+					axes[op->target] = op->max;
 				}
 				break;
 			case HATSWITCH:
-				value = grab_value(data, dec->axes[i].byte_offset,
-					dec->axes[i].bit_offset);
-				switch (value.u8 & 0b1111) {
-					case 0:	// up
-						dec->state.axes[i + 0] = 0;
-						dec->state.axes[i + 1] = dec->axes[i].data.hatswitch.max;
-						dec->state.buttons |= dec->axes[i].data.hatswitch.button;
-						break;
-					case 1:	// up-right
-						dec->state.axes[i + 0] = dec->axes[i].data.hatswitch.max;
-						dec->state.axes[i + 1] = dec->axes[i].data.hatswitch.max;
-						dec->state.buttons |= dec->axes[i].data.hatswitch.button;
-						break;
-					case 2:	// right
-						dec->state.axes[i + 0] = dec->axes[i].data.hatswitch.max;
-						dec->state.axes[i + 1] = 0;
-						dec->state.buttons |= dec->axes[i].data.hatswitch.button;
-						break;
-					case 3:	// down-right
-						dec->state.axes[i + 0] = dec->axes[i].data.hatswitch.max;
-						dec->state.axes[i + 1] = dec->axes[i].data.hatswitch.min;
-						dec->state.buttons |= dec->axes[i].data.hatswitch.button;
-						break;
-					case 4:	// down
-						dec->state.axes[i + 0] = 0;
-						dec->state.axes[i + 1] = dec->axes[i].data.hatswitch.min;
-						dec->state.buttons |= dec->axes[i].data.hatswitch.button;
-						break;
-					case 5:	// up-left
-						dec->state.axes[i + 0] = dec->axes[i].data.hatswitch.min;
-						dec->state.axes[i + 1] = dec->axes[i].data.hatswitch.min;
-						dec->state.buttons |= dec->axes[i].data.hatswitch.button;
-						break;
-					case 6:	// left
-						dec->state.axes[i + 0] = dec->axes[i].data.hatswitch.min;
-						dec->state.axes[i + 1] = 0;
-						dec->state.buttons |= dec->axes[i].data.hatswitch.button;
-						break;
-					case 7:	// down-left
-						dec->state.axes[i + 0] = dec->axes[i].data.hatswitch.min;
-						dec->state.axes[i + 1] = dec->axes[i].data.hatswitch.max;
-						dec->state.buttons |= dec->axes[i].data.hatswitch.button;
-						break;
-					default: // centered
-						dec->state.axes[i + 0] = 0;
-						dec->state.axes[i + 1] = 0;
-						break;
-				}
+				hat = value & op->mask;
+				axes[op->target + 0] = HAT_X[hat] > 0 ? op->max : (HAT_X[hat] < 0 ? op->min : 0);
+				axes[op->target + 1] = HAT_Y[hat] > 0 ? op->max : (HAT_Y[hat] < 0 ? op->min : 0);
+				if (hat < 8)
+					buttons |= op->button;
 				break;
 			case DS4ACCEL:
-				value = grab_value(data, dec->axes[i].byte_offset,
-					dec->axes[i].bit_offset);
-				dec->state.axes[i] = value.s16;
+				axes[op->target] = (int16_t)(value & op->mask);
 				break;
 			case DS4GYRO:
-				value = grab_value(data, dec->axes[i].byte_offset,
-					dec->axes[i].bit_offset);
-				dec->state.axes[i] = -value.s16;
+				axes[op->target] = -(int16_t)(value & op->mask);
 				break;
 			case DS4TOUCHPAD:
-				value = grab_value(data, dec->axes[i].byte_offset,
-					dec->axes[i].bit_offset);
-				dec->state.axes[i] = (value.u16 & 0x0FFF);
+				axes[op->target] = value & op->mask;
 				break;
 			default:
 				break;
 		}
 	}
 	
-	// Buttons
-	if (dec->buttons.enabled) {
-		union Value value = grab_value(data, dec->buttons.byte_offset, dec->buttons.bit_offset);
-		for (i=0; i<BUTTON_COUNT; i++) {
-			if (dec->buttons.button_map[i] < 33) {
-				uint32_t bit = (value.u32 >> i) & 1;
-				dec->state.buttons |= bit << dec->buttons.button_map[i];
-			}
-		}
+	if (dec->button_lut_count > 0) {
+		size_t i;
+		value = grab_value(data, dec->buttons.byte_offset,
+				dec->button_read_size, dec->buttons.bit_offset);
+		for (i=0; i<dec->button_lut_count; i++)
+			buttons |= dec->button_lut[i][(value >> (i * 8)) & 0xFF];
+	}
+	dec->state.buttons = buttons;
+}
+
+
+/**
+ * Decodes 'count' reports, 'report_size' bytes each, stored one after
+ * another in 'data'. When done, old_state holds state before first report
+ * and state is set to state after last one. Buttons pressed or released
+ * by any of reports are stored in 'pressed' and 'released' masks, so
+ * button pressed and released again is not lost.
+ *
+ * If motion_sink is set, it gets gyro data from state after last report.
+ *
+ * Returns true if state has changed or if any button was pressed or released.
+ */
+bool decode_many(struct HIDDecoder* dec, const char* data, size_t report_size, size_t count) {
+	uint32_t pressed = 0, released = 0, previous;
+	size_t i;
+	if (!dec->compiled)
+		compile_decoder(dec);
+	dec->timestamp = mono_time_us();
+	memcpy(&(dec->old_state), &(dec->state), sizeof(struct HIDControllerInput));
+	for (i=0; i<count; i++) {
+		previous = dec->state.buttons;
+		decode_report(dec, data + i * report_size);
+		pressed |= dec->state.buttons & ~previous;
+		released |= previous & ~dec->state.buttons;
+	}
+	dec->pressed = pressed;
+	dec->released = released;
+	if ((dec->motion_sink != NULL) && (count > 0)) {
+		const int32_t* axes = dec->state.axes;
+		struct GyroInput gyro = {
+			axes[AXIS_GPITCH], axes[AXIS_GROLL], axes[AXIS_GYAW],
+			axes[AXIS_Q1], axes[AXIS_Q2], axes[AXIS_Q3], axes[AXIS_Q4]
+		};
+		dec->motion_sink->motion(dec->motion_sink, &gyro, dec->timestamp);
 	}
-	return memcmp(&(dec->old_state), &(dec->state), sizeof(struct HIDControllerInput)) != 0;
+	return (pressed | released)
+		|| memcmp(&(dec->old_state), &(dec->state), sizeof(struct HIDControllerInput)) != 0;
+}
+
+
+bool decode(struct HIDDecoder* dec, const char* data) {
+	return decode_many(dec, data, 0, 1);
 }
 
 
@@ -26,6 +26,7 @@ LIBUSB_DT_REPORT = 0x22
 AXIS_COUNT = 17		# Must match number of axis fields in HIDControllerInput and values in AxisType
 BUTTON_COUNT = 32	# Must match (or be less than) number of bits in HIDControllerInput.buttons
 ALLOWED_SIZES = [1, 2, 4, 8, 16, 32]
+INPUT_TRANSFERS = 4	# Number of input transfers submitted at once
 SYS_DEVICES = "/sys/devices"
 
 
@@ -156,6 +157,28 @@ class ButtonData(ctypes.Structure):
 	]
 
 
+class DecoderOp(ctypes.Structure):
+	# Generated by compile_decoder, not supposed to be touched from python
+	_fields_ = [
+		('mode', ctypes.c_int),
+		('byte_offset', ctypes.c_uint32),
+		('shift', ctypes.c_uint8),
+		('read_size', ctypes.c_uint8),
+		('target', ctypes.c_uint8),
+		('_padding', ctypes.c_uint8),
+		('mask', ctypes.c_uint32),
+		('button', ctypes.c_uint32),
+		('scale', ctypes.c_float),
+		('offset', ctypes.c_float),
+		('deadzone', ctypes.c_float),
+		('clamp_max', ctypes.c_float),
+		('min', ctypes.c_int32),
+		('max', ctypes.c_int32),
+		('bit1', ctypes.c_uint32),
+		('bit2', ctypes.c_uint32),
+	]
+
+
 class HIDDecoder(ctypes.Structure):
 	_fields_ = [
 		('axes', AxisData * AXIS_COUNT),
@@ -164,6 +187,20 @@ class HIDDecoder(ctypes.Structure):
 		
 		('old_state', HIDControllerInput),
 		('state', HIDControllerInput),
+		
+		# Generated by compile_decoder from fields above
+		('compiled', ctypes.c_bool),
+		('op_count', ctypes.c_uint8),
+		('button_read_size', ctypes.c_uint8),
+		('button_lut_count', ctypes.c_uint8),
+		('ops', DecoderOp * AXIS_COUNT),
+		('button_lut', (ctypes.c_uint32 * 256) * (BUTTON_COUNT / 8)),
+		
+		# Set by decode_many
+		('pressed', ctypes.c_uint32),
+		('released', ctypes.c_uint32),
+		('timestamp', ctypes.c_uint64),
+		('motion_sink', ctypes.c_void_p),
 	]
 
 
@@ -173,6 +210,10 @@ HIDDecoderPtr = ctypes.POINTER(HIDDecoder)
 _lib = find_library('libhiddrv')
 _lib.decode.restype = bool
 _lib.decode.argtypes = [ HIDDecoderPtr, ctypes.c_char_p ]
+_lib.decode_many.restype = bool
+_lib.decode_many.argtypes = [ HIDDecoderPtr, ctypes.c_char_p, ctypes.c_size_t, ctypes.c_size_t ]
+_lib.compile_decoder.restype = None
+_lib.compile_decoder.argtypes = [ HIDDecoderPtr ]
 
 
 class HIDController(USBDevice, Controller):
@@ -180,10 +221,13 @@ class HIDController(USBDevice, Controller):
 			| ControllerFlags.SEPARATE_STICK
 			| ControllerFlags.HAS_DPAD
 			| ControllerFlags.NO_GRIPS )
+	STATS_STAGES = { "receive" : "flush", "decode" : "_decode" }
 	
 	def __init__(self, device, daemon, handle, config_file, config, test_mode=False):
 		USBDevice.__init__(self, device, handle)
 		self._ready = False
+		self._pending = []		# reports recieved since last flush
+		self._decode = _lib.decode_many
 		self.daemon = daemon
 		self.config_file = config_file
 		
@@ -208,6 +252,7 @@ class HIDController(USBDevice, Controller):
 			raise NotHIDDevice("Blacklisted device: %x:%x", vid, pid)
 		self._packet_size = 64
 		self._load_hid_descriptor(config, max_size, vid, pid, test_mode)
+		_lib.compile_decoder(ctypes.byref(self._decoder))
 		self.claim_by(klass=DEV_CLASS_HID, subclass=0, protocol=0)
 		Controller.__init__(self)
 		
@@ -223,7 +268,8 @@ class HIDController(USBDevice, Controller):
 					]))])
 		else:
 			self._id = self._generate_id()
-			self.set_input_interrupt(id, self._packet_size, self.input)
+			self.set_input_interrupt(id, self._packet_size, self.input,
+				transfers=INPUT_TRANSFERS)
 			self.daemon.add_controller(self)
 			self._ready = True
 	
@@ -519,10 +565,39 @@ class HIDController(USBDevice, Controller):
 	
 	
 	def input(self, endpoint, data):
-		if _lib.decode(ctypes.byref(self._decoder), data):
-			if self.mapper:
-				self.mapper.input(self,
-						self._decoder.old_state, self._decoder.state)
+		# Reports are only queued here and decoded all at once by flush
+		self._pending.append(data)
+	
+	
+	def flush(self):
+		if self._pending:
+			data, count = b"".join(self._pending), len(self._pending)
+			last = self._pending[-1]
+			del self._pending[:]
+			self.coalesced_reports += count - 1
+			if self._decode(ctypes.byref(self._decoder), data,
+					self._packet_size, count):
+				self.decoded(last)
+		USBDevice.flush(self)
+	
+	
+	def decoded(self, last_report):
+		"""
+		Called when decoded input changes, with last of decoded reports.
+		If any button was pressed and released (or other way around) while
+		other reports were decoded, mapper gets intermediate state first.
+		"""
+		if self.mapper:
+			old_state, state = self._decoder.old_state, self._decoder.state
+			bounced = (self._decoder.pressed & self._decoder.released
+					& ~(old_state.buttons ^ state.buttons))
+			if bounced:
+				between = HIDControllerInput.from_buffer_copy(state)
+				between.buttons = old_state.buttons ^ bounced
+				self.mapper.input(self, old_state, between)
+				self.mapper.input(self, between, state)
+			else:
+				self.mapper.input(self, old_state, state)
 	
 	
 	def apply_config(self, config):
@@ -546,6 +621,11 @@ class HIDController(USBDevice, Controller):
 	def set_gyro_enabled(self, enabled):
 		# TODO: This, maybe.
 		pass
+	
+	
+	def set_motion_sink(self, sink):
+		self._decoder.motion_sink = sink
+		return True
 
 
 class HIDDrv(object):
@@ -614,6 +694,7 @@ def hiddrv_test(cls, args):
 	Basically, if HID device works with this, it will work with daemon as well.
 	"""
 	from scc.poller import Poller
+	from scc.scheduler import Scheduler
 	from scc.drivers.usb import _usb
 	from scc.device_monitor import create_device_monitor
 	from scc.scripts import InvalidArguments
@@ -630,6 +711,7 @@ def hiddrv_test(cls, args):
 		
 		def __init__(self):
 			self.poller = Poller()
+			self.scheduler = Scheduler()
 			self.dev_monitor = create_device_monitor(self)
 			self.exitcode = -1
 		
@@ -644,6 +726,9 @@ def hiddrv_test(cls, args):
 		
 		def get_poller(self):
 			return self.poller
+		
+		def get_scheduler(self):
+			return self.scheduler
 	
 	fake_daemon = FakeDaemon()
 	
@@ -670,7 +755,8 @@ def hiddrv_test(cls, args):
 		print "Ready"
 	sys.stdout.flush()
 	while fake_daemon.exitcode < 0:
-		fake_daemon.poller.poll()
+		fake_daemon.poller.poll(fake_daemon.scheduler.get_timeout(0.01))
+		fake_daemon.scheduler.run()
 		_usb.mainloop()
 	
 	return fake_daemon.exitcode
@@ -8,44 +8,14 @@ Based on https://github.com/libretro/RetroArch/blob/master/cores/libretro-net-re
 from scc.tools import find_library
 from scc.constants import ControllerFlags
 from scc.controller import Controller
-from ctypes import CFUNCTYPE, POINTER, byref, cast, c_void_p
+from scc.native_mapper import ControllerInput, Mapper, MapperInputCB
+from scc.native_mapper import NativeMapper
+from ctypes import POINTER, byref, cast
 import logging, socket, ctypes
 
 log = logging.getLogger("remotepad")
 
 
-class ControllerInput(ctypes.Structure):
-	_fields_ = [
-		("buttons",		ctypes.c_uint32),
-		("ltrig",		ctypes.c_uint8),
-		("rtrig",		ctypes.c_uint8),
-		("stick_x",		ctypes.c_int16),
-		("stick_y",		ctypes.c_int16),
-		("lpad_x",		ctypes.c_int16),
-		("lpad_y",		ctypes.c_int16),
-		("rpad_x",		ctypes.c_int16),
-		("rpad_y",		ctypes.c_int16),
-		("cpad_x",		ctypes.c_int16),
-		("cpad_y",		ctypes.c_int16),
-		("gpitch",		ctypes.c_int16),
-		("groll",		ctypes.c_int16),
-		("gyaw",		ctypes.c_int16),
-		("q1",			ctypes.c_int16),
-		("q2",			ctypes.c_int16),
-		("q3",			ctypes.c_int16),
-		("q4",			ctypes.c_int16),
-	]
-
-
-MapperInputCB = CFUNCTYPE(None, c_void_p, POINTER(ControllerInput))
-
-
-class Mapper(ctypes.Structure):
-	_fields_ = [
-		("input",		MapperInputCB),
-	]
-
-
 class RemotePad(ctypes.Structure):
 	_fields_ = [
 		("mapper",		POINTER(Mapper)),
@@ -77,12 +47,44 @@ class RemotePadController(Controller):
 		self._mapper.input = MapperInputCB(self._input)
 		self._old_state = ControllerInput()
 		self._state_size = ctypes.sizeof(ControllerInput)
+		self._mapper_ptr = POINTER(Mapper)(self._mapper)
 		self._pad = RemotePad()
-		self._pad.mapper = POINTER(Mapper)(self._mapper)
+		self._pad.mapper = self._mapper_ptr
+		self._native = None
+		try:
+			self._native = NativeMapper(self._mapper_ptr)
+		except Exception, e:
+			log.warning("Native mapper not available: %s", e)
 	
 	def get_type(self):
 		return "rpad"
 	
+	def get_input(self):
+		# Python mapper gets natively handled inputs masked out
+		return self._pad.input
+	
+	def set_mapper(self, mapper):
+		if self.mapper:
+			self.mapper.remove_profile_listener(self._profile_modified)
+		Controller.set_mapper(self, mapper)
+		if mapper:
+			mapper.add_profile_listener(self._profile_modified)
+		self._compile()
+	
+	def _profile_modified(self, mapper):
+		# Profile may be changed from client thread; Native tables are
+		# rebuilt from main loop, so they are never modified during input.
+		self._driver.daemon.get_scheduler().schedule(0, self._compile)
+	
+	def _compile(self, *a):
+		if self._native and self.mapper and self._native.compile(
+					self.mapper, self.flags, self._pad.input):
+			self._pad.mapper = self._native.get_mapper()
+		else:
+			if self._native:
+				self._native.clear(self._pad.input)
+			self._pad.mapper = self._mapper_ptr
+	
 	def _remove(self, *a):
 		self._driver._remove(self._address)
 	
@@ -137,6 +139,9 @@ class Driver:
 		
 		self._lib.remotepad_input(controller._pad, cast(
 				ctypes.c_char_p(data), POINTER(RemoteJoypadMessage)))
+		if controller.shared_state:
+			# Written before masking, see RemotePadController.get_input
+			controller.shared_state.write(controller._pad.input)
 
 
 def init(daemon, config):
@@ -0,0 +1,402 @@
+#!/usr/bin/env python2
+"""
+SC Controller - Input trace replay driver
+
+This driver does nothing by default, unless SCC_REPLAY environment variable
+is set to name of trace recorded with SCC_TRACE (see scc/lib/trace.py).
+If it is, devices from trace are recreated using fake USB handles, hidraw
+and evdev devices and recorded packets are fed to them, so they go through
+same decoders, controller classes and Mapper as when they were recorded.
+
+Trace is replayed at original speed. If SCC_REPLAY_SPEED is set, it's used
+as multiplier and 0 means "as fast as possible".
+
+For debuging and benchmarking purposes only.
+"""
+
+from scc.lib.trace import TraceReader, RecordKind, EVDEV_EVENT
+from collections import namedtuple
+import os, json, time, logging
+log = logging.getLogger("Replay")
+
+ENV_VAR = "SCC_REPLAY"
+SPEED_ENV_VAR = "SCC_REPLAY_SPEED"
+# Records handled in one go when replaying as fast as possible,
+# before control is returned to mainloop
+BATCH_SIZE = 256
+
+if ENV_VAR in os.environ:
+	def init(daemon, config):
+		return True
+	
+	
+	def start(daemon):
+		speed = float(os.environ.get(SPEED_ENV_VAR, 1.0))
+		replay = Replay(daemon, os.environ[ENV_VAR], speed)
+		# Delayed, so all other drivers have time to register hotplug callbacks
+		daemon.get_scheduler().schedule(0, replay.start)
+
+
+class Replay(object):
+	"""
+	Replays trace file. In daemon, start() is used to replay it through
+	scheduler; run() replays everything at once and is meant to be used
+	by benchmarks.
+	"""
+	
+	def __init__(self, daemon, filename, speed=1.0):
+		self.daemon = daemon
+		self.speed = speed
+		self.filename = filename
+		self.reader = TraceReader(filename)
+		self.responses = self.reader.get_responses()
+		self.sources = {}
+		self._records = None
+		self._next = None
+		self._start = None
+		self._first = None
+	
+	
+	def start(self):
+		log.info("Replaying %s", self.filename)
+		self._records = iter(self.reader)
+		self._start = time.time()
+		self._step()
+	
+	
+	def _step(self):
+		count = 0
+		while True:
+			if self._next is None:
+				try:
+					self._next = next(self._records)
+				except StopIteration:
+					self.finish()
+					return
+			timestamp = self._next[0]
+			if self.speed > 0:
+				if self._first is None:
+					self._first = timestamp
+				delay = ((self._start - time.time())
+					+ (timestamp - self._first) / 1000000.0 / self.speed)
+				if delay > 0:
+					self.daemon.get_scheduler().schedule(delay, self._step)
+					return
+			elif count >= BATCH_SIZE:
+				self.daemon.get_scheduler().schedule(0, self._step)
+				return
+			self.dispatch(*self._next)
+			self._next = None
+			count += 1
+	
+	
+	def run(self):
+		"""
+		Replays whole trace as fast as possible, without using scheduler.
+		Returns number of INPUT records replayed.
+		"""
+		count = 0
+		for record in self.reader:
+			self.dispatch(*record)
+			if record[2] == RecordKind.INPUT:
+				count += 1
+		self.finish()
+		return count
+	
+	
+	def dispatch(self, timestamp, source, kind, payload):
+		if kind == RecordKind.SOURCE:
+			info = json.loads(payload)
+			factory = REPLAYERS.get(info.get("type"))
+			if factory is None:
+				log.warning("Cannot replay %s device", info.get("type"))
+				return
+			try:
+				self.sources[source] = factory(self, info,
+					Responses(self.responses.get(source, [])))
+			except Exception, e:
+				log.error("Failed to recreate source %s", source)
+				log.exception(e)
+		elif source in self.sources:
+			if kind == RecordKind.INPUT:
+				self.sources[source].input(payload)
+			elif kind == RecordKind.FLUSH:
+				self.sources[source].flush()
+			elif kind == RecordKind.REMOVED:
+				self.sources.pop(source).remove()
+	
+	
+	def finish(self):
+		""" Removes all devices that were not removed while recording """
+		for source in self.sources.values():
+			source.remove()
+		self.sources = {}
+		log.info("Replay finished")
+
+
+class Responses(object):
+	""" Provides recorded responses to replayed device """
+	
+	def __init__(self, lst):
+		self._list = lst
+	
+	
+	def get(self, method, default=None):
+		""" Returns first not yet used response recorded for given method """
+		for i, (m, value) in enumerate(self._list):
+			if m == method:
+				del self._list[i]
+				return value
+		log.warning("No recorded response for %s", method)
+		return default
+	
+	
+	def method(self, name, default=None):
+		""" Returns method that can replace one of recorded device methods """
+		return lambda *a, **b: self.get(name, default)
+
+
+class FakeUSBDevice(object):
+	""" Mimics usb1.USBDevice using descriptors stored in trace """
+	
+	def __init__(self, info):
+		self._info = info
+		self._config = [
+			[ FakeUSBSetting(s) for s in inter ]
+			for inter in info["interfaces"] ]
+	
+	def getVendorID(self): return self._info["vendor"]
+	def getProductID(self): return self._info["product"]
+	def getBusNumber(self): return self._info["bus"]
+	def getPortNumber(self): return self._info["port"]
+	def getDeviceAddress(self): return self._info["address"]
+	def __getitem__(self, index): return self._config
+	def close(self): pass
+
+
+class FakeUSBSetting(object):
+
+	def __init__(self, info):
+		self._info = info
+		self._endpoints = [ FakeUSBEndpoint(*e) for e in info["endpoints"] ]
+	
+	def getNumber(self): return self._info["number"]
+	def getClass(self): return self._info["class"]
+	def getSubClass(self): return self._info["subclass"]
+	def getProtocol(self): return self._info["protocol"]
+	def __iter__(self): return iter(self._endpoints)
+
+
+FakeUSBEndpoint = namedtuple("FakeUSBEndpoint", "address attributes max_packet_size")
+FakeUSBEndpoint.getAddress = lambda self: self.address
+FakeUSBEndpoint.getAttributes = lambda self: self.attributes
+FakeUSBEndpoint.getMaxPacketSize = lambda self: self.max_packet_size
+
+
+class FakeTransfer(object):
+	""" Holds callback set by driver. Replay calls it with recorded data """
+	
+	def __init__(self):
+		self.endpoint = None
+		self._callback = None
+		self._data = None
+	
+	
+	def setInterrupt(self, endpoint, size, callback=None):
+		self.endpoint = endpoint & 0x7F
+		self._callback = callback
+	
+	
+	def complete(self, data):
+		self._data = data
+		self._callback(self)
+	
+	
+	def getStatus(self):
+		from scc.lib.usb1 import TRANSFER_COMPLETED
+		return TRANSFER_COMPLETED
+	
+	
+	def getActualLength(self): return len(self._data)
+	def getBuffer(self): return self._data
+	def submit(self): pass
+
+
+class FakeUSBHandle(object):
+	"""
+	Mimics usb1.USBDeviceHandle. Everything that driver sends to device is
+	ignored and everything driver reads is taken from recorded responses.
+	"""
+	
+	def __init__(self, responses):
+		self.transfers = []
+		self.getRawDescriptor = responses.method("getRawDescriptor")
+		self.controlRead = responses.method("controlRead", b"\0" * 64)
+		self.kernelDriverActive = responses.method("kernelDriverActive", False)
+	
+	
+	def getTransfer(self):
+		self.transfers.append(FakeTransfer())
+		return self.transfers[-1]
+	
+	
+	def _nothing(self, *a, **b):
+		pass
+	
+	controlWrite = claimInterface = releaseInterface = _nothing
+	attachKernelDriver = detachKernelDriver = _nothing
+	resetDevice = close = _nothing
+
+
+class USBReplayer(object):
+	""" Recreates USB device and passes it to driver's hotplug callback """
+	
+	def __init__(self, replay, info, responses):
+		from scc.drivers.usb import get_hotplug_callback
+		callback = get_hotplug_callback(info["vendor"], info["product"])
+		if callback is None:
+			raise ValueError("No driver for USB device %.4x:%.4x" % (
+				info["vendor"], info["product"]))
+		self.handle = FakeUSBHandle(responses)
+		self.device = callback(FakeUSBDevice(info), self.handle)
+		if self.device is None:
+			raise ValueError("USB device %.4x:%.4x ignored by driver" % (
+				info["vendor"], info["product"]))
+		# When driver submits more transfers for same endpoint, any of them
+		# can be used, as all share same callback
+		self._endpoints = { t.endpoint: t for t in self.handle.transfers }
+	
+	
+	def input(self, data):
+		transfer = self._endpoints.get(ord(data[0]))
+		if transfer:
+			transfer.complete(data[1:])
+	
+	
+	def flush(self):
+		self.device.flush()
+	
+	
+	def remove(self):
+		self.device.close()
+
+
+class FakeHIDRaw(object):
+	""" Mimics HIDRaw device; Reports are written to pipe driver reads """
+	
+	def __init__(self, responses):
+		self._pipe_r, self._pipe_w = os.pipe()
+		self._device = self
+		self.getName = responses.method("getName", "")
+		self.getPhysicalAddress = responses.method("getPhysicalAddress", "")
+		self.getFeatureReport = responses.method("getFeatureReport")
+	
+	
+	def fileno(self):
+		return self._pipe_r
+	
+	
+	def sendFeatureReport(self, report, report_num=0):
+		pass
+	
+	
+	def write(self, data):
+		os.write(self._pipe_w, data)
+	
+	
+	def close(self):
+		for fd in (self._pipe_r, self._pipe_w):
+			try:
+				os.close(fd)
+			except OSError:
+				pass
+
+
+class HIDRawReplayer(object):
+	""" Recreates Steam Controller connected over bluetooth """
+	
+	def __init__(self, replay, info, responses):
+		from scc.drivers import sc_by_bt
+		driver = sc_by_bt._drv or sc_by_bt.Driver(replay.daemon, {})
+		self.hidraw = FakeHIDRaw(responses)
+		self.controller = sc_by_bt.SCByBt(driver, info["syspath"], self.hidraw)
+	
+	
+	def input(self, data):
+		self.hidraw.write(data)
+		# Called directly, so it doesn't depend on when poller wakes up
+		self.controller._input()
+	
+	
+	def flush(self):
+		pass
+	
+	
+	def remove(self):
+		self.controller.close()
+
+
+FakeInputEvent = namedtuple("FakeInputEvent", "sec usec type code value")
+
+
+class FakeInputDevice(object):
+	""" Mimics evdev.InputDevice; read() returns recorded events """
+	
+	def __init__(self, info):
+		self.name = info["name"]
+		self.fn = info["fn"]
+		self.fd, self._pipe_w = os.pipe()
+		self.events = []
+	
+	
+	def read(self):
+		events, self.events = self.events, []
+		return events
+	
+	
+	def grab(self): pass
+	def ungrab(self): pass
+	
+	
+	def close(self):
+		os.close(self.fd)
+		os.close(self._pipe_w)
+
+
+class EvdevReplayer(object):
+	""" Recreates evdev device configured by user """
+	
+	def __init__(self, replay, info, responses):
+		from scc.drivers.evdevdrv import EvdevController, HAVE_EVDEV
+		self.event_type = FakeInputEvent
+		if HAVE_EVDEV:
+			import evdev
+			self.event_type = evdev.InputEvent
+		self.daemon = replay.daemon
+		self.device = FakeInputDevice(info)
+		self.controller = EvdevController(self.daemon, self.device,
+			info["config_file"], info["config"])
+		self.daemon.add_controller(self.controller)
+	
+	
+	def input(self, data):
+		self.device.events = [
+			self.event_type(*EVDEV_EVENT.unpack_from(data, i))
+			for i in xrange(0, len(data), EVDEV_EVENT.size) ]
+		self.controller.input()
+	
+	
+	def flush(self):
+		pass
+	
+	
+	def remove(self):
+		self.daemon.remove_controller(self.controller)
+		self.controller.close()
+
+
+REPLAYERS = {
+	"usb": USBReplayer,
+	"hidraw": HIDRawReplayer,
+	"evdev": EvdevReplayer,
+}
@@ -3,8 +3,12 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "scc_future.h"
 
-#define SC_BY_BT_MODULE_VERSION 3
+#define SC_BY_BT_MODULE_VERSION 6
 
 enum BtInPacketType {
 	BUTTON   = 0x0010,
@@ -67,8 +71,12 @@ struct SCByBtC {
 	int fileno;
 	char buffer[256];
 	uint8_t long_packet;
+	uint8_t pending;		// set when packet in buffer is not processed yet
+	uint8_t failed;			// set when read failed after change was already merged
 	struct SCByBtControllerInput state;
 	struct SCByBtControllerInput old_state;
+	uint64_t timestamp;		// mono_time_us() when last packet was read
+	MotionSink* motion_sink;	// if set, gets data from every gyro packet
 };
 
 typedef struct SCByBtC* SCByBtCPtr;
@@ -111,87 +119,178 @@ static inline void debug_packet(char* buffer, size_t size) {
 
 static char tmp_buffer[256];
 
-/** Returns 1 if state has changed, 2 on read error */
-int read_input(SCByBtCPtr ptr) {
-	if (ptr->long_packet) {
-		// Previous packet had long flag set and this is its 2nd part
-		if (read(ptr->fileno, tmp_buffer, PACKET_SIZE) < PACKET_SIZE)
-			return 2;
-		memcpy(ptr->buffer + PACKET_SIZE, tmp_buffer + 1, PACKET_SIZE - 1);
-		ptr->long_packet = 0;
-		// debug_packet(ptr->buffer, PACKET_SIZE * 2);
-	} else {
-		if (read(ptr->fileno, ptr->buffer, PACKET_SIZE) < PACKET_SIZE)
-			return 2;
-		ptr->long_packet = *((uint8_t*)(ptr->buffer + 1)) == LONG_PACKET;
-		if (ptr->long_packet) {
-			// This is 1st part of long packet
-			return 0;
+/** BT_BUTTONS converted to one lookup table for every byte of button data */
+static uint32_t BT_BUTTONS_LUT[3][256];
+static bool lut_initialized = false;
+
+static void init_lut(void) {
+	int bit, i;
+	memset(BT_BUTTONS_LUT, 0, sizeof(BT_BUTTONS_LUT));
+	for (bit=0; bit<BT_BUTTONS_BITS; bit++) {
+		for (i=0; i<256; i++) {
+			if ((i >> (bit % 8)) & 1)
+				BT_BUTTONS_LUT[bit / 8][i] |= BT_BUTTONS[bit];
 		}
-		// debug_packet(ptr->buffer, PACKET_SIZE);
 	}
-	
+	lut_initialized = true;
+}
+
+
+static inline int16_t grab_s16(const char* data, size_t index) {
+	int16_t value;
+	memcpy(&value, data + index * sizeof(int16_t), sizeof(int16_t));
+	return value;
+}
+
+
+/**
+ * Merges packet stored in buffer into state. Before state is changed for
+ * first time, it's copied to old_state and 'changed' is set to true.
+ *
+ * Returns false, without changing anything, if packet would overwrite
+ * buttons already changed since old_state was saved. Button that was
+ * pressed and released while packets were merged would be lost otherwise.
+ */
+static bool apply_packet(SCByBtCPtr ptr, bool* changed) {
 	struct SCByBtControllerInput* state = &(ptr->state);
-	struct SCByBtControllerInput* old_state = &(ptr->old_state);
+	const char* data = &ptr->buffer[4];
+	uint16_t type;
+	memcpy(&type, ptr->buffer + 2, sizeof(uint16_t));
 	
-	int rv = 0;
-	int bit;
-	uint16_t type = *((uint16_t*)(ptr->buffer + 2));
-	char* data = &ptr->buffer[4];
 	if ((type & PING) == PING) {
 		// PING packet does nothing
-		return 0;
+		return true;
 	}
+	if ((type & (BUTTON | TRIGGERS | STICK | LPAD | RPAD | GYRO)) == 0)
+		return true;
+	
 	if ((type & BUTTON) == BUTTON) {
-		uint32_t bt_buttons = *((uint32_t*)data);
-		uint32_t sc_buttons = 0;
-		for (bit=0; bit<BT_BUTTONS_BITS; bit++) {
-			if ((bt_buttons & 1) != 0)
-				sc_buttons |= BT_BUTTONS[bit];
-			bt_buttons >>= 1;
-		}
-		
-		if (rv == 0) { *old_state = *state; state->type = type; rv = 1; }
+		uint32_t bt_buttons;
+		memcpy(&bt_buttons, data, sizeof(uint32_t));
+		uint32_t sc_buttons = BT_BUTTONS_LUT[0][bt_buttons & 0xFF]
+				| BT_BUTTONS_LUT[1][(bt_buttons >> 8) & 0xFF]
+				| BT_BUTTONS_LUT[2][(bt_buttons >> 16) & 0xFF];
+		if (*changed && ((state->type & BUTTON) == BUTTON) && (sc_buttons != state->buttons))
+			return false;
+		if (!*changed) { ptr->old_state = *state; state->type = 0; *changed = true; }
 		state->buttons = sc_buttons;
 		data += 3;
 	}
+	if (!*changed) { ptr->old_state = *state; state->type = 0; *changed = true; }
+	state->type |= type;
+	
 	if ((type & TRIGGERS) == TRIGGERS) {
-		if (rv == 0) { *old_state = *state; state->type = type; rv = 1; }
 		state->ltrig = *(((uint8_t*)data) + 0);
 		state->rtrig = *(((uint8_t*)data) + 1);
 		data += 2;
 	}	
 	if ((type & STICK) == STICK) {
-		if (rv == 0) { *old_state = *state; state->type = type; rv = 1; }
-		state->stick_x = *(((int16_t*)data) + 0);
-		state->stick_y = *(((int16_t*)data) + 1);
+		state->stick_x = grab_s16(data, 0);
+		state->stick_y = grab_s16(data, 1);
 		data += 4;
 	}
 	if ((type & LPAD) == LPAD) {
-		if (rv == 0) { *old_state = *state; state->type = type; rv = 1; }
-		state->lpad_x = *(((int16_t*)data) + 0);
-		state->lpad_y = *(((int16_t*)data) + 1);
+		state->lpad_x = grab_s16(data, 0);
+		state->lpad_y = grab_s16(data, 1);
 		data += 4;
 	}
 	if ((type & RPAD) == RPAD) {
-		if (rv == 0) { *old_state = *state; state->type = type; rv = 1; }
-		state->rpad_x = *(((int16_t*)data) + 0);
-		state->rpad_y = *(((int16_t*)data) + 1);
+		state->rpad_x = grab_s16(data, 0);
+		state->rpad_y = grab_s16(data, 1);
 		data += 4;
 	}
 	if ((type & GYRO) == GYRO) {
-		if (rv == 0) { *old_state = *state; state->type = type; rv = 1; }
-		state->gpitch = *(((int16_t*)data) + 0);
-		state->groll = *(((int16_t*)data) + 1);
-		state->gyaw = *(((int16_t*)data) + 2);
-		state->q1 = *(((int16_t*)data) + 3);
-		state->q2 = *(((int16_t*)data) + 4);
-		state->q3 = *(((int16_t*)data) + 5);
-		state->q4 = *(((int16_t*)data) + 6);
+		state->gpitch = grab_s16(data, 0);
+		state->groll = grab_s16(data, 1);
+		state->gyaw = grab_s16(data, 2);
+		state->q1 = grab_s16(data, 3);
+		state->q2 = grab_s16(data, 4);
+		state->q3 = grab_s16(data, 5);
+		state->q4 = grab_s16(data, 6);
 		data += 14;
+		if (ptr->motion_sink != NULL) {
+			struct GyroInput gyro = {
+				state->gpitch, state->groll, state->gyaw,
+				state->q1, state->q2, state->q3, state->q4
+			};
+			ptr->motion_sink->motion(ptr->motion_sink, &gyro, ptr->timestamp);
+		}
+	}
+	return true;
+}
+
+
+/**
+ * Reads all packets available on (non-blocking) fileno, reassembling long
+ * ones, and merges them into state. old_state is set to state before
+ * first merged packet and state.type to combination of all merged types.
+ *
+ * If packet changing buttons is read after buttons were already changed,
+ * reading stops and 'pending' is set. That packet is processed first
+ * by next call.
+ *
+ * Every packet with gyro data is also passed to motion_sink, if set,
+ * together with time when it was read.
+ *
+ * Returns 1 if state has changed, 2 on read error
+ */
+int read_input(SCByBtCPtr ptr) {
+	bool changed = false;
+	ssize_t r;
+	if (!lut_initialized)
+		init_lut();
+	if (ptr->failed)
+		return 2;
+	if (ptr->pending) {
+		ptr->pending = 0;
+		apply_packet(ptr, &changed);
+	}
+	
+	while (true) {
+		if (ptr->long_packet) {
+			// Previous packet had long flag set and this is its 2nd part
+			r = read(ptr->fileno, tmp_buffer, PACKET_SIZE);
+		} else {
+			r = read(ptr->fileno, ptr->buffer, PACKET_SIZE);
+		}
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				break;
+			ptr->failed = 1;
+			break;
+		}
+		if (r < PACKET_SIZE) {
+			ptr->failed = 1;
+			break;
+		}
+		ptr->timestamp = mono_time_us();
+		
+		if (ptr->long_packet) {
+			memcpy(ptr->buffer + PACKET_SIZE, tmp_buffer + 1, PACKET_SIZE - 1);
+			ptr->long_packet = 0;
+			// debug_packet(ptr->buffer, PACKET_SIZE * 2);
+		} else {
+			ptr->long_packet = *((uint8_t*)(ptr->buffer + 1)) == LONG_PACKET;
+			if (ptr->long_packet) {
+				// This is 1st part of long packet
+				continue;
+			}
+			// debug_packet(ptr->buffer, PACKET_SIZE);
+		}
+		
+		if (!apply_packet(ptr, &changed)) {
+			ptr->pending = 1;
+			break;
+		}
 	}
 	
-	return rv;
+	if (ptr->failed && !changed)
+		return 2;
+	// If read failed after some packets were already merged, change is
+	// reported first and error is returned by next call
+	return changed ? 1 : 0;
 }
 
 const int sc_by_bt_module_version(void) {
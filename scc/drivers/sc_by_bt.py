@@ -8,12 +8,13 @@ Shares a lot of classes with sc_dongle.py
 """
 
 from scc.lib.hidraw import HIDRaw
+from scc.lib.trace import RecordingHIDRaw, get_recorder
 from scc.constants import ControllerFlags
 from scc.tools import find_library
 from sc_dongle import SCPacketType, SCPacketLength, SCConfigType
 from sc_dongle import SCController
 from math import sin, cos
-import os, sys, struct, ctypes, logging
+import os, sys, fcntl, select, struct, ctypes, logging
 
 VENDOR_ID = 0x28de
 PRODUCT_ID = 0x1106
@@ -49,8 +50,12 @@ class SCByBtC(ctypes.Structure):
 		('fileno', ctypes.c_int),
 		('buffer', ctypes.c_char * 256),
 		('long_packet', ctypes.c_uint8),
+		('pending', ctypes.c_uint8),
+		('failed', ctypes.c_uint8),
 		('state', SCByBtControllerInput),
 		('old_state', SCByBtControllerInput),
+		('timestamp', ctypes.c_uint64),
+		('motion_sink', ctypes.c_void_p),
 	]
 
 
@@ -103,6 +108,12 @@ class Driver:
 			return None
 		try:
 			dev = HIDRaw(open(os.path.join("/dev/", hidrawname), "w+b"))
+			recorder = get_recorder()
+			if recorder:
+				trace = recorder.add_source({ "type": "hidraw",
+					"driver": "sc_by_bt", "syspath": syspath })
+				dev = RecordingHIDRaw(dev, trace,
+					self.daemon.get_poller(), PACKET_SIZE)
 			return SCByBt(self, syspath, dev)
 		except Exception, e:
 			log.exception(e)
@@ -111,6 +122,7 @@ class Driver:
 
 class SCByBt(SCController):
 	flags = 0 | ControllerFlags.SEPARATE_STICK
+	STATS_STAGES = { "receive" : "_read_input" }
 	
 	def __init__(self, driver, syspath, hidrawdev):
 		self._cmsg = []  # controll messages
@@ -123,8 +135,12 @@ class SCByBt(SCController):
 		self._device_name = hidrawdev.getName()
 		self._hidrawdev = hidrawdev
 		self._fileno = hidrawdev._device.fileno()
+		# read_input reads until there is nothing left
+		fcntl.fcntl(self._fileno, fcntl.F_SETFL,
+			fcntl.fcntl(self._fileno, fcntl.F_GETFL) | os.O_NONBLOCK)
 		self._c_data = SCByBtC(fileno=self._fileno, long_packet=0)
 		self._c_data_ptr = ctypes.byref(self._c_data)
+		self._read_input = driver._lib.read_input
 		self._old_state = self._c_data.old_state
 		self._state = self._c_data.state
 		self._poller = self.daemon.get_poller()
@@ -261,28 +277,39 @@ class SCByBt(SCController):
 		pass
 	
 	
+	def set_motion_sink(self, sink):
+		self._c_data.motion_sink = sink
+		return True
+	
+	
 	def _input(self, *a):
-		r = self.driver._lib.read_input(self._c_data_ptr)
-		
-		if r == 1:
-			if self.mapper is not None:
-				if self._input_rotation_l and (self._state.type & 0x0100) != 0:
-					lx, ly = self._state.lpad_x, self._state.lpad_y
-					s, c = sin(self._input_rotation_l), cos(self._input_rotation_l)
-					self._state.lpad_x = int(lx * c - ly * s)
-					self._state.lpad_y = int(lx * s + ly * c)
-				if self._input_rotation_r and (self._state.type & 0x0200) != 0:
-					rx, ry = self._state.rpad_x, self._state.rpad_y
-					s, c = sin(self._input_rotation_r), cos(self._input_rotation_r)
-					self._state.rpad_x = int(rx * c - ry * s)
-					self._state.rpad_y = int(rx * s + ry * c)
-				
-				self.mapper.input(self, self._old_state, self._state)
-			self.flush()
-		elif r > 1:
-			log.error("Read Failed")
-			self.close()
-			self.driver.retry(self.syspath)
+		while True:
+			r = self._read_input(self._c_data_ptr)
+			
+			if r == 1:
+				if self.mapper is not None:
+					if self._input_rotation_l and (self._state.type & 0x0100) != 0:
+						lx, ly = self._state.lpad_x, self._state.lpad_y
+						s, c = sin(self._input_rotation_l), cos(self._input_rotation_l)
+						self._state.lpad_x = int(lx * c - ly * s)
+						self._state.lpad_y = int(lx * s + ly * c)
+					if self._input_rotation_r and (self._state.type & 0x0200) != 0:
+						rx, ry = self._state.rpad_x, self._state.rpad_y
+						s, c = sin(self._input_rotation_r), cos(self._input_rotation_r)
+						self._state.rpad_x = int(rx * c - ry * s)
+						self._state.rpad_y = int(rx * s + ry * c)
+					
+					self.mapper.input(self, self._old_state, self._state)
+				self.flush()
+			elif r > 1:
+				log.error("Read Failed")
+				self.close()
+				self.driver.retry(self.syspath)
+				return
+			if not self._c_data.pending and not self._c_data.failed:
+				# Otherwise, read_input stopped before another button change
+				# or has read error to report
+				break
 
 
 def hidraw_test(filename):
@@ -310,6 +337,7 @@ def hidraw_test(filename):
 	c.configure()
 	c.flush()
 	while True:
+		select.select([ c._fileno ], [], [])
 		c._input()
 		print { x[0]: getattr(c._state, x[0]) for x in c._state._fields_ }
 
@@ -322,6 +350,7 @@ def init(daemon, config):
 	# if not (HAVE_EVDEV and config["drivers"].get("evdevdrv")):
 	# 	log.warning("Evdev driver is not enabled, Steam Controller over Bluetooth support cannot be enabled.")
 	# 	return False
+	global _drv
 	_drv = Driver(daemon, config)
 	return True
 
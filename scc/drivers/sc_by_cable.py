@@ -71,6 +71,8 @@ class SCByCable(USBDevice, SCController):
 			self.configure()
 			self._ready = True
 		if tup.status == SCStatus.INPUT:
+			if self._last_tup:
+				self.coalesced_reports += 1
 			self._last_tup = tup
 	
 	
@@ -161,6 +161,8 @@ class SCConfigType(IntEnum):
 
 
 class SCController(Controller):
+	STATS_STAGES = { "receive" : "input" }
+	
 	def __init__(self, driver, ccidx, endpoint):
 		Controller.__init__(self)
 		self._driver = driver
@@ -1,5 +1,6 @@
 #pragma once
 #include <stdint.h>
+#include <time.h>
 
 typedef struct ControllerInput ControllerInput;
 
@@ -84,6 +85,22 @@ struct Mapper {
 	void		(*input)(Mapper* m, ControllerInput* i);
 };
 
+/**
+ * Receives motion data directly from driver, bypassing mapper. 'timestamp'
+ * is mono_time_us() taken when data was read from device.
+ */
+typedef struct MotionSink MotionSink;
+struct MotionSink {
+	void		(*motion)(MotionSink* s, const struct GyroInput* gyro, uint64_t timestamp);
+};
+
+/** Returns current value of CLOCK_MONOTONIC converted to number of microseconds */
+inline static uint64_t mono_time_us(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
 
 #define STICK_PAD_MIN		((AxisValue)-0x8000)
 #define STICK_PAD_MAX		((AxisValue) 0x7FFF)
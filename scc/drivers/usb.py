@@ -10,12 +10,15 @@ Callback will be called with following arguments:
 Callback has to return created USBDevice instance or None.
 """
 from scc.lib import usb1
+from scc.lib.trace import RecordingProxy, get_recorder
 
-import time, traceback, logging
+import traceback, logging
 log = logging.getLogger("USB")
 
 class USBDevice(object):
 	""" Base class for all handled usb devices """
+	dropped_reports = 0		# transfers that failed or had unexpected size
+	
 	def __init__(self, device, handle):
 		self.device = device
 		self.handle = handle
@@ -25,18 +28,28 @@ class USBDevice(object):
 		self._transfer_list = []
 	
 	
-	def set_input_interrupt(self, endpoint, size, callback):
+	def set_input_interrupt(self, endpoint, size, callback, transfers=1):
 		"""
 		Helper method for setting up input transfer.
 		
 		callback(endpoint, data) is called repeadedly with every packed recieved.
+		With 'transfers' > 1, that many transfers is submitted at once, so
+		device can send more packets before they are handled. All packets
+		recieved since last mainloop iteration are then passed to callback
+		before flush() is called.
 		"""
+		trace = getattr(self.handle, "trace", None)
+		
 		def callback_wrapper(transfer):
-			if (transfer.getStatus() != usb1.TRANSFER_COMPLETED or
-				transfer.getActualLength() != size):
+			status = transfer.getStatus()
+			if status != usb1.TRANSFER_COMPLETED or transfer.getActualLength() != size:
+				if status != usb1.TRANSFER_CANCELLED:
+					self.dropped_reports += 1
 				return
 			
 			data = transfer.getBuffer()
+			if trace:
+				trace.input(chr(endpoint) + data)
 			try:
 				callback(endpoint, data)
 			except Exception, e:
@@ -46,14 +59,15 @@ class USBDevice(object):
 			finally:
 				transfer.submit()
 		
-		transfer = self.handle.getTransfer()
-		transfer.setInterrupt(
-			usb1.ENDPOINT_IN | endpoint,
-			size,
-			callback=callback_wrapper,
-		)
-		transfer.submit()
-		self._transfer_list.append(transfer)
+		for i in xrange(transfers):
+			transfer = self.handle.getTransfer()
+			transfer.setInterrupt(
+				usb1.ENDPOINT_IN | endpoint,
+				size,
+				callback=callback_wrapper,
+			)
+			transfer.submit()
+			self._transfer_list.append(transfer)
 	
 	
 	def send_control(self, index, data):
@@ -124,7 +138,7 @@ class USBDevice(object):
 		"""
 		tp = self.device.getVendorID(), self.device.getProductID()
 		self.close()
-		_usb._retry_devices.append(tp)
+		_usb._retry_later(tp)
 	
 	
 	def claim(self, number):
@@ -187,7 +201,7 @@ class USBDriver(object):
 		self._syspaths = {}
 		self._started = False
 		self._retry_devices = []
-		self._retry_devices_timer = 0
+		self._retry_scheduled = False
 		self._ctx = None	# Set by start method
 		self._changed = 0
 	
@@ -248,6 +262,12 @@ class USBDriver(object):
 		else:
 			return
 		
+		recorder = get_recorder()
+		if recorder:
+			handle = RecordingProxy(handle, recorder.add_source(
+					USBDriver.describe_device(device)),
+				("getRawDescriptor", "controlRead", "kernelDriverActive"))
+		
 		callback = self._known_ids[tp]
 		handled_device = None
 		try:
@@ -264,7 +284,7 @@ class USBDriver(object):
 						"usb:%s:%s" % (tp[0], tp[1]),
 						"Failed to claim USB device: %s" % (e,)
 					)
-				self._retry_devices.append((syspath, tp))
+				self._retry_later((syspath, tp))
 				device.close()
 				return True
 		if handled_device:
@@ -286,6 +306,9 @@ class USBDriver(object):
 			del self._syspaths[syspath]
 			del self._devices[device]
 			handled_device.close()
+			trace = getattr(handled_device.handle, "trace", None)
+			if trace:
+				trace.removed()
 			try:
 				device.close()
 			except usb1.USBErrorNoDevice:
@@ -293,6 +316,36 @@ class USBDriver(object):
 				pass
 	
 	
+	@staticmethod
+	def describe_device(device):
+		"""
+		Returns dict with IDs, address and interface descriptors of device,
+		stored in input trace so replay can recreate it
+		"""
+		return {
+			"type": "usb",
+			"vendor": device.getVendorID(),
+			"product": device.getProductID(),
+			"bus": device.getBusNumber(),
+			"port": device.getPortNumber(),
+			"address": device.getDeviceAddress(),
+			"interfaces": [
+				[ {
+					"number": setting.getNumber(),
+					"class": setting.getClass(),
+					"subclass": setting.getSubClass(),
+					"protocol": setting.getProtocol(),
+					"endpoints": [ ( e.getAddress(), e.getAttributes(),
+						e.getMaxPacketSize() ) for e in setting ],
+				} for setting in inter ]
+				for inter in device[0] ]
+		}
+	
+	
+	def get_hotplug_callback(self, vendor_id, product_id):
+		return self._known_ids.get((vendor_id, product_id))
+	
+	
 	def register_hotplug_device(self, callback, vendor_id, product_id, on_failure):
 		self._known_ids[vendor_id, product_id] = callback
 		if on_failure:
@@ -317,18 +370,30 @@ class USBDriver(object):
 			self._changed = 0
 		
 		for d in self._devices.values():		# TODO: don't use .values() here
+			trace = getattr(d.handle, "trace", None)
+			if trace:
+				trace.flush()
 			try:
 				d.flush()
 			except usb1.USBErrorPipe:
 				log.error("USB device %s disconnected durring flush", d)
 				d.close()
 				break
-		if len(self._retry_devices):
-			if time.time() > self._retry_devices_timer:
-				self._retry_devices_timer = time.time() + 5.0
-				lst, self._retry_devices = self._retry_devices, []
-				for syspath, (vendor, product) in lst:
-					self.handle_new_device(syspath, vendor, product)
+	
+	
+	def _retry_later(self, item):
+		""" Schedules another attempt to grab device in 5 seconds """
+		self._retry_devices.append(item)
+		if not self._retry_scheduled:
+			self._retry_scheduled = True
+			self.daemon.get_scheduler().schedule(5.0, self._retry)
+	
+	
+	def _retry(self):
+		self._retry_scheduled = False
+		lst, self._retry_devices = self._retry_devices, []
+		for syspath, (vendor, product) in lst:
+			self.handle_new_device(syspath, vendor, product)
 
 
 # USBDriver should be process-wide singleton
@@ -337,7 +402,8 @@ _usb = USBDriver()
 def init(daemon, config):
 	_usb.set_daemon(daemon)
 	daemon.add_on_exit(_usb.on_exit)
-	daemon.add_mainloop(_usb.mainloop)
+	# USB mainloop only reacts to events, it doesn't need periodic calls
+	daemon.add_mainloop(_usb.mainloop, periodic=False)
 	return True
 
 def start(daemon):
@@ -350,3 +416,8 @@ def register_hotplug_device(callback, vendor_id, product_id, on_failure=None):
 
 def unregister_hotplug_device(callback, vendor_id, product_id):
 	_usb.unregister_hotplug_device(callback, vendor_id, product_id)
+
+
+def get_hotplug_callback(vendor_id, product_id):
+	""" Returns callback registered for given device or None """
+	return _usb.get_hotplug_callback(vendor_id, product_id)
@@ -8,3 +8,39 @@ BUTTON_ORDER = (
 	SCButtons.STICKPRESS, SCButtons.RPAD, SCButtons.LPAD,
 	SCButtons.RGRIP, SCButtons.LGRIP
 )
+
+# Buttons displayed while input test mode is enabled
+TEST_BUTTONS = (
+	SCButtons.A, SCButtons.B, SCButtons.C, SCButtons.X, SCButtons.Y,
+	SCButtons.START, SCButtons.BACK, SCButtons.LB, SCButtons.RB,
+	SCButtons.LPAD, SCButtons.RPAD, SCButtons.LGRIP, SCButtons.RGRIP,
+	SCButtons.LT, SCButtons.RT, SCButtons.STICKPRESS
+)
+# Fields of input state that affect which of TEST_BUTTONS are pressed
+TEST_FIELDS = ( "buttons", "ltrig", "rtrig" )
+
+
+def get_test_buttons(state):
+	"""
+	Returns list of TEST_BUTTONS pressed in given input state.
+	Triggers are displayed as pressed on any pressure, not only
+	when they are clicked.
+	"""
+	rv = [ b for b in TEST_BUTTONS if state.buttons & b
+		and b not in (SCButtons.LT, SCButtons.RT) ]
+	if state.ltrig: rv.append(SCButtons.LT)
+	if state.rtrig: rv.append(SCButtons.RT)
+	return rv
+
+
+def get_refresh_rate(widget, default=60):
+	"""
+	Returns refresh rate of monitor on which widget is displayed
+	or 'default' if it can't be determined.
+	"""
+	try:
+		window = widget.get_window()
+		m = window.get_display().get_monitor_at_window(window)
+		return (m.get_refresh_rate() / 1000) or default
+	except:
+		return default
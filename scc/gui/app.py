@@ -18,6 +18,7 @@ from scc.gui.binding_editor import BindingEditor
 from scc.gui.statusicon import get_status_icon
 from scc.gui.dwsnc import headerbar, IS_UNITY
 from scc.gui.ribar import RIBar
+from scc.gui import TEST_FIELDS, get_test_buttons, get_refresh_rate
 from scc.tools import check_access, find_gksudo, profile_is_override, nameof
 from scc.tools import get_profile_name, profile_is_default, find_profile
 from scc.constants import SCButtons, STICK, STICK_PAD_MAX
@@ -81,6 +82,7 @@ class App(Gtk.Application, UserDataManager, BindingEditor):
 		self.outdated_version = None
 		self.profile_switchers = []
 		self.test_mode_controller = None
+		self.test_mode_handler = None
 		self.current_ui_layout = "default"		# only "default" and "deck" are supported
 		self.current_file = None				# Currently edited file
 		self.controller_count = 0
@@ -991,6 +993,8 @@ class App(Gtk.Application, UserDataManager, BindingEditor):
 		if self.dm.is_alive() and not self.osd_mode:
 			if self.test_mode_controller:
 				self.test_mode_controller.unlock_all()
+				self.test_mode_controller.disconnect(self.test_mode_handler)
+				self.test_mode_controller = None
 			try:
 				c = self.dm.get_controllers()[0]
 			except IndexError:
@@ -998,11 +1002,10 @@ class App(Gtk.Application, UserDataManager, BindingEditor):
 				return
 			if c:
 				c.unlock_all()
-				c.observe(DaemonManager.nocallback, self.on_observe_failed,
-					'A', 'B', 'C', 'X', 'Y', 'START', 'BACK', 'LB', 'RB',
-					'LPAD', 'RPAD', 'LGRIP', 'RGRIP', 'LT', 'RT', 'LEFT',
-					'RIGHT', 'STICK', 'STICKPRESS')
+				c.subscribe(DaemonManager.nocallback, self.on_observe_failed,
+					get_refresh_rate(self.window))
 				self.test_mode_controller = c
+				self.test_mode_handler = c.connect('state', self.on_controller_state)
 	
 	
 	def enable_osd_mode(self):
@@ -1108,46 +1111,38 @@ class App(Gtk.Application, UserDataManager, BindingEditor):
 	def on_daemon_event_observer(self, daemon, c, what, data):
 		if self.osd_mode_mapper:
 			self.osd_mode_mapper.handle_event(daemon, what, data)
-		elif what in (LEFT, RIGHT, STICK):
-			widget, area = {
-				LEFT  : (self.lpad_test,  "LPADTEST"),
-				RIGHT : (self.rpad_test,  "RPADTEST"),
-				STICK : (self.stick_test, "STICKTEST"),
-			}[what]
-			# Check if stick or pad is released
-			if data[0] == data[1] == 0:
-				widget.hide()
-				return
-			if not widget.is_visible():
-				widget.show()
-			# Grab values
-			ax, ay, aw, trash = self.background.get_area_position(area)
-			cw = widget.get_allocation().width
-			# Compute center
-			x, y = ax + aw * 0.5 - cw * 0.5, ay + 1.0 - cw * 0.5
-			# Add pad position
-			x += data[0] * aw / STICK_PAD_MAX * 0.5
-			y -= data[1] * aw / STICK_PAD_MAX * 0.5
-			# Move circle
-			self.main_area.move(widget, x, y)
-		elif what in ("LT", "RT", "STICKPRESS"):
-			if data[0]:
-				self.hilights[App.OBSERVE_COLOR].add(what)
-			else:
-				self.hilights[App.OBSERVE_COLOR].remove(what)
+	
+	
+	def on_controller_state(self, c, state, changed):
+		if any(x in changed for x in TEST_FIELDS):
+			self.hilights[App.OBSERVE_COLOR] = set(
+				b.name for b in get_test_buttons(state))
 			self._update_background()
-		elif hasattr(SCButtons, what):
-			try:
-				if data[0]:
-					self.hilights[App.OBSERVE_COLOR].add(what)
-				else:
-					self.hilights[App.OBSERVE_COLOR].remove(what)
-				self._update_background()
-			except KeyError, e:
-				# Non fatal
-				pass
-		else:
-			print "event", what
+		for widget, area, x, y in (
+				(self.lpad_test,  "LPADTEST",  "lpad_x",  "lpad_y"),
+				(self.rpad_test,  "RPADTEST",  "rpad_x",  "rpad_y"),
+				(self.stick_test, "STICKTEST", "stick_x", "stick_y")):
+			if x in changed or y in changed:
+				self._move_test_cursor(widget, area, getattr(state, x), getattr(state, y))
+	
+	
+	def _move_test_cursor(self, widget, area, x, y):
+		# Check if stick or pad is released
+		if x == y == 0:
+			widget.hide()
+			return
+		if not widget.is_visible():
+			widget.show()
+		# Grab values
+		ax, ay, aw, trash = self.background.get_area_position(area)
+		cw = widget.get_allocation().width
+		# Compute center
+		cx, cy = ax + aw * 0.5 - cw * 0.5, ay + 1.0 - cw * 0.5
+		# Add pad position
+		cx += x * aw / STICK_PAD_MAX * 0.5
+		cy -= y * aw / STICK_PAD_MAX * 0.5
+		# Move circle
+		self.main_area.move(widget, cx, cy)
 	
 	
 	def on_profile_right_clicked(self, ps):
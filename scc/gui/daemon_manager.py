@@ -13,6 +13,7 @@ from __future__ import unicode_literals
 from scc.tools import find_binary, find_button_image, nameof
 from scc.paths import get_daemon_socket
 from scc.constants import SCButtons
+from scc.snapshot import SnapshotDecoder
 from scc.gui import BUTTON_ORDER
 from gi.repository import GObject, Gio, GLib
 
@@ -175,7 +176,17 @@ class DaemonManager(GObject.GObject):
 			return
 		self.buffer += data
 		while b"\n" in self.buffer:
-			line, self.buffer = self.buffer.split(b"\n", 1)
+			line, rest = self.buffer.split(b"\n", 1)
+			if line.startswith(b"Snapshot:"):
+				# Binary data follows; wait until all of it is recieved
+				controller_id, length = line[9:].strip().split(b" ")
+				length = int(length)
+				if len(rest) < length:
+					break
+				data, self.buffer = rest[0:length], rest[length:]
+				self.get_controller(controller_id.decode("utf-8"))._on_snapshot(data)
+				continue
+			self.buffer = rest
 			line = line.decode("utf-8")
 			if line.startswith("Version:"):
 				version = line.split(":", 1)[-1].strip()
@@ -338,12 +349,18 @@ class ControllerManager(GObject.GObject):
 		profile-changed (profile)
 			Emited after profile for controller is changed.
 			Profile is filename of currently active profile
+		
+		state (state, changed)
+			Emited when subscribe() was called and state of controller
+			changes. 'state' is InputSnapshot namedtuple, 'changed' is list
+			of names of its fields that changed since last emission.
 	"""
 	
 	__gsignals__ = {
 			b"event"			: (GObject.SignalFlags.RUN_FIRST, None, (object,object)),
 			b"lost"				: (GObject.SignalFlags.RUN_FIRST, None, ()),
 			b"profile-changed"	: (GObject.SignalFlags.RUN_FIRST, None, (object,)),
+			b"state"			: (GObject.SignalFlags.RUN_FIRST, None, (object,object)),
 	}
 	
 	DEFAULT_ICONS = [ "A", "B", "X", "Y", "BACK", "C", "START",
@@ -360,6 +377,7 @@ class ControllerManager(GObject.GObject):
 		self._profile = None
 		self._type = None
 		self._flags = 0
+		self._decoder = SnapshotDecoder()
 	
 	
 	def __repr__(self):
@@ -532,6 +550,24 @@ class ControllerManager(GObject.GObject):
 		self._dm.request("Observe: %s" % (what,), success_cb, error_cb)
 	
 	
+	def subscribe(self, success_cb, error_cb, rate):
+		"""
+		Asks daemon to send state of controller at most 'rate' times per
+		second, only when it changes. State is processed using 'state'
+		signal, until unlock_all() is called.
+		
+		Calls success_cb() on success or error_cb(error) on failure.
+		"""
+		self._decoder = SnapshotDecoder()
+		self._send_id()
+		self._dm.request("Subscribe: %s" % (rate,), success_cb, error_cb)
+	
+	
+	def _on_snapshot(self, data):
+		changed = self._decoder.decode(data)
+		self.emit('state', self._decoder.state, changed)
+	
+	
 	def replace(self, success_cb, error_cb, what, action):
 		"""
 		Temporally replaces action on physical button, axis or pad,
@@ -4,23 +4,68 @@ SC-Controller - Background
 
 Changes SVG on the fly and uptates that magnificent image on background with it.
 Also supports clicking on areas defined in SVG image.
+
+Rendered images are cached by all SVGWidgets in process, keyed by content
+of SVG, so reopening OSD window with same image doesn't render anything.
+Additionally, every hilighted element is rendered only once per color into
+layer covering only its bounding box and image with different hilights is
+composed from such layers, repainting only elements that were changed.
 """
 from __future__ import unicode_literals
 from scc.tools import _
 
 from gi.repository import Gtk, Gdk, GObject, GdkPixbuf, Rsvg
 from xml.etree import ElementTree as ET
-from math import sin, cos, pi as PI
+from math import sin, cos, floor, ceil, pi as PI
 from collections import OrderedDict
-import os, sys, re, logging
+import os, sys, re, hashlib, logging
+try:
+	import cairo
+except ImportError:
+	# Without pycairo, every image is rendered as whole
+	cairo = None
 
 log = logging.getLogger("Background")
 ET.register_namespace('', "http://www.w3.org/2000/svg")
 
 
+class RasterCache(object):
+	""" Keeps up to 'size' most recently used items """
+	
+	def __init__(self, size):
+		self.size = size
+		self._items = OrderedDict()
+	
+	
+	def get(self, key):
+		""" Returns cached item or None """
+		value = self._items.pop(key, None)
+		if value is not None:
+			self._items[key] = value
+		return value
+	
+	
+	def put(self, key, value):
+		self._items.pop(key, None)
+		while len(self._items) >= self.size:
+			self._items.popitem(False)
+		self._items[key] = value
+
+
+# (digest, size_override, hilights) -> pixbuf displayed by widget
+IMAGE_CACHE = RasterCache(50)
+# (digest, element id, color) -> cairo surface of element area
+# (digest, None, None) -> cairo surface of image without hilights
+LAYER_CACHE = RasterCache(200)
+
+
 class SVGWidget(Gtk.EventBox):
 	FILENAME = "background.svg"
-	CACHE_SIZE = 50
+	# Pixels added around bounding box of element to cover stroke and
+	# antialiasing, which rsvg doesn't include
+	LAYER_MARGIN = 4
+	# Cleared if rsvg or cairo doesn't support rendering into layers
+	use_layers = cairo is not None
 	
 	__gsignals__ = {
 			# Raised when mouse is over defined area
@@ -34,7 +79,6 @@ class SVGWidget(Gtk.EventBox):
 	
 	def __init__(self, filename, init_hilighted=True):
 		Gtk.EventBox.__init__(self)
-		self.cache = OrderedDict()
 		self.areas = []
 		
 		self.connect("motion-notify-event", self.on_mouse_moved)
@@ -54,11 +98,24 @@ class SVGWidget(Gtk.EventBox):
 	
 	def set_image(self, filename):
 		self.current_svg = open(filename, "r").read().decode("utf-8")
-		self.cache = OrderedDict()
+		self.svg_changed()
 		self.areas = []
 		self.parse_image()
 	
 	
+	def svg_changed(self):
+		"""
+		Called when current_svg is changed. Drops everything widget
+		computed from old image; cached images are kept, as they are keyed
+		by content of SVG.
+		"""
+		self._digest = hashlib.sha1(self.current_svg.encode("utf-8")).hexdigest()
+		self._handle = None			# Rsvg handle of current_svg
+		self._boxes = {}			# element id -> area covered by element
+		self._surface = None		# composed image
+		self._layered = {}			# hilights applied on self._surface
+	
+	
 	def parse_image(self):
 		"""
 		Goes trought SVG image, searches for all rects named
@@ -75,11 +132,10 @@ class SVGWidget(Gtk.EventBox):
 	def resize(self, width, height):
 		"""
 		Overrides image size.
-		Doesn't keep aspect ratio and causes cache to be flushed,
-		so this may be slow and nasty.
+		Doesn't keep aspect ratio and every image has to be scaled
+		after it's rendered, so this may be slow and nasty.
 		"""
 		self.size_override = width, height
-		self.cache = OrderedDict()
 	
 	
 	def on_mouse_click(self, trash, event):
@@ -191,37 +247,158 @@ class SVGWidget(Gtk.EventBox):
 	
 	def hilight(self, buttons):
 		""" Hilights specified button, if same ID is found in svg """
-		cache_id = "|".join([ "%s:%s" % (x, buttons[x]) for x in buttons ])
-		if not cache_id in self.cache:
-			# Ok, this is close to madness, but probably better than drawing
-			# 200 images by hand;
-			if len(buttons) == 0:
-				# Quick way out - changes are not needed
-				svg = Rsvg.Handle.new_from_data(self.current_svg.encode("utf-8"))
-			else:
-				# 1st, parse source as XML
-				tree = ET.fromstring(self.current_svg.encode("utf-8"))
-				# 2nd, change colors of some elements
-				for button in buttons:
-					el = SVGEditor.find_by_id(tree, button)
-					if el is not None:
-						SVGEditor.recolor(el, buttons[button])
-					
-				# 3rd, turn it back into XML string......
-				xml = ET.tostring(tree)
-				
-				# ... and now, parse that as XML again......
-				svg = Rsvg.Handle.new_from_data(xml.encode("utf-8"))
-			while len(self.cache) >= self.CACHE_SIZE:
-				self.cache.popitem(False)
+		cache_id = (self._digest, self.size_override, tuple(sorted(buttons.items())))
+		pixbuf = IMAGE_CACHE.get(cache_id)
+		if pixbuf is None:
+			if SVGWidget.use_layers:
+				try:
+					pixbuf = self._compose(buttons)
+				except (AttributeError, TypeError), e:
+					log.warning("Failed to render image in layers: %s", e)
+					SVGWidget.use_layers = False
+			if pixbuf is None:
+				pixbuf = self._render(buttons)
 			if self.size_override:
 				w, h = self.size_override
-				self.cache[cache_id] = svg.get_pixbuf().scale_simple(
-						w, h, GdkPixbuf.InterpType.BILINEAR)
+				pixbuf = pixbuf.scale_simple(w, h, GdkPixbuf.InterpType.BILINEAR)
+			IMAGE_CACHE.put(cache_id, pixbuf)
+		
+		self.image.set_from_pixbuf(pixbuf)
+	
+	
+	def _render(self, buttons):
+		""" Renders entire image with specified buttons hilighted """
+		# Ok, this is close to madness, but probably better than drawing
+		# 200 images by hand;
+		if len(buttons) == 0:
+			# Quick way out - changes are not needed
+			return self._get_handle().get_pixbuf()
+		# 1st, parse source as XML
+		tree = ET.fromstring(self.current_svg.encode("utf-8"))
+		# 2nd, change colors of some elements
+		for button in buttons:
+			el = SVGEditor.find_by_id(tree, button)
+			if el is not None:
+				SVGEditor.recolor(el, buttons[button])
+		
+		# 3rd, turn it back into XML string......
+		xml = ET.tostring(tree)
+		
+		# ... and now, parse that as XML again......
+		svg = Rsvg.Handle.new_from_data(xml.encode("utf-8"))
+		return svg.get_pixbuf()
+	
+	
+	def _compose(self, buttons):
+		"""
+		Updates composed image so it has specified buttons hilighted,
+		repainting only area of elements which hilight changed since
+		last call.
+		
+		Returns None if that's not possible because some of elements
+		overlap and so whole image has to be rendered.
+		"""
+		ids = [ id for id in set(buttons) | set(self._layered)
+			if self._get_box(id) is not None ]
+		boxes = [ self._get_box(id) for id in ids ]
+		for i in xrange(0, len(boxes)):
+			for j in xrange(i + 1, len(boxes)):
+				if SVGWidget._overlaps(boxes[i], boxes[j]):
+					return None
+		
+		base = self._get_base()
+		if self._surface is None:
+			self._surface = cairo.ImageSurface(cairo.FORMAT_ARGB32,
+				base.get_width(), base.get_height())
+			self._layered = {}
+			ctx = cairo.Context(self._surface)
+			ctx.set_source_surface(base, 0, 0)
+			ctx.set_operator(cairo.OPERATOR_SOURCE)
+			ctx.paint()
+		
+		ctx = cairo.Context(self._surface)
+		ctx.set_operator(cairo.OPERATOR_SOURCE)
+		for id in ids:
+			if buttons.get(id) == self._layered.get(id):
+				continue
+			x, y, w, h = self._get_box(id)
+			if id in buttons:
+				ctx.set_source_surface(self._get_layer(id, buttons[id]), x, y)
 			else:
-				self.cache[cache_id] = svg.get_pixbuf()
+				ctx.set_source_surface(base, 0, 0)
+			ctx.rectangle(x, y, w, h)
+			ctx.fill()
+		self._layered = dict(buttons)
 		
-		self.image.set_from_pixbuf(self.cache[cache_id])
+		self._surface.flush()
+		return Gdk.pixbuf_get_from_surface(self._surface, 0, 0,
+			self._surface.get_width(), self._surface.get_height())
+	
+	
+	@staticmethod
+	def _overlaps(a, b):
+		return (a[0] < b[0] + b[2] and b[0] < a[0] + a[2]
+			and a[1] < b[1] + b[3] and b[1] < a[1] + a[3])
+	
+	
+	def _get_handle(self):
+		""" Returns (cached) Rsvg handle of current image """
+		if self._handle is None:
+			self._handle = Rsvg.Handle.new_from_data(self.current_svg.encode("utf-8"))
+		return self._handle
+	
+	
+	def _get_box(self, id):
+		"""
+		Returns area covered by element as (x, y, width, height) in whole
+		pixels or None if there is no such element.
+		"""
+		if id not in self._boxes:
+			handle, box = self._get_handle(), None
+			if handle.has_sub("#" + id):
+				found1, pos = handle.get_position_sub("#" + id)
+				found2, dim = handle.get_dimensions_sub("#" + id)
+				if found1 and found2:
+					m = SVGWidget.LAYER_MARGIN
+					x, y = int(floor(pos.x - m)), int(floor(pos.y - m))
+					box = (x, y,
+						int(ceil(pos.x + dim.width + m)) - x,
+						int(ceil(pos.y + dim.height + m)) - y)
+			self._boxes[id] = box
+		return self._boxes[id]
+	
+	
+	def _get_base(self):
+		""" Returns (cached) surface with image without any hilights """
+		key = (self._digest, None, None)
+		base = LAYER_CACHE.get(key)
+		if base is None:
+			handle = self._get_handle()
+			dim = handle.get_dimensions()
+			base = cairo.ImageSurface(cairo.FORMAT_ARGB32, dim.width, dim.height)
+			handle.render_cairo(cairo.Context(base))
+			LAYER_CACHE.put(key, base)
+		return base
+	
+	
+	def _get_layer(self, id, color):
+		"""
+		Returns (cached) surface with area of element, as returned by
+		_get_box, rendered with element recolored to specified color.
+		"""
+		key = (self._digest, id, color)
+		layer = LAYER_CACHE.get(key)
+		if layer is None:
+			tree = ET.fromstring(self.current_svg.encode("utf-8"))
+			SVGEditor.recolor(SVGEditor.find_by_id(tree, id), color)
+			svg = Rsvg.Handle.new_from_data(ET.tostring(tree).encode("utf-8"))
+			x, y, w, h = self._get_box(id)
+			layer = cairo.ImageSurface(cairo.FORMAT_ARGB32, w, h)
+			ctx = cairo.Context(layer)
+			ctx.translate(-x, -y)
+			svg.render_cairo(ctx)
+			LAYER_CACHE.put(key, layer)
+		return layer
 	
 	
 	def get_pixbuf(self):
@@ -287,7 +464,7 @@ class SVGEditor(object):
 		Return self.
 		"""
 		self._svgw.current_svg = ET.tostring(self._tree)
-		self._svgw.cache = OrderedDict()
+		self._svgw.svg_changed()
 		self._svgw.hilight({})
 		
 		return self
@@ -0,0 +1,82 @@
+#!/usr/bin/env python2
+"""
+eventfd.py - minimal ctypes wrapper for Linux eventfd API
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2 as published by
+the Free Software Foundation
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+"""
+
+from ctypes.util import find_library
+import os, ctypes, struct, errno
+
+EFD_NONBLOCK		= os.O_NONBLOCK
+EFD_CLOEXEC			= 0o2000000
+ONE					= struct.pack("Q", 1)
+
+
+_libc = None
+
+def _get_libc():
+	global _libc
+	if _libc is None:
+		_libc = ctypes.CDLL(find_library("c"), use_errno=True)
+		_libc.eventfd.argtypes = [ ctypes.c_uint, ctypes.c_int ]
+		_libc.eventfd.restype = ctypes.c_int
+	return _libc
+
+
+class EventFD(object):
+	"""
+	Counter that can be increased from any thread. File descriptor is
+	readable while counter is not zero; reading resets it.
+	"""
+	
+	def __init__(self):
+		self._fd = _get_libc().eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)
+		if self._fd < 0:
+			e = ctypes.get_errno()
+			raise OSError(e, os.strerror(e))
+	
+	
+	def fileno(self):
+		return self._fd
+	
+	
+	def signal(self):
+		""" Makes descriptor readable """
+		try:
+			os.write(self._fd, ONE)
+		except OSError, e:
+			# EAGAIN means counter is about to overflow, what can
+			# happen only if nobody reads it. Still readable either way.
+			if e.errno != errno.EAGAIN:
+				raise
+	
+	
+	def read(self):
+		"""
+		Clears readable state. Returns how many times signal() was called
+		since last read or 0 if it was not called at all.
+		"""
+		try:
+			return struct.unpack("Q", os.read(self._fd, 8))[0]
+		except OSError, e:
+			if e.errno == errno.EAGAIN:
+				return 0
+			raise
+	
+	
+	def close(self):
+		if self._fd >= 0:
+			os.close(self._fd)
+			self._fd = -1
@@ -0,0 +1,114 @@
+#!/usr/bin/env python2
+"""
+timerfd.py - minimal ctypes wrapper for Linux timerfd API
+
+Copyright (C) 2018 by Kozec
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2 as published by
+the Free Software Foundation
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+"""
+
+from ctypes.util import find_library
+import os, ctypes, struct, errno
+
+CLOCK_REALTIME		= 0
+TFD_TIMER_ABSTIME	= 1 << 0
+TFD_NONBLOCK		= os.O_NONBLOCK
+TFD_CLOEXEC			= 0o2000000
+PR_SET_TIMERSLACK	= 29
+
+
+class timespec(ctypes.Structure):
+	_fields_ = [
+		("tv_sec",		ctypes.c_long),
+		("tv_nsec",		ctypes.c_long),
+	]
+
+
+class itimerspec(ctypes.Structure):
+	_fields_ = [
+		("it_interval",	timespec),
+		("it_value",	timespec),
+	]
+
+
+_libc = None
+
+def _get_libc():
+	global _libc
+	if _libc is None:
+		_libc = ctypes.CDLL(find_library("c"), use_errno=True)
+		_libc.timerfd_create.argtypes = [ ctypes.c_int, ctypes.c_int ]
+		_libc.timerfd_create.restype = ctypes.c_int
+		_libc.timerfd_settime.argtypes = [ ctypes.c_int, ctypes.c_int,
+			ctypes.POINTER(itimerspec), ctypes.POINTER(itimerspec) ]
+		_libc.timerfd_settime.restype = ctypes.c_int
+	return _libc
+
+
+def set_timer_slack(ns):
+	"""
+	Sets how much can kernel delay wakeups of this process (thread)
+	to group them with other wakeups. Default is 50us.
+	"""
+	return _get_libc().prctl(PR_SET_TIMERSLACK, ctypes.c_ulong(ns), 0, 0, 0) == 0
+
+
+class TimerFD(object):
+	"""
+	One-shot timer armed to absolute time, as returned by time.time().
+	File descriptor becomes readable when time is reached.
+	"""
+	
+	def __init__(self):
+		self._lib = _get_libc()
+		self._fd = self._lib.timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC)
+		if self._fd < 0:
+			e = ctypes.get_errno()
+			raise OSError(e, os.strerror(e))
+		self._spec = itimerspec()
+	
+	
+	def fileno(self):
+		return self._fd
+	
+	
+	def arm(self, when):
+		""" Arms timer to fire at 'when'. Zero or None disarms it """
+		if when:
+			sec = int(when)
+			self._spec.it_value.tv_sec = sec
+			# tv_nsec == 0 with tv_sec == 0 would disarm the timer
+			self._spec.it_value.tv_nsec = max(1, int((when - sec) * 1000000000))
+		else:
+			self._spec.it_value.tv_sec = self._spec.it_value.tv_nsec = 0
+		self._lib.timerfd_settime(self._fd, TFD_TIMER_ABSTIME, ctypes.byref(self._spec), None)
+	
+	
+	def read(self):
+		"""
+		Clears readable state. Returns number of expirations
+		or 0 if timer didn't fire yet.
+		"""
+		try:
+			return struct.unpack("Q", os.read(self._fd, 8))[0]
+		except OSError, e:
+			if e.errno == errno.EAGAIN:
+				return 0
+			raise
+	
+	
+	def close(self):
+		if self._fd >= 0:
+			os.close(self._fd)
+			self._fd = -1
@@ -0,0 +1,305 @@
+#!/usr/bin/env python2
+"""
+SC-Controller - Input traces
+
+Binary format used to record raw input packets received by drivers, so they
+can be later replayed by scc/drivers/replay.py through same decoders and
+Mapper. Recording is enabled by setting SCC_TRACE environment variable to
+name of file that should be written.
+
+File starts with 16B header:
+ - 8B		magic, "SCCTRACE"
+ - uint16	format version
+ - uint16	header size
+ - uint32	flags, unused
+
+Header is followed by records, each of them aligned to 8 bytes:
+ - uint64	timestamp, in microseconds since recording started
+ - uint16	source, number assigned to device when it was added
+ - uint16	kind, one of RecordKind values
+ - uint32	payload size
+ - payload, padded with zeros to multiple of 8 bytes
+
+Payload depends on kind:
+ - SOURCE	JSON describing device; always first record for given source
+ - INPUT	raw data as driver read it. For USB, first byte is endpoint
+ - RESPONSE	marshaled (method, tag, value) tuple with value returned by
+			device when driver asked it for something (serial number, etc.)
+ - FLUSH	empty; driver finished handling all inputs read at once
+ - REMOVED	empty; device was disconnected
+
+All numbers are little-endian. Whole file can be mmaped and walked without
+parsing anything but record headers.
+"""
+from scc.lib.timerfd import timespec
+from ctypes.util import find_library
+import os, json, mmap, struct, marshal, ctypes, atexit, logging
+log = logging.getLogger("Trace")
+
+ENV_VAR = "SCC_TRACE"
+MAGIC = b"SCCTRACE"
+VERSION = 1
+HEADER = struct.Struct("<8sHHI")
+RECORD = struct.Struct("<QHHI")
+EVDEV_EVENT = struct.Struct("<qiHHi")	# sec, usec, type, code, value
+CLOCK_MONOTONIC = 1
+
+
+class RecordKind:
+	SOURCE		= 1
+	INPUT		= 2
+	RESPONSE	= 3
+	FLUSH		= 4
+	REMOVED		= 5
+
+
+_libc = None
+
+def mono_time_us():
+	""" Returns CLOCK_MONOTONIC time in microseconds """
+	global _libc
+	if _libc is None:
+		_libc = ctypes.CDLL(find_library("c"))
+		_libc.clock_gettime.argtypes = [ ctypes.c_int, ctypes.POINTER(timespec) ]
+		_libc.clock_gettime.restype = ctypes.c_int
+	ts = timespec()
+	_libc.clock_gettime(CLOCK_MONOTONIC, ctypes.byref(ts))
+	return ts.tv_sec * 1000000 + ts.tv_nsec // 1000
+
+
+def _padding(size):
+	return b"\0" * (-size & 7)
+
+
+class TraceWriter(object):
+	"""
+	Writes trace file. Records go through buffered file object, so recording
+	doesn't add syscall to every received packet.
+	"""
+	
+	def __init__(self, filename):
+		self._file = open(filename, "wb")
+		self._file.write(HEADER.pack(MAGIC, VERSION, HEADER.size, 0))
+		self._start = mono_time_us()
+		self._sources = 0
+	
+	
+	def add_source(self, info):
+		"""
+		Writes SOURCE record with 'info' dict.
+		Returns TraceSource used to record everything else done with device.
+		"""
+		number = self._sources
+		self._sources += 1
+		self.write(number, RecordKind.SOURCE, json.dumps(info))
+		log.debug("Recording %s device as source %s", info.get("type"), number)
+		return TraceSource(self, number)
+	
+	
+	def write(self, source, kind, payload=b""):
+		if self._file is None:
+			return
+		size = len(payload)
+		self._file.write(RECORD.pack(mono_time_us() - self._start, source, kind, size))
+		if size:
+			self._file.write(payload)
+			self._file.write(_padding(size))
+	
+	
+	def close(self):
+		if self._file is not None:
+			self._file.close()
+			self._file = None
+
+
+class TraceSource(object):
+	""" Records data for single device """
+	
+	def __init__(self, writer, number):
+		self.writer = writer
+		self.number = number
+		self._pending = False
+	
+	
+	def input(self, data):
+		self._pending = True
+		self.writer.write(self.number, RecordKind.INPUT, data)
+	
+	
+	def response(self, method, value):
+		tag = None
+		if isinstance(value, bytearray):
+			tag, value = "bytearray", bytes(value)
+		self.writer.write(self.number, RecordKind.RESPONSE,
+			marshal.dumps((method, tag, value)))
+	
+	
+	def flush(self):
+		""" Writes FLUSH record, if anything was recorded since last one """
+		if self._pending:
+			self._pending = False
+			self.writer.write(self.number, RecordKind.FLUSH)
+	
+	
+	def removed(self):
+		self.writer.write(self.number, RecordKind.REMOVED)
+
+
+class TraceReader(object):
+	""" Reads trace file using mmap """
+	
+	def __init__(self, filename):
+		self._file = open(filename, "rb")
+		self._map = mmap.mmap(self._file.fileno(), 0, access=mmap.ACCESS_READ)
+		magic, version, self._offset, flags = HEADER.unpack_from(self._map, 0)
+		if magic != MAGIC:
+			raise ValueError("%s is not input trace" % (filename,))
+		if version != VERSION:
+			raise ValueError("Unsupported trace version: %s" % (version,))
+	
+	
+	def __iter__(self):
+		"""
+		Yields (timestamp, source, kind, payload) tuples.
+		Incomplete record at end of file, left there when recording
+		process was killed, is ignored.
+		"""
+		m, offset, end = self._map, self._offset, len(self._map)
+		while offset + RECORD.size <= end:
+			timestamp, source, kind, size = RECORD.unpack_from(m, offset)
+			offset += RECORD.size
+			if offset + size > end:
+				break
+			yield timestamp, source, kind, m[offset:offset + size]
+			offset += size + (-size & 7)
+	
+	
+	def get_responses(self):
+		"""
+		Returns dict of { source: [ (method, value), ... ] } with all
+		RESPONSE records, in order in which they were recorded.
+		"""
+		rv = {}
+		for timestamp, source, kind, payload in self:
+			if kind == RecordKind.RESPONSE:
+				method, tag, value = marshal.loads(payload)
+				if tag == "bytearray":
+					value = bytearray(value)
+				rv.setdefault(source, []).append((method, value))
+		return rv
+	
+	
+	def close(self):
+		self._map.close()
+		self._file.close()
+
+
+class RecordingProxy(object):
+	"""
+	Wraps object, usually device handle, and records values returned by
+	listed methods as RESPONSE records. Everything else is passed through.
+	"""
+	
+	def __init__(self, obj, trace, methods):
+		self._obj = obj
+		self.trace = trace
+		for name in methods:
+			setattr(self, name, self._wrap(name, getattr(obj, name)))
+	
+	
+	def _wrap(self, name, method):
+		def wrapper(*a, **b):
+			value = method(*a, **b)
+			self.trace.response(name, value)
+			return value
+		return wrapper
+	
+	
+	def __getattr__(self, name):
+		return getattr(self._obj, name)
+
+
+class RecordingHIDRaw(RecordingProxy):
+	"""
+	Wraps HIDRaw device. Reports read from real device are recorded and
+	written to pipe, so driver reading from '_device.fileno()' gets exactly
+	same data, without knowing about recording.
+	"""
+	
+	def __init__(self, hidraw, trace, poller, packet_size):
+		RecordingProxy.__init__(self, hidraw, trace,
+			("getName", "getPhysicalAddress", "getFeatureReport"))
+		self._poller = poller
+		self._packet_size = packet_size
+		self._real_fd = hidraw._device.fileno()
+		self._pipe_r, self._pipe_w = os.pipe()
+		self._device = self
+		if poller:
+			poller.register(self._real_fd, poller.POLLIN, self._on_input)
+	
+	
+	def _on_input(self, *a):
+		try:
+			data = os.read(self._real_fd, self._packet_size)
+		except OSError:
+			# Pass error to driver by closing pipe
+			self._poller.unregister(self._real_fd)
+			os.close(self._pipe_w)
+			# Not to be closed again by close(), fd may be reused by then
+			self._pipe_w = None
+			return
+		self.trace.input(data)
+		os.write(self._pipe_w, data)
+	
+	
+	def fileno(self):
+		return self._pipe_r
+	
+	
+	def close(self):
+		if self._poller:
+			self._poller.unregister(self._real_fd)
+		for fd in (self._pipe_r, self._pipe_w):
+			if fd is None:
+				continue
+			try:
+				os.close(fd)
+			except OSError:
+				pass
+		self._obj._device.close()
+		self.trace.removed()
+
+
+class RecordingInputDevice(RecordingProxy):
+	""" Wraps evdev InputDevice and records every batch of events it reads """
+	
+	def __init__(self, device, trace):
+		RecordingProxy.__init__(self, device, trace, ())
+	
+	
+	def read(self):
+		events = list(self._obj.read())
+		self.trace.input(b"".join([
+			EVDEV_EVENT.pack(e.sec, e.usec, e.type, e.code, e.value)
+			for e in events ]))
+		return events
+	
+	
+	def close(self):
+		self._obj.close()
+		self.trace.removed()
+
+
+_recorder = None
+
+def get_recorder():
+	"""
+	Returns TraceWriter writing to file set by SCC_TRACE environment variable
+	or None if recording is not enabled.
+	"""
+	global _recorder
+	if _recorder is None and os.environ.get(ENV_VAR):
+		_recorder = TraceWriter(os.environ[ENV_VAR])
+		atexit.register(_recorder.close)
+		log.info("Recording input trace to %s", os.environ[ENV_VAR])
+	return _recorder
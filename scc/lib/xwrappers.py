@@ -18,7 +18,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 """
 
-from ctypes import CDLL, POINTER, c_void_p, Structure, byref, cast
+from ctypes import CDLL, POINTER, CFUNCTYPE, c_void_p, Structure, Union, byref, cast
 from ctypes import c_long, c_ulong, c_int, c_uint, c_short, c_char_p
 from ctypes import c_ushort, c_ubyte, c_char_p, c_bool
 
@@ -82,6 +82,36 @@ class XkbStateRec(Structure):
 		('ptr_buttons', c_ushort),
 	]
 
+class XPropertyEvent(Structure):
+	_fields_ = [
+		('type', c_int),
+		('serial', c_ulong),
+		('send_event', c_int),
+		('display', c_void_p),
+		('window', XID),
+		('atom', Atom),
+		('time', c_ulong),
+		('state', c_int),
+	]
+
+class XErrorEvent(Structure):
+	_fields_ = [
+		('type', c_int),
+		('display', c_void_p),
+		('resourceid', XID),
+		('serial', c_ulong),
+		('error_code', c_ubyte),
+		('request_code', c_ubyte),
+		('minor_code', c_ubyte),
+	]
+
+class XEvent(Union):
+	_fields_ = [
+		('type', c_int),
+		('xproperty', XPropertyEvent),
+		('pad', c_long * 24),
+	]
+
 class XWindowAttributes(Structure):
 	_fields_ = [
 		('x', c_int),
@@ -121,6 +151,12 @@ SUCCESS			= 0
 
 ISVIEWABLE		= 2
 
+NOEVENTMASK			= 0
+PROPERTYCHANGEMASK	= 1 << 22
+PROPERTYNOTIFY		= 28
+
+BADWINDOW			= 3
+
 
 # Functions
 open_display = libX11.XOpenDisplay
@@ -253,6 +289,31 @@ shape_combine_mask = libXext.XShapeCombineMask
 shape_combine_mask.__doc__ = "Sets 1-bit transparency mask for window"
 shape_combine_mask.argtypes = [ c_void_p, XID, c_int, c_int, c_int, Pixmap, c_int ]
 
+select_input = libX11.XSelectInput
+select_input.__doc__ = "Sets events that should be reported for window"
+select_input.argtypes = [ c_void_p, XID, c_long ]
+
+pending = libX11.XPending
+pending.__doc__ = "Returns number of events that can be read without blocking"
+pending.argtypes = [ c_void_p ]
+pending.restype = c_int
+
+next_event = libX11.XNextEvent
+next_event.__doc__ = "Reads next event, blocking if there is none"
+next_event.argtypes = [ c_void_p, POINTER(XEvent) ]
+
+connection_number = libX11.XConnectionNumber
+connection_number.__doc__ = "Returns file descriptor of connection to X server"
+connection_number.argtypes = [ c_void_p ]
+connection_number.restype = c_int
+
+ErrorHandler = CFUNCTYPE(c_int, c_void_p, POINTER(XErrorEvent))
+set_error_handler = libX11.XSetErrorHandler
+set_error_handler.__doc__ = """Sets handler called when X server reports error.
+	Handler has to be kept referenced for as long as it's set."""
+set_error_handler.argtypes = [ ErrorHandler ]
+set_error_handler.restype = c_void_p
+
 
 
 # Wrapped functions
@@ -16,6 +16,7 @@ from scc.profile import Profile
 
 import traceback, logging, time, os
 log = logging.getLogger("Mapper")
+NO_FORCED_EVENTS = frozenset()
 
 class Mapper(object):
 	DEBUG = False
@@ -58,6 +59,11 @@ class Mapper(object):
 		self.lpad_touched = False
 		self.state, self.old_state = None, None
 		self.force_event = set()
+		self._dispatch = None					# CompiledProfile, see _compile
+		self.state_sink = None					# SharedState of controller, if any
+		self._profile_listeners = []
+		self._rumble_task = None
+		self._in_input = False
 	
 	
 	def create_gamepad(self, enabled, poller):
@@ -102,15 +108,29 @@ class Mapper(object):
 		return Mouse(name=name)
 	
 	
-	def _rumble_ready(self, fd, event):
-		ef = self.gamepad.ff_read()
-		if ef:	# tale of...
+	def _rumble_ready(self, *a):
+		"""
+		Called when emulated gamepad has force feedback requests waiting
+		and then by scheduler whenever rendered effects may change.
+		"""
+		if self._rumble_task:
+			self._rumble_task.cancel()
+			self._rumble_task = None
+		ff = self.gamepad.ff_update()
+		if ff is None:
+			return
+		if ff.changed:
+			# Amplitude is held for 'duration' ms, controller counts in ~30ms steps
 			self.send_feedback(HapticData(
 				HapticPos.BOTH,
 				period = 32760,
-				amplitude = max(0, ef.level),
-				count = min(0x7FFF, ef.duration * ef.repetitions / 30)
+				amplitude = ff.level,
+				count = min(0x7FFF, (ff.duration + 29) / 30)
 			))
+			self.generate_feedback()
+		if ff.next_update >= 0:
+			self._rumble_task = self.scheduler.schedule(
+				ff.next_update / 1000.0, self._rumble_ready)
 	
 	
 	def get_gamepad_name(self):
@@ -124,7 +144,11 @@ class Mapper(object):
 	
 	
 	def sync(self):
-		""" Syncs generated events """
+		"""
+		Syncs generated events.
+		Every device used in this frame writes all its queued events,
+		terminated by SYN_REPORT, with single write() call.
+		"""
 		if len(self.syn_list):
 			for dev in self.syn_list:
 				dev.synEvent()
@@ -134,6 +158,12 @@ class Mapper(object):
 	def set_controller(self, c):
 		""" Sets controller device, used by some (one so far) actions """
 		self.controller = c
+		# Controller that masks inputs handled natively publishes
+		# unmasked input by itself
+		self.state_sink = None
+		if c and c.shared_state and c.get_input() is None:
+			self.state_sink = c.shared_state
+		self._dispatch = None
 	
 	
 	def get_controller(self):
@@ -141,6 +171,37 @@ class Mapper(object):
 		return self.controller
 	
 	
+	def set_profile(self, profile):
+		""" Sets new profile and notifies profile listeners """
+		self.profile = profile
+		self.profile_modified()
+	
+	
+	def profile_modified(self):
+		"""
+		Should be called when actions in current profile are replaced,
+		e.g. when client locks or observes an input.
+		Calls every listener added by add_profile_listener.
+		"""
+		self._dispatch = None
+		for cb in list(self._profile_listeners):
+			cb(self)
+	
+	
+	def add_profile_listener(self, cb):
+		"""
+		Adds callback called with mapper as only argument when profile is
+		changed or modified. Used by drivers with native mapping.
+		"""
+		if cb not in self._profile_listeners:
+			self._profile_listeners.append(cb)
+	
+	
+	def remove_profile_listener(self, cb):
+		if cb in self._profile_listeners:
+			self._profile_listeners.remove(cb)
+	
+	
 	def set_special_actions_handler(self, sa):
 		self._sa_handler = sa
 	
@@ -172,7 +233,15 @@ class Mapper(object):
 		Delay is float number in seconds.
 		Callback is called with mapper as only argument.
 		"""
-		return self.scheduler.schedule(delay, cb, self)
+		return self.scheduler.schedule(delay, self._run_task, cb)
+	
+	
+	def _run_task(self, cb):
+		cb(self)
+		if not self._in_input:
+			# Events generated by task executed from input() are synced with
+			# rest of frame. Otherwise, nothing else would sync them.
+			self.sync()
 	
 	
 	def cancel_task(self, task):
@@ -351,19 +420,37 @@ class Mapper(object):
 				a.reset()
 	
 	
+	def _compile(self):
+		"""
+		Compiles profile for flags of current controller.
+		Result is kept until profile or controller changes.
+		"""
+		flags = self.controller.flags if self.controller else 0
+		self._dispatch = self.profile.compile(flags)
+		return self._dispatch
+	
+	
 	def input(self, controller, old_state, state):
+		d = self._dispatch or self._compile()
+		
 		# Store states
 		self.old_state = old_state
 		self.old_buttons = self.buttons
 		
 		self.state = state
 		self.buttons = state.buttons
+		if self.state_sink:
+			self.state_sink.write(state)
 		
 		if self.buttons & SCButtons.LPAD and not self.buttons & (SCButtons.LPADTOUCH | STICKTILT):
 			self.buttons = (self.buttons & ~SCButtons.LPAD) | SCButtons.STICKPRESS
 		
 		fe = self.force_event
-		self.force_event = set()
+		if fe:
+			self.force_event = set()
+		else:
+			# Events forced while handling this input are kept for next one
+			fe = NO_FORCED_EVENTS
 		
 		# Check buttons
 		xor = self.old_buttons ^ self.buttons
@@ -371,81 +458,86 @@ class Mapper(object):
 		btn_add = xor & self.buttons
 		
 		try:
-			if btn_add or btn_rem:
-				# At least one button was pressed
-				for x in self.profile.buttons:
-					if x & btn_add:
-						self.profile.buttons[x].button_press(self)
-					elif x & btn_rem:
-						self.profile.buttons[x].button_release(self)
+			changed = xor & d.button_mask
+			while changed:
+				# At least one bound button was pressed or released
+				bit = changed & -changed
+				changed ^= bit
+				if bit & btn_add:
+					d.buttons[bit].button_press(self)
+				else:
+					d.buttons[bit].button_release(self)
 			
 			
 			# Check sticks
-			if self.controller.flags & ControllerFlags.SEPARATE_STICK:
-				if FE_STICK in fe or self.old_state.stick_x != state.stick_x or self.old_state.stick_y != state.stick_y:
-					self.profile.stick.whole(self, state.stick_x, state.stick_y, STICK)
-			elif not self.buttons & SCButtons.LPADTOUCH:
-				if FE_STICK in fe or self.old_state.lpad_x != state.lpad_x or self.old_state.lpad_y != state.lpad_y:
-					self.profile.stick.whole(self, state.lpad_x, state.lpad_y, STICK)
-			if self.controller.flags & ControllerFlags.IS_DECK:
-				if FE_STICK in fe or self.old_state.rstick_x != state.rstick_x or self.old_state.rstick_y != state.rstick_y:
-					self.profile.rstick.whole(self, state.rstick_x, state.rstick_y, RSTICK)
+			stick = d.stick
+			if stick:
+				if d.separate_stick:
+					if FE_STICK in fe or old_state.stick_x != state.stick_x or old_state.stick_y != state.stick_y:
+						stick.whole(self, state.stick_x, state.stick_y, STICK)
+				elif not self.buttons & SCButtons.LPADTOUCH:
+					if FE_STICK in fe or old_state.lpad_x != state.lpad_x or old_state.lpad_y != state.lpad_y:
+						stick.whole(self, state.lpad_x, state.lpad_y, STICK)
+			if d.rstick:
+				if FE_STICK in fe or old_state.rstick_x != state.rstick_x or old_state.rstick_y != state.rstick_y:
+					d.rstick.whole(self, state.rstick_x, state.rstick_y, RSTICK)
 			
 			# Check gyro
-			if controller.get_gyro_enabled():
-				self.profile.gyro.gyro(self, state.gpitch, state.gyaw, state.groll, state.q1, state.q2, state.q3, state.q4)
+			if d.gyro and controller.get_gyro_enabled():
+				d.gyro.gyro(self, state.gpitch, state.gyaw, state.groll, state.q1, state.q2, state.q3, state.q4)
 			
 			# Check triggers
-			if FE_TRIGGER in fe or state.ltrig != self.old_state.ltrig:
-				if LEFT in self.profile.triggers:
-					self.profile.triggers[LEFT].trigger(self, state.ltrig, self.old_state.ltrig)
-			if FE_TRIGGER in fe or state.rtrig != self.old_state.rtrig:
-				if RIGHT in self.profile.triggers:
-					self.profile.triggers[RIGHT].trigger(self, state.rtrig, self.old_state.rtrig)
+			if d.ltrig and (FE_TRIGGER in fe or state.ltrig != old_state.ltrig):
+				d.ltrig.trigger(self, state.ltrig, old_state.ltrig)
+			if d.rtrig and (FE_TRIGGER in fe or state.rtrig != old_state.rtrig):
+				d.rtrig.trigger(self, state.rtrig, old_state.rtrig)
 			
 			# Check pads
 			# RPAD
-			if controller.flags & ControllerFlags.HAS_RSTICK:
-				if FE_PAD in fe or self.old_state.rpad_x != state.rpad_x or self.old_state.rpad_y != state.rpad_y:
-					self.profile.pads[RIGHT].whole(self, state.rpad_x, state.rpad_y, RIGHT)
-			elif FE_PAD in fe or self.buttons & SCButtons.RPADTOUCH or SCButtons.RPADTOUCH & btn_rem:
-				self.profile.pads[RIGHT].whole(self, state.rpad_x, state.rpad_y, RIGHT)
+			if d.rpad:
+				if d.rpad_is_stick:
+					if FE_PAD in fe or old_state.rpad_x != state.rpad_x or old_state.rpad_y != state.rpad_y:
+						d.rpad.whole(self, state.rpad_x, state.rpad_y, RIGHT)
+				elif FE_PAD in fe or self.buttons & SCButtons.RPADTOUCH or SCButtons.RPADTOUCH & btn_rem:
+					d.rpad.whole(self, state.rpad_x, state.rpad_y, RIGHT)
 			# DPAD
-			if controller.flags & ControllerFlags.IS_DECK:
-				if FE_PAD in fe or self.old_state.dpad_x != state.dpad_x or self.old_state.dpad_y != state.dpad_y:
-					self.profile.pads[DPAD].whole(self, state.dpad_x, state.dpad_y, DPAD)
+			if d.dpad:
+				if FE_PAD in fe or old_state.dpad_x != state.dpad_x or old_state.dpad_y != state.dpad_y:
+					d.dpad.whole(self, state.dpad_x, state.dpad_y, DPAD)
 			
 			# LPAD
-			if self.controller.flags & ControllerFlags.SEPARATE_STICK:
-				if FE_PAD in fe or self.old_state.lpad_x != state.lpad_x or self.old_state.lpad_y != state.lpad_y:
-					self.profile.pads[LEFT].whole(self, state.lpad_x, state.lpad_y, LEFT)
+			if d.separate_stick:
+				if d.lpad and (FE_PAD in fe or old_state.lpad_x != state.lpad_x or old_state.lpad_y != state.lpad_y):
+					d.lpad.whole(self, state.lpad_x, state.lpad_y, LEFT)
 			else:
 				if self.buttons & SCButtons.LPADTOUCH:
 					# Pad is being touched now
 					if not self.lpad_touched:
 						self.lpad_touched = True
-					self.profile.pads[LEFT].whole(self, state.lpad_x, state.lpad_y, LEFT)
-					if self.old_state.buttons & STICKTILT and not self.buttons & STICKTILT:
+					if d.lpad:
+						d.lpad.whole(self, state.lpad_x, state.lpad_y, LEFT)
+					if stick and old_state.buttons & STICKTILT and not self.buttons & STICKTILT:
 						# LPAD and stick share axes and so when they are used simultaneously (by someone with 3 hands or so :)
 						# this is how mapper can tell that stick was recentered
-						self.profile.stick.whole(self, 0, 0, STICK)
+						stick.whole(self, 0, 0, STICK)
 				elif not self.buttons & STICKTILT:
 					# Pad is not being touched
 					if self.lpad_touched:
 						self.lpad_touched = False
-						self.profile.pads[LEFT].whole(self, 0, 0, LEFT)
-					
+						if d.lpad:
+							d.lpad.whole(self, 0, 0, LEFT)
+			
 			# CPAD (touchpad on DS4 controller)
-			if controller.flags & ControllerFlags.HAS_CPAD:
+			if d.cpad:
 				if ((FE_PAD in fe)
-						or (self.old_state.cpad_x != state.cpad_x)
-						or (self.old_state.cpad_y != state.cpad_y)
+						or (old_state.cpad_x != state.cpad_x)
+						or (old_state.cpad_y != state.cpad_y)
 						or ((self.old_buttons & SCButtons.CPADTOUCH) and not (self.buttons & SCButtons.CPADTOUCH))
 					):
 					if self.buttons & SCButtons.CPADTOUCH:
-						self.profile.pads[CPAD].whole(self, state.cpad_x, state.cpad_y, CPAD)
+						d.cpad.whole(self, state.cpad_x, state.cpad_y, CPAD)
 					elif self.old_buttons & SCButtons.CPADTOUCH:
-						self.profile.pads[CPAD].whole(self, 0, 0, CPAD)
+						d.cpad.whole(self, 0, 0, CPAD)
 		except Exception:
 			# Log error but don't crash here, it breaks too many things at once
 			if hasattr(self, "_testing"):
@@ -454,7 +546,11 @@ class Mapper(object):
 			log.error(traceback.format_exc())
 		
 		# TODO: Is it important to run scheduled stuff before generate_events?
-		self.scheduler.run()
+		self._in_input = True
+		try:
+			self.scheduler.run()
+		finally:
+			self._in_input = False
 		self.generate_events()
 		self.generate_feedback()
 	
@@ -464,9 +560,11 @@ class Mapper(object):
 		if len(self.keypress_list):
 			self.keyboard.pressEvent(self.keypress_list)
 			self.keypress_list = []
+			self.syn_list.add(self.keyboard)
 		if len(self.keyrelease_list):
 			self.keyboard.releaseEvent(self.keyrelease_list)
 			self.keyrelease_list = []
+			self.syn_list.add(self.keyboard)
 		# Generate events - mouse
 		mx, my, wx, wy = self.mouse_movements
 		if mx != 0 or my != 0:
@@ -0,0 +1,508 @@
+/**
+ * SC Controller - native mapper
+ *
+ * Implements Mapper interface from drivers/scc_future.h. Simple actions
+ * (buttons, axes, dpads, stick-as-mouse and triggers) are translated into
+ * tables by scc/native_mapper.py and executed here, writing directly to
+ * uinput file descriptors.
+ *
+ * Everything that can't be handled natively is left for 'fallback' mapper,
+ * which is called with input state where natively handled buttons are
+ * masked out and natively handled axes are zeroed. Fallback is called on
+ * every input, even if masked state didn't change, as python actions may
+ * depend on it (e.g. for smoothing or to generate events on every frame).
+ */
+#include <linux/uinput.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include "drivers/scc_future.h"
+
+#pragma GCC diagnostic ignored "-Wunused-result"
+#define NATIVE_MAPPER_MODULE_VERSION 1
+
+#define NM_DEVICE_COUNT		3
+#define NM_BUFFER_SIZE		64
+// Same as DPadAction.MIN_DISTANCE_P2
+#define NM_MIN_DISTANCE_P2	2000000
+// Same as value used by MouseAction.whole
+#define NM_STICK_MOUSE_FACTOR 0.01
+#define B_STICKTILT			0b10000000000000000000000000000000
+
+typedef enum NMDevice {
+	NMD_KEYBOARD		= 0,
+	NMD_MOUSE			= 1,
+	NMD_GAMEPAD			= 2,
+} NMDevice;
+
+typedef enum NMOutputType {
+	NMO_NONE			= 0,	// NoAction
+	NMO_KEY				= 1,	// key or button, press / release
+	NMO_AXIS			= 2,	// axis set to 'press' or 'release' value
+} NMOutputType;
+
+typedef enum NMMode {
+	NMM_FALLBACK		= 0,	// handled by fallback mapper
+	NMM_NOTHING			= 1,	// handled by doing nothing
+	NMM_OUTPUT			= 2,	// button / trigger as NMOutput
+	NMM_AXES			= 3,	// stick / pad / trigger as AxisAction(s)
+	NMM_DPAD			= 4,	// stick / pad as DPadAction
+	NMM_MOUSE			= 5,	// stick as MouseAction
+	NMM_LEVELS			= 6,	// trigger as TriggerAction
+} NMMode;
+
+typedef enum NMXYSource {
+	NMS_STICK			= 0,
+	NMS_LPAD			= 1,
+	NMS_RPAD			= 2,
+} NMXYSource;
+#define NMS_COUNT 3
+
+/** Mirrored by NMOutput in native_mapper.py */
+typedef struct NMOutput {
+	int32_t			type;		// NMOutputType
+	int32_t			device;		// NMDevice
+	uint16_t		code;
+	uint16_t		_padding;
+	int32_t			scan;		// scan code to send with keyboard keys or -1
+	int32_t			press;		// axis value for NMO_AXIS
+	int32_t			release;	// axis value for NMO_AXIS
+} NMOutput;
+
+/** Mirrored by NMAxis in native_mapper.py */
+typedef struct NMAxis {
+	int32_t			enabled;
+	uint16_t		code;
+	uint16_t		_padding;
+	float			speed;
+	int32_t			min;
+	int32_t			max;
+	int32_t			clamp_min;
+	int32_t			clamp_max;
+} NMAxis;
+
+typedef struct NMXY {
+	NMMode			mode;
+	NMAxis			axes[2];
+	NMOutput		sides[4];		// dpad up, down, left, right
+	uint8_t			lut[361];		// dpad angle (in degrees) -> index to SIDES
+	int8_t			dpad_state[2];
+	float			mouse_speed[2];
+} NMXY;
+
+typedef struct NMTrigger {
+	NMMode			mode;
+	NMAxis			axis;
+	NMOutput		output;
+	int32_t			press_level;
+	int32_t			release_level;
+	bool			pressed;
+} NMTrigger;
+
+typedef struct NativeMapper {
+	Mapper				mapper;		// has to be 1st
+	Mapper*				fallback;
+	int					fds[NM_DEVICE_COUNT];
+	float				mouse_scale[2];
+	
+	uint32_t			handled;	// buttons handled natively
+	NMOutput			buttons[32];
+	NMXY				xy[NMS_COUNT];
+	NMTrigger			triggers[2];
+	
+	uint32_t			old_buttons;
+	ControllerInput		old_state;
+	ControllerInput		py_state;
+	double				mouse_dx, mouse_dy;	// movement generated in this frame
+	double				mouse_acc[2];		// sub-pixel remainder, as in Mouse.moveEvent
+	uint8_t				pressed[NM_DEVICE_COUNT][KEY_CNT];
+	struct input_event	events[NM_DEVICE_COUNT][NM_BUFFER_SIZE];
+	int					event_count[NM_DEVICE_COUNT];
+} NativeMapper;
+
+/** Same as DPadAction.SIDES; 0 - up, 1 - down, 2 - left, 3 - right */
+static const int8_t SIDES[8][2] = {
+	{ -1, 1 }, { 2, 1 }, { 2, -1 }, { 2, 0 },
+	{ -1, 0 }, { 3, 0 }, { 3, -1 }, { 3, 1 },
+};
+
+
+static void nm_flush(NativeMapper* nm, NMDevice d) {
+	if (nm->event_count[d] > 0) {
+		write(nm->fds[d], nm->events[d], sizeof(struct input_event) * nm->event_count[d]);
+		nm->event_count[d] = 0;
+	}
+}
+
+static void nm_emit(NativeMapper* nm, NMDevice d, uint16_t type, uint16_t code, int32_t value) {
+	struct input_event* ev;
+	if (nm->fds[d] < 0) return;
+	// One slot is always kept free for SYN_REPORT
+	if (nm->event_count[d] >= NM_BUFFER_SIZE - 1)
+		nm_flush(nm, d);
+	ev = &nm->events[d][nm->event_count[d]++];
+	memset(&ev->time, 0, sizeof(ev->time));
+	ev->type = type;
+	ev->code = code;
+	ev->value = value;
+}
+
+static void nm_sync(NativeMapper* nm) {
+	for (int d=0; d<NM_DEVICE_COUNT; d++) {
+		if (nm->event_count[d] > 0) {
+			nm_emit(nm, d, EV_SYN, SYN_REPORT, 0);
+			nm_flush(nm, d);
+		}
+	}
+}
+
+static void nm_key(NativeMapper* nm, const NMOutput* o, int32_t value) {
+	if ((o->device == NMD_KEYBOARD) && (o->scan >= 0))
+		nm_emit(nm, o->device, EV_MSC, MSC_SCAN, o->scan);
+	nm_emit(nm, o->device, EV_KEY, o->code, value);
+}
+
+/** Works as ButtonAction._button_press and AxisAction.button_press */
+static void nm_press(NativeMapper* nm, const NMOutput* o) {
+	uint8_t* pressed;
+	switch (o->type) {
+	case NMO_KEY:
+		pressed = &nm->pressed[o->device][o->code];
+		if (*pressed > 0) {
+			// Virtual button is already pressed - generate release event first
+			nm_key(nm, o, 0);
+		}
+		if (*pressed < 0xFF) (*pressed) ++;
+		nm_key(nm, o, 1);
+		break;
+	case NMO_AXIS:
+		nm_emit(nm, o->device, EV_ABS, o->code, o->press);
+		break;
+	}
+}
+
+/** Works as ButtonAction._button_release and AxisAction.button_release */
+static void nm_release(NativeMapper* nm, const NMOutput* o) {
+	uint8_t* pressed;
+	switch (o->type) {
+	case NMO_KEY:
+		pressed = &nm->pressed[o->device][o->code];
+		if (*pressed > 1) {
+			// More than one action is holding this virtual button
+			(*pressed) --;
+			return;
+		}
+		*pressed = 0;
+		nm_key(nm, o, 0);
+		break;
+	case NMO_AXIS:
+		nm_emit(nm, o->device, EV_ABS, o->code, o->release);
+		break;
+	}
+}
+
+static inline int32_t nm_clamp(const NMAxis* a, double value) {
+	int32_t p = (int32_t)value;
+	if (p < a->clamp_min) return a->clamp_min;
+	if (p > a->clamp_max) return a->clamp_max;
+	return p;
+}
+
+/** Works as AxisAction.axis */
+static void nm_axis(NativeMapper* nm, const NMAxis* a, AxisValue position) {
+	double p;
+	if (!a->enabled) return;
+	p = ((double)position * a->speed - STICK_PAD_MIN) / ((double)STICK_PAD_MAX - STICK_PAD_MIN);
+	nm_emit(nm, NMD_GAMEPAD, EV_ABS, a->code, nm_clamp(a, p * (a->max - a->min) + a->min));
+}
+
+/** Works as AxisAction.trigger */
+static void nm_axis_trigger(NativeMapper* nm, const NMAxis* a, TriggerValue position) {
+	double p;
+	if (!a->enabled) return;
+	p = ((double)position * a->speed - TRIGGER_MIN) / ((double)TRIGGER_MAX - TRIGGER_MIN);
+	nm_emit(nm, NMD_GAMEPAD, EV_ABS, a->code, nm_clamp(a, p * (a->max - a->min) + a->min));
+}
+
+/** Works as DPadAction.whole */
+static void nm_dpad(NativeMapper* nm, NMXY* xy, AxisValue x, AxisValue y) {
+	static const int8_t none[2] = { -1, -1 };
+	const int8_t* side = none;
+	if ((int64_t)x * x + (int64_t)y * y > NM_MIN_DISTANCE_P2) {
+		double angle = (atan2(x, y) * 180.0 / M_PI) + 180;
+		side = SIDES[xy->lut[(int)angle]];
+	}
+	for (int i=0; i<2; i++) {
+		if ((side[i] != xy->dpad_state[i]) && (xy->dpad_state[i] >= 0)) {
+			nm_release(nm, &xy->sides[xy->dpad_state[i]]);
+			xy->dpad_state[i] = -1;
+		}
+		if ((side[i] >= 0) && (side[i] != xy->dpad_state[i])) {
+			nm_press(nm, &xy->sides[side[i]]);
+			xy->dpad_state[i] = side[i];
+		}
+	}
+}
+
+static void nm_xy(NativeMapper* nm, NMXY* xy, AxisValue x, AxisValue y, AxisValue old_x, AxisValue old_y) {
+	switch (xy->mode) {
+	case NMM_AXES:
+		if ((x != old_x) || (y != old_y)) {
+			nm_axis(nm, &xy->axes[0], x);
+			nm_axis(nm, &xy->axes[1], y);
+		}
+		break;
+	case NMM_DPAD:
+		if ((x != old_x) || (y != old_y))
+			nm_dpad(nm, xy, x, y);
+		break;
+	case NMM_MOUSE:
+		// Processed on every input, as MouseAction forces event for stick
+		nm->mouse_dx += x * xy->mouse_speed[0] * NM_STICK_MOUSE_FACTOR;
+		nm->mouse_dy += y * xy->mouse_speed[1] * NM_STICK_MOUSE_FACTOR;
+		break;
+	default:
+		break;
+	}
+}
+
+/** Works as TriggerAction.trigger, ButtonAction.trigger and AxisAction.trigger */
+static void nm_trigger(NativeMapper* nm, NMTrigger* t, TriggerValue p, TriggerValue old_p) {
+	switch (t->mode) {
+	case NMM_AXES:
+		nm_axis_trigger(nm, &t->axis, p);
+		break;
+	case NMM_OUTPUT:
+		if ((p >= TRIGGER_HALF) && (old_p < TRIGGER_HALF))
+			nm_press(nm, &t->output);
+		else if ((p < TRIGGER_HALF) && (old_p >= TRIGGER_HALF))
+			nm_release(nm, &t->output);
+		break;
+	case NMM_LEVELS: {
+		int32_t press = t->press_level, release = t->release_level;
+		bool entered = (p >= press) && (old_p < press);
+		bool left_press = (p < press) && (old_p >= press);
+		if (!t->pressed && entered) {
+			t->pressed = true;
+			nm_press(nm, &t->output);
+		} else if (t->pressed) {
+			if ((release > press) && (
+					((p > release) && (old_p <= release)) || left_press)) {
+				t->pressed = false;
+				nm_release(nm, &t->output);
+			} else if ((release == press) && left_press) {
+				t->pressed = false;
+				nm_release(nm, &t->output);
+			} else if ((release < press) && (p < release) && (old_p >= release)) {
+				t->pressed = false;
+				nm_release(nm, &t->output);
+			}
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+/** Works as Mouse.moveEvent called from Mapper.generate_events */
+static void nm_mouse(NativeMapper* nm) {
+	int32_t rx, ry;
+	if ((nm->mouse_dx == 0) && (nm->mouse_dy == 0)) return;
+	nm->mouse_acc[0] += nm->mouse_dx * nm->mouse_scale[0];
+	nm->mouse_acc[1] += nm->mouse_dy * -1.0 * nm->mouse_scale[1];
+	nm->mouse_dx = nm->mouse_dy = 0;
+	rx = (int32_t)nm->mouse_acc[0];
+	ry = (int32_t)nm->mouse_acc[1];
+	if (rx != 0) {
+		nm_emit(nm, NMD_MOUSE, EV_REL, REL_X, rx);
+		nm->mouse_acc[0] -= rx;
+	}
+	if (ry != 0) {
+		nm_emit(nm, NMD_MOUSE, EV_REL, REL_Y, ry);
+		nm->mouse_acc[1] -= ry;
+	}
+}
+
+/** Returns button state with LPADPRESS converted in same way as Mapper.input does */
+static inline uint32_t nm_buttons(const ControllerInput* i) {
+	uint32_t buttons = i->buttons;
+	if ((buttons & B_LPADPRESS) && !(buttons & (B_LPADTOUCH | B_STICKTILT)))
+		buttons = (buttons & ~B_LPADPRESS) | B_STICKPRESS;
+	return buttons;
+}
+
+static void nm_input(Mapper* m, ControllerInput* i) {
+	NativeMapper* nm = (NativeMapper*)m;
+	ControllerInput* old = &nm->old_state;
+	ControllerInput* py = &nm->py_state;
+	uint32_t buttons = nm_buttons(i);
+	uint32_t changed = (buttons ^ nm->old_buttons) & nm->handled;
+	
+	while (changed) {
+		int bit = __builtin_ctz(changed);
+		changed &= changed - 1;
+		if (buttons & (1u << bit))
+			nm_press(nm, &nm->buttons[bit]);
+		else
+			nm_release(nm, &nm->buttons[bit]);
+	}
+	
+	nm_xy(nm, &nm->xy[NMS_STICK], i->stick_x, i->stick_y, old->stick_x, old->stick_y);
+	nm_xy(nm, &nm->xy[NMS_LPAD], i->lpad_x, i->lpad_y, old->lpad_x, old->lpad_y);
+	nm_xy(nm, &nm->xy[NMS_RPAD], i->rpad_x, i->rpad_y, old->rpad_x, old->rpad_y);
+	if (i->ltrig != old->ltrig)
+		nm_trigger(nm, &nm->triggers[0], i->ltrig, old->ltrig);
+	if (i->rtrig != old->rtrig)
+		nm_trigger(nm, &nm->triggers[1], i->rtrig, old->rtrig);
+	
+	nm_mouse(nm);
+	nm_sync(nm);
+	nm->old_buttons = buttons;
+	memcpy(old, i, sizeof(ControllerInput));
+	
+	if (nm->fallback != NULL) {
+		// Build state for fallback mapper, with everything
+		// that was handled already masked out
+		memcpy(py, i, sizeof(ControllerInput));
+		py->buttons &= ~nm->handled;
+		if ((nm->handled & B_STICKPRESS) && (buttons & B_STICKPRESS))
+			py->buttons &= ~B_LPADPRESS;
+		if (nm->xy[NMS_STICK].mode != NMM_FALLBACK)
+			py->stick_x = py->stick_y = 0;
+		if (nm->xy[NMS_LPAD].mode != NMM_FALLBACK)
+			py->lpad_x = py->lpad_y = 0;
+		if (nm->xy[NMS_RPAD].mode != NMM_FALLBACK)
+			py->rpad_x = py->rpad_y = 0;
+		if (nm->triggers[0].mode != NMM_FALLBACK)
+			py->ltrig = 0;
+		if (nm->triggers[1].mode != NMM_FALLBACK)
+			py->rtrig = 0;
+		nm->fallback->input(nm->fallback, py);
+	}
+}
+
+
+NativeMapper* native_mapper_new(Mapper* fallback) {
+	NativeMapper* nm = malloc(sizeof(NativeMapper));
+	if (nm == NULL) return NULL;
+	memset(nm, 0, sizeof(NativeMapper));
+	nm->mapper.input = &nm_input;
+	nm->fallback = fallback;
+	for (int d=0; d<NM_DEVICE_COUNT; d++)
+		nm->fds[d] = -1;
+	for (int s=0; s<NMS_COUNT; s++)
+		nm->xy[s].dpad_state[0] = nm->xy[s].dpad_state[1] = -1;
+	return nm;
+}
+
+void native_mapper_free(NativeMapper* nm) {
+	free(nm);
+}
+
+/**
+ * Sets uinput descriptors used for output. -1 can be used for device that
+ * is not emulated. 'xscale' and 'yscale' are same as used by Mouse class.
+ */
+void native_mapper_set_devices(NativeMapper* nm, int keyboard, int mouse, int gamepad,
+						float xscale, float yscale) {
+	nm->fds[NMD_KEYBOARD] = keyboard;
+	nm->fds[NMD_MOUSE] = mouse;
+	nm->fds[NMD_GAMEPAD] = gamepad;
+	nm->mouse_scale[0] = xscale;
+	nm->mouse_scale[1] = yscale;
+}
+
+/**
+ * Releases everything what is held by natively handled actions and resets
+ * all inputs to be handled by fallback mapper.
+ * 'current' is current controller state, used as 'old state' from now on.
+ */
+void native_mapper_clear(NativeMapper* nm, const ControllerInput* current) {
+	for (int d=0; d<NM_DEVICE_COUNT; d++) {
+		for (int code=0; code<KEY_CNT; code++) {
+			if (nm->pressed[d][code] > 0) {
+				NMOutput o = { NMO_KEY, d, code, 0, -1, 0, 0 };
+				nm->pressed[d][code] = 1;
+				nm_release(nm, &o);
+			}
+		}
+	}
+	nm_sync(nm);
+	
+	nm->handled = 0;
+	memset(nm->buttons, 0, sizeof(nm->buttons));
+	memset(nm->xy, 0, sizeof(nm->xy));
+	memset(nm->triggers, 0, sizeof(nm->triggers));
+	for (int s=0; s<NMS_COUNT; s++)
+		nm->xy[s].dpad_state[0] = nm->xy[s].dpad_state[1] = -1;
+	nm->mouse_dx = nm->mouse_dy = 0;
+	memcpy(&nm->old_state, current, sizeof(ControllerInput));
+	nm->old_buttons = nm_buttons(current);
+}
+
+/** Sets button (identified by bit number) to be handled as NMOutput */
+void native_mapper_set_button(NativeMapper* nm, int bit, const NMOutput* o) {
+	if ((bit < 0) || (bit >= 32)) return;
+	memcpy(&nm->buttons[bit], o, sizeof(NMOutput));
+	nm->handled |= (1u << bit);
+}
+
+/** Sets stick or pad to be handled as pair of AxisActions. Either one can be disabled */
+void native_mapper_set_axes(NativeMapper* nm, NMXYSource what, const NMAxis* x, const NMAxis* y) {
+	if (what >= NMS_COUNT) return;
+	nm->xy[what].mode = NMM_AXES;
+	memcpy(&nm->xy[what].axes[0], x, sizeof(NMAxis));
+	memcpy(&nm->xy[what].axes[1], y, sizeof(NMAxis));
+}
+
+/**
+ * Sets stick or pad to be handled as DPadAction.
+ * 'sides' is array of 4 outputs, 'lut' maps angle in degrees to index to DPadAction.SIDES.
+ */
+void native_mapper_set_dpad(NativeMapper* nm, NMXYSource what, const NMOutput* sides, const uint8_t* lut) {
+	if (what >= NMS_COUNT) return;
+	nm->xy[what].mode = NMM_DPAD;
+	memcpy(nm->xy[what].sides, sides, sizeof(NMOutput) * 4);
+	for (int i=0; i<361; i++)
+		nm->xy[what].lut[i] = lut[i] & 0x07;
+}
+
+/** Sets stick to be handled as MouseAction */
+void native_mapper_set_mouse(NativeMapper* nm, NMXYSource what, float speed_x, float speed_y) {
+	if (what >= NMS_COUNT) return;
+	nm->xy[what].mode = NMM_MOUSE;
+	nm->xy[what].mouse_speed[0] = speed_x;
+	nm->xy[what].mouse_speed[1] = speed_y;
+}
+
+/** Sets stick, pad (0 - 2) or trigger (3 - 4) to do nothing */
+void native_mapper_set_nothing(NativeMapper* nm, int what) {
+	if (what < NMS_COUNT)
+		nm->xy[what].mode = NMM_NOTHING;
+	else if (what < NMS_COUNT + 2)
+		nm->triggers[what - NMS_COUNT].mode = NMM_NOTHING;
+}
+
+/**
+ * Sets trigger (0 - left, 1 - right) to be handled natively.
+ * Depending on mode, either 'axis' or 'output' is used.
+ */
+void native_mapper_set_trigger(NativeMapper* nm, int side, NMMode mode,
+			const NMAxis* axis, const NMOutput* output, int press_level, int release_level) {
+	NMTrigger* t;
+	if ((side < 0) || (side > 1)) return;
+	t = &nm->triggers[side];
+	t->mode = mode;
+	memcpy(&t->axis, axis, sizeof(NMAxis));
+	memcpy(&t->output, output, sizeof(NMOutput));
+	t->press_level = press_level;
+	t->release_level = release_level;
+	t->pressed = false;
+}
+
+int native_mapper_module_version(void) {
+	return NATIVE_MAPPER_MODULE_VERSION;
+}
@@ -0,0 +1,385 @@
+#!/usr/bin/env python2
+"""
+SC Controller - native mapper
+
+Wrapper around libnative_mapper, implementation of Mapper interface from
+scc/drivers/scc_future.h. NativeMapper translates simple actions from profile
+into tables that are then executed by C code, directly against uinput
+devices. Input that can't be handled natively is passed to fallback mapper.
+
+Used by drivers that can call Mapper interface from C.
+
+Native code keeps count of pressed keys on its own, separately from python
+Mapper. To keep press/release events balanced, input that would press key
+also used by action left to fallback mapper is not handled natively.
+Only keys bound by ButtonActions (including ones nested in macros, modifiers
+and menus) are known; keys sent by python code directly, such as by OSD
+keyboard, may still get unbalanced events when bound natively as well.
+"""
+from __future__ import unicode_literals
+
+from scc.tools import find_library
+from scc.constants import SCButtons, ControllerFlags, LEFT, RIGHT, STICK
+from scc.constants import STICK_PAD_MIN, STICK_PAD_MAX, TRIGGER_MIN, TRIGGER_MAX
+from scc.actions import ButtonAction, AxisAction, MouseAction, DPadAction
+from scc.actions import XYAction, TriggerAction, NoAction, MOUSE_BUTTONS
+from scc.actions import GAMEPAD_BUTTONS
+from scc.macros import Macro, PressAction
+from scc.uinput import Axes, Mouse, Dummy, Scans
+from ctypes import CFUNCTYPE, POINTER, byref, c_void_p
+import ctypes, logging
+
+log = logging.getLogger("NativeMapper")
+
+NATIVE_MAPPER_MODULE_VERSION = 1
+
+
+class ControllerInput(ctypes.Structure):
+	""" Mirrors ControllerInput from scc/drivers/scc_future.h """
+	_fields_ = [
+		("buttons",		ctypes.c_uint32),
+		("ltrig",		ctypes.c_uint8),
+		("rtrig",		ctypes.c_uint8),
+		("stick_x",		ctypes.c_int16),
+		("stick_y",		ctypes.c_int16),
+		("lpad_x",		ctypes.c_int16),
+		("lpad_y",		ctypes.c_int16),
+		("rpad_x",		ctypes.c_int16),
+		("rpad_y",		ctypes.c_int16),
+		("cpad_x",		ctypes.c_int16),
+		("cpad_y",		ctypes.c_int16),
+		("dpad_x",		ctypes.c_int16),
+		("dpad_y",		ctypes.c_int16),
+		("rstick_x",	ctypes.c_int16),
+		("rstick_y",	ctypes.c_int16),
+		("gpitch",		ctypes.c_int16),
+		("groll",		ctypes.c_int16),
+		("gyaw",		ctypes.c_int16),
+		("q1",			ctypes.c_int16),
+		("q2",			ctypes.c_int16),
+		("q3",			ctypes.c_int16),
+		("q4",			ctypes.c_int16),
+	]
+
+
+MapperInputCB = CFUNCTYPE(None, c_void_p, POINTER(ControllerInput))
+
+
+class Mapper(ctypes.Structure):
+	""" Mirrors Mapper from scc/drivers/scc_future.h """
+	_fields_ = [
+		("input",		MapperInputCB),
+	]
+
+
+class NMOutput(ctypes.Structure):
+	_fields_ = [
+		("type",		ctypes.c_int32),
+		("device",		ctypes.c_int32),
+		("code",		ctypes.c_uint16),
+		("_padding",	ctypes.c_uint16),
+		("scan",		ctypes.c_int32),
+		("press",		ctypes.c_int32),
+		("release",		ctypes.c_int32),
+	]
+
+
+class NMAxis(ctypes.Structure):
+	_fields_ = [
+		("enabled",		ctypes.c_int32),
+		("code",		ctypes.c_uint16),
+		("_padding",	ctypes.c_uint16),
+		("speed",		ctypes.c_float),
+		("min",			ctypes.c_int32),
+		("max",			ctypes.c_int32),
+		("clamp_min",	ctypes.c_int32),
+		("clamp_max",	ctypes.c_int32),
+	]
+
+
+# Values of NMDevice, NMOutputType and NMMode enums
+NMD_KEYBOARD, NMD_MOUSE, NMD_GAMEPAD = 0, 1, 2
+NMO_NONE, NMO_KEY, NMO_AXIS = 0, 1, 2
+NMM_OUTPUT, NMM_AXES, NMM_LEVELS = 2, 3, 6
+NMS_STICK, NMS_LPAD, NMS_RPAD = 0, 1, 2
+NMS_LTRIG, NMS_RTRIG = 3, 4
+
+
+class CannotHandle(Exception):
+	""" Raised when action can't be handled natively """
+	pass
+
+
+class NativeMapper(object):
+	"""
+	Holds native mapper instance. 'fallback' is pointer to Mapper struct
+	that is called with everything that couldn't be handled natively.
+	"""
+	# Natively handled inputs are hidden from fallback mapper. Pad touches
+	# are always left to it, as those are used by pad actions.
+	NEVER_NATIVE = SCButtons.LPADTOUCH | SCButtons.RPADTOUCH | SCButtons.CPADTOUCH
+	
+	def __init__(self, fallback):
+		self._lib, self._nm = None, None
+		self._lib = find_library("libnative_mapper")
+		try:
+			if self._lib.native_mapper_module_version() != NATIVE_MAPPER_MODULE_VERSION:
+				raise Exception()
+		except:
+			log.error("Invalid native module version. Please, recompile 'libnative_mapper.so'")
+			raise Exception("Invalid native module version")
+		
+		self._lib.native_mapper_new.argtypes = [ POINTER(Mapper) ]
+		self._lib.native_mapper_new.restype = c_void_p
+		self._lib.native_mapper_free.argtypes = [ c_void_p ]
+		self._lib.native_mapper_set_devices.argtypes = [ c_void_p, ctypes.c_int,
+			ctypes.c_int, ctypes.c_int, ctypes.c_float, ctypes.c_float ]
+		self._lib.native_mapper_clear.argtypes = [ c_void_p, POINTER(ControllerInput) ]
+		self._lib.native_mapper_set_button.argtypes = [ c_void_p, ctypes.c_int, POINTER(NMOutput) ]
+		self._lib.native_mapper_set_axes.argtypes = [ c_void_p, ctypes.c_int,
+			POINTER(NMAxis), POINTER(NMAxis) ]
+		self._lib.native_mapper_set_dpad.argtypes = [ c_void_p, ctypes.c_int,
+			POINTER(NMOutput), POINTER(ctypes.c_uint8) ]
+		self._lib.native_mapper_set_mouse.argtypes = [ c_void_p, ctypes.c_int,
+			ctypes.c_float, ctypes.c_float ]
+		self._lib.native_mapper_set_nothing.argtypes = [ c_void_p, ctypes.c_int ]
+		self._lib.native_mapper_set_trigger.argtypes = [ c_void_p, ctypes.c_int,
+			ctypes.c_int, POINTER(NMAxis), POINTER(NMOutput), ctypes.c_int, ctypes.c_int ]
+		
+		self._fallback = fallback
+		self._nm = self._lib.native_mapper_new(fallback)
+		if not self._nm:
+			raise MemoryError("Failed to allocate native mapper")
+		self._ptr = ctypes.cast(ctypes.c_void_p(self._nm), POINTER(Mapper))
+	
+	
+	def __del__(self):
+		if self._lib and self._nm:
+			self._lib.native_mapper_free(self._nm)
+			self._nm = None
+	
+	
+	def get_mapper(self):
+		""" Returns pointer to Mapper struct that can be passed to driver """
+		return self._ptr
+	
+	
+	def clear(self, state):
+		"""
+		Releases everything held by native actions and leaves everything
+		to fallback mapper. 'state' is current ControllerInput.
+		"""
+		self._lib.native_mapper_clear(self._nm, byref(state))
+	
+	
+	def compile(self, mapper, flags, state):
+		"""
+		Translates profile currently assigned to 'mapper' into native tables.
+		'flags' are ControllerFlags of controller and 'state'
+		is its current ControllerInput.
+		
+		Returns True if at least something is handled natively.
+		"""
+		self.clear(state)
+		if not flags & ControllerFlags.SEPARATE_STICK:
+			# Stick and left pad sharing axes is handled only in python
+			return False
+		if flags & (ControllerFlags.HAS_CPAD | ControllerFlags.IS_DECK):
+			return False
+		if all(isinstance(x, Dummy) for x in (mapper.keyboard, mapper.mouse, mapper.gamepad)):
+			# Mapper without uinput devices, such as WorkerMapper that
+			# forwards input to worker process. Native tables would have
+			# nowhere to send events to and masked inputs would be lost.
+			return False
+		
+		self._lib.native_mapper_set_devices(self._nm,
+			NativeMapper._fd(mapper.keyboard), NativeMapper._fd(mapper.mouse),
+			NativeMapper._fd(mapper.gamepad),
+			getattr(mapper.mouse, "_xscale", Mouse.DEFAULT_XSCALE),
+			getattr(mapper.mouse, "_yscale", Mouse.DEFAULT_YSCALE))
+		
+		profile = mapper.profile
+		# List of (input, action, (function, args)) for everything
+		# that can be handled natively
+		candidates = []
+		sources = [ (NMS_STICK, profile.stick, STICK), (NMS_LPAD, profile.pads[LEFT], LEFT) ]
+		if flags & ControllerFlags.HAS_RSTICK:
+			sources.append((NMS_RPAD, profile.pads[RIGHT], RIGHT))
+		for what, action, name in sources:
+			NativeMapper._add(candidates, name, action, self._compile_xy, what, action)
+		
+		for side, what in ((0, LEFT), (1, RIGHT)):
+			if what in profile.triggers:
+				action = profile.triggers[what]
+				NativeMapper._add(candidates, ("trigger", what), action,
+					self._compile_trigger, side, action)
+		
+		for button, action in profile.buttons.items():
+			if not button & NativeMapper.NEVER_NATIVE:
+				NativeMapper._add(candidates, button, action, self._compile_button,
+					int(button).bit_length() - 1, action)
+		
+		native = NativeMapper._exclude_shared_keys(profile, candidates)
+		for input, action, (fn, args) in native:
+			fn(*args)
+		
+		count = len(native)
+		log.debug("%s inputs handled natively", count)
+		return count > 0
+	
+	
+	@staticmethod
+	def _add(candidates, input, action, compile_fn, *args):
+		""" Adds 'input' to 'candidates' if it can be handled natively """
+		try:
+			candidates.append((input, action, compile_fn(*args)))
+		except CannotHandle:
+			pass
+	
+	
+	@staticmethod
+	def _exclude_shared_keys(profile, candidates):
+		"""
+		Returns subset of 'candidates' that doesn't press any key used by
+		action left for fallback mapper. Repeated until nothing changes, as
+		every excluded input may bring more keys to fallback mapper.
+		"""
+		native = candidates
+		while True:
+			names = set([ input for input, a, s in native ])
+			skip = 0
+			if LEFT not in names: skip |= SCButtons.LPAD
+			if RIGHT not in names: skip |= SCButtons.RPAD
+			native = [ c for c in native if not (
+				isinstance(c[0], SCButtons) and c[0] & skip) ]
+			native_actions = set([ id(a) for input, a, s in native ])
+			fallback = [ a for a in profile.get_actions()
+				if id(a) not in native_actions ]
+			fallback += profile.menus.values()
+			shared = NativeMapper._keys(fallback)
+			keep = [ c for c in native if not (NativeMapper._keys([ c[1] ]) & shared) ]
+			if len(keep) == len(native):
+				return native
+			native = keep
+	
+	
+	@staticmethod
+	def _keys(actions):
+		""" Returns set of keys pressed by ButtonActions in 'actions' and their children """
+		rv, stack = set(), list(actions)
+		while stack:
+			for a in stack.pop().get_all_actions():
+				if isinstance(a, ButtonAction):
+					rv.update([ x for x in (a.button, a.button2) if x is not None ])
+				elif isinstance(a, Macro):
+					# Macros don't report their actions as child actions
+					stack += a.actions
+				elif isinstance(a, PressAction):
+					stack.append(a.action)
+		return rv
+	
+	
+	@staticmethod
+	def _fd(device):
+		if isinstance(device, Dummy):
+			return -1
+		return device.getDescriptor()
+	
+	
+	@staticmethod
+	def _check(action):
+		""" Raises CannotHandle for actions with features not supported natively """
+		if getattr(action, "haptic", None):
+			raise CannotHandle(action)
+	
+	
+	@staticmethod
+	def _axis(action):
+		""" Translates AxisAction to NMAxis """
+		if isinstance(action, NoAction):
+			return NMAxis(enabled=0)
+		if not isinstance(action, AxisAction):
+			raise CannotHandle(action)
+		if action.id in (Axes.ABS_Z, Axes.ABS_RZ):
+			clamp_min, clamp_max = TRIGGER_MIN, TRIGGER_MAX
+		elif action.id in (Axes.ABS_HAT0X, Axes.ABS_HAT0Y):
+			clamp_min, clamp_max = -1, 1
+		else:
+			clamp_min, clamp_max = STICK_PAD_MIN, STICK_PAD_MAX
+		return NMAxis(enabled=1, code=action.id, speed=action.speed,
+			min=int(action.min), max=int(action.max),
+			clamp_min=clamp_min, clamp_max=clamp_max)
+	
+	
+	@staticmethod
+	def _output(action):
+		""" Translates action used as button to NMOutput """
+		NativeMapper._check(action)
+		if isinstance(action, NoAction):
+			return NMOutput(type=NMO_NONE)
+		if isinstance(action, AxisAction):
+			return NMOutput(type=NMO_AXIS, device=NMD_GAMEPAD, code=action.id,
+				press=AxisAction.clamp_axis(action.id, action.max),
+				release=AxisAction.clamp_axis(action.id, action.min))
+		if type(action) != ButtonAction or action.button2 is not None:
+			raise CannotHandle(action)
+		button = action.button
+		if button in MOUSE_BUTTONS:
+			return NMOutput(type=NMO_KEY, device=NMD_MOUSE, code=button, scan=-1)
+		if button in GAMEPAD_BUTTONS:
+			return NMOutput(type=NMO_KEY, device=NMD_GAMEPAD, code=button, scan=-1)
+		if button in Scans:
+			return NMOutput(type=NMO_KEY, device=NMD_KEYBOARD, code=button,
+				scan=Scans[button])
+		raise CannotHandle(action)
+	
+	
+	def _compile_button(self, bit, action):
+		"""
+		Returns (function, args) tuple that sets button to be handled as
+		'action' or raises CannotHandle. _compile_xy and _compile_trigger
+		work in same way.
+		"""
+		output = NativeMapper._output(action)
+		return self._lib.native_mapper_set_button, (self._nm, bit, byref(output))
+	
+	
+	def _compile_xy(self, what, action):
+		NativeMapper._check(action)
+		if isinstance(action, NoAction):
+			return self._lib.native_mapper_set_nothing, (self._nm, what)
+		elif type(action) == XYAction:
+			x, y = NativeMapper._axis(action.x), NativeMapper._axis(action.y)
+			return self._lib.native_mapper_set_axes, (self._nm, what, byref(x), byref(y))
+		elif type(action) == DPadAction:
+			sides = (NMOutput * 4)(*[ NativeMapper._output(a) for a in action.actions ])
+			lut = (ctypes.c_uint8 * 361)()
+			for angle in xrange(0, 361):
+				for a1, a2, i in action.ranges:
+					if angle >= a1 and angle < a2:
+						lut[angle] = i
+						break
+			return self._lib.native_mapper_set_dpad, (self._nm, what, sides, lut)
+		elif type(action) == MouseAction and action.get_axis() is None and what != NMS_LPAD:
+			return self._lib.native_mapper_set_mouse, (self._nm, what) + tuple(action.speed)
+		else:
+			raise CannotHandle(action)
+	
+	
+	def _compile_trigger(self, side, action):
+		NativeMapper._check(action)
+		axis, output = NMAxis(), NMOutput()
+		press, release = 0, 0
+		if isinstance(action, NoAction):
+			return self._lib.native_mapper_set_nothing, (self._nm, NMS_LTRIG + side)
+		elif isinstance(action, AxisAction):
+			mode, axis = NMM_AXES, NativeMapper._axis(action)
+		elif type(action) == ButtonAction:
+			mode, output = NMM_OUTPUT, NativeMapper._output(action)
+		elif type(action) == TriggerAction and not action.child_is_axis:
+			mode, output = NMM_LEVELS, NativeMapper._output(action.action)
+			press, release = action.press_level, action.release_level
+		else:
+			raise CannotHandle(action)
+		return self._lib.native_mapper_set_trigger, (self._nm, side, mode,
+			byref(axis), byref(output), press, release)
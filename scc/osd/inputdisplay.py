@@ -6,8 +6,11 @@ from __future__ import unicode_literals
 from scc.tools import _, set_logging_level
 
 from gi.repository import Gtk, GLib
-from scc.constants import SCButtons, STICK, LEFT, RIGHT, STICK_PAD_MAX
+from scc.constants import SCButtons, STICK_PAD_MAX, INPUT_FIELDS
+from scc.shared_state import SharedStateReader
+from scc.snapshot import ZERO_SNAPSHOT
 from scc.gui.daemon_manager import DaemonManager
+from scc.gui import TEST_FIELDS, get_test_buttons, get_refresh_rate
 from scc.gui.svg_widget import SVGWidget
 from scc.osd import OSDWindow
 
@@ -19,6 +22,8 @@ class InputDisplay(OSDWindow):
 	IMAGE = "inputdisplay.svg"
 	HILIGHT_COLOR = "#FF00FF00"		# ARGB
 	OBSERVE_COLOR = "#00007FFF"		# ARGB
+	# Areas hilighted for buttons with name different than area
+	AREAS = { SCButtons.LT : "LEFT", SCButtons.RT : "RIGHT", SCButtons.STICKPRESS : "STICK" }
 	
 	def __init__(self, imagepath="/usr/share/scc/images"):
 		OSDWindow.__init__(self, "osd-menu")
@@ -26,6 +31,9 @@ class InputDisplay(OSDWindow):
 		self.config = None
 		self.hilights = { self.HILIGHT_COLOR : set(), self.OBSERVE_COLOR : set() }
 		self.imagepath = imagepath
+		self.reader = None
+		self.state = ZERO_SNAPSHOT
+		self._tick_id = None
 		
 		self._eh_ids = []
 	
@@ -82,12 +90,37 @@ class InputDisplay(OSDWindow):
 	def on_daemon_connected(self, *a):
 		c = self.daemon.get_controllers()[0]
 		c.unlock_all()
-		c.observe(DaemonManager.nocallback, self.on_observe_failed,
-			'A', 'B', 'C', 'X', 'Y', 'START', 'BACK', 'LB', 'RB',
-			'LPAD', 'RPAD', 'LGRIP', 'RGRIP', 'LT', 'RT', 'LEFT',
-			'RIGHT', 'STICK', 'STICKPRESS')	
-		c.connect('event', self.on_daemon_event_observer)
 		c.connect('lost', self.on_controller_lost)
+		if self._tick_id is not None:
+			# Reconnected to daemon
+			self.remove_tick_callback(self._tick_id)
+			self._tick_id = None
+		try:
+			self.reader = SharedStateReader(c.get_id())
+		except OSError:
+			# State is not published, daemon has to send it
+			self.reader = None
+			c.subscribe(DaemonManager.nocallback, self.on_observe_failed,
+				get_refresh_rate(self))
+			c.connect('state', self.on_controller_state)
+			return
+		self._tick_id = self.add_tick_callback(self.on_tick)
+	
+	
+	def on_tick(self, *a):
+		""" Reads state published by daemon once per frame """
+		state = self.reader.read()
+		if state is None:
+			# Controller disconnected or daemon died, 'lost' or 'dead'
+			# signal follows
+			self._tick_id = None
+			return False
+		if state != self.state:
+			changed = [ name for (name, old, new)
+				in zip(INPUT_FIELDS, self.state, state) if old != new ]
+			self.state = state
+			self.on_controller_state(None, state, changed)
+		return True
 	
 	
 	def on_observe_failed(self, error):
@@ -100,52 +133,36 @@ class InputDisplay(OSDWindow):
 		self.quit(3)
 	
 	
-	def on_daemon_event_observer(self, daemon, what, data):
-		if what in (LEFT, RIGHT, STICK):
-			widget, area = {
-				LEFT  : (self.lpadTest,  "LPADTEST"),
-				RIGHT : (self.rpadTest,  "RPADTEST"),
-				STICK : (self.stickTest, "STICKTEST"),
-			}[what]
-			# Check if stick or pad is released
-			if data[0] == data[1] == 0:
-				widget.hide()
-				return
-			if not widget.is_visible():
-				widget.show()
-			# Grab values
-			ax, ay, aw, trash = self.background.get_area_position(area)
-			cw = widget.get_allocation().width
-			# Compute center
-			x, y = ax + aw * 0.5 - cw * 0.5, ay + 1.0 - cw * 0.5
-			# Add pad position
-			x += data[0] * aw / STICK_PAD_MAX * 0.5
-			y -= data[1] * aw / STICK_PAD_MAX * 0.5
-			# Move circle
-			self.main_area.move(widget, x, y)
-		elif what in ("LT", "RT", "STICKPRESS"):
-			what = {
-				"LT" : "LEFT",
-				"RT" : "RIGHT",
-				"STICKPRESS" : "STICK"
-			}[what]
-			if data[0]:
-				self.hilights[self.OBSERVE_COLOR].add(what)
-			else:
-				self.hilights[self.OBSERVE_COLOR].remove(what)
+	def on_controller_state(self, c, state, changed):
+		if any(x in changed for x in TEST_FIELDS):
+			self.hilights[self.OBSERVE_COLOR] = set(
+				self.AREAS.get(b, b.name) for b in get_test_buttons(state))
 			self._update_background()
-		elif hasattr(SCButtons, what):
-			try:
-				if data[0]:
-					self.hilights[self.OBSERVE_COLOR].add(what)
-				else:
-					self.hilights[self.OBSERVE_COLOR].remove(what)
-				self._update_background()
-			except KeyError, e:
-				# Non fatal
-				pass
-		else:
-			print "event", what
+		for widget, area, x, y in (
+				(self.lpadTest,  "LPADTEST",  "lpad_x",  "lpad_y"),
+				(self.rpadTest,  "RPADTEST",  "rpad_x",  "rpad_y"),
+				(self.stickTest, "STICKTEST", "stick_x", "stick_y")):
+			if x in changed or y in changed:
+				self._move_cursor(widget, area, getattr(state, x), getattr(state, y))
+	
+	
+	def _move_cursor(self, widget, area, x, y):
+		# Check if stick or pad is released
+		if x == y == 0:
+			widget.hide()
+			return
+		if not widget.is_visible():
+			widget.show()
+		# Grab values
+		ax, ay, aw, trash = self.background.get_area_position(area)
+		cw = widget.get_allocation().width
+		# Compute center
+		cx, cy = ax + aw * 0.5 - cw * 0.5, ay + 1.0 - cw * 0.5
+		# Add pad position
+		cx += x * aw / STICK_PAD_MAX * 0.5
+		cy -= y * aw / STICK_PAD_MAX * 0.5
+		# Move circle
+		self.main_area.move(widget, cx, cy)
 	
 	
 	def _update_background(self):
@@ -164,7 +181,7 @@ def sigint(*a):
 
 if __name__ == "__main__":
 	signal.signal(signal.SIGINT, sigint)
-
+	
 	import gi
 	gi.require_version('Gtk', '3.0')
 	gi.require_version('Rsvg', '2.0')
@@ -8,7 +8,7 @@ Display menu that user can navigate through and print chosen item id to stdout
 from __future__ import unicode_literals
 from scc.tools import _, set_logging_level
 
-from gi.repository import Gtk, Gdk, GdkX11, GObject, GLib, GdkPixbuf, cairo
+from gi.repository import Gtk, Gdk, GdkX11, GObject, GLib, GdkPixbuf
 from xml.etree import ElementTree as ET
 from scc.constants import LEFT, RIGHT, STICK, STICK_PAD_MIN, STICK_PAD_MAX
 from scc.constants import STICK_PAD_MIN_HALF, STICK_PAD_MAX_HALF, CPAD
@@ -33,7 +33,8 @@ from scc.osd.slave_mapper import SlaveMapper
 from scc.osd import OSDWindow
 import scc.osd.osk_actions
 
-import os, sys, json, logging
+from math import floor, ceil
+import os, sys, json, cairo, logging
 log = logging.getLogger("osd.keyboard")
 
 SPECIAL_KEYS = {
@@ -48,7 +49,17 @@ SPECIAL_KEYS = {
 
 
 class KeyboardImage(Gtk.DrawingArea):
+	"""
+	Draws keyboard. Every key is rendered in every state only once, into
+	layer with all keys in that state, and so redrawing key is done just by
+	copying its area from one of layers into composed frame. Only keys which
+	state changed are copied and only their area is redrawn on screen.
+	
+	Layers are rendered again only when labels or colors change.
+	"""
 	LINE_WIDTH = 2
+	# Key states, used as indexes in self._layers
+	NORMAL, HILIGHT, PRESSED = 0, 1, 2
 	
 	__gsignals__ = {}
 	
@@ -73,6 +84,9 @@ class KeyboardImage(Gtk.DrawingArea):
 		
 		self._hilight = ()
 		self._pressed = ()
+		self._layers = None			# list of surfaces, one for every state
+		self._frame = None			# composed image, painted on screen
+		self._drawn = {}			# button -> state, if not NORMAL, on frame
 		self._button_images = {}
 		self._help_areas = [ self.get_limit("HELP_LEFT"), self.get_limit("HELP_RIGHT") ]
 		self._help_lines = ( [], [] )
@@ -89,6 +103,7 @@ class KeyboardImage(Gtk.DrawingArea):
 		log.debug("Using font %s", self.font_face)
 		
 		self.buttons = [ Button(self.tree, area) for area in areas ]
+		self.grid = KeyGrid(self.buttons)
 		background = SVGEditor.find_by_id(self.tree, "BACKGROUND")
 		self.set_size_request(*SVGEditor.get_size(background))
 		self.overlay.edit().keep("overlay").commit()
@@ -99,22 +114,54 @@ class KeyboardImage(Gtk.DrawingArea):
 	def hilight(self, hilight, pressed):
 		self._hilight = hilight
 		self._pressed = pressed
+		if self._frame is None:
+			self.queue_draw()
+			return
+		ctx = cairo.Context(self._frame)
+		ctx.set_operator(cairo.OPERATOR_SOURCE)
+		for button in set(self._drawn) | set(hilight) | set(pressed):
+			state = self.get_state(button)
+			if self._drawn.get(button, KeyboardImage.NORMAL) != state:
+				self.queue_draw_area(*self._copy_key(ctx, button, state))
+	
+	
+	def get_state(self, button):
+		if button in self._pressed:
+			return KeyboardImage.PRESSED
+		elif button in self._hilight:
+			return KeyboardImage.HILIGHT
+		return KeyboardImage.NORMAL
+	
+	
+	def get_button_at(self, x, y):
+		""" Returns button at specified position or None """
+		return self.grid.get(x, y)
+	
+	
+	def invalidate(self):
+		""" Forces all keys to be rendered again, used when colors change """
+		self._layers = None
+		self._frame = None
 		self.queue_draw()
 	
 	
 	def set_help(self, left, right):
 		self._help_lines = ( left, right )
+		self._frame = None
 		self.queue_draw()
 	
 	
 	def set_labels(self, labels):
+		changed = False
 		for b in self.buttons:
 			label = labels.get(b)
 			if type(label) in (long, int):
 				pass
-			elif label:
+			elif label and b.label != label.encode("utf-8"):
 				b.label = label.encode("utf-8")
-		self.queue_draw()
+				changed = True
+		if changed:
+			self.invalidate()
 	
 	
 	def get_limit(self, id):
@@ -175,6 +222,58 @@ class KeyboardImage(Gtk.DrawingArea):
 	
 	
 	def on_draw(self, self2, ctx):
+		if self._frame is None:
+			self._compose(ctx.get_target())
+		# Gtk clips this to area that actually needs redrawing
+		ctx.set_source_surface(self._frame, 0, 0)
+		ctx.paint()
+	
+	
+	def _compose(self, target):
+		""" Creates frame from layers, rendering them first if needed """
+		size = self.get_size_request()
+		if self._layers is None:
+			self._layers = [
+				self._render_keys(target, size, state)
+				for state in (KeyboardImage.NORMAL,
+					KeyboardImage.HILIGHT, KeyboardImage.PRESSED)
+			]
+		self._frame = target.create_similar(cairo.CONTENT_COLOR_ALPHA, *size)
+		ctx = cairo.Context(self._frame)
+		ctx.set_source_surface(self._layers[KeyboardImage.NORMAL], 0, 0)
+		ctx.paint()
+		
+		self._drawn = {}
+		ctx.set_operator(cairo.OPERATOR_SOURCE)
+		for button in set(self._hilight) | set(self._pressed):
+			self._copy_key(ctx, button, self.get_state(button))
+		ctx.set_operator(cairo.OPERATOR_OVER)
+		self._draw_help(ctx)
+	
+	
+	def _copy_key(self, ctx, button, state):
+		"""
+		Copies area of key, including its border, from layer of given state
+		into frame. Returns copied area as (x, y, width, height).
+		"""
+		x, y, w, h = button
+		m = self.LINE_WIDTH * 0.5
+		x1, y1 = int(floor(x - m)), int(floor(y - m))
+		x2, y2 = int(ceil(x + w + m)), int(ceil(y + h + m))
+		ctx.set_source_surface(self._layers[state], 0, 0)
+		ctx.rectangle(x1, y1, x2 - x1, y2 - y1)
+		ctx.fill()
+		if state == KeyboardImage.NORMAL:
+			self._drawn.pop(button, None)
+		else:
+			self._drawn[button] = state
+		return x1, y1, x2 - x1, y2 - y1
+	
+	
+	def _render_keys(self, target, size, state):
+		""" Renders layer with all keys in specified state """
+		surface = target.create_similar(cairo.CONTENT_COLOR_ALPHA, *size)
+		ctx = cairo.Context(surface)
 		ctx.select_font_face(self.font_face, 0, 0)
 		
 		ctx.set_line_width(self.LINE_WIDTH)
@@ -183,9 +282,9 @@ class KeyboardImage(Gtk.DrawingArea):
 		
 		# Buttons
 		for button in self.buttons:
-			if button in self._pressed:
+			if state == KeyboardImage.PRESSED:
 				ctx.set_source_rgba(*self.color_pressed)
-			elif button in self._hilight:
+			elif state == KeyboardImage.HILIGHT:
 				ctx.set_source_rgba(*self.color_hilight)
 			elif button.dark:
 				ctx.set_source_rgba(*self.color_button2)
@@ -221,8 +320,11 @@ class KeyboardImage(Gtk.DrawingArea):
 		# Overlay
 		Gdk.cairo_set_source_pixbuf(ctx, self.overlay.get_pixbuf(), 0, 0)
 		ctx.paint()
-		
-		# Help
+		return surface
+	
+	
+	def _draw_help(self, ctx):
+		ctx.select_font_face(self.font_face, 0, 0)
 		ctx.set_source_rgba(*self.color_text)
 		ctx.set_font_size(16)
 		ascent, descent, height, max_x_advance, max_y_advance = ctx.font_extents()
@@ -266,6 +368,38 @@ class KeyboardImage(Gtk.DrawingArea):
 		pass
 
 
+class KeyGrid(object):
+	"""
+	Uniform grid laid over keyboard image. Every cell lists buttons
+	intersecting it, so finding button under cursor means checking only
+	few buttons in single cell instead of all of them.
+	"""
+	
+	def __init__(self, buttons):
+		sizes = [ min(b.w, b.h) for b in buttons if b.w > 0 and b.h > 0 ]
+		# Cell is as large as smallest key, so no cell has more than few
+		self.cell_size = max(1.0, min(sizes or [ 1.0 ]))
+		self.cells = {}
+		for b in buttons:
+			x1, y1 = self._cell(b.x, b.y)
+			x2, y2 = self._cell(b.x + b.w, b.y + b.h)
+			for cx in xrange(x1, x2 + 1):
+				for cy in xrange(y1, y2 + 1):
+					self.cells.setdefault((cx, cy), []).append(b)
+	
+	
+	def _cell(self, x, y):
+		return int(floor(x / self.cell_size)), int(floor(y / self.cell_size))
+	
+	
+	def get(self, x, y):
+		""" Returns first button containing specified point or None """
+		for b in self.cells.get(self._cell(x, y), ()):
+			if b.contains(x, y):
+				return b
+		return None
+
+
 class Button:
 	
 	def __init__(self, tree, area):
@@ -371,6 +505,7 @@ class Keyboard(OSDWindow, TimerManager):
 		self.background.color_hilight = _get("hilight")
 		self.background.color_pressed = _get("pressed")
 		self.background.color_text = _get("text")
+		self.background.invalidate()
 	
 	
 	def use_daemon(self, d):
@@ -634,16 +769,14 @@ class Keyboard(OSDWindow, TimerManager):
 		self.f.move(cursor,
 			x - cursor.get_allocation().width * 0.5,
 			y - cursor.get_allocation().height * 0.5)
-		for button in self.background.buttons:
-			if button.contains(x, y):
-				if button != self._hovers[cursor]:
-					self._hovers[cursor] = button
-					if self._pressed[cursor] is not None:
-						self.mapper.keyboard.releaseEvent([ self._pressed[cursor] ])
-						self.key_from_cursor(cursor, True)
-					if not self.timer_active('update'):
-						self.timer('update', 0.01, self.update_background)
-					break
+		button = self.background.get_button_at(x, y)
+		if button is not None and button != self._hovers[cursor]:
+			self._hovers[cursor] = button
+			if self._pressed[cursor] is not None:
+				self.mapper.keyboard.releaseEvent([ self._pressed[cursor] ])
+				self.key_from_cursor(cursor, True)
+			if not self.timer_active('update'):
+				self.timer('update', 0.01, self.update_background)
 	
 	
 	def update_background(self, *whatever):
@@ -677,20 +810,21 @@ class Keyboard(OSDWindow, TimerManager):
 		x, y = cursor.position
 		
 		if pressed:
-			for button in self.background.buttons:
-				if button.contains(x, y):
-					if button.name.startswith("KEY_") and hasattr(Keys, button.name):
-						key = getattr(Keys, button.name)
-						if self._pressed[cursor] is not None:
-							self.mapper.keyboard.releaseEvent([ self._pressed[cursor] ])
-						self.mapper.keyboard.pressEvent([ key ])
-						self._pressed[cursor] = key
-						self._pressed_areas[cursor] = button
-					break
+			button = self.background.get_button_at(x, y)
+			if button is not None:
+				if button.name.startswith("KEY_") and hasattr(Keys, button.name):
+					key = getattr(Keys, button.name)
+					if self._pressed[cursor] is not None:
+						self.mapper.keyboard.releaseEvent([ self._pressed[cursor] ])
+					self.mapper.keyboard.pressEvent([ key ])
+					self._pressed[cursor] = key
+					self._pressed_areas[cursor] = button
 		elif self._pressed[cursor] is not None:
 			self.mapper.keyboard.releaseEvent([ self._pressed[cursor] ])
 			self._pressed[cursor] = None
 			del self._pressed_areas[cursor]
+		# Written when mapper finishes processing event
+		self.mapper.syn_list.add(self.mapper.keyboard)
 		if not self.timer_active('update'):
 			self.timer('update', 0.01, self.update_background)
 
@@ -136,6 +136,20 @@ def get_pid_file():
 	return os.path.join(get_config_path(), "daemon.pid")
 
 
+def get_shared_state_path(controller_id):
+	"""
+	Returns path to file where daemon publishes state of controller
+	with given ID.
+	
+	$XDG_RUNTIME_DIR/scc/<controller_id>.state if XDG_RUNTIME_DIR is set,
+	~/.config/scc/<controller_id>.state otherwise.
+	"""
+	name = "%s.state" % (controller_id.replace("/", "_"),)
+	if "XDG_RUNTIME_DIR" in os.environ:
+		return os.path.join(os.environ["XDG_RUNTIME_DIR"], "scc", name)
+	return os.path.join(get_config_path(), name)
+
+
 def get_daemon_socket():
 	"""
 	Returns path to socket that can be used to controll sccdaemon.
@@ -2,13 +2,23 @@
 """
 SC-Controller - Poller
 
-Uses select to pool for file descriptors. Driver classes can use
+Uses epoll to pool for file descriptors. Driver classes can use
 daemon.get_poller().register and .unregister to add file descriptors and
 register callbacks to be called when data is available in them.
 
 Callback is called as callback(fd, event) where event is one of select.POLL*
+
+File descriptors are registered with kernel only once, so register and
+unregister are cheap and poll() doesn't need to rebuild anything.
+Poller also counts how many times poll() returned with something to do
+(useful wakeups) and how many times it just timed out (idle wakeups).
+
+Other threads can interrupt poll() with wakeup(), which signals eventfd
+registered as one of descriptors.
 """
-import select, logging
+from scc.lib.eventfd import EventFD
+from math import ceil
+import select, fcntl, os, errno, threading, logging
 log = logging.getLogger("Poller")
 
 
@@ -22,37 +32,128 @@ class Poller(object):
 	def __init__(self):
 		self._events = {}
 		self._callbacks = {}
-		self._pool_in = ()
-		self._pool_out = ()
-		self._pool_pri = ()
+		# Descriptors that epoll refuses (regular files) are always ready,
+		# same as select() would report them
+		self._always_ready = set()
+		self._epoll = select.epoll()
+		self.useful_wakeups = 0
+		self.idle_wakeups = 0
+		# Used to interrupt poll() from other threads
+		self._wakeup = EventFD()
+		self._main_thread = threading.current_thread()
+		self._on_wake = None
+		self.register(self._wakeup.fileno(), Poller.POLLIN, self._on_wakeup)
+	
+	
+	@staticmethod
+	def _set_nonblocking(fd):
+		fcntl.fcntl(fd, fcntl.F_SETFL, fcntl.fcntl(fd, fcntl.F_GETFL) | os.O_NONBLOCK)
 	
 	
 	def register(self, fd, events, callback):
 		if fd < 0:
 			raise ValueError("Invalid file descriptor")
+		mask = events & (Poller.POLLIN | Poller.POLLOUT | Poller.POLLPRI)
+		try:
+			if fd in self._events and fd not in self._always_ready:
+				self._epoll.modify(fd, mask)
+			else:
+				self._epoll.register(fd, mask)
+			self._always_ready.discard(fd)
+		except IOError, e:
+			if e.errno != errno.EPERM:
+				raise
+			self._always_ready.add(fd)
 		self._events[fd] = events
 		self._callbacks[fd] = callback
-		self._generate_lists()
 	
 	
 	def unregister(self, fd):
-		if fd in self._events: del self._events[fd]
+		if fd in self._events:
+			del self._events[fd]
+			if fd in self._always_ready:
+				self._always_ready.remove(fd)
+			else:
+				try:
+					self._epoll.unregister(fd)
+				except (IOError, ValueError):
+					# Already closed
+					pass
 		if fd in self._callbacks: del self._callbacks[fd]
-		self._generate_lists()
 	
 	
-	def _generate_lists(self):
-		self._pool_in = [ fd for fd, events in self._events.iteritems() if events & Poller.POLLIN ]
-		self._pool_out = [ fd for fd, events in self._events.iteritems() if events & Poller.POLLOUT ]
-		self._pool_pri = [ fd for fd, events in self._events.iteritems() if events & Poller.POLLPRI ]
+	def wakeup(self):
+		"""
+		Interrupts poll() that is currently waiting, if any.
+		Safe to call from any thread.
+		"""
+		if threading.current_thread() is self._main_thread:
+			# Main thread is not waiting in poll() at this point
+			return
+		self._wakeup.signal()
+	
+	
+	def set_wake_callback(self, cb):
+		"""
+		Sets callback called without arguments every time poll() returns
+		with something to do, before any other callback is called.
+		"""
+		self._on_wake = cb
 	
 	
-	def poll(self, timeout=0.01):
-		inn, out, pri = select.select( self._pool_in, self._pool_out, self._pool_pri, timeout )
+	def _on_wakeup(self, fd, event):
+		self._wakeup.read()
+	
+	
+	def get_stats(self):
+		""" Returns (useful_wakeups, idle_wakeups) tuple """
+		return self.useful_wakeups, self.idle_wakeups
+	
+	
+	def poll(self, timeout=0.01, timer=False):
+		"""
+		Waits up to 'timeout' seconds for any registered descriptor to
+		become ready and calls its callback. None means no timeout.
+		
+		'timer' should be True if timeout is time when something else
+		has to be done, so timing out is counted as useful wakeup.
+		"""
+		if self._always_ready:
+			timeout = 0
+		elif timeout is None:
+			timeout = -1
+		else:
+			# epoll truncates to milliseconds, what would wake it up just
+			# before scheduled task is due
+			timeout = ceil(timeout * 1000.0) / 1000.0
+		try:
+			ready = self._epoll.poll(timeout)
+		except IOError, e:
+			if e.errno == errno.EINTR:
+				return
+			raise
 		
-		for fd in inn:
-			self._callbacks.get(fd, DO_NOTHING)(fd, Poller.POLLIN)
-		for fd in out:
-			self._callbacks.get(fd, DO_NOTHING)(fd, Poller.POLLOUT)
-		for fd in pri:
-			self._callbacks.get(fd, DO_NOTHING)(fd, Poller.POLLPRI)
+		if not ready and not self._always_ready:
+			if timer:
+				self.useful_wakeups += 1
+			else:
+				self.idle_wakeups += 1
+			return
+		self.useful_wakeups += 1
+		if self._on_wake:
+			self._on_wake()
+		for fd, events in ready:
+			if events & (select.EPOLLERR | select.EPOLLHUP):
+				# select() reported errors as readable / writable descriptor
+				events |= self._events.get(fd, 0) & (Poller.POLLIN | Poller.POLLOUT)
+			if events & Poller.POLLIN:
+				self._callbacks.get(fd, DO_NOTHING)(fd, Poller.POLLIN)
+			if events & Poller.POLLOUT:
+				self._callbacks.get(fd, DO_NOTHING)(fd, Poller.POLLOUT)
+			if events & Poller.POLLPRI:
+				self._callbacks.get(fd, DO_NOTHING)(fd, Poller.POLLPRI)
+		for fd in list(self._always_ready):
+			events = self._events.get(fd, 0)
+			for e in (Poller.POLLIN, Poller.POLLOUT, Poller.POLLPRI):
+				if events & e:
+					self._callbacks.get(fd, DO_NOTHING)(fd, e)
@@ -7,7 +7,7 @@ Handles mapping profile stored in json file
 from __future__ import unicode_literals
 
 from scc.constants import LEFT, RIGHT, CPAD, DPAD, WHOLE, STICK, RSTICK, GYRO
-from scc.constants import SCButtons, HapticPos
+from scc.constants import SCButtons, HapticPos, ControllerFlags
 from scc.special_actions import MenuAction
 from scc.modifiers import HoldModifier
 from scc.lib.jsonencoder import JSONEncoder
@@ -238,6 +238,16 @@ class Profile(object):
 			yield action
 	
 	
+	def compile(self, flags):
+		"""
+		Returns CompiledProfile used by Mapper to dispatch input from
+		controller with given ControllerFlags.
+		Profile is not watched for changes, so it has to be compiled again
+		every time any action in it is replaced.
+		"""
+		return CompiledProfile(self, flags)
+	
+	
 	def get_filename(self):
 		"""
 		Returns filename of last loaded file or None.
@@ -344,6 +354,39 @@ class Profile(object):
 			# Action format completly changed in v0.4, but profile foramat is same.
 			pass
 
+class CompiledProfile(object):
+	"""
+	Dispatch structure built by Profile.compile() and used by Mapper.input.
+	
+	Holds only inputs bound to something else than NoAction, so everything
+	else is skipped without being looked at, and decides once whether
+	stick, pads and DPAD are read from separate axes, so controller flags
+	don't have to be tested on every report. Inputs that controller with
+	given flags doesn't have are set to None as well.
+	"""
+	
+	def __init__(self, profile, flags):
+		# Button bit -> action
+		self.buttons = { int(b) : a for (b, a) in profile.buttons.items() if a }
+		self.button_mask = 0
+		for b in self.buttons:
+			self.button_mask |= b
+		self.separate_stick = bool(flags & ControllerFlags.SEPARATE_STICK)
+		self.rpad_is_stick = bool(flags & ControllerFlags.HAS_RSTICK)
+		self.stick = profile.stick or None
+		self.gyro = profile.gyro or None
+		self.ltrig = profile.triggers.get(LEFT) or None
+		self.rtrig = profile.triggers.get(RIGHT) or None
+		self.lpad = profile.pads.get(LEFT) or None
+		self.rpad = profile.pads.get(RIGHT) or None
+		self.rstick, self.dpad, self.cpad = None, None, None
+		if flags & ControllerFlags.IS_DECK:
+			self.rstick = profile.rstick or None
+			self.dpad = profile.pads.get(DPAD) or None
+		if flags & ControllerFlags.HAS_CPAD:
+			self.cpad = profile.pads.get(CPAD) or None
+
+
 class Encoder(JSONEncoder):
 	def default(self, obj):
 		#if type(obj) in (list, tuple):
@@ -0,0 +1,150 @@
+#!/usr/bin/env python2
+"""
+SC-Controller - Profile cache
+
+Parsing profile runs every action string through TalkingActionParser,
+what takes noticeable time with large profiles. ProfileCache keeps parsed
+and compressed profiles ready, so switching to one of them doesn't have to
+wait for parser.
+
+Profile is not immutable - actions keep their state and daemon replaces
+actions of active profile when client locks or observes an input. Because
+of that, cache never hands out same Profile twice. Every cached profile is
+used only once and new copy is parsed in background thread right after,
+so it's ready for next switch. Cached copy is used only if modification
+time and size of profile file didn't change since it was parsed.
+"""
+from __future__ import unicode_literals
+from scc.special_actions import ChangeProfileAction
+from scc.parser import TalkingActionParser
+from scc.tools import find_profile
+from scc.profile import Profile
+from collections import OrderedDict
+import os, time, threading, logging
+log = logging.getLogger("ProfileCache")
+
+
+class ProfileCache(object):
+	# Number of profiles kept ready. Least recently used is dropped first
+	MAX_SIZE = 32
+	
+	def __init__(self):
+		self._lock = threading.Lock()
+		self._ready = OrderedDict()		# filename -> (stamp, Profile)
+		self._pending = []				# filenames to load in background
+		self._wakeup = threading.Event()
+		self._thread = None
+		self.hits, self.misses = 0, 0
+	
+	
+	@staticmethod
+	def _stamp(filename):
+		st = os.stat(filename)
+		return st.st_mtime, st.st_size
+	
+	
+	@staticmethod
+	def _parse(filename):
+		p = Profile(TalkingActionParser())
+		p.load(filename).compress()
+		return p
+	
+	
+	def load(self, filename):
+		"""
+		Returns compressed Profile loaded from given file, taking one from
+		cache if possible. Either way, next copy is parsed in background.
+		
+		Raises same exceptions as Profile.load if file can't be loaded.
+		"""
+		stamp = ProfileCache._stamp(filename)
+		with self._lock:
+			entry = self._ready.pop(filename, None)
+		if entry and entry[0] == stamp:
+			self.hits += 1
+			profile = entry[1]
+		else:
+			self.misses += 1
+			profile = ProfileCache._parse(filename)
+		self.prewarm([ filename ])
+		return profile
+	
+	
+	def prewarm(self, filenames):
+		"""
+		Schedules loading of given profiles in background thread.
+		Files that are already cached and not modified since are skipped.
+		"""
+		stamps = []
+		for filename in filenames:
+			try:
+				stamps.append((filename, ProfileCache._stamp(filename)))
+			except OSError:
+				pass
+		with self._lock:
+			for filename, stamp in stamps:
+				entry = self._ready.get(filename)
+				if entry and entry[0] == stamp:
+					continue
+				if filename not in self._pending:
+					self._pending.append(filename)
+			if not self._pending:
+				return
+			if self._thread is None:
+				self._thread = threading.Thread(target=self._threaded)
+				self._thread.daemon = True
+				self._thread.start()
+		self._wakeup.set()
+	
+	
+	def clear(self):
+		""" Drops everything cached """
+		with self._lock:
+			self._ready.clear()
+	
+	
+	def _threaded(self):
+		while True:
+			self._wakeup.wait()
+			with self._lock:
+				if not self._pending:
+					self._wakeup.clear()
+					continue
+				filename = self._pending[0]
+			try:
+				stamp = ProfileCache._stamp(filename)
+				profile = ProfileCache._parse(filename)
+			except Exception, e:
+				log.warning("Failed to pre-load profile '%s': %s", filename, e)
+				profile = None
+			with self._lock:
+				self._pending.remove(filename)
+				if profile is not None:
+					self._ready[filename] = (stamp, profile)
+					while len(self._ready) > ProfileCache.MAX_SIZE:
+						self._ready.popitem(last=False)
+	
+	
+	def wait(self):
+		""" Blocks until everything scheduled is loaded. Used by benchmark """
+		while True:
+			with self._lock:
+				if not self._pending:
+					return
+			time.sleep(0.01)
+	
+	
+	@staticmethod
+	def get_referenced(actions):
+		"""
+		Returns list of filenames of profiles that can be switched to
+		by given actions or their children.
+		"""
+		rv = []
+		for action in actions:
+			for a in action.get_all_actions():
+				if isinstance(a, ChangeProfileAction):
+					filename = find_profile(a.profile)
+					if filename and filename not in rv:
+						rv.append(filename)
+		return rv
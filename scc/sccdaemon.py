@@ -1,13 +1,18 @@
 #!/usr/bin/env python2
 """
 SC-Controller - Daemon class
+
+Control socket is served by one thread per client, but those threads only
+read and split messages. Every message is queued and handled by main loop
+between processing inputs, so clients can't delay input by holding locks,
+and responses are written to non-blocking per-client buffers (ClientOutput).
 """
 from __future__ import unicode_literals
 
 from scc.lib import xwrappers as X
 from scc.lib import xinput
 from scc.lib.daemon import Daemon
-from scc.constants import SCButtons, DAEMON_VERSION, HapticPos
+from scc.constants import SCButtons, DAEMON_VERSION, HapticPos, ControllerFlags
 from scc.constants import LEFT, RIGHT, STICK, RSTICK, CPAD, DPAD
 from scc.tools import find_profile, find_menu, nameof, shsplit, shjoin
 from scc.uinput import CannotCreateUInputException
@@ -19,7 +24,12 @@ from scc.gestures import GestureDetector
 from scc.parser import TalkingActionParser
 from scc.controller import HapticData
 from scc.scheduler import Scheduler
+from scc.stats import Instrumentation
 from scc.menu_data import MenuData
+from scc.profile_cache import ProfileCache
+from scc.snapshot import SnapshotEncoder
+from scc.shared_state import SharedState, remove_stale
+from scc.worker import WorkerMapper
 from scc.profile import Profile
 from scc.actions import Action
 from scc.config import Config
@@ -28,7 +38,8 @@ from scc.mapper import Mapper
 from scc import drivers
 
 from SocketServer import UnixStreamServer, ThreadingMixIn, StreamRequestHandler
-import os, sys, pkgutil, signal, time, json, logging
+from collections import deque
+import os, sys, pkgutil, signal, time, json, errno, socket, logging
 import threading, traceback, subprocess, shlex
 log = logging.getLogger("SCCDaemon")
 tlog = logging.getLogger("Socket Thread")
@@ -37,6 +48,10 @@ class ThreadingUnixStreamServer(ThreadingMixIn, UnixStreamServer): daemon_thread
 
 
 class SCCDaemon(Daemon):
+	# Used as poll timeout while any periodic mainloop is registered
+	PERIODIC_INTERVAL = 0.01
+	# Upper bound of poll timeout when there is nothing scheduled
+	MAX_POLL_INTERVAL = 1.0
 	
 	def __init__(self, piddile, socket_file):
 		set_logging_level(True, True)
@@ -48,6 +63,10 @@ class SCCDaemon(Daemon):
 		self.poller = Poller()
 		self.dev_monitor = create_device_monitor(self)
 		self.scheduler = Scheduler()
+		self.scheduler.set_wakeup_callback(self.poller.wakeup)
+		self.poller.set_wake_callback(self.scheduler.update_time)
+		if Config()["precise_scheduler"]:
+			self.scheduler.enable_precise(self.poller)
 		self.xdisplay = None
 		self.sserver = None			# UnixStreamServer instance
 		self.errors = []
@@ -59,7 +78,12 @@ class SCCDaemon(Daemon):
 		# TODO: Use osd_ids for all menus
 		self.osd_ids = {}
 		self.controllers = []
-		self.mainloops = [ self.poller.poll, self.scheduler.run ]
+		self.stats = Instrumentation(self.scheduler)
+		self.profile_cache = ProfileCache()
+		# (callback, args) tuples queued by socket threads, see _sshandler
+		self.commands = deque()
+		self.mainloops = [ self.poll, self.run_commands, self.run_scheduler ]
+		self.periodic_mainloops = set()
 		self.rescan_cbs = [ ]
 		self.on_exit_cbs = []
 		self.subprocs = []
@@ -146,13 +170,19 @@ class SCCDaemon(Daemon):
 		return self.scheduler
 	
 	
-	def add_mainloop(self, fn):
+	def add_mainloop(self, fn, periodic=True):
 		"""
 		Adds function that is called in every mainloop iteration.
 		Can be called only durring initialization, in driver 'init' method.
+		
+		If 'periodic' is True, mainloop iterates at least every
+		PERIODIC_INTERVAL while function is registered. Otherwise, function
+		is called only after poller or scheduler had something to do.
 		"""
 		if fn not in self.mainloops:
 			self.mainloops.append(fn)
+		if periodic:
+			self.periodic_mainloops.add(fn)
 	
 	
 	def remove_mainloop(self, fn):
@@ -161,6 +191,44 @@ class SCCDaemon(Daemon):
 		"""
 		if fn in self.mainloops:
 			self.mainloops.remove(fn)
+		self.periodic_mainloops.discard(fn)
+	
+	
+	def run_scheduler(self):
+		# Called through attribute, so Instrumentation can replace 'run'
+		self.scheduler.run()
+	
+	
+	def run_commands(self):
+		"""
+		Runs everything queued by socket threads. Other threads only append
+		to queue and only main thread takes from it, so no lock is needed.
+		"""
+		while self.commands:
+			callback, args = self.commands.popleft()
+			try:
+				callback(*args)
+			except Exception, e:
+				log.exception(e)
+	
+	
+	def _enqueue(self, callback, *args):
+		""" Queues callback to be called from main loop. Safe to call from any thread """
+		self.commands.append(( callback, args ))
+		self.poller.wakeup()
+	
+	
+	def poll(self):
+		"""
+		Waits for file descriptors registered in poller until next
+		scheduled task is due.
+		"""
+		if self.periodic_mainloops:
+			max_timeout = SCCDaemon.PERIODIC_INTERVAL
+		else:
+			max_timeout = SCCDaemon.MAX_POLL_INTERVAL
+		timeout = self.scheduler.get_timeout(max_timeout)
+		self.poller.poll(timeout, timer=timeout < max_timeout)
 	
 	
 	def add_on_exit(self, fn):
@@ -180,10 +248,10 @@ class SCCDaemon(Daemon):
 			self.rescan_cbs.append(fn)
 	
 	
-	def _set_profile(self, mapper, filename):
-		# Called from socket server thread
-		p = Profile(TalkingActionParser())
-		p.load(filename).compress()
+	def _set_profile(self, mapper, filename, p=None):
+		# 'p' is passed if profile was already loaded by socket thread
+		if p is None:
+			p = self.profile_cache.load(filename)
 		self.profile_file = filename
 		
 		if mapper.profile.gyro and not p.gyro:
@@ -204,7 +272,7 @@ class SCCDaemon(Daemon):
 		mapper.mouse.reset()
 		
 		# This last line kinda depends on GIL...
-		mapper.profile = p
+		mapper.set_profile(p)
 		# Re-apply all locks
 		for c in self.clients:
 			c.reaply_locks(self, mapper)
@@ -212,6 +280,8 @@ class SCCDaemon(Daemon):
 			self.send_profile_info(mapper.get_controller(), self._send_to_all)
 		else:
 			self.send_profile_info(None, self._send_to_all, mapper=mapper)
+		# Profiles that can be switched to from this one are loaded ahead
+		self.profile_cache.prewarm(ProfileCache.get_referenced(p.get_all_actions()))
 	
 	
 	def _send_to_all(self, message_str):
@@ -286,7 +356,9 @@ class SCCDaemon(Daemon):
 			except Exception, e:
 				log.error("Failed to initialize CemuHookUDP Motion Provider: %s", e)
 				return
-		self.cemuhook.feed(data)
+		if mapper.profile.gyro is action:
+			self.cemuhook.attach(mapper)
+		self.cemuhook.feed(mapper.get_controller(), data)
 	
 	def _osd(self, *data):
 		"""
@@ -409,8 +481,15 @@ class SCCDaemon(Daemon):
 	
 	def sigterm(self, *a):
 		self.exiting = True
+		log.debug("Poller wakeups: %s useful, %s idle", *self.poller.get_stats())
+		log.debug("Scheduler jitter: %s", ", ".join([
+			"<%gus: %s" % (bound * 1000000, count)
+			for (bound, count) in self.scheduler.get_jitter_histogram() ]))
 		for fn in self.on_exit_cbs:
 			fn(self)
+		for c in self.controllers:
+			if c.shared_state:
+				c.shared_state.close()
 		for d in (self.osd_daemon, self.autoswitch_daemon):
 			if d: d.wfile.close()
 		self.osd_daemon, self.autoswitch_daemon = None, None
@@ -455,8 +534,11 @@ class SCCDaemon(Daemon):
 		Setups new mapper instance.
 		"""
 		try:
-			mapper = Mapper(Profile(TalkingActionParser()),
-					self.scheduler, poller=self.poller)
+			if Config()["worker_processes"]:
+				mapper = WorkerMapper(self)
+			else:
+				mapper = Mapper(Profile(TalkingActionParser()),
+						self.scheduler, poller=self.poller)
 		except CannotCreateUInputException, e:
 			# Most likely UInput is not available
 			# Create mapper with all virtual devices set to Dummies.
@@ -497,11 +579,23 @@ class SCCDaemon(Daemon):
 				pass
 		try:
 			mapper.profile.load(self.default_profile).compress()
+			mapper.profile_modified()
 		except Exception, e:
 			log.warning("Failed to load profile. Starting with no mappings.")
 			log.warning("Reason: %s", e)
 	
 	
+	def prewarm_profiles(self):
+		"""
+		Loads profiles that autoswitcher or default profile can switch to
+		in background, so switching to them doesn't stall input.
+		"""
+		from scc.x11.autoswitcher import AutoSwitcher
+		actions = AutoSwitcher.parse_conditions(Config()).values()
+		actions += list(self.default_mapper.profile.get_all_actions())
+		self.profile_cache.prewarm(ProfileCache.get_referenced(actions))
+	
+	
 	def add_controller(self, c):
 		if len(self.free_mappers) > 0:
 			# Reuse already created mapper, so SCC will not spam system
@@ -513,6 +607,11 @@ class SCCDaemon(Daemon):
 			# New controller, but no mapper created
 			mapper = self.init_mapper()
 			self.load_default_profile(mapper)
+		if Config()["enable_sniffing"]:
+			try:
+				c.shared_state = SharedState(c.get_id(), c.flags)
+			except (IOError, OSError), e:
+				log.warning("Failed to publish state of %s: %s", c, e)
 		mapper.set_controller(c)
 		c.set_mapper(mapper)
 		if mapper == self.default_mapper:
@@ -525,6 +624,7 @@ class SCCDaemon(Daemon):
 		self.controllers.append(c)
 		log.debug("Controller added: %s", c)
 		with self.lock:
+			self.stats.attach(mapper)
 			self.send_controller_list(self._send_to_all)
 			self.send_all_profiles(self._send_to_all)
 	
@@ -534,11 +634,18 @@ class SCCDaemon(Daemon):
 		if mapper:
 			mapper.release_virtual_buttons()
 		c.disconnected()
+		if c.shared_state:
+			c.shared_state.close()
+			c.shared_state = None
+		if self.cemuhook:
+			self.cemuhook.controller_removed(c)
 		
 		with self.lock:
 			while c in self.controllers:
 				self.controllers.remove(c)
 			log.debug("Controller removed: %s", c)
+			if mapper:
+				self.stats.detach(mapper)
 			
 			if mapper == self.default_mapper and len(self.controllers) > 0:
 				# Special case, default_mapper should be always
@@ -550,6 +657,9 @@ class SCCDaemon(Daemon):
 				swap_c.set_mapper(mapper)
 				mapper.set_controller(swap_c)
 				self.free_mappers.append(swap_mapper)
+				if self.stats.enabled:
+					self.stats.detach(swap_mapper)
+					self.stats.attach(mapper)
 				log.debug("Reassigned default_mapper to %s", swap_c)
 			else:
 				c.set_mapper(None)
@@ -638,12 +748,14 @@ class SCCDaemon(Daemon):
 	def run(self):
 		log.debug("Starting SCCDaemon...")
 		signal.signal(signal.SIGTERM, self.sigterm)
+		remove_stale()
 		self.init_drivers()
 		self.dev_monitor.start()
 		load_custom_module(log)
 		self.default_mapper = self.init_default_mapper()
 		self.free_mappers.append(self.default_mapper)
 		self.load_default_profile()
+		self.prewarm_profiles()
 		self.lock.acquire()
 		self.start_listening()
 		self.connect_x()
@@ -705,19 +817,10 @@ class SCCDaemon(Daemon):
 	
 	
 	def _sshandler(self, connection, rfile, wfile):
-		with self.lock:
-			client = Client(connection, self.default_mapper, rfile, wfile)
-			self.clients.add(client)
-			wfile.write(b"SCCDaemon\n")
-			wfile.write(("Version: %s\n" % (DAEMON_VERSION,)).encode("utf-8"))
-			wfile.write(("PID: %s\n" % (os.getpid(),)).encode("utf-8"))
-			self.send_controller_list(wfile.write)
-			self.send_all_profiles(wfile.write)
-			if len(self.errors) == 0:
-				wfile.write(b"Ready.\n")
-			else:
-				for id, error in self.errors:
-					wfile.write(("Error: %s\n" % (error,)).encode("utf-8"))
+		# Called from socket server thread, one for every client
+		client = Client(connection, self.default_mapper, rfile,
+			ClientOutput(connection, self.poller))
+		self._enqueue(self._client_connected, client)
 		
 		while True:
 			try:
@@ -726,9 +829,40 @@ class SCCDaemon(Daemon):
 				# Connection terminated
 				break
 			if len(line) == 0: break
-			if len(line.strip("\t\n ")) > 0:
-				self._handle_message(client, line.strip("\n"))
+			line = line.strip("\n")
+			if len(line.strip("\t ")) > 0:
+				profile = None
+				if line.startswith("Profile:"):
+					# Parsed here, so main loop doesn't have to wait for it.
+					# If this fails, main loop tries again and reports error
+					try:
+						profile = self.profile_cache.load(line[8:].strip("\t "))
+					except Exception:
+						pass
+				self._enqueue(self._handle_message, client, line, profile)
 		
+		self._enqueue(self._client_disconnected, client)
+		# Connection is closed once this returns, what has to wait until
+		# main loop is done with client
+		client.closed.wait()
+	
+	
+	def _client_connected(self, client):
+		with self.lock:
+			self.clients.add(client)
+			client.wfile.write(b"SCCDaemon\n")
+			client.wfile.write(("Version: %s\n" % (DAEMON_VERSION,)).encode("utf-8"))
+			client.wfile.write(("PID: %s\n" % (os.getpid(),)).encode("utf-8"))
+			self.send_controller_list(client.wfile.write)
+			self.send_all_profiles(client.wfile.write)
+			if len(self.errors) == 0:
+				client.wfile.write(b"Ready.\n")
+			else:
+				for id, error in self.errors:
+					client.wfile.write(("Error: %s\n" % (error,)).encode("utf-8"))
+	
+	
+	def _client_disconnected(self, client):
 		with self.lock:
 			client.unlock_actions(self)
 			if self.osd_daemon == client:
@@ -737,18 +871,26 @@ class SCCDaemon(Daemon):
 			if self.autoswitch_daemon == client:
 				log.info("scc-autoswitch-daemon lost")
 				self.autoswitch_daemon = None
-			self.clients.remove(client)
+			self.clients.discard(client)
+		client.wfile.close()
+		client.closed.set()
 	
 	
-	def _handle_message(self, client, message):
+	def _handle_message(self, client, message, profile=None):
 		"""
 		Handles message recieved from client.
+		Called from main loop; 'profile' is set if message is 'Profile:'
+		and socket thread already loaded it.
 		"""
+		if isinstance(client.mapper, WorkerMapper):
+			if message.split(":", 1)[0] in ("Observe", "Replace", "Lock", "Gesture"):
+				client.wfile.write(b"Fail: Not available with worker processes\n")
+				return
 		if message.startswith("Profile:"):
 			with self.lock:
 				try:
 					filename = message[8:].strip("\t ")
-					self._set_profile(client.mapper, filename)
+					self._set_profile(client.mapper, filename, profile)
 					log.info("Loaded profile '%s'", filename)
 					client.wfile.write(b"OK.\n")
 				except Exception, e:
@@ -798,6 +940,23 @@ class SCCDaemon(Daemon):
 						raise Exception("goto fail")
 				except Exception, e:
 					client.wfile.write(b"Fail: no such controller\n")
+		elif message.startswith("Stats:"):
+			action = message[6:].strip(" \t\r")
+			with self.lock:
+				if action == "on":
+					self.stats.enable([ c.get_mapper() for c in self.controllers ])
+				elif action == "off":
+					self.stats.disable()
+				elif action == "reset":
+					self.stats.reset()
+				else:
+					client.wfile.write(b"Fail: unknown action\n")
+					return
+			client.wfile.write(b"OK.\n")
+		elif message.startswith("Stats."):
+			with self.lock:
+				data = json.dumps(self.stats.dump())
+			client.wfile.write(b"Stats: %s\n" % (data,))
 		elif message.startswith("State."):
 			if Config()["enable_sniffing"]:
 				client.wfile.write(b"State: %s\n" % (str(client.mapper.state), ))
@@ -861,6 +1020,18 @@ class SCCDaemon(Daemon):
 			with self.lock:
 				client.unlock_actions(self)
 				client.wfile.write(b"OK.\n")
+		elif message.startswith("Subscribe:"):
+			if not Config()["enable_sniffing"]:
+				log.warning("Refused 'Subscribe' request: Sniffing disabled")
+				client.wfile.write(b"Fail: Sniffing disabled.\n")
+				return
+			try:
+				rate = float(message[10:])
+			except ValueError, e:
+				client.wfile.write(b"Fail: %s\n" % (e,))
+				return
+			client.subscribe(self, rate)
+			client.wfile.write(b"OK.\n")
 		elif message.startswith("Reconfigure."):
 			with self.lock:
 				# Load config
@@ -876,6 +1047,7 @@ class SCCDaemon(Daemon):
 					self._remove_subproccess("scc-autoswitch-daemon")
 					self.autoswitch_daemon.close()
 					self.autoswitch_daemon = None
+				self.prewarm_profiles()
 				# Respond
 				try:
 					client.wfile.write(b"OK.\n")
@@ -892,8 +1064,8 @@ class SCCDaemon(Daemon):
 				except:
 					pass
 			# Do stuff later
-			# (this cannot be done while self.lock is held, as creating new
-			# controller would create race condition)
+			# (this cannot be done while self.lock is held, as adding
+			# new controller takes it as well)
 			for cb in self.rescan_cbs:
 				try:
 					cb()
@@ -904,7 +1076,7 @@ class SCCDaemon(Daemon):
 				self.dev_monitor.rescan()
 			except Exception, e:
 				log.exception(e)
-
+		
 		elif message.startswith("Turnoff."):
 			to_turn_off = []
 			with self.lock:
@@ -967,7 +1139,10 @@ class SCCDaemon(Daemon):
 					log.warning("Selected menu item is no longer valid.")
 					client.wfile.write(b"Fail: Selected menu item is no longer valid\n")
 				if menuaction:
-					client.mapper.schedule(0, press)
+					if isinstance(client.mapper, WorkerMapper):
+						client.mapper.press(menuaction)
+					else:
+						client.mapper.schedule(0, press)
 		elif message.startswith("Register:"):
 			with self.lock:
 				if message.strip().endswith("osd"):
@@ -1067,6 +1242,7 @@ class SCCDaemon(Daemon):
 			mapper.profile.pads[what] = a
 		else:
 			raise ValueError("Unknown source: %s" % (what,))
+		mapper.profile_modified()
 	
 	
 	@staticmethod
@@ -1108,6 +1284,120 @@ class SCCDaemon(Daemon):
 		self.sigterm()
 
 
+class ClientOutput(object):
+	"""
+	Used as client's wfile. Writes what socket accepts without blocking and
+	keeps the rest until poller reports socket as writable again, so slow
+	client can't block main loop.
+	
+	Has to be used only from main thread. Write never fails; if client
+	is gone or doesn't read fast enough, data is dropped and connection
+	closed, what socket thread notices.
+	"""
+	# Client that has this much unsent data waiting is disconnected
+	MAX_BUFFERED = 1024 * 1024
+	
+	def __init__(self, connection, poller):
+		self.connection = connection
+		self.poller = poller
+		self.buffer = b""
+		self.closed = False
+	
+	
+	def write(self, data):
+		if self.closed:
+			return
+		if self.buffer:
+			self.buffer += data
+			if len(self.buffer) > ClientOutput.MAX_BUFFERED:
+				log.warning("Client is not reading, disconnecting")
+				self.close()
+			return
+		sent = self._send(data)
+		if sent is not None and sent < len(data):
+			self.buffer = data[sent:]
+			self.poller.register(self.connection.fileno(), self.poller.POLLOUT,
+				self._on_writable)
+	
+	
+	def _send(self, data):
+		""" Returns number of bytes sent or None if connection was closed """
+		try:
+			return self.connection.send(data, socket.MSG_DONTWAIT)
+		except socket.error, e:
+			if e.errno in (errno.EAGAIN, errno.EWOULDBLOCK, errno.EINTR):
+				return 0
+			self.close()
+			return None
+	
+	
+	def _on_writable(self, fd, event):
+		sent = self._send(self.buffer)
+		if sent is not None:
+			self.buffer = self.buffer[sent:]
+			if not self.buffer:
+				self.poller.unregister(fd)
+	
+	
+	def flush(self):
+		# Everything is sent as soon as possible anyway
+		pass
+	
+	
+	def close(self):
+		if self.closed:
+			return
+		self.closed = True
+		if self.buffer:
+			self.buffer = b""
+			self.poller.unregister(self.connection.fileno())
+		try:
+			self.connection.shutdown(socket.SHUT_RDWR)
+		except socket.error:
+			pass
+
+
+class Subscription(object):
+	"""
+	Sends snapshot of controller state to client periodically, but only
+	if something changed since last one. Created by 'Subscribe:' message.
+	"""
+	# Highest rate client can ask for, in snapshots per second
+	MAX_RATE = 1000.0
+	
+	def __init__(self, client, scheduler, rate):
+		self.client = client
+		self.mapper = client.mapper
+		self.scheduler = scheduler
+		self.interval = 1.0 / clamp(1.0, rate, Subscription.MAX_RATE)
+		self.controller = None
+		self.encoder = SnapshotEncoder()
+		self.task = scheduler.schedule(0, self.send)
+	
+	
+	def send(self):
+		controller = self.mapper.get_controller()
+		if controller is not self.controller:
+			# New controller; client gets whole state of it
+			self.controller = controller
+			self.encoder.separate_stick = bool(controller and
+				controller.flags & ControllerFlags.SEPARATE_STICK)
+			self.encoder.reset()
+		state = controller.get_input() if controller else None
+		if state is None:
+			state = self.mapper.state
+		if controller and state is not None:
+			data = self.encoder.encode(state)
+			if data is not None:
+				self.client.wfile.write(b"Snapshot: %s %s\n%s" % (
+					controller.get_id().encode("utf-8"), len(data), data))
+		self.task = self.scheduler.schedule(self.interval, self.send)
+	
+	
+	def cancel(self):
+		self.scheduler.cancel_task(self.task)
+
+
 class Client(object):
 	def __init__(self, connection, mapper, rfile, wfile):
 		self.connection = connection
@@ -1116,6 +1406,9 @@ class Client(object):
 		self.mapper = mapper
 		self.gesture_action = None
 		self.locked_actions = {}
+		self.subscriptions = {}		# mapper -> Subscription
+		# Set by main loop when it's done with disconnected client
+		self.closed = threading.Event()
 	
 	
 	def close(self):
@@ -1182,8 +1475,28 @@ class Client(object):
 				lambda a : ReplacedAction(what, self, action, a))
 	
 	
+	def subscribe(self, daemon, rate):
+		"""
+		Starts sending snapshots of state of current controller at given
+		rate, replacing previous subscription to same controller.
+		Rate of 0 only cancels previous subscription.
+		
+		Called from main loop.
+		"""
+		if self.mapper in self.subscriptions:
+			self.subscriptions.pop(self.mapper).cancel()
+		if rate > 0:
+			self.subscriptions[self.mapper] = Subscription(self, daemon.scheduler, rate)
+	
+	
 	def unlock_actions(self, daemon):
-		""" Should be called while daemon.lock is acquired """
+		"""
+		Cancels subscriptions as well.
+		Should be called while daemon.lock is acquired
+		"""
+		subscriptions, self.subscriptions = self.subscriptions, {}
+		for s in subscriptions.values():
+			s.cancel()
 		locked, self.locked_actions = self.locked_actions, {}
 		for mapper in locked:
 			s = locked[mapper]
@@ -1228,12 +1541,8 @@ class ReportingAction(Action):
 	
 	
 	def _report(self, message):
-		try:
-			self.client.wfile.write(message.encode("utf-8"))
-		except Exception, e:
-			# May fail when client dies
-			self.client.rfile.close()
-			self.client.wfile.close()
+		# ClientOutput doesn't fail, it closes connection when client dies
+		self.client.wfile.write(message.encode("utf-8"))
 	
 	
 	def trigger(self, mapper, position, old_position):
@@ -7,20 +7,148 @@ Runs in SCCDaemon's (single-threaded) mainloop. That means all callbacks are
 also called on main thread.
 
 Use schedule(delay, callback, *data) to register one-time task.
+
+Tasks are kept in binary heap. Canceling task only marks its heap entry as
+dead and dead entries are skipped (or dropped all at once, when there is too
+many of them), so both scheduling and canceling costs O(log n).
+
+In precise mode, enabled by enable_precise(), scheduler arms timerfd for its
+earliest task and runs as soon as it fires, instead of waiting for mainloop.
 """
-import time, Queue, logging
+from collections import deque
+from heapq import heappush, heappop, heapify
+from bisect import bisect_left
+import time, thread, logging
 log = logging.getLogger("Scheduler")
 
-# TODO: Maybe create actual thread for this? Use poler? Scrap everything and rewrite it in GO?
 
 class Scheduler(object):
+	# When there is more canceled than live entries in heap (and at least
+	# this many of them), heap is rebuilt without them
+	COMPACT_THRESHOLD = 1024
+	# Upper bounds of jitter histogram buckets, in seconds
+	JITTER_BUCKETS = ( 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.002,
+		0.005, 0.01, 0.02, float("inf") )
 	
 	def __init__(self):
-		self._scheduled = Queue.PriorityQueue()
-		self._next = None
+		self._heap = []					# [ time, generation, task ] lists
+		self._generation = 0
+		self._canceled = 0				# number of dead entries in heap
+		self._incoming = deque()		# tasks scheduled from other threads
+		self._thread = thread.get_ident()
+		self._now = time.time()
+		self._wakeup = None
+		self._timer = None
+		self._armed = None
+		self._jitter = [ 0 ] * len(Scheduler.JITTER_BUCKETS)
+	
+	
+	def enable_precise(self, poller):
+		"""
+		Enables precise mode. Timerfd armed for earliest scheduled task
+		is registered with 'poller' and scheduler runs when it fires.
+		
+		Returns False if timerfd is not available.
+		"""
+		from scc.lib.timerfd import TimerFD, set_timer_slack
+		try:
+			self._timer = TimerFD()
+		except Exception, e:
+			log.warning("Failed to create timerfd, precise mode not available: %s", e)
+			return False
+		set_timer_slack(1000)
+		poller.register(self._timer.fileno(), poller.POLLIN, self._on_timer)
+		self._arm()
+		log.debug("Precise scheduling enabled")
+		return True
+	
+	
+	def _on_timer(self, *a):
+		self._timer.read()
+		self._armed = None
+		self.run()
+	
+	
+	def _arm(self):
+		""" Arms timerfd for earliest task, if it's not armed for it already """
+		entry = self._peek()
+		when = None if entry is None else entry[0]
+		if when != self._armed:
+			self._armed = when
+			self._timer.arm(when)
+	
+	
+	def get_jitter_histogram(self):
+		"""
+		Returns list of (upper_bound, count) tuples, where count is number of
+		tasks executed with delay (from time they were scheduled for)
+		lower than upper_bound seconds.
+		"""
+		return zip(Scheduler.JITTER_BUCKETS, self._jitter)
+	
+	
+	def reset_jitter_histogram(self):
+		self._jitter = [ 0 ] * len(Scheduler.JITTER_BUCKETS)
+	
+	
+	def set_wakeup_callback(self, cb):
+		"""
+		Sets callback called when scheduled task becomes one that should be
+		executed first. Used to interrupt poller that may be waiting
+		for time computed before task was added.
+		"""
+		self._wakeup = cb
+	
+	
+	def update_time(self):
+		"""
+		Updates time that is used as base for newly scheduled tasks.
+		Called by run() and by poller after it wakes up, as mainloop may have
+		been sleeping for a while before callbacks are called.
+		"""
 		self._now = time.time()
 	
 	
+	def _peek(self):
+		""" Returns first live heap entry or None. Drops dead entries on top """
+		if self._incoming:
+			self._push_incoming()
+		heap = self._heap
+		while heap:
+			if heap[0][2] is not None:
+				return heap[0]
+			heappop(heap)
+			self._canceled -= 1
+		return None
+	
+	
+	def get_timeout(self, max_timeout=None):
+		"""
+		Returns number of seconds until next task should be executed,
+		but no more than 'max_timeout'.
+		Returns 'max_timeout' if there is no task scheduled.
+		"""
+		entry = self._peek()
+		if entry is None:
+			return max_timeout
+		timeout = max(0.0, entry[0] - time.time())
+		if max_timeout is not None:
+			return min(timeout, max_timeout)
+		return timeout
+	
+	
+	def _push(self, task):
+		self._generation += 1
+		entry = task._entry = [ task.time, self._generation, task ]
+		heappush(self._heap, entry)
+		return entry
+	
+	
+	def _push_incoming(self):
+		while self._incoming:
+			self._push(self._incoming.popleft())
+	
+	
 	def schedule(self, delay, callback, *data):
 		"""
 		Schedules one-time task to be executed no sooner than after 'delay' of
@@ -29,13 +157,18 @@ class Scheduler(object):
 		
 		Returned Task instance can be used to cancel task once scheduled.
 		"""
-		task = Task(self._now + delay, callback, data)
-		if self._next is None or task.time < self._next.time:
-			if self._next:
-				self._scheduled.put(self._next)
-			self._next = task
-		else:
-			self._scheduled.put(task)
+		task = Task(self._now + delay, callback, data, self)
+		if thread.get_ident() != self._thread:
+			# Heap is not touched from other threads. Task is only queued and
+			# moved to heap by main thread when it's woken up.
+			self._incoming.append(task)
+			if self._wakeup:
+				self._wakeup()
+		elif self._push(task) is self._heap[0]:
+			if self._timer:
+				self._arm()
+			if self._wakeup:
+				self._wakeup()
 		return task
 	
 	
@@ -44,44 +177,69 @@ class Scheduler(object):
 		Returns True if task was sucessfully removed or False if task was
 		already executed or not known at all.
 		
-		Note that this is slow as hell and completly thread-unsafe,
-		so it _has_ to be called on main thread.
+		Has to be called on main thread.
 		"""
-		if task == self._next:
-			self._next = None if self._scheduled.empty() else self._scheduled.get()
-			return True
-		# Fun part: All tasks are removed from PriorityQueue
-		# until correct is found. Then everything is put back
-		tasks, found = [], False
-		while not self._scheduled.empty():
-			t = self._scheduled.get()
-			if t == task:
-				found = True
-				break
-			tasks.append(t)
-		for t in tasks:
-			self._scheduled.put(t)
-		return found
+		entry = task._entry
+		if entry is None or task._scheduler is not self:
+			if task in self._incoming:
+				self._incoming.remove(task)
+				return True
+			return False
+		entry[2] = None
+		task._entry = None
+		self._canceled += 1
+		if (self._canceled > Scheduler.COMPACT_THRESHOLD
+				and self._canceled * 2 > len(self._heap)):
+			self._compact()
+		return True
+	
+	
+	def _compact(self):
+		""" Rebuilds heap without dead entries """
+		self._heap = [ e for e in self._heap if e[2] is not None ]
+		heapify(self._heap)
+		self._canceled = 0
+	
+	
+	def __len__(self):
+		""" Returns number of pending tasks """
+		return len(self._heap) - self._canceled + len(self._incoming)
 	
 	
 	def run(self):
-		self._now = time.time()
-		while self._next and self._now >= self._next.time:
-			callback, data = self._next.callback, self._next.data
-			self._next = None if self._scheduled.empty() else self._scheduled.get()
-			callback(*data)
+		# Only tasks due when run() started are executed. Task rescheduled
+		# by callback is based on same time and so it's not due sooner
+		# than on next run(), even if its delay is shorter than time spent
+		# by callbacks.
+		self._now = now = time.time()
+		jitter = self._jitter
+		while True:
+			entry = self._peek()
+			if entry is None or now < entry[0]:
+				break
+			heappop(self._heap)
+			task = entry[2]
+			task._entry = None
+			late = time.time() - entry[0]
+			jitter[bisect_left(Scheduler.JITTER_BUCKETS, late)] += 1
+			task.callback(*task.data)
+		if self._timer:
+			self._arm()
 
 
 class Task(object):
 	
-	def __init__(self, time, callback, data):
+	def __init__(self, time, callback, data, scheduler=None):
 		self.time = time
 		self.callback = callback
 		self.data = data
+		self._scheduler = scheduler
+		self._entry = None
 	
 	
 	def cancel(self):
-		""" Marks task as canceled, without actually removing it from scheduler """
+		""" Marks task as canceled and removes it from scheduler """
 		self.callback = lambda *a, **b: False
 		self.data = ()
-
+		if self._scheduler and self._entry is not None:
+			self._scheduler.cancel_task(self)
@@ -0,0 +1,185 @@
+#!/usr/bin/env python2
+"""
+SC-Controller - Shared controller state
+
+When input sniffing is enabled, daemon publishes latest input report of
+every controller into memory-mapped file (see get_shared_state_path), so
+OSD and other read-only clients can read state of controller whenever they
+need it, for example once per frame, without asking daemon over socket.
+
+File starts with StateHeader followed by ControllerInput structure laid out
+as in scc/drivers/scc_future.h. Header holds sequence number used as
+seqlock: writer makes it odd before updating input and even again after,
+reader retries if it was odd or changed while input was being copied.
+
+New file is created (and renamed over old one) every time controller
+connects, so readers still having the old one mapped never read past its
+end. Old file is marked as closed instead.
+
+Files left behind by daemon that crashed, or that ran with sniffing enabled
+before, are removed when daemon starts. Header also holds PID of daemon,
+so reader doesn't take file of daemon that is not running for live state.
+"""
+from __future__ import unicode_literals
+from scc.constants import ControllerFlags, INPUT_FIELDS
+from scc.snapshot import InputSnapshot, ZERO_SNAPSHOT
+from scc.snapshot import input_getter, split_stick
+from scc.paths import get_shared_state_path
+
+from ctypes import Structure, c_uint32, sizeof
+import os, mmap, glob, errno, struct, tempfile, logging
+log = logging.getLogger("SharedState")
+
+# Fields of ControllerInput, in order of scc_future.h
+FIELDS = ( "buttons", "ltrig", "rtrig",
+	"stick_x", "stick_y", "lpad_x", "lpad_y", "rpad_x", "rpad_y",
+	"cpad_x", "cpad_y", "dpad_x", "dpad_y", "rstick_x", "rstick_y",
+	"gpitch", "groll", "gyaw", "q1", "q2", "q3", "q4" )
+INPUT = struct.Struct(b"<I2B19h")
+LIMITS = [ (0, 0xFFFFFFFF), (0, 255), (0, 255) ] + [ (-0x8000, 0x7FFF) ] * 19
+# Index in FIELDS for every field in INPUT_FIELDS
+ORDER = [ FIELDS.index(x) for x in INPUT_FIELDS ]
+
+
+class StateHeader(Structure):
+	_fields_ = [
+		('seq', c_uint32),			# odd while input is being written
+		('flags', c_uint32),		# ControllerFlags of controller
+		('closed', c_uint32),		# set when controller is disconnected
+		('pid', c_uint32),			# PID of daemon that publishes state
+	]
+
+HEADER = struct.Struct(b"<4I")
+SIZE = sizeof(StateHeader) + INPUT.size
+
+
+def remove_stale():
+	"""
+	Removes all state files. Called by daemon when it starts, before
+	any controller is connected.
+	"""
+	pattern = get_shared_state_path("*")
+	for path in glob.glob(pattern):
+		try:
+			os.unlink(path)
+			log.debug("Removed stale %s", path)
+		except OSError:
+			pass
+
+
+def _is_running(pid):
+	try:
+		os.kill(pid, 0)
+	except OSError, e:
+		# EPERM means that process exists, but belongs to someone else
+		return e.errno == errno.EPERM
+	return True
+
+
+class SharedState(object):
+	"""
+	Writing side, used by daemon. Instance is set as 'shared_state'
+	of controller and mapper writes every report it gets to it.
+	"""
+	
+	def __init__(self, controller_id, flags):
+		self.path = get_shared_state_path(controller_id)
+		directory = os.path.dirname(self.path)
+		if not os.path.exists(directory):
+			os.makedirs(directory, 0700)
+		# mkstemp creates file readable only by owner
+		fd, tmp = tempfile.mkstemp(dir=directory, suffix=".tmp")
+		try:
+			os.ftruncate(fd, SIZE)
+			self._mmap = mmap.mmap(fd, SIZE)
+			self._inode = os.fstat(fd).st_ino
+			os.rename(tmp, self.path)
+		except:
+			os.unlink(tmp)
+			raise
+		finally:
+			os.close(fd)
+		self.header = StateHeader.from_buffer(self._mmap)
+		self.header.flags = flags
+		self.header.pid = os.getpid()
+		self._getters = {}			# report type -> function returning values
+	
+	
+	def write(self, state):
+		""" Publishes input report """
+		cls = state.__class__
+		if cls not in self._getters:
+			self._getters[cls] = input_getter(cls, FIELDS)
+		values = self._getters[cls](state)
+		h = self.header
+		h.seq += 1
+		try:
+			INPUT.pack_into(self._mmap, sizeof(StateHeader), *values)
+		except struct.error:
+			INPUT.pack_into(self._mmap, sizeof(StateHeader), *[
+				max(low, min(high, int(value)))
+				for ((low, high), value) in zip(LIMITS, values) ])
+		h.seq += 1
+	
+	
+	def close(self):
+		""" Marks state as closed and removes file, unless it was replaced """
+		self.header.closed = 1
+		try:
+			if os.stat(self.path).st_ino == self._inode:
+				os.unlink(self.path)
+		except OSError:
+			pass
+
+
+class SharedStateReader(object):
+	"""
+	Reading side. Raises OSError if state of controller with given ID
+	is not published or if daemon that published it is not running.
+	"""
+	# How many times read is retried while writer is updating state
+	MAX_TRIES = 100
+	
+	def __init__(self, controller_id):
+		fd = os.open(get_shared_state_path(controller_id), os.O_RDONLY)
+		try:
+			self._mmap = mmap.mmap(fd, SIZE, mmap.MAP_SHARED, mmap.PROT_READ)
+		finally:
+			os.close(fd)
+		seq, flags, closed, pid = HEADER.unpack_from(self._mmap)
+		if closed or not _is_running(pid):
+			self._mmap.close()
+			raise OSError(errno.ESTALE, "State is not published anymore")
+		self._seq = None
+		self.last = ZERO_SNAPSHOT
+	
+	
+	def read(self):
+		"""
+		Returns InputSnapshot with latest state of controller or None
+		if controller was disconnected or daemon exited since.
+		"""
+		for i in xrange(0, SharedStateReader.MAX_TRIES):
+			seq, flags, closed, pid = HEADER.unpack_from(self._mmap)
+			if closed:
+				return None
+			if seq == self._seq:
+				# Nothing written since last read. Daemon may have died
+				# without closing state, in which case nothing ever will be
+				if not _is_running(pid):
+					return None
+				return self.last
+			if seq & 1:
+				continue
+			values = INPUT.unpack_from(self._mmap, sizeof(StateHeader))
+			if HEADER.unpack_from(self._mmap)[0] == seq:
+				break
+		else:
+			# Writer keeps updating state all the time
+			return self.last
+		self._seq = seq
+		values = [ values[i] for i in ORDER ]
+		if not flags & ControllerFlags.SEPARATE_STICK:
+			split_stick(values, self.last)
+		self.last = InputSnapshot._make(values)
+		return self.last
@@ -0,0 +1,147 @@
+#!/usr/bin/env python2
+"""
+SC-Controller - Input snapshots
+
+Compact binary encoding of controller state, sent by daemon to clients that
+used 'Subscribe:' message instead of observing inputs one by one.
+
+Snapshot is sent as 'Snapshot: <controller_id> <length>' line followed by
+<length> bytes of data: 32bit mask of fields changed since last snapshot
+sent to same client, followed by new value of every such field in order of
+INPUT_FIELDS. Buttons are sent as unsigned 64bit number, everything else
+as signed 32bit number, all little-endian. First snapshot has all fields set.
+
+Steam Controller reports stick and left pad on same axes. Encoder splits
+them the same way as mapper does, so stick_x, stick_y, lpad_x and lpad_y
+always mean what they say, and LPAD button is replaced by STICKPRESS when
+pad is not touched.
+"""
+from __future__ import unicode_literals
+from scc.constants import SCButtons, STICKTILT, INPUT_FIELDS
+
+from collections import namedtuple
+from operator import attrgetter, itemgetter
+import struct
+
+InputSnapshot = namedtuple("InputSnapshot", INPUT_FIELDS)
+ZERO_SNAPSHOT = InputSnapshot(*[ 0 ] * len(INPUT_FIELDS))
+FULL_MASK = (1 << len(INPUT_FIELDS)) - 1
+FORMATS = [ b"Q" if x == "buttons" else b"i" for x in INPUT_FIELDS ]
+
+STICK_X, PAD_X = INPUT_FIELDS.index("stick_x"), INPUT_FIELDS.index("lpad_x")
+_structs = {}		# mask -> struct.Struct
+
+
+def _struct(mask):
+	""" Returns (cached) Struct used to pack mask and fields selected by it """
+	if mask not in _structs:
+		_structs[mask] = struct.Struct(b"<I" + b"".join(
+			FORMATS[i] for i in xrange(0, len(INPUT_FIELDS))
+			if mask & (1 << i)))
+	return _structs[mask]
+
+
+def input_getter(cls, fields=INPUT_FIELDS):
+	"""
+	Returns function that returns sequence of values of given fields
+	of input report of given type. Fields report doesn't have are zero.
+	"""
+	if issubclass(cls, tuple) and hasattr(cls, "_fields"):
+		# namedtuple; missing fields are taken from zero appended to it
+		get = itemgetter(*[ cls._fields.index(x) if x in cls._fields
+			else len(cls._fields) for x in fields ])
+		return lambda state: get(state + (0,))
+	names = [ x for x in fields if hasattr(cls, x) ]
+	get = attrgetter(*names)
+	if len(names) == len(fields):
+		return get
+	indexes = [ fields.index(x) for x in names ]
+	def getter(state):
+		rv = [ 0 ] * len(fields)
+		for i, value in zip(indexes, get(state)):
+			rv[i] = value
+		return rv
+	return getter
+
+
+def split_stick(values, last):
+	"""
+	Splits stick and left pad reported on same axes, the same way as
+	mapper does. 'values' is list of INPUT_FIELDS values and is modified
+	in place, 'last' are values returned for previous report.
+	"""
+	buttons = values[0]
+	if buttons & SCButtons.LPAD and not buttons & (SCButtons.LPADTOUCH | STICKTILT):
+		buttons = (buttons & ~SCButtons.LPAD) | SCButtons.STICKPRESS
+	if buttons & STICKTILT:
+		# Stick used while pad is touched; values belong to stick
+		pad = last[PAD_X:PAD_X+2] if buttons & SCButtons.LPADTOUCH else [ 0, 0 ]
+		stick = values[PAD_X:PAD_X+2]
+	elif buttons & SCButtons.LPADTOUCH:
+		pad, stick = values[PAD_X:PAD_X+2], [ 0, 0 ]
+	else:
+		pad, stick = [ 0, 0 ], values[PAD_X:PAD_X+2]
+	values[0] = buttons & ~STICKTILT
+	values[STICK_X:STICK_X+2] = stick
+	values[PAD_X:PAD_X+2] = pad
+
+
+class SnapshotEncoder(object):
+	""" Remembers last snapshot sent and encodes only what changed since """
+	
+	def __init__(self, separate_stick=True):
+		self.separate_stick = separate_stick
+		self.last = None
+	
+	
+	def reset(self):
+		""" Makes next snapshot contain all fields """
+		self.last = None
+	
+	
+	def _values(self, state):
+		values = [ int(getattr(state, x, 0)) for x in INPUT_FIELDS ]
+		if not self.separate_stick:
+			split_stick(values, self.last or ZERO_SNAPSHOT)
+		return values
+	
+	
+	def encode(self, state):
+		"""
+		Returns snapshot of given controller state as string or None
+		if nothing changed since last one.
+		"""
+		values = self._values(state)
+		if self.last is None:
+			mask = FULL_MASK
+		else:
+			mask = 0
+			for i, (a, b) in enumerate(zip(self.last, values)):
+				if a != b:
+					mask |= 1 << i
+			if mask == 0:
+				return None
+		self.last = values
+		return _struct(mask).pack(mask, *[ values[i]
+			for i in xrange(0, len(values)) if mask & (1 << i) ])
+
+
+class SnapshotDecoder(object):
+	""" Applies received snapshots to locally kept InputSnapshot """
+	
+	def __init__(self):
+		self.state = ZERO_SNAPSHOT
+	
+	
+	def decode(self, data):
+		"""
+		Updates self.state with received snapshot.
+		Returns list of names of changed fields.
+		"""
+		mask, = struct.unpack_from(b"<I", data)
+		indexes = [ i for i in xrange(0, len(INPUT_FIELDS)) if mask & (1 << i) ]
+		values = list(self.state)
+		for i, value in zip(indexes, _struct(mask).unpack(data)[1:]):
+			values[i] = value
+		self.state = InputSnapshot._make(values)
+		return [ INPUT_FIELDS[i] for i in indexes ]
@@ -0,0 +1,315 @@
+#!/usr/bin/env python2
+"""
+SC-Controller - Daemon - Hot path instrumentation
+
+Measures time spent in stages of input processing and aggregates it into
+fixed-bucket histograms, separately for every controller. Enabled, disabled
+and dumped using 'Stats:' messages sent to daemon (see docs/protocol.md).
+
+Nothing is measured by default. Instrumentation is enabled by replacing
+methods of Mapper, Scheduler, virtual devices, controllers and top-level
+profile actions with timing wrappers, stored as instance attributes.
+Disabling removes those attributes again, so there is no cost when it's off.
+
+Measured stages:
+ - receive			- everything driver does with received input, including
+					  stages below. Listed in Controller.STATS_STAGES, as
+					  'decode' is, where driver decodes input separately
+ - input			- whole Mapper.input call
+ - scheduler		- Scheduler.run, including scheduled actions
+ - generate_events, sync, generate_feedback - respective Mapper methods
+ - A.button_press, LT.trigger, RPAD.whole, ... - top-level profile actions
+"""
+from __future__ import unicode_literals
+from scc.constants import SCButtons, LEFT, RIGHT, CPAD, DPAD, STICK, RSTICK, GYRO
+from scc.uinput import Dummy
+from bisect import bisect_left
+import time, logging
+log = logging.getLogger("Stats")
+
+# Upper bounds of histogram buckets, in microseconds
+BUCKETS = ( 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000,
+	float("inf") )
+MAPPER_STAGES = ( "input", "generate_events", "sync", "generate_feedback" )
+PADS = ( (LEFT, "LPAD"), (RIGHT, "RPAD"), (CPAD, CPAD), (DPAD, DPAD) )
+
+
+class Histogram(object):
+
+	def __init__(self):
+		self.reset()
+	
+	
+	def reset(self):
+		# Cleared in place, as timing wrappers keep reference to histogram
+		self.counts = [ 0 ] * len(BUCKETS)
+		self.count = 0
+		self.total = 0.0
+		self.max = 0.0
+	
+	
+	def add(self, us):
+		self.counts[bisect_left(BUCKETS, us)] += 1
+		self.count += 1
+		self.total += us
+		if us > self.max:
+			self.max = us
+	
+	
+	def to_dict(self):
+		# Bucket bounds are same for all histograms and dumped only once
+		return {
+			'counts' : self.counts,
+			'count' : self.count,
+			'avg' : self.total / self.count if self.count else 0.0,
+			'max' : self.max,
+		}
+
+
+class ControllerStats(object):
+	""" Everything measured for single controller (mapper) """
+	
+	def __init__(self, mapper):
+		self.mapper = mapper
+		self.controller = mapper.get_controller()
+		self.stages = {}
+		self.actions = []			# (action, method name) tuples patched for this mapper
+		self.reset()
+	
+	
+	def reset(self):
+		for h in self.stages.values():
+			h.reset()
+		self.reports = 0
+		self.events = 0
+		self.start = time.time()
+		# Counters kept by controller all the time; Only difference is reported
+		self._coalesced = getattr(self.controller, "coalesced_reports", 0)
+		self._dropped = getattr(self.controller, "dropped_reports", 0)
+	
+	
+	def get(self, stage):
+		if stage not in self.stages:
+			self.stages[stage] = Histogram()
+		return self.stages[stage]
+	
+	
+	def to_dict(self):
+		t = max(0.001, time.time() - self.start)
+		return {
+			'type' : self.controller.get_type() if self.controller else None,
+			'time' : t,
+			'reports' : self.reports,
+			'reports_per_second' : self.reports / t,
+			'events' : self.events,
+			'events_per_second' : self.events / t,
+			'coalesced' : getattr(self.controller, "coalesced_reports", 0) - self._coalesced,
+			'dropped' : getattr(self.controller, "dropped_reports", 0) - self._dropped,
+			'stages' : { name : h.to_dict() for (name, h) in self.stages.items()
+				if h.count },
+		}
+
+
+class Instrumentation(object):
+
+	def __init__(self, scheduler):
+		self.scheduler = scheduler
+		self.enabled = False
+		self._stats = {}			# mapper -> ControllerStats
+		self._patched = []			# (object, attribute) tuples
+		self._scheduler_hist = Histogram()
+		self._backlog, self._max_backlog = 0, 0
+		# Stats of controller whose input is being processed. Used to account
+		# time spent by Scheduler.run when it's called from Mapper.input
+		self._current = None
+	
+	
+	def enable(self, mappers):
+		""" Starts measuring, for every mapper in 'mappers' """
+		if self.enabled:
+			return
+		self.enabled = True
+		self._scheduler_hist.reset()
+		self._patch(self.scheduler, "run", self._time_scheduler(self.scheduler.run))
+		for mapper in mappers:
+			self.attach(mapper)
+		log.info("Instrumentation enabled")
+	
+	
+	def disable(self):
+		""" Stops measuring and removes all wrappers """
+		if not self.enabled:
+			return
+		for mapper in list(self._stats):
+			self.detach(mapper)
+		for obj, name in self._patched:
+			obj.__dict__.pop(name, None)
+		self._patched = []
+		self._current = None
+		self.enabled = False
+		log.info("Instrumentation disabled")
+	
+	
+	def reset(self):
+		""" Clears everything measured so far """
+		for stats in self._stats.values():
+			stats.reset()
+		self._scheduler_hist.reset()
+		self._max_backlog = self._backlog
+	
+	
+	def attach(self, mapper):
+		""" Starts measuring input handled by given mapper """
+		if not self.enabled or mapper in self._stats:
+			return
+		stats = self._stats[mapper] = ControllerStats(mapper)
+		for name in MAPPER_STAGES:
+			if not hasattr(mapper, name):
+				# WorkerMapper (see scc/worker.py) has only 'input', which
+				# measures handing report over to worker process
+				continue
+			self._patch(mapper, name, self._time_stage(stats, name,
+				getattr(mapper, name), name == "input"))
+		for dev in (mapper.keyboard, mapper.mouse, mapper.gamepad):
+			if not isinstance(dev, Dummy):
+				self._patch(dev, "flush", self._count_events(stats, dev))
+		c = stats.controller
+		if c:
+			for stage, name in c.STATS_STAGES.items():
+				self._patch(c, name, self._time_stage(stats, stage,
+					getattr(c, name)))
+		self._patch_actions(mapper)
+		mapper.add_profile_listener(self._patch_actions)
+	
+	
+	def detach(self, mapper):
+		""" Stops measuring input handled by given mapper and drops its stats """
+		stats = self._stats.pop(mapper, None)
+		if stats is None:
+			return
+		mapper.remove_profile_listener(self._patch_actions)
+		self._unpatch_actions(stats)
+		owned = set([ id(mapper), id(stats.controller),
+			id(mapper.keyboard), id(mapper.mouse), id(mapper.gamepad) ])
+		for obj, name in self._patched:
+			if id(obj) in owned:
+				obj.__dict__.pop(name, None)
+		self._patched = [ x for x in self._patched if id(x[0]) not in owned ]
+		if self._current is stats:
+			self._current = None
+	
+	
+	def dump(self):
+		""" Returns everything measured so far as dict serializable to JSON """
+		return {
+			'enabled' : self.enabled,
+			# Last bucket is unbounded, 'null' stands for infinity in JSON
+			'buckets' : [ None if b == BUCKETS[-1] else b for b in BUCKETS ],
+			'scheduler' : {
+				'run' : self._scheduler_hist.to_dict(),
+				'backlog' : self._backlog,
+				'max_backlog' : self._max_backlog,
+			},
+			'controllers' : {
+				(str(s.controller.get_id()) if s.controller else "-") : s.to_dict()
+				for s in self._stats.values()
+			},
+		}
+	
+	
+	def _patch(self, obj, name, wrapper):
+		setattr(obj, name, wrapper)
+		self._patched.append((obj, name))
+	
+	
+	def _time_stage(self, stats, stage, method, is_input=False):
+		hist = stats.get(stage)
+		def wrapper(*a, **b):
+			start = time.time()
+			try:
+				return method(*a, **b)
+			finally:
+				hist.add((time.time() - start) * 1000000.0)
+		
+		def input_wrapper(*a, **b):
+			stats.reports += 1
+			self._current = stats
+			try:
+				return wrapper(*a, **b)
+			finally:
+				self._current = None
+		
+		return input_wrapper if is_input else wrapper
+	
+	
+	def _time_scheduler(self, run):
+		def wrapper():
+			# Backlog is measured before run, as that's when tasks are waiting
+			self._backlog = len(self.scheduler)
+			if self._backlog > self._max_backlog:
+				self._max_backlog = self._backlog
+			start = time.time()
+			try:
+				return run()
+			finally:
+				us = (time.time() - start) * 1000000.0
+				self._scheduler_hist.add(us)
+				if self._current:
+					self._current.get("scheduler").add(us)
+		return wrapper
+	
+	
+	def _count_events(self, stats, dev):
+		flush = dev.flush
+		def wrapper():
+			stats.events += dev._event_count
+			return flush()
+		return wrapper
+	
+	
+	def _patch_actions(self, mapper):
+		"""
+		Wraps methods of top-level actions in mapper's profile.
+		Called again (as profile listener) when profile changes.
+		"""
+		stats = self._stats.get(mapper)
+		if stats is None:
+			return
+		self._unpatch_actions(stats)
+		p = mapper.profile
+		for b in p.buttons:
+			name = b.name if isinstance(b, SCButtons) else str(b)
+			self._patch_action(stats, p.buttons[b], name, "button_press")
+			self._patch_action(stats, p.buttons[b], name, "button_release")
+		for side, what in ((LEFT, "LT"), (RIGHT, "RT")):
+			if side in p.triggers:
+				self._patch_action(stats, p.triggers[side], what, "trigger")
+		for side, what in PADS:
+			if side in p.pads:
+				self._patch_action(stats, p.pads[side], what, "whole")
+		self._patch_action(stats, p.stick, STICK, "whole")
+		self._patch_action(stats, p.rstick, RSTICK, "whole")
+		self._patch_action(stats, p.gyro, GYRO, "gyro")
+	
+	
+	def _patch_action(self, stats, action, what, method):
+		# NoAction is false-ish and there is nothing to measure on it.
+		# Action that is already wrapped is used on more places in profile
+		if not action or method in action.__dict__:
+			return
+		hist = stats.get("%s.%s" % (what, method))
+		original = getattr(action, method)
+		def wrapper(*a, **b):
+			start = time.time()
+			try:
+				return original(*a, **b)
+			finally:
+				hist.add((time.time() - start) * 1000000.0)
+		setattr(action, method, wrapper)
+		stats.actions.append((action, method))
+	
+	
+	def _unpatch_actions(self, stats):
+		for action, method in stats.actions:
+			action.__dict__.pop(method, None)
+		stats.actions = []
@@ -32,21 +32,48 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
 
 #pragma GCC diagnostic ignored "-Wunused-result"
-#define UNPUT_MODULE_VERSION 9
+#define UNPUT_MODULE_VERSION 13
 #define MAX_FF_EVENTS 4
+#define MAX_FF_READ 32					// input_events read at once
+
+#define FF_MAX_DURATION		10000		// Longest command sent to controller, in ms
+#define FF_RENDER_INTERVAL	10			// How often is changing effect rendered, in ms
+#define FF_NEVER			UINT64_MAX
+
+#ifndef REL_WHEEL_HI_RES
+#define REL_WHEEL_HI_RES	0x0b
+#define REL_HWHEEL_HI_RES	0x0c
+#endif
+#define HI_RES_PER_NOTCH	120			// REL_WHEEL_HI_RES units per one REL_WHEEL
+
+struct mouse_accumulator {
+	double scale[4];		// REL_X, REL_Y, horizontal and vertical scroll
+	double acc[4];			// fractions not emitted yet, scroll in hi-res units
+	int32_t notches[2];		// hi-res units not emitted as REL_HWHEEL / REL_WHEEL yet
+};
 
-#define INFINITE_RUMBLE		10000		// Not really infinite, but longer than controller can handle
-
-struct feedback_effect {
+struct ff_slot {
 	bool in_use;
-	bool continuous_rumble;
-	int32_t duration;
-	int32_t delay;
-	int32_t repetitions;
-	uint16_t type;
-	int16_t level;
+	struct ff_effect effect;
+	int32_t repetitions;	// how many times it should be played yet. 0 = not playing
+	uint64_t play_start;	// when current repetition starts (after delay)
+};
+
+struct ff_engine {
+	// Following is read by python
+	bool changed;			// set if controller should get new command
+	int32_t level;			// amplitude, 0 to 0x7FFF
+	int32_t duration;		// for how long is level valid, in ms
+	int32_t next_update;	// ms until uinput_ff_update should be called again, -1 if not needed
+	// Internal
+	uint16_t gain;
+	int32_t sent_level;
+	uint64_t sent_until;
+	struct ff_slot effects[MAX_FF_EVENTS];
 };
 
 int uinput_init(
@@ -222,6 +249,86 @@ void uinput_scan(int fd, __s32 val)
 	write(fd, &ev, sizeof(ev));
 }
 
+/**
+ * Writes 'count' of already prepared events with single write() call.
+ * Caller is responsible for terminating batch with EV_SYN / SYN_REPORT event.
+ *
+ * Returns number of events written or -1 on failure.
+ */
+int uinput_write_events(int fd, struct input_event* events, int count)
+{
+	ssize_t r;
+	if (count <= 0)
+		return 0;
+	r = write(fd, events, sizeof(struct input_event) * count);
+	if (r < 0)
+		return -1;
+	return r / sizeof(struct input_event);
+}
+
+static inline int mouse_emit(struct input_event* ev, __u16 code, double* acc) {
+	int32_t value = (int32_t)*acc;
+	if (value == 0)
+		return 0;
+	*acc -= value;
+	memset(ev, 0, sizeof(struct input_event));
+	ev->type = EV_REL;
+	ev->code = code;
+	ev->value = value;
+	return 1;
+}
+
+/**
+ * As it always was, legacy wheel events are limited to one notch per frame
+ * and anything above that is thrown away. Only high resolution events
+ * carry full amount of scrolling.
+ */
+static inline int mouse_emit_notches(struct input_event* ev, __u16 code, int32_t* notches) {
+	int32_t value = *notches / HI_RES_PER_NOTCH;
+	if (value == 0)
+		return 0;
+	*notches -= value * HI_RES_PER_NOTCH;
+	memset(ev, 0, sizeof(struct input_event));
+	ev->type = EV_REL;
+	ev->code = code;
+	ev->value = (value > 0) ? 1 : -1;
+	return 1;
+}
+
+/**
+ * Adds scaled movement to accumulator and stores events for its integer
+ * part into 'events', which has to have room for at least 4 events.
+ * If 'scroll' is set, movement is converted to REL_(H)WHEEL_HI_RES
+ * events, with REL_(H)WHEEL generated every HI_RES_PER_NOTCH units,
+ * but never more than one notch per call.
+ *
+ * Returns number of events stored.
+ */
+int uinput_mouse_accumulate(struct mouse_accumulator* a, bool scroll, double dx, double dy, struct input_event* events)
+{
+	int n = 0;
+	if (!scroll) {
+		a->acc[0] += dx * a->scale[0];
+		a->acc[1] += dy * a->scale[1];
+		n += mouse_emit(&events[n], REL_X, &a->acc[0]);
+		n += mouse_emit(&events[n], REL_Y, &a->acc[1]);
+		return n;
+	}
+	a->acc[2] += dx * a->scale[2] * HI_RES_PER_NOTCH;
+	a->acc[3] += dy * a->scale[3] * HI_RES_PER_NOTCH;
+	if (mouse_emit(&events[n], REL_HWHEEL_HI_RES, &a->acc[2])) {
+		a->notches[0] += events[n].value;
+		n ++;
+		n += mouse_emit_notches(&events[n], REL_HWHEEL, &a->notches[0]);
+	}
+	if (mouse_emit(&events[n], REL_WHEEL_HI_RES, &a->acc[3])) {
+		a->notches[1] += events[n].value;
+		n ++;
+		n += mouse_emit_notches(&events[n], REL_WHEEL, &a->notches[1]);
+	}
+	return n;
+}
+
 void uinput_set_delay_period(int fd, __s32 delay, __s32 period)
 {
 	struct input_event ev;
@@ -250,183 +357,283 @@ void uinput_syn(int fd)
 // #define RUMBLE_DEBUG(...) do { printf(__VA_ARGS__); } while (0)
 #define RUMBLE_DEBUG(...) do { } while (0)
 
-int uinput_ff_read(int fd, int ff_effects_max, struct feedback_effect** ff_effects) {
-	static struct uinput_ff_upload upload;
-	static struct uinput_ff_erase erase;
-	static struct input_event event;
-	int n = read(fd, &event, sizeof(event));
-	int rv = -1;
+/**
+ * Force feedback engine.
+ *
+ * Uploaded effects are kept in table and every request waiting on uinput
+ * device is processed by single uinput_ff_update call. Effects that are
+ * playing are then rendered into single amplitude, together with time for
+ * how long it stays same. Controller should be sent new command only when
+ * uinput_ff_update says so, that is when amplitude changes or when command
+ * sent last time is about to run out.
+ */
+
+static uint64_t ff_time_ms(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+static void ff_upload(int fd, struct ff_engine* e, int32_t request_id, uint64_t now) {
+	struct uinput_ff_upload upload;
+	struct ff_slot* slot;
 	int eid;
-	if (n == sizeof(struct input_event)) {
-		switch (event.type) {
-			case EV_UINPUT:
-				switch (event.code) {
-					case UI_FF_UPLOAD:
-						memset(&upload, 0, sizeof(struct uinput_ff_upload));
-						upload.request_id = event.value;
-						ioctl(fd, UI_BEGIN_FF_UPLOAD, &upload);
-						
-						upload.effect.id = -1;
-						if ((upload.old.type != 0) && (upload.old.id >= 0) && (upload.old.id < ff_effects_max) && (ff_effects[upload.old.id]->in_use)) {
-							// Updating old effect
-							eid = upload.effect.id = upload.old.id;
-							ff_effects[eid]->in_use = true;
-							RUMBLE_DEBUG("Updated effect id %i\n", upload.effect.id);
-						} else if (upload.old.type == 0) {
-							// Generating new effect
-							for (eid=0; eid<ff_effects_max; eid++) {
-								if (!ff_effects[eid]->in_use) {
-									ff_effects[eid]->in_use = true;
-									upload.effect.id = eid;
-									RUMBLE_DEBUG("Generated new effect id %i\n", upload.effect.id);
-									break;
-								}
-							}
-						}
-						
-						if (upload.effect.id >= 0) {
-							int32_t avg;
-							eid = upload.effect.id;
-							ff_effects[eid]->duration = upload.effect.replay.length;
-							ff_effects[eid]->delay = upload.effect.replay.delay;
-							ff_effects[eid]->repetitions = 0;
-							ff_effects[eid]->type = upload.effect.type;
-							ff_effects[eid]->level = 0x4FFF;
-							// This part converts all possible event types to one that
-							// SCC and controller really supports. Only output level is used.
-							switch (upload.effect.type) {
-								case FF_CONSTANT:
-									ff_effects[eid]->level = upload.effect.u.constant.level;
-									RUMBLE_DEBUG("FF_CONSTANT [%i] %i\n", eid, ff_effects[eid]->level);
-									break;
-								case FF_PERIODIC:
-									RUMBLE_DEBUG("FF_PERIODIC [%i] %i %i %i %i %i length %i\n",
-										eid,
-										upload.effect.u.periodic.waveform,
-										upload.effect.u.periodic.period,
-										upload.effect.u.periodic.magnitude,
-										upload.effect.u.periodic.offset,
-										upload.effect.u.periodic.phase,
-										ff_effects[eid]->duration
-									);
-									ff_effects[eid]->level = upload.effect.u.periodic.magnitude;
-									break;
-								case FF_RAMP:
-									ff_effects[eid]->level = upload.effect.u.ramp.start_level;
-									RUMBLE_DEBUG("FF_RAMP [%i] %i\n", eid, ff_effects[eid]->level);
-									break;
-								case FF_RUMBLE:
-									RUMBLE_DEBUG("FF_RUMBLE [%i] %i %i\n",
-										eid,
-										upload.effect.u.rumble.strong_magnitude,
-										upload.effect.u.rumble.weak_magnitude
-									);
-									avg = upload.effect.u.rumble.strong_magnitude / 3 +
-										upload.effect.u.rumble.weak_magnitude / 6;
-									ff_effects[eid]->level = (int32_t)MIN(avg, 0x7FFF);
-									if (ff_effects[eid]->continuous_rumble) {
-										// See comment in case EV_FF: block
-										ff_effects[eid]->duration = INFINITE_RUMBLE;
-										ff_effects[eid]->repetitions = 1;
-										rv = eid;
-										RUMBLE_DEBUG("FF_PLAY_RUMBLE -> %i\n", eid);
-									}
-									break;
-								case FF_FRICTION:
-									RUMBLE_DEBUG("FF_FRICTION [%i] \n", eid);
-									ff_effects[eid]->level = 0x7FFF;
-									break;
-								case FF_DAMPER:
-									RUMBLE_DEBUG("FF_DAMPER [%i] \n", eid);
-									ff_effects[eid]->level = 0x7FFF;
-									break;
-								case FF_INERTIA:
-									RUMBLE_DEBUG("FF_INERTIA [%i] \n", eid);
-									ff_effects[eid]->level = 0x7FFF;
-									break;
-								case FF_SPRING:
-									RUMBLE_DEBUG("FF_SPRING [%i] \n", eid);
-									ff_effects[eid]->level = 0x7FFF;
-									break;
-								case FF_CUSTOM:
-									RUMBLE_DEBUG("FF_CUSTOM [%i] \n", eid);
-									ff_effects[eid]->level = 0x7FFF;
-									break;
-							}
-							
-							upload.retval = 0;
-						} else {
-							// Upload failed
-							RUMBLE_DEBUG("Cannot create more effects!\n");
-							upload.retval = -1;
-						}
-						
-						ioctl(fd, UI_END_FF_UPLOAD, &upload);
-						break;
-					case UI_FF_ERASE:
-						memset(&erase, 0, sizeof(struct uinput_ff_erase));
-						erase.request_id = event.value;
-						ioctl(fd, UI_BEGIN_FF_ERASE, &erase);
-						if ((erase.effect_id >= 0) && (erase.effect_id < ff_effects_max)) {
-							ff_effects[erase.effect_id]->in_use = false;
-						}
-						RUMBLE_DEBUG("Erased effect id %i\n", upload.effect.id);
-						ioctl(fd, UI_END_FF_ERASE, &erase);
-						break;
-					default:
-						break;
-				}
-				break;
-			case EV_FF:
-				switch (event.code) {
-					case FF_GAIN:
-						RUMBLE_DEBUG("FF_GAIN\n");
-						break;
-					case FF_AUTOCENTER:
-						// TODO: Maybe support theese?
-						RUMBLE_DEBUG("FF_AUTOCENTER\n");
-						break;
-					default:
-						if ((event.code >= 0) && (event.code < ff_effects_max)) {
-							if (ff_effects[event.code]->in_use) {
-								rv = event.code;
-								ff_effects[rv]->repetitions = event.value;
-								if ( (ff_effects[rv]->type == FF_RUMBLE) && (ff_effects[rv]->duration == 0) ) {
-									// With FF_RUMBLE, duration of zero means infinite duration
-									ff_effects[rv]->duration = INFINITE_RUMBLE;
-								}
-								if ( (ff_effects[rv]->type == FF_RUMBLE) && (event.value > 0) && ( (ff_effects[rv]->duration >= INFINITE_RUMBLE) || (event.value > 1) )) {
-									// continuous_rumble is special kind of effect used by some games.
-									// This event is "played" infinitelly, but with zero amplitide and whenever actual rumble is
-									// supposed to play, effect properties are updated on the fly.
-									if (!ff_effects[rv]->continuous_rumble) {
-										ff_effects[rv]->continuous_rumble = true;
-										RUMBLE_DEBUG("CONTINUOUS RUMBLE enabled on %i\n", rv);
-									}
-								} else if (ff_effects[rv]->continuous_rumble) {
-									RUMBLE_DEBUG("CONTINUOUS RUMBLE disabled on %i\n", rv);
-									ff_effects[rv]->continuous_rumble = false;
-								}
-								RUMBLE_DEBUG("FF_PLAY -> %i (type %i, lvl %i, dur. %i, reps. %i)\n", event.code,
-									ff_effects[rv]->type, ff_effects[rv]->level, ff_effects[rv]->duration,
-									ff_effects[rv]->repetitions, event.value);
-							} else {
-								// SDL uses this to turn rumble off - fake event
-								// is generated here to achieve same effect
-								rv = event.code;
-								ff_effects[rv]->level = 0;
-								ff_effects[rv]->repetitions = 0;
-								ff_effects[rv]->duration = 0;
-								RUMBLE_DEBUG("FF NOT IN USE! %i\n", event.code);
-							}
-						}
-				}
-				break;
-			default:
+	memset(&upload, 0, sizeof(struct uinput_ff_upload));
+	upload.request_id = request_id;
+	ioctl(fd, UI_BEGIN_FF_UPLOAD, &upload);
+	
+	upload.effect.id = -1;
+	if ((upload.old.type != 0) && (upload.old.id >= 0) && (upload.old.id < MAX_FF_EVENTS) && (e->effects[upload.old.id].in_use)) {
+		// Updating old effect
+		upload.effect.id = upload.old.id;
+		RUMBLE_DEBUG("Updated effect id %i\n", upload.effect.id);
+	} else if (upload.old.type == 0) {
+		// Generating new effect
+		for (eid=0; eid<MAX_FF_EVENTS; eid++) {
+			if (!e->effects[eid].in_use) {
+				upload.effect.id = eid;
+				RUMBLE_DEBUG("Generated new effect id %i\n", upload.effect.id);
 				break;
+			}
+		}
+	}
+	
+	if (upload.effect.id >= 0) {
+		slot = &e->effects[upload.effect.id];
+		slot->in_use = true;
+		memcpy(&slot->effect, &upload.effect, sizeof(struct ff_effect));
+		if (slot->repetitions > 0) {
+			// Effect updated while playing starts again with new parameters.
+			// Some games play single rumble effect forever and only update
+			// its magnitude.
+			slot->play_start = now + slot->effect.replay.delay;
+		}
+		RUMBLE_DEBUG("Uploaded effect %i type %i length %i\n", upload.effect.id,
+				slot->effect.type, slot->effect.replay.length);
+		upload.retval = 0;
+	} else {
+		RUMBLE_DEBUG("Cannot create more effects!\n");
+		upload.retval = -1;
+	}
+	ioctl(fd, UI_END_FF_UPLOAD, &upload);
+}
+
+static void ff_erase(int fd, struct ff_engine* e, int32_t request_id) {
+	struct uinput_ff_erase erase;
+	memset(&erase, 0, sizeof(struct uinput_ff_erase));
+	erase.request_id = request_id;
+	ioctl(fd, UI_BEGIN_FF_ERASE, &erase);
+	if ((erase.effect_id >= 0) && (erase.effect_id < MAX_FF_EVENTS)) {
+		e->effects[erase.effect_id].in_use = false;
+		e->effects[erase.effect_id].repetitions = 0;
+	}
+	RUMBLE_DEBUG("Erased effect id %i\n", erase.effect_id);
+	erase.retval = 0;
+	ioctl(fd, UI_END_FF_ERASE, &erase);
+}
+
+static void ff_play(struct ff_engine* e, uint16_t code, int32_t value, uint64_t now) {
+	if (code == FF_GAIN) {
+		e->gain = value & 0xFFFF;
+		RUMBLE_DEBUG("FF_GAIN %i\n", e->gain);
+	} else if (code < MAX_FF_EVENTS) {
+		// Playing effect that is not uploaded is used by SDL to turn
+		// rumble off; there is nothing playing in that case anyway
+		struct ff_slot* slot = &e->effects[code];
+		if (slot->in_use) {
+			slot->repetitions = (value > 0) ? value : 0;
+			slot->play_start = now + slot->effect.replay.delay;
+			RUMBLE_DEBUG("FF_PLAY %i x%i\n", code, value);
+		}
+	}
+	// FF_AUTOCENTER is not supported
+}
+
+/**
+ * Applies envelope to level of effect that is playing for 't' ms.
+ * Lowers 'next' to time when result changes, if it changes sooner.
+ */
+static int32_t ff_envelope(const struct ff_envelope* env, int32_t level, uint64_t t, uint64_t length, uint64_t* next) {
+	int32_t abs_level = (level < 0) ? -level : level;
+	if ((env->attack_length > 0) && (t < env->attack_length)) {
+		*next = MIN(*next, MIN(FF_RENDER_INTERVAL, env->attack_length - t));
+		return env->attack_level + (abs_level - (int32_t)env->attack_level)
+				* (int64_t)t / env->attack_length;
+	}
+	if ((env->fade_length > 0) && (length > 0)) {
+		uint64_t fade_start = (length > env->fade_length) ? length - env->fade_length : 0;
+		if (t >= fade_start) {
+			*next = MIN(*next, MIN(FF_RENDER_INTERVAL, length - t));
+			return env->fade_level + (abs_level - (int32_t)env->fade_level)
+					* (int64_t)(length - t) / env->fade_length;
+		}
+		*next = MIN(*next, fade_start - t);
+	}
+	return abs_level;
+}
+
+/** Returns value of waveform at 'phase', in range of -0x7FFF to 0x7FFF */
+static int32_t ff_waveform(uint16_t waveform, uint32_t phase, uint32_t period) {
+	// 'p' is position in period, 0 to 0xFFFF
+	int64_t p = (int64_t)phase * 0x10000 / period;
+	int64_t h;
+	switch (waveform) {
+		case FF_SQUARE:
+			return (p < 0x8000) ? 0x7FFF : -0x7FFF;
+		case FF_TRIANGLE:
+			if (p < 0x4000) return p * 0x7FFF / 0x4000;
+			if (p < 0xC000) return 0x7FFF - (p - 0x4000) * 0x7FFF / 0x4000;
+			return (p - 0x10000) * 0x7FFF / 0x4000;
+		case FF_SAW_UP:
+			return (p - 0x8000) * 0x7FFF / 0x8000;
+		case FF_SAW_DOWN:
+			return (0x8000 - p) * 0x7FFF / 0x8000;
+		case FF_SINE:
+		default:
+			// Bhaskara I approximation, good enough for motor
+			h = (p & 0x7FFF);	// position in half period, 0 to 0x7FFF
+			h = 16 * h * (0x8000 - h) / 0x8000;
+			h = h * 0x7FFF / (5 * 0x8000 - 4 * h / 16);
+			return (p < 0x8000) ? h : -h;
+	}
+}
+
+/**
+ * Returns amplitude of effect playing for 't' ms.
+ * Sets 'next' to time when it changes.
+ */
+static int32_t ff_render_effect(const struct ff_effect* effect, uint64_t t, uint64_t* next) {
+	uint64_t length = effect->replay.length;
+	int32_t level, magnitude;
+	*next = (length > 0) ? length - t : FF_NEVER;
+	switch (effect->type) {
+		case FF_RUMBLE:
+			level = effect->u.rumble.strong_magnitude / 3
+					+ effect->u.rumble.weak_magnitude / 6;
+			return MIN(level, 0x7FFF);
+		case FF_CONSTANT:
+			return ff_envelope(&effect->u.constant.envelope,
+					effect->u.constant.level, t, length, next);
+		case FF_RAMP:
+			level = effect->u.ramp.start_level;
+			if ((length > 0) && (effect->u.ramp.start_level != effect->u.ramp.end_level)) {
+				level += (effect->u.ramp.end_level - effect->u.ramp.start_level) * (int64_t)t / length;
+				*next = MIN(FF_RENDER_INTERVAL, length - t);
+			}
+			return ff_envelope(&effect->u.ramp.envelope, level, t, length, next);
+		case FF_PERIODIC:
+			magnitude = ff_envelope(&effect->u.periodic.envelope,
+					effect->u.periodic.magnitude, t, length, next);
+			if (effect->u.periodic.period >= FF_RENDER_INTERVAL * 4) {
+				// Slow enough to be rendered as changing amplitude
+				level = effect->u.periodic.offset + magnitude * ff_waveform(
+						effect->u.periodic.waveform,
+						t % effect->u.periodic.period,
+						effect->u.periodic.period) / 0x7FFF;
+				*next = MIN(*next, FF_RENDER_INTERVAL);
+			} else {
+				// Too fast, only its strength is used
+				level = magnitude + abs(effect->u.periodic.offset);
+			}
+			if (level < 0) level = -level;
+			return MIN(level, 0x7FFF);
+		default:
+			// Condition effects are not something controller can do
+			return 0x7FFF;
+	}
+}
+
+/**
+ * Sums all playing effects into e->level, sets e->duration to time
+ * for how long is that level valid and returns true if controller
+ * should be sent new command.
+ */
+static bool ff_render(struct ff_engine* e, uint64_t now) {
+	uint64_t next_change = FF_NEVER, next, t, length;
+	int64_t level = 0;
+	int i;
+	for (i=0; i<MAX_FF_EVENTS; i++) {
+		struct ff_slot* slot = &e->effects[i];
+		if (!slot->in_use || (slot->repetitions == 0))
+			continue;
+		length = slot->effect.replay.length;
+		// Moves to next repetition when one has ended
+		while ((length > 0) && (now >= slot->play_start + length) && (slot->repetitions > 0)) {
+			slot->repetitions --;
+			slot->play_start += length + slot->effect.replay.delay;
 		}
+		if (slot->repetitions == 0)
+			continue;
+		if (now < slot->play_start) {
+			next_change = MIN(next_change, slot->play_start - now);
+			continue;
+		}
+		t = now - slot->play_start;
+		level += ff_render_effect(&slot->effect, t, &next);
+		next_change = MIN(next_change, next);
+	}
+	level = level * e->gain / 0xFFFF;
+	e->level = MIN(level, 0x7FFF);
+	e->duration = (e->level > 0) ? MIN(next_change, FF_MAX_DURATION) : 0;
+	
+	bool changed = (e->level != e->sent_level)
+			|| ((e->level > 0) && (now + FF_RENDER_INTERVAL >= e->sent_until));
+	if (changed) {
+		e->sent_level = e->level;
+		e->sent_until = now + e->duration;
+	}
+	if (next_change != FF_NEVER) {
+		e->next_update = MIN(next_change, FF_MAX_DURATION);
+	} else if (e->level > 0) {
+		// Nothing changes, but command sent to controller has to be renewed
+		e->next_update = e->sent_until - now - FF_RENDER_INTERVAL;
+	} else {
+		e->next_update = -1;
 	}
-	return rv;
+	return changed;
+}
+
+struct ff_engine* uinput_ff_engine_new(void) {
+	struct ff_engine* e = malloc(sizeof(struct ff_engine));
+	if (e == NULL) return NULL;
+	memset(e, 0, sizeof(struct ff_engine));
+	e->gain = 0xFFFF;
+	e->next_update = -1;
+	return e;
+}
+
+void uinput_ff_engine_free(struct ff_engine* e) {
+	free(e);
+}
+
+/**
+ * Processes all requests waiting on uinput device and renders
+ * playing effects. Should be called when device is readable and
+ * then again after e->next_update ms, unless it's -1.
+ *
+ * Sets e->changed if controller should be sent new command.
+ */
+void uinput_ff_update(int fd, struct ff_engine* e) {
+	struct input_event events[MAX_FF_READ];
+	uint64_t now = ff_time_ms();
+	ssize_t n;
+	int i;
+	
+	do {
+		n = read(fd, events, sizeof(events));
+		for (i=0; i<n/(ssize_t)sizeof(struct input_event); i++) {
+			if (events[i].type == EV_UINPUT) {
+				if (events[i].code == UI_FF_UPLOAD)
+					ff_upload(fd, e, events[i].value, now);
+				else if (events[i].code == UI_FF_ERASE)
+					ff_erase(fd, e, events[i].value);
+			} else if (events[i].type == EV_FF) {
+				ff_play(e, events[i].code, events[i].value, now);
+			}
+		}
+	} while (n == sizeof(events));
+	
+	e->changed = ff_render(e, now);
 }
 
 void uinput_destroy(int fd)
@@ -24,13 +24,13 @@
 
 import os, ctypes, time
 from ctypes import Structure, POINTER, c_bool, c_int16, c_uint16, c_int32, byref
-from math import pi, copysign, sqrt
+from math import pi, sqrt
 from scc.lib.libusb1 import timeval
 from scc.tools import find_library
 from scc.cheader import defines
 from scc.lib import IntEnum
 
-UNPUT_MODULE_VERSION = 9
+UNPUT_MODULE_VERSION = 13
 
 # Get All defines from linux headers
 if os.path.exists('/usr/include/linux/input-event-codes.h'):
@@ -41,6 +41,20 @@ else:
 	CHEAD = defines('/usr/include', 'linux/input.h')
 
 MAX_FEEDBACK_EFFECTS = 4
+# Number of events that can be queued before they are written to device.
+# One slot is always kept free for EV_SYN. This is more than gamepad or mouse
+# can generate in one frame; If keyboard fills it, report is terminated
+# early, but never in middle of event group (such as scan code + key).
+EVENT_BUFFER_SIZE = 64
+
+EV_SYN, EV_KEY, EV_REL, EV_ABS, EV_MSC = [ CHEAD[x] for x in
+		("EV_SYN", "EV_KEY", "EV_REL", "EV_ABS", "EV_MSC") ]
+SYN_REPORT, MSC_SCAN = CHEAD["SYN_REPORT"], CHEAD["MSC_SCAN"]
+# Not defined by older headers
+REL_WHEEL_HI_RES = CHEAD.get("REL_WHEEL_HI_RES", 0x0b)
+REL_HWHEEL_HI_RES = CHEAD.get("REL_HWHEEL_HI_RES", 0x0c)
+# Most of events generated by single uinput_mouse_accumulate call
+MOUSE_MAX_EVENTS = 4
 
 # Keys enum contains all keys and button from linux/uinput.h (KEY_* BTN_*)
 Keys = IntEnum('Keys', {i: CHEAD[i] for i in CHEAD.keys() if (i.startswith('KEY_') or
@@ -183,25 +197,33 @@ class InputEvent(ctypes.Structure):
 		('value', c_int32)
 	]
 
-class FeedbackEvent(ctypes.Structure):
+class MouseAccumulator(ctypes.Structure):
+	""" Mirrors mouse_accumulator struct from uinput.c """
 	_fields_ = [
-		('in_use', c_bool),
-		('continuous_rumble', c_bool),
-		('duration', c_int32),
-		('delay', c_int32),
-		('repetitions', c_int32),
-		('type', c_uint16),
-		('level', c_int16),
+		('scale', ctypes.c_double * 4),
+		('acc', ctypes.c_double * 4),
+		('notches', c_int32 * 2),
 	]
 
-	def __init__(self):
-		self.in_use = False
+
+class FeedbackState(ctypes.Structure):
+	""" Mirrors beginning of ff_engine struct from uinput.c """
+	_fields_ = [
+		('changed', c_bool),
+		('level', c_int32),
+		('duration', c_int32),
+		('next_update', c_int32),
+	]
 
 
 class UInput(object):
 	"""
 	UInput class permits to create a uinput device.
 
+	Events are not written to device immediately, but queued in per-device
+	buffer and sent with single write() call when synEvent is called.
+	Mapper does that once per frame for every device in its syn_list.
+
 	See Gamepad, Mouse, Keyboard for examples
 	"""
 
@@ -216,13 +238,12 @@ class UInput(object):
 			self._a, self._amin, self._amax, self._afuzz, self._aflat = zip(*axes)
 
 		self._r = rels
+		self._events = (InputEvent * EVENT_BUFFER_SIZE)()
+		self._event_count = 0
+		self._dirty = False
 		
 		self._lib = find_library("libuinput")
-		self._ff_events = None
-		if rumble:
-			self._ff_events = (POINTER(FeedbackEvent) * MAX_FEEDBACK_EFFECTS)()
-			for i in xrange(MAX_FEEDBACK_EFFECTS):
-				self._ff_events[i].contents = FeedbackEvent()
+		self._ff = None
 		
 		try:
 			if self._lib.uinput_module_version() != UNPUT_MODULE_VERSION:
@@ -266,12 +287,49 @@ class UInput(object):
 										 c_name)
 		if self._fd < 0:
 			raise CannotCreateUInputException("Failed to create uinput device. Error code: %s" % (self._fd,))
+		self._write_events = self._lib.uinput_write_events
+		if rumble:
+			self._lib.uinput_ff_engine_new.restype = POINTER(FeedbackState)
+			self._lib.uinput_ff_update.argtypes = [ ctypes.c_int, POINTER(FeedbackState) ]
+			self._lib.uinput_ff_update.restype = None
+			self._ff = self._lib.uinput_ff_engine_new()
 
 
 	def getDescriptor(self):
 		return self._fd
 
 
+	def _reserve(self, count):
+		"""
+		Makes sure that 'count' events will fit into buffer. If they wouldn't,
+		events queued so far are terminated by EV_SYN and written, so group
+		of events that belongs together is never split between reports.
+		"""
+		if self._event_count + count >= EVENT_BUFFER_SIZE:
+			self.synEvent()
+
+
+	def _queue(self, type, code, value):
+		"""
+		Stores event in buffer. Buffer is written to device when synEvent
+		is called or when it's full.
+		"""
+		self._reserve(1)
+		ev = self._events[self._event_count]
+		ev.type, ev.code, ev.value = type, code, value
+		self._event_count += 1
+		self._dirty = True
+
+
+	def flush(self):
+		"""
+		Writes all queued events to device, without adding EV_SYN event.
+		"""
+		if self._event_count:
+			self._write_events(self._fd, self._events, self._event_count)
+			self._event_count = 0
+
+
 	def keyEvent(self, key, val):
 		"""
 		Generate a key or btn event
@@ -279,9 +337,7 @@ class UInput(object):
 		@param int axis		 key or btn event (KEY_* or BTN_*)
 		@param int val		  event value
 		"""
-		self._lib.uinput_key(self._fd,
-							 ctypes.c_uint16(key),
-							 ctypes.c_int32(val))
+		self._queue(EV_KEY, key, val)
 
 
 	def axisEvent(self, axis, val):
@@ -291,9 +347,7 @@ class UInput(object):
 		@param int axis		 abs event (ABS_*)
 		@param int val		  event value
 		"""
-		self._lib.uinput_abs(self._fd,
-							 ctypes.c_uint16(axis),
-							 ctypes.c_int32(val))
+		self._queue(EV_ABS, axis, val)
 
 	def relEvent(self, rel, val):
 		"""
@@ -302,9 +356,7 @@ class UInput(object):
 		@param int rel		  rel event (REL_*)
 		@param int val		  event value
 		"""
-		self._lib.uinput_rel(self._fd,
-							 ctypes.c_uint16(rel),
-							 ctypes.c_int32(val))
+		self._queue(EV_REL, rel, val)
 
 	def scanEvent(self, val):
 		"""
@@ -312,14 +364,20 @@ class UInput(object):
 
 		@param int val		  scan event value (scancode)
 		"""
-		self._lib.uinput_scan(self._fd,
-							  ctypes.c_int32(val))
+		self._queue(EV_MSC, MSC_SCAN, val)
 
 	def synEvent(self):
 		"""
-		Generate a syn event
+		Generate a syn event and writes all queued events to device.
+		Does nothing if no event was queued since last syn event.
 		"""
-		self._lib.uinput_syn(self._fd)
+		if self._dirty:
+			# Slot for EV_SYN is always kept free by _reserve
+			ev = self._events[self._event_count]
+			ev.type, ev.code, ev.value = EV_SYN, SYN_REPORT, 0
+			self._event_count += 1
+			self.flush()
+			self._dirty = False
 
 
 	def setDelayPeriod(self, delay, period):
@@ -343,19 +401,26 @@ class UInput(object):
 	def relManaged(self, ev):
 		return ev in self._r
 
-	def ff_read(self):
+	def ff_update(self):
 		"""
-		Returns effect that should be played or None if there were no such request.
+		Processes all force feedback requests sent to device and renders
+		effects that are playing. Should be called when device descriptor
+		is readable and then again after state.next_update ms.
+		
+		Returns FeedbackState or None if rumble is not enabled.
 		"""
-		if self._ff_events:
-			id = self._lib.uinput_ff_read(self._fd, MAX_FEEDBACK_EFFECTS, byref(self._ff_events))
-			if id >= 0:
-				return self._ff_events[id].contents
+		if self._ff:
+			self._lib.uinput_ff_update(self._fd, self._ff)
+			return self._ff.contents
 		return None
 
 	def __del__(self):
-		if self._lib:
+		if self._lib and self._fd >= 0:
+			self.flush()
 			self._lib.uinput_destroy(self._fd)
+		if self._ff:
+			self._lib.uinput_ff_engine_free(self._ff)
+			self._ff = None
 
 
 class Gamepad(UInput):
@@ -395,8 +460,9 @@ class Mouse(UInput):
 	"""
 	Mouse uinput class, create a mouse device
 
-	moveEvent can emulate free ball rotation of a track ball
-	updateParams permit to upgrade ball model and move scale
+	Movement and scrolling is scaled and accumulated in native code, so
+	fractions are not lost between frames. Scrolling generates high
+	resolution wheel events, 120 of them per one wheel notch.
 	"""
 
 	DEFAULT_XSCALE = 0.006
@@ -419,7 +485,14 @@ class Mouse(UInput):
 									rels=[Rels.REL_X,
 										  Rels.REL_Y,
 										  Rels.REL_WHEEL,
-										  Rels.REL_HWHEEL])
+										  Rels.REL_HWHEEL,
+										  REL_WHEEL_HI_RES,
+										  REL_HWHEEL_HI_RES])
+		self._acc = MouseAccumulator()
+		self._accumulate = self._lib.uinput_mouse_accumulate
+		self._accumulate.argtypes = [ POINTER(MouseAccumulator), c_bool,
+			ctypes.c_double, ctypes.c_double, ctypes.c_void_p ]
+		self._accumulate.restype = ctypes.c_int
 		self.updateParams()
 		self.updateScrollParams()
 		self.reset()
@@ -430,10 +503,9 @@ class Mouse(UInput):
 		Fixes scroll wheel feedback desynchronisation, as reported
 		in https://github.com/kozec/sc-controller/issues/222
 		"""
-		self._scr_dx = 0.0
-		self._scr_dy = 0.0
-		self._dx = 0.0
-		self._dy = 0.0
+		for i in xrange(4):
+			self._acc.acc[i] = 0.0
+		self._acc.notches[0] = self._acc.notches[1] = 0
 
 	def updateParams(self,
 					 xscale=DEFAULT_XSCALE,
@@ -441,15 +513,11 @@ class Mouse(UInput):
 		"""
 		Update Movement parameters
 
-		@param float mass	   mass in g of the ball
-		@param float r		  radius in m of the ball
-		@param int ampli		integer amplitude for move from border to border
-		@param float degree	 degree of rotation of the ball for move from border to border
 		@param float xscale	 scale applied on move param to input event on x axis
 		@param float yscale	 scale applied on move param to input event on y axis
 		"""
-		self._xscale = xscale
-		self._yscale = yscale
+		self._xscale = self._acc.scale[0] = xscale
+		self._yscale = self._acc.scale[1] = yscale
 
 	def updateScrollParams(self,
 						   xscale=DEFAULT_SCR_XSCALE,
@@ -457,16 +525,19 @@ class Mouse(UInput):
 		"""
 		Update Scroll parameters
 
-		@param float mass	   mass in g of the ball
-		@param float r		  radius in m of the ball
-		@param float friction   constat friction force applied to the ball
-		@param int ampli		integer amplitude for move from border to border
-		@param float degree	 degree of rotation of the ball for move from border to border
-		@param float xscale	 scale applied on move param to input event on x axis
-		@param float yscale	 scale applied on move param to input event on y axis
+		@param float xscale	 scale applied on move param to wheel notches on x axis
+		@param float yscale	 scale applied on move param to wheel notches on y axis
 		"""
-		self._scr_xscale = xscale
-		self._scr_yscale = yscale
+		self._acc.scale[2] = xscale
+		self._acc.scale[3] = yscale
+
+	def _accumulate_events(self, scroll, dx, dy):
+		self._reserve(MOUSE_MAX_EVENTS)
+		n = self._accumulate(byref(self._acc), scroll, dx, dy,
+			ctypes.addressof(self._events[self._event_count]))
+		if n:
+			self._event_count += n
+			self._dirty = True
 
 	def moveEvent(self, dx=0, dy=0):
 		"""
@@ -476,19 +547,7 @@ class Mouse(UInput):
 		@param int dy		   delta movement from last call on y axis
 
 		"""
-		self._dx += dx * self._xscale
-		self._dy += dy * self._yscale
-		_syn = False
-		if int(self._dx):
-			self.relEvent(rel=Rels.REL_X, val=int(self._dx))
-			self._dx -= int(self._dx)
-			_syn = True
-		if int(self._dy):
-			self.relEvent(rel=Rels.REL_Y, val=int(self._dy))
-			self._dy -= int(self._dy)
-			_syn = True
-		if _syn:
-			self.synEvent()
+		self._accumulate_events(False, dx, dy)
 
 	def scrollEvent(self, dx=0, dy=0):
 		"""
@@ -497,23 +556,8 @@ class Mouse(UInput):
 		@param int dx		   delta movement from last call on x axis
 		@param int dy		   delta movement from last call on y axis
 
-		@return float		   absolute distance moved this tick
-
-		"""
-		# Compute mouse mouvement from interger part of d * scale
-		self._scr_dx += dx * self._scr_xscale
-		self._scr_dy += dy * self._scr_yscale
-		_syn = False
-		if int(self._scr_dx):
-			self.relEvent(rel=Rels.REL_HWHEEL, val=int(copysign(1, self._scr_dx)))
-			self._scr_dx -= int(self._scr_dx)
-			_syn = True
-		if int(self._scr_dy):
-			self.relEvent(rel=Rels.REL_WHEEL,  val=int(copysign(1, self._scr_dy)))
-			self._scr_dy -= int(self._scr_dy)
-			_syn = True
-		if _syn:
-			self.synEvent()
+		"""
+		self._accumulate_events(True, dx, dy)
 
 
 class Keyboard(UInput):
@@ -543,23 +587,23 @@ class Keyboard(UInput):
 	def pressEvent(self, keys):
 		"""
 		Generate key press event with corresponding scan codes.
-		Events are generated only for new keys.
+		Events are generated only for new keys and written by synEvent.
 
 		@param list of Keys keys		keys to press
 		"""
 
 		new = [k for k in keys if k not in self._pressed]
 		for i in new:
+			self._reserve(2)
 			self.scanEvent(Scans[i])
 			self.keyEvent(i, 1)
-		if len(new):
-			self.synEvent()
-			self._pressed |= set(new)
+		self._pressed |= set(new)
 
 	def releaseEvent(self, keys=None):
 		"""
 		Generate key release event with corresponding scan codes.
-		Events are generated only for keys that was pressed
+		Events are generated only for keys that was pressed and written
+		by synEvent.
 
 
 		@param list of Keys keys		keys to release, give None or empty list
@@ -570,11 +614,10 @@ class Keyboard(UInput):
 		else:
 			rem = list(self._pressed)
 		for i in rem:
+			self._reserve(2)
 			self.scanEvent(Scans[i])
 			self.keyEvent(i, 0)
-		if len(rem):
-			self.synEvent()
-			self._pressed -= set(rem)
+		self._pressed -= set(rem)
 
 
 class Dummy(object):
@@ -589,6 +632,7 @@ class Dummy(object):
 	relEvent = keyEvent
 	scanEvent = keyEvent
 	synEvent = keyEvent
+	flush = keyEvent
 	setDelayPeriod = keyEvent
 	updateParams = keyEvent
 	updateScrollParams = keyEvent
@@ -0,0 +1,594 @@
+#!/usr/bin/env python2
+"""
+SC-Controller - Worker processes
+
+When 'worker_processes' is enabled in config, daemon doesn't map input on
+its own main loop. Every mapper is replaced by WorkerMapper, which starts
+worker process with its own Mapper, Scheduler and virtual devices, so one
+busy mapper can't delay input of other controllers.
+
+Driver still receives and decodes input in daemon process (libusb handles
+can't be passed to another process), but then only copies every report
+into InputRing - ring buffer in shared memory - and wakes worker up by
+writing to pipe. Worker reads reports from ring and feeds them to mapper.
+
+Everything else is sent through socket pair as json-encoded lists,
+one per line:
+ - from daemon: controller and profile changes, cancel and release
+   requests and selected menu items
+ - from worker: haptic feedback, led and gyro requests and special actions
+   (OSD, menus, profile changes...), which daemon executes same way as if
+   they came from local mapper.
+
+Locking, observing and replacing actions over control socket and
+'gestures' and 'cemuhook' actions are not available for controllers
+handled by worker processes.
+"""
+from __future__ import unicode_literals
+
+from scc.uinput import Dummy, CannotCreateUInputException
+from scc.parser import TalkingActionParser
+from scc.profile_cache import ProfileCache
+from scc.controller import HapticData
+from scc.constants import INPUT_FIELDS
+from scc.snapshot import input_getter
+from scc.scheduler import Scheduler
+from scc.profile import Profile
+from scc.actions import Action
+from scc.mapper import Mapper
+from scc.config import Config
+from scc.poller import Poller
+from scc.lib import xwrappers as X
+
+from collections import namedtuple
+from ctypes import Structure, c_uint64, sizeof
+import os, sys, json, mmap, fcntl, signal, socket, struct
+import tempfile, subprocess, logging
+log = logging.getLogger("Worker")
+
+WorkerInput = namedtuple("WorkerInput", INPUT_FIELDS)
+ZERO_STATE = WorkerInput(*[ 0 ] * len(INPUT_FIELDS))
+RECORD = struct.Struct(b"<Q%si" % (len(INPUT_FIELDS) - 1,))
+
+
+class RingHeader(Structure):
+	_fields_ = [
+		('written', c_uint64),		# written only by daemon
+		('read', c_uint64),			# written only by worker
+	]
+
+
+class InputRing(object):
+	"""
+	Single-producer, single-consumer ring of input reports in shared memory.
+	Both counters only grow; slot is index modulo SIZE. When worker falls
+	behind by whole ring, new reports are dropped, what mapper sees same
+	way as reports coalesced by driver.
+	"""
+	SIZE = 256
+	
+	def __init__(self, fd, create=False):
+		size = sizeof(RingHeader) + RECORD.size * InputRing.SIZE
+		if create:
+			os.ftruncate(fd, size)
+		self._mmap = mmap.mmap(fd, size)
+		self.header = RingHeader.from_buffer(self._mmap)
+		self._getters = {}			# report type -> function returning values
+	
+	
+	def push(self, state):
+		""" Copies report to ring. Returns False if ring is full """
+		h = self.header
+		if h.written - h.read >= InputRing.SIZE:
+			return False
+		cls = state.__class__
+		if cls not in self._getters:
+			self._getters[cls] = input_getter(cls)
+		RECORD.pack_into(self._mmap,
+			sizeof(RingHeader) + RECORD.size * (h.written % InputRing.SIZE),
+			*self._getters[cls](state))
+		h.written += 1
+		return True
+	
+	
+	def pop_all(self):
+		""" Returns list of all reports waiting in ring """
+		h = self.header
+		read, written = h.read, h.written
+		rv = [
+			WorkerInput._make(RECORD.unpack_from(self._mmap,
+				sizeof(RingHeader) + RECORD.size * (i % InputRing.SIZE)))
+			for i in xrange(read, written)
+		]
+		h.read = written
+		return rv
+
+
+def _set_cloexec(fd, cloexec):
+	flags = fcntl.fcntl(fd, fcntl.F_GETFD)
+	if cloexec:
+		flags |= fcntl.FD_CLOEXEC
+	else:
+		flags &= ~fcntl.FD_CLOEXEC
+	fcntl.fcntl(fd, fcntl.F_SETFD, flags)
+
+
+def _encode_pars(pars):
+	return [ { "action" : x.to_string() } if isinstance(x, Action) else x
+		for x in pars ]
+
+
+def _decode_pars(pars):
+	return [ TalkingActionParser().restart(x["action"]).parse()
+		if isinstance(x, dict) else x for x in pars ]
+
+
+class WorkerMapper(object):
+	"""
+	Stands in for Mapper in daemon process. Forwards input and everything
+	that changes mapping to worker process, where real Mapper runs.
+	
+	Keeps its own copy of profile, so daemon can still read filename,
+	menus and gyro settings from it.
+	"""
+	# Delay before worker that died unexpectedly is started again
+	RESTART_DELAY = 1.0
+	
+	def __init__(self, daemon):
+		self.daemon = daemon
+		self.profile = Profile(TalkingActionParser())
+		self.controller = None
+		self.state = None
+		self.keyboard, self.mouse, self.gamepad = Dummy(), Dummy(), Dummy()
+		self._sa_handler = None
+		self._profile_listeners = []
+		self._gamepad_name = None
+		self._process = None
+		self._socket = None
+		self._wake_w = None
+		self._exiting = False
+		daemon.add_on_exit(self._on_exit)
+		self._start()
+	
+	
+	def _start(self):
+		""" Starts worker process and sends it current controller and profile """
+		fd, path = tempfile.mkstemp(prefix="scc-worker-",
+			dir="/dev/shm" if os.path.isdir("/dev/shm") else None)
+		os.unlink(path)
+		self._ring = InputRing(fd, create=True)
+		if self._wake_w is not None:
+			# Kept open after previous worker died, so input() has
+			# something to write to
+			os.close(self._wake_w)
+		wake_r, self._wake_w = os.pipe()
+		Poller._set_nonblocking(self._wake_w)
+		self._socket, remote = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+		# Only worker ends are inherited, otherwise worker started later
+		# would keep this one from noticing that daemon is gone
+		for x in (fd, wake_r, remote.fileno()):
+			_set_cloexec(x, False)
+		for x in (self._wake_w, self._socket.fileno()):
+			_set_cloexec(x, True)
+		
+		args = [ sys.executable, "-m", "scc.worker",
+			str(fd), str(wake_r), str(remote.fileno()) ]
+		if logging.getLogger().isEnabledFor(logging.DEBUG):
+			args.append("debug")
+		env = dict(os.environ)
+		path = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+		env["PYTHONPATH"] = os.pathsep.join(
+			[ path ] + [ x for x in [ env.get("PYTHONPATH") ] if x ])
+		self._process = subprocess.Popen(args, env=env)
+		log.debug("Started worker process %s", self._process.pid)
+		os.close(fd)
+		os.close(wake_r)
+		remote.close()
+		
+		self._buffer = b""
+		self.daemon.get_poller().register(self._socket.fileno(),
+			Poller.POLLIN, self._on_message)
+		self._send_controller()
+		self._send("profile", self.profile.get_filename())
+	
+	
+	def _on_exit(self, daemon):
+		self._exiting = True
+		if self._process and self._process.poll() is None:
+			self._process.terminate()
+			self._process.wait()
+	
+	
+	def _lost(self):
+		""" Called when connection to worker process is closed """
+		self.daemon.get_poller().unregister(self._socket.fileno())
+		self._socket.close()
+		self._socket = None
+		self._process.wait()
+		if self._exiting:
+			return
+		log.error("Worker process %s exited with code %s, restarting",
+			self._process.pid, self._process.returncode)
+		self.daemon.get_scheduler().schedule(WorkerMapper.RESTART_DELAY,
+			lambda *a: self._start())
+	
+	
+	def _send(self, *message):
+		if self._socket is None:
+			return
+		try:
+			self._socket.sendall(json.dumps(message) + b"\n")
+		except socket.error, e:
+			# Handled by _lost once poller reports closed socket
+			log.error("Failed to send message to worker process: %s", e)
+	
+	
+	def _send_controller(self):
+		c = self.controller
+		if c:
+			self._send("controller", c.get_id(), c.get_type(), c.flags,
+				c.get_gui_config_file())
+		else:
+			self._send("controller", None)
+	
+	
+	def _on_message(self, fd, event):
+		try:
+			data = self._socket.recv(4096)
+		except socket.error:
+			data = b""
+		if not data:
+			return self._lost()
+		self._buffer += data
+		while b"\n" in self._buffer:
+			line, self._buffer = self._buffer.split(b"\n", 1)
+			try:
+				self._handle(*json.loads(line))
+			except Exception, e:
+				log.exception(e)
+	
+	
+	def _handle(self, message, *args):
+		c = self.controller
+		if message == "ready":
+			self._gamepad_name, = args
+		elif message == "feedback":
+			if c:
+				c.feedback(HapticData(*args))
+		elif message == "led":
+			if c:
+				c.set_led_level(*args)
+		elif message == "gyro":
+			if c:
+				c.set_gyro_enabled(*args)
+		elif message == "turnoff":
+			if c:
+				c.turnoff()
+		elif message == "sa":
+			name, actionstr, pars = args
+			h_name = "on_sa_%s" % (name,)
+			if hasattr(self._sa_handler, h_name):
+				action = TalkingActionParser().restart(actionstr).parse()
+				getattr(self._sa_handler, h_name)(self, action, *_decode_pars(pars))
+		else:
+			log.warning("Unknown message from worker process: %s", message)
+	
+	
+	def input(self, controller, old_state, state):
+		self.state = state
+		if controller.shared_state and controller.get_input() is None:
+			controller.shared_state.write(state)
+		if not self._ring.push(state):
+			controller.dropped_reports += 1
+		try:
+			os.write(self._wake_w, b"\0")
+		except OSError:
+			# Pipe is full or closed, worker is going to wake up anyway
+			pass
+	
+	
+	def press(self, action):
+		"""
+		Presses and, after while, releases action in worker process.
+		Used for menu items selected in OSD.
+		"""
+		self._send("press", action.to_string())
+	
+	
+	def get_gamepad_name(self):
+		return self._gamepad_name
+	
+	
+	def set_controller(self, c):
+		self.controller = c
+		self._send_controller()
+	
+	
+	def get_controller(self):
+		return self.controller
+	
+	
+	def set_profile(self, profile):
+		self.profile = profile
+		self.profile_modified()
+	
+	
+	def profile_modified(self):
+		self._send("profile", self.profile.get_filename())
+		for cb in list(self._profile_listeners):
+			cb(self)
+	
+	
+	def add_profile_listener(self, cb):
+		if cb not in self._profile_listeners:
+			self._profile_listeners.append(cb)
+	
+	
+	def remove_profile_listener(self, cb):
+		if cb in self._profile_listeners:
+			self._profile_listeners.remove(cb)
+	
+	
+	def set_special_actions_handler(self, sa):
+		self._sa_handler = sa
+	
+	
+	def get_special_actions_handler(self):
+		return self._sa_handler
+	
+	
+	def set_xdisplay(self, x):
+		# Worker opens its own connection
+		pass
+	
+	
+	def schedule(self, delay, cb):
+		""" Schedules callback in daemon process """
+		return self.daemon.get_scheduler().schedule(delay, cb, self)
+	
+	
+	def cancel_task(self, task):
+		""" Removes task scheduled by schedule() """
+		return self.daemon.get_scheduler().cancel_task(task)
+	
+	
+	def cancel_all(self):
+		self._send("cancel")
+	
+	
+	def release_virtual_buttons(self):
+		self._send("release")
+
+
+class RemoteController(object):
+	"""
+	Stands in for controller in worker process. Everything that should
+	reach real controller is sent to daemon.
+	"""
+	# Daemon publishes state before report reaches worker
+	shared_state = None
+	
+	def __init__(self, worker, id, type, flags, gui_config_file):
+		self._worker = worker
+		self._id = id
+		self._type = type
+		self._gui_config_file = gui_config_file
+		self._gyro_enabled = False
+		self.flags = flags
+		self.mapper = None
+	
+	
+	def get_id(self):
+		return self._id
+	
+	def get_type(self):
+		return self._type
+	
+	def get_gui_config_file(self):
+		return self._gui_config_file
+	
+	def get_battery_level(self):
+		return None
+	
+	def set_motion_sink(self, sink):
+		return False
+	
+	def set_mapper(self, mapper):
+		self.mapper = mapper
+	
+	def get_mapper(self):
+		return self.mapper
+	
+	def get_gyro_enabled(self):
+		return self._gyro_enabled
+	
+	
+	def set_gyro_enabled(self, enabled):
+		self._gyro_enabled = enabled
+		self._worker.send("gyro", enabled)
+	
+	
+	def set_led_level(self, level):
+		self._worker.send("led", level)
+	
+	
+	def feedback(self, data):
+		position, amplitude, period, count = data.data
+		self._worker.send("feedback", position, amplitude,
+			data.get_frequency(), period, count)
+	
+	
+	def turnoff(self):
+		self._worker.send("turnoff")
+	
+	
+	def __repr__(self):
+		return "<RemoteController %s>" % (self._id,)
+
+
+def _forwarded(name):
+	""" Creates on_sa_<name> method that lets daemon execute special action """
+	def on_sa(self, mapper, action, *pars):
+		self.send("sa", name, action.to_string(), _encode_pars(pars))
+	return on_sa
+
+
+class Worker(object):
+	""" Runs in worker process, feeds input from InputRing to Mapper """
+	MAX_POLL_INTERVAL = 1.0
+	
+	def __init__(self, ring_fd, wake_fd, socket_fd):
+		self.ring = InputRing(ring_fd)
+		os.close(ring_fd)
+		self.wake_fd = wake_fd
+		Poller._set_nonblocking(wake_fd)
+		self.socket = socket.fromfd(socket_fd, socket.AF_UNIX, socket.SOCK_STREAM)
+		os.close(socket_fd)
+		self.buffer = b""
+		self.state = ZERO_STATE
+		self.controller = None
+		self.warned = set()
+		
+		self.poller = Poller()
+		self.scheduler = Scheduler()
+		self.scheduler.set_wakeup_callback(self.poller.wakeup)
+		self.poller.set_wake_callback(self.scheduler.update_time)
+		if Config()["precise_scheduler"]:
+			self.scheduler.enable_precise(self.poller)
+		self.profile_cache = ProfileCache()
+		self.mapper = self.init_mapper()
+		self.poller.register(self.wake_fd, Poller.POLLIN, self.on_input)
+		self.poller.register(self.socket.fileno(), Poller.POLLIN, self.on_message)
+		self.send("ready", self.mapper.get_gamepad_name())
+	
+	
+	def init_mapper(self):
+		""" Same as SCCDaemon.init_mapper, but nothing is reported to user """
+		try:
+			mapper = Mapper(Profile(TalkingActionParser()),
+					self.scheduler, poller=self.poller)
+		except (CannotCreateUInputException, OSError), e:
+			# OSError is raised if libuinput is not found. Worker that
+			# exits here would be just restarted over and over again
+			log.exception(e)
+			mapper = Mapper(Profile(TalkingActionParser()),
+				self.scheduler, keyboard=None, mouse=None, gamepad=False)
+		mapper.set_special_actions_handler(self)
+		if "DISPLAY" in os.environ and "WAYLAND_DISPLAY" not in os.environ:
+			mapper.set_xdisplay(X.open_display(os.environ["DISPLAY"]))
+		return mapper
+	
+	
+	def send(self, *message):
+		self.socket.sendall(json.dumps(message) + b"\n")
+	
+	
+	def on_input(self, fd, event):
+		try:
+			while os.read(fd, 1024): pass
+		except OSError:
+			pass
+		for state in self.ring.pop_all():
+			old_state, self.state = self.state, state
+			self.mapper.input(self.controller, old_state, state)
+	
+	
+	def on_message(self, fd, event):
+		data = self.socket.recv(4096)
+		if not data:
+			log.debug("Daemon is gone")
+			self.exit()
+		self.buffer += data
+		while b"\n" in self.buffer:
+			line, self.buffer = self.buffer.split(b"\n", 1)
+			try:
+				self.handle(*json.loads(line))
+			except Exception, e:
+				log.exception(e)
+	
+	
+	def handle(self, message, *args):
+		if message == "controller":
+			if args[0] is None:
+				self.controller = None
+			else:
+				self.controller = RemoteController(self, *args)
+				self.controller.set_mapper(self.mapper)
+			self.state = ZERO_STATE
+			self.mapper.set_controller(self.controller)
+		elif message == "profile":
+			filename, = args
+			if filename:
+				profile = self.profile_cache.load(filename)
+				self.profile_cache.prewarm(ProfileCache.get_referenced(
+					profile.get_all_actions()))
+			else:
+				profile = Profile(TalkingActionParser())
+			self.mapper.mouse.reset()
+			self.mapper.set_profile(profile)
+		elif message == "cancel":
+			self.mapper.cancel_all()
+		elif message == "release":
+			self.mapper.release_virtual_buttons()
+		elif message == "press":
+			action = TalkingActionParser().restart(args[0]).parse()
+			action.button_press(self.mapper)
+			self.mapper.schedule(0.1, action.button_release)
+		elif message == "exit":
+			self.exit()
+		else:
+			log.warning("Unknown message from daemon: %s", message)
+	
+	
+	on_sa_profile = _forwarded("profile")
+	on_sa_turnoff = _forwarded("turnoff")
+	on_sa_restart = _forwarded("restart")
+	on_sa_led = _forwarded("led")
+	on_sa_osd = _forwarded("osd")
+	on_sa_clearosd = _forwarded("clearosd")
+	on_sa_clear_osd = _forwarded("clear_osd")
+	on_sa_area = _forwarded("area")
+	on_sa_keyboard = _forwarded("keyboard")
+	on_sa_menu = _forwarded("menu")
+	on_sa_gridmenu = _forwarded("gridmenu")
+	on_sa_dialog = _forwarded("dialog")
+	
+	
+	def on_sa_shell(self, mapper, action):
+		return subprocess.Popen(action.command, shell=True)
+	
+	
+	def _not_available(self, mapper, action, *a):
+		if action.SA not in self.warned:
+			self.warned.add(action.SA)
+			log.warning("'%s' action is not available with worker processes",
+				action.SA)
+	
+	on_sa_gestures = _not_available
+	on_sa_cemuhook = _not_available
+	
+	
+	def exit(self, *a):
+		self.mapper.release_virtual_buttons()
+		sys.exit(0)
+	
+	
+	def run(self):
+		while True:
+			timeout = self.scheduler.get_timeout(Worker.MAX_POLL_INTERVAL)
+			self.poller.poll(timeout, timer=timeout < Worker.MAX_POLL_INTERVAL)
+			self.scheduler.run()
+
+
+def main():
+	from scc.tools import init_logging, set_logging_level
+	init_logging(suffix=" WRK")
+	set_logging_level('debug' in sys.argv, 'debug' in sys.argv)
+	worker = Worker(*[ int(x) for x in sys.argv[1:4] ])
+	signal.signal(signal.SIGTERM, worker.exit)
+	signal.signal(signal.SIGINT, signal.SIG_IGN)
+	worker.run()
+
+
+if __name__ == "__main__":
+	main()
@@ -3,6 +3,10 @@
 SC-Controller - Autoswitch Daemon
 
 Observes active window and commands scc-daemon to change profiles as needed.
+
+Instead of polling, AutoSwitcher listens for PropertyNotify events on root
+window (for _NET_ACTIVE_WINDOW) and on active window (for title changes) and
+re-checks conditions only when one of them is reported.
 """
 from __future__ import unicode_literals
 from scc.tools import _
@@ -16,12 +20,17 @@ from scc.tools import find_profile
 from scc.actions import Action
 from scc.mapper import Mapper
 from scc.config import Config
+from collections import OrderedDict
+from ctypes import byref
 
-import os, sys, re, time, socket, traceback, threading, logging
+import os, sys, re, time, socket, select, traceback, threading, logging
 log = logging.getLogger("AutoSwitcher")
 
 class AutoSwitcher(object):
+	# Used only if window manager doesn't provide _NET_ACTIVE_WINDOW
 	INTERVAL = 1
+	# Window properties that, when changed, may change what conditions match
+	WATCHED_ATOMS = ( "_NET_ACTIVE_WINDOW", "_NET_WM_NAME", "WM_NAME" )
 	
 	def __init__(self):
 		self.dpy = X.open_display(os.environ["DISPLAY"])
@@ -36,14 +45,21 @@ class AutoSwitcher(object):
 		self.exit_code = None
 		self.current_profile = None
 		self.current_window = None
+		self.current_pars = None
+		self.current_actions = None
 		self.conds = AutoSwitcher.parse_conditions(self.config)
+		self.matcher = ConditionMatcher(self.conds)
+		# Written to by connect_daemon thread to wake up main loop
+		self.wakeup_r, self.wakeup_w = os.pipe()
+		# Has to be kept referenced for as long as it's set
+		self._x_error_handler = X.ErrorHandler(self.on_x_error)
 	
 	
 	@staticmethod
 	def parse_conditions(config):
 		""" Parses conditions from config """
 		parser = TalkingActionParser()
-		conds = {}
+		conds = OrderedDict()
 		for c in config['autoswitch']:
 			try:
 				astr = c['action']
@@ -112,37 +128,77 @@ class AutoSwitcher(object):
 					profile = line.split(":", 1)[-1].strip()
 					log.debug("Daemon reported profile change: %s", profile)
 					self.current_profile = profile
+					self.wakeup()
 				elif line.startswith("Reconfigured."):
 					log.debug("Reloading config...")
 					self.config = Config()
 					self.conds = AutoSwitcher.parse_conditions(self.config)
+					self.matcher = ConditionMatcher(self.conds)
+					self.wakeup()
 				elif line.startswith("Controller Count:"):
 					self.enabled = int(line.split(":")[-1]) > 0
 					log.debug("Enabled: %s", self.enabled)
+					self.wakeup()
 			
 			self.lock.release()
 	
 	
+	def wakeup(self):
+		""" Makes main loop to check active window """
+		os.write(self.wakeup_w, b"\n")
+	
+	
+	def on_x_error(self, dpy, error):
+		"""
+		Default handler terminates process, but BadWindow is expected
+		when active window is closed before its properties are read.
+		"""
+		e = error.contents
+		if e.error_code == X.BADWINDOW:
+			log.debug("Ignored BadWindow error")
+		else:
+			log.warning("X error %s (request %s.%s, resource 0x%x)",
+				e.error_code, e.request_code, e.minor_code, e.resourceid)
+		return 0
+	
+	
+	def watch_window(self, w):
+		""" Subscribes for title changes of new active window """
+		root = X.get_default_root_window(self.dpy)
+		if self.current_window not in (None, root):
+			X.select_input(self.dpy, self.current_window, X.NOEVENTMASK)
+		if w != root:
+			X.select_input(self.dpy, w, X.PROPERTYCHANGEMASK)
+	
+	
 	def check(self, *a):
-		w = X.get_current_window(self.dpy)
-		if w == self.current_window or not self.current_profile:
-			# Window not switched or profile is not known yet
+		if not self.current_profile:
+			# Profile is not known yet
 			return
+		w = X.get_current_window(self.dpy)
+		title, wm_class = X.get_window_title(self.dpy, w), X.get_window_class(self.dpy, w)
+		pars = title or "", tuple(x or "" for x in wm_class)
+		if w == self.current_window:
+			if pars == self.current_pars:
+				# Nothing changed
+				return
+			self.current_pars = pars
+			actions = self.matcher.match(*pars)
+			if actions == self.current_actions:
+				# Title changed, but same conditions are matching
+				return
+			log.debug("Window title changed: %s", w)
+		else:
+			log.debug("Window switched: %s", w)
+			self.watch_window(w)
+			self.current_pars = pars
+			actions = self.matcher.match(*pars)
 		self.current_window = w
-		log.debug("Window switched: %s", w)
-		pars = X.get_window_title(self.dpy, w), X.get_window_class(self.dpy, w)
-
-                if pars[0] is None:
-                        pars = ("",pars[1])
-
-                if pars[1] is None:
-                        pars = (pars[0], ("",""))
-
-		for c in self.conds:
-			if c.matches(*pars):
-				action = self.conds[c]
-				action.button_press(self.mapper)
-				action.button_release(self.mapper)
+		self.current_actions = actions
+		
+		for action in actions:
+			action.button_press(self.mapper)
+			action.button_release(self.mapper)
 	
 	
 	def on_sa_profile(self, mapper, action):
@@ -190,15 +246,93 @@ class AutoSwitcher(object):
 	
 	
 	def run(self):
+		X.set_error_handler(self._x_error_handler)
+		root = X.get_default_root_window(self.dpy)
+		atoms = set([ X.intern_atom(self.dpy, name, False)
+			for name in AutoSwitcher.WATCHED_ATOMS ])
+		trash, prop = X.get_window_prop(self.dpy, root, "_NET_ACTIVE_WINDOW")
+		if prop is not None:
+			X.free(prop)
+			timeout = None
+		else:
+			log.warning("Window manager doesn't report active window, "
+				"falling back to polling")
+			timeout = self.INTERVAL
+		X.select_input(self.dpy, root, X.PROPERTYCHANGEMASK)
+		X.flush(self.dpy)
+		
 		self.thread.start()
 		log.debug("AutoSwitcher started")
+		fd = X.connection_number(self.dpy)
+		event = X.XEvent()
+		dirty = True
 		while self.exit_code is None:
-			if self.enabled:
+			# Events may be already queued by Xlib while window
+			# properties were read, so queue is emptied before select
+			while X.pending(self.dpy):
+				X.next_event(self.dpy, byref(event))
+				if event.type == X.PROPERTYNOTIFY and event.xproperty.atom in atoms:
+					dirty = True
+			if dirty and self.enabled:
+				dirty = False
 				self.check()
-			time.sleep(self.INTERVAL)
+				X.flush(self.dpy)
+				continue
+			readable, trash, trash = select.select([ fd, self.wakeup_r ], [], [], timeout)
+			if self.wakeup_r in readable:
+				os.read(self.wakeup_r, 1024)
+				dirty = True
+			elif not readable:
+				# Timeout, possible only when polling
+				dirty = True
 		return 1
 
 
+class ConditionMatcher(object):
+	"""
+	Matches window against all conditions at once.
+	
+	Conditions that test only window class are looked up by class, rest
+	is tested one by one. Results are cached for last few title and class
+	combinations, so switching between few windows doesn't test anything.
+	Matching actions are returned in same order as conditions are stored.
+	"""
+	CACHE_SIZE = 256
+	
+	def __init__(self, conds):
+		self._by_class = {}				# wm_class -> [ (index, action) ]
+		self._other = []				# [ (index, condition, action) ]
+		self._cache = OrderedDict()		# (title, wm_class) -> [ action ]
+		for index, c in enumerate(conds):
+			if c.empty:
+				# Empty condition matches nothing
+				continue
+			if c.wm_class and not (c.exact_title or c.title or c.regexp):
+				self._by_class.setdefault(c.wm_class, []).append((index, conds[c]))
+			else:
+				self._other.append((index, c, conds[c]))
+	
+	
+	def match(self, title, wm_class):
+		"""
+		Returns list of actions assigned to conditions matching provided
+		window properties. Arguments are same as for Condition.matches.
+		"""
+		key = title, wm_class
+		rv = self._cache.pop(key, None)
+		if rv is None:
+			found = []
+			for cls in set(wm_class):
+				found += self._by_class.get(cls, [])
+			found += [ (index, action) for (index, c, action) in self._other
+				if c.matches(title, wm_class) ]
+			rv = [ action for (index, action) in sorted(found, key=lambda x: x[0]) ]
+			while len(self._cache) >= ConditionMatcher.CACHE_SIZE:
+				self._cache.popitem(last=False)
+		self._cache[key] = rv
+		return rv
+
+
 class Condition(object):
 	"""
 	Represents AutoSwitcher condition loaded from configuration file.
@@ -67,10 +67,11 @@ if __name__ == "__main__":
 			ext_modules = [
 				Extension('libuinput', sources = ['scc/uinput.c']),
 				Extension('libcemuhook', define_macros = [('PYTHON', 1)],
-							sources = ['scc/cemuhook_server.c'], libraries = ["z"]),
+							sources = ['scc/cemuhook_server.c']),
 				Extension('libhiddrv', sources = ['scc/drivers/hiddrv.c']),
 				Extension('libsc_by_bt', sources = ['scc/drivers/sc_by_bt.c']),
 				Extension('libremotepad', sources = ['scc/drivers/remotepad_controller.c']),
+				Extension('libnative_mapper', sources = ['scc/native_mapper.c'], libraries = ["m"]),
 			]
 	)
 
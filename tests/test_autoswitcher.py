@@ -0,0 +1,43 @@
+from scc.x11.autoswitcher import AutoSwitcher, Condition, ConditionMatcher
+from scc.special_actions import ChangeProfileAction
+from collections import OrderedDict
+
+
+class TestAutoSwitcher(object):
+	
+	def test_matcher(self):
+		"""
+		Tests if ConditionMatcher returns same actions as testing
+		conditions one by one, in order in which they are stored.
+		"""
+		conds = OrderedDict()
+		conds[Condition(title="Firefox")] = ChangeProfileAction("a")
+		conds[Condition(wm_class="Navigator")] = ChangeProfileAction("b")
+		conds[Condition(wm_class="firefox", regexp="^Mozilla")] = ChangeProfileAction("c")
+		conds[Condition(wm_class="Firefox")] = ChangeProfileAction("d")
+		conds[Condition()] = ChangeProfileAction("e")
+		matcher = ConditionMatcher(conds)
+		
+		for pars in (
+				("Mozilla Firefox", ("Navigator", "Firefox")),
+				("Mozilla Firefox", ("firefox", "Firefox")),
+				("Mozilla", ("firefox", "Firefox")),
+				("Terminal", ("xterm", "XTerm")),
+				("", ("", "")),
+			):
+			expected = [ conds[c] for c in conds if c.matches(*pars) ]
+			assert matcher.match(*pars) == expected
+			# Cached
+			assert matcher.match(*pars) == expected
+	
+	
+	def test_parse_conditions_order(self):
+		"""
+		Tests if parse_conditions keeps order from configuration.
+		"""
+		config = { 'autoswitch' : [
+			{ 'condition' : { 'title' : str(i) }, 'action' : "profile('%s')" % (i,) }
+			for i in xrange(20)
+		]}
+		conds = AutoSwitcher.parse_conditions(config)
+		assert [ c.title for c in conds ] == [ str(i) for i in xrange(20) ]
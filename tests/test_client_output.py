@@ -0,0 +1,47 @@
+from scc.sccdaemon import ClientOutput
+from scc.poller import Poller
+import socket
+
+
+class TestClientOutput(object):
+
+	def test_no_blocking(self):
+		"""
+		Tests if writing to client that doesn't read never blocks
+		and if buffered data is delivered once client reads it.
+		"""
+		poller = Poller()
+		ours, theirs = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+		out = ClientOutput(ours, poller)
+		lines = [ b"Event: %s\n" % (i,) for i in xrange(50000) ]
+		for line in lines:
+			out.write(line)
+		assert out.buffer
+		assert not out.closed
+		
+		received = b""
+		theirs.setblocking(False)
+		while len(received) < len(b"".join(lines)):
+			poller.poll(0.1)
+			try:
+				received += theirs.recv(65536)
+			except socket.error:
+				pass
+		assert received == b"".join(lines)
+		assert not out.buffer
+	
+	
+	def test_disconnect(self):
+		"""
+		Tests if client that doesn't read anything is disconnected
+		instead of buffering data forever and if write to closed
+		connection doesn't fail.
+		"""
+		poller = Poller()
+		ours, theirs = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+		out = ClientOutput(ours, poller)
+		while not out.closed:
+			out.write(b"x" * 4096)
+		assert not out.buffer
+		theirs.close()
+		out.write(b"x")
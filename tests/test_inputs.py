@@ -112,6 +112,47 @@ class TestInputs(object):
 		assert Keys.KEY_ENTER not in mapper.keyboard.pressed
 	
 	
+	@input_test
+	def test_profile_modified(self, mapper):
+		"""
+		Tests if action replaced in profile is used once mapper is notified,
+		as mapper dispatches input using compiled profile.
+		"""
+		mapper.profile.buttons[SCButtons.A] = (parser
+			.restart("button(Keys.KEY_ENTER)")).parse()
+		state = ZERO_STATE._replace(buttons=SCButtons.A | SCButtons.B)
+		mapper.input(mapper.controller, ZERO_STATE, state)
+		assert mapper.keyboard.pressed == set([ Keys.KEY_ENTER ])
+		mapper.input(mapper.controller, state, ZERO_STATE)
+		assert not mapper.keyboard.pressed
+		
+		mapper.profile.buttons[SCButtons.A] = (parser
+			.restart("button(Keys.KEY_ESC)")).parse()
+		mapper.profile.buttons[SCButtons.B] = (parser
+			.restart("button(Keys.KEY_TAB)")).parse()
+		mapper.profile_modified()
+		mapper.input(mapper.controller, ZERO_STATE, state)
+		assert mapper.keyboard.pressed == set([ Keys.KEY_ESC, Keys.KEY_TAB ])
+		mapper.input(mapper.controller, state, ZERO_STATE)
+		assert not mapper.keyboard.pressed
+	
+	
+	@input_test
+	def test_profile_listener_removed(self, mapper):
+		"""
+		Tests if every profile listener is called when one of them removes
+		itself while being notified.
+		"""
+		called = []
+		def detach(m):
+			called.append(detach)
+			m.remove_profile_listener(detach)
+		mapper.add_profile_listener(detach)
+		mapper.add_profile_listener(called.append)
+		mapper.profile_modified()
+		assert called == [ detach, mapper ]
+	
+	
 	@input_test
 	def test_trackball(self, mapper):
 		"""
@@ -0,0 +1,37 @@
+from scc.native_mapper import NativeMapper
+from scc.constants import SCButtons, LEFT
+from scc.parser import ActionParser
+from scc.profile import Profile
+
+parser = ActionParser()
+
+
+class TestNativeMapper(object):
+	
+	def test_shared_key(self):
+		"""
+		Tests if input is not handled natively when key it presses is also
+		used by action left for fallback mapper.
+		"""
+		profile = Profile(parser)
+		profile.buttons[SCButtons.A] = parser.restart("button(Keys.KEY_ENTER)").parse()
+		profile.buttons[SCButtons.B] = parser.restart("button(Keys.KEY_TAB)").parse()
+		profile.buttons[SCButtons.X] = parser.restart(
+			"button(Keys.KEY_Q); button(Keys.KEY_ENTER)").parse()
+		profile.buttons[SCButtons.LPAD] = parser.restart("button(Keys.KEY_W)").parse()
+		profile.buttons[SCButtons.Y] = parser.restart("button(Keys.KEY_W)").parse()
+		profile.pads[LEFT] = parser.restart("dpad(button(Keys.KEY_UP), "
+			"button(Keys.KEY_DOWN), button(Keys.KEY_LEFT), button(Keys.KEY_Q))").parse()
+		
+		candidates = []
+		NativeMapper._add(candidates, LEFT, profile.pads[LEFT],
+			lambda a: [ NativeMapper._output(x) for x in a.actions ], profile.pads[LEFT])
+		for button, action in profile.buttons.items():
+			NativeMapper._add(candidates, button, action, NativeMapper._output, action)
+		names = [ c[0] for c in NativeMapper._exclude_shared_keys(profile, candidates) ]
+		
+		# Enter and Q are used by macro on X, so A and pad are left for python
+		assert SCButtons.A not in names and LEFT not in names
+		assert SCButtons.B in names
+		# Pad press goes with pad and Y shares key with it
+		assert SCButtons.LPAD not in names and SCButtons.Y not in names
@@ -0,0 +1,42 @@
+from scc.profile_cache import ProfileCache
+import os, shutil, tempfile
+
+PROFILE = "default_profiles/Desktop.sccprofile"
+
+
+class TestProfileCache(object):
+
+	def test_never_same_profile(self):
+		"""
+		Tests if cache parses profile ahead and never returns same instance.
+		"""
+		cache = ProfileCache()
+		cache.prewarm([ PROFILE ])
+		cache.wait()
+		p1 = cache.load(PROFILE)
+		assert cache.hits == 1
+		cache.wait()
+		p2 = cache.load(PROFILE)
+		assert cache.hits == 2
+		assert p1 is not p2
+		assert p1.buttons is not p2.buttons
+		cache.wait()
+	
+	
+	def test_modified(self):
+		"""
+		Tests if modified file is parsed again.
+		"""
+		tmp = tempfile.mktemp(suffix=".sccprofile")
+		shutil.copy(PROFILE, tmp)
+		try:
+			cache = ProfileCache()
+			cache.prewarm([ tmp ])
+			cache.wait()
+			file(tmp, "a").write("\n")
+			cache.load(tmp)
+			assert cache.hits == 0
+			assert cache.misses == 1
+			cache.wait()
+		finally:
+			os.unlink(tmp)
@@ -0,0 +1,116 @@
+from scc.scheduler import Scheduler
+import threading, time
+
+class TestScheduler(object):
+
+	def test_order(self):
+		"""
+		Tests if tasks are executed in order of their time.
+		"""
+		_time, now = time.time, time.time()
+		time.time = lambda: now
+		try:
+			s, called = Scheduler(), []
+			for delay in (0.3, -0.1, 0.1, -0.3, 0.2, -0.2):
+				s.schedule(delay, called.append, delay)
+			s.run()
+			assert called == [ -0.3, -0.2, -0.1 ]
+			now += 1.0
+			s.run()
+			assert called == [ -0.3, -0.2, -0.1, 0.1, 0.2, 0.3 ]
+			assert len(s) == 0
+		finally:
+			time.time = _time
+	
+	
+	def test_cancel(self):
+		"""
+		Tests if canceled tasks are not executed, using both ways to cancel.
+		"""
+		s, called = Scheduler(), []
+		tasks = [ s.schedule(-1.0 + i * 0.01, called.append, i) for i in xrange(10) ]
+		assert s.cancel_task(tasks[0])
+		assert not s.cancel_task(tasks[0])
+		tasks[5].cancel()
+		assert len(s) == 8
+		s.run()
+		assert called == [ 1, 2, 3, 4, 6, 7, 8, 9 ]
+		assert not s.cancel_task(tasks[1])
+	
+	
+	def test_compact(self):
+		"""
+		Tests if heap stays usable after many tasks are canceled.
+		"""
+		s, called = Scheduler(), []
+		tasks = [ s.schedule(-1.0, called.append, i) for i in xrange(Scheduler.COMPACT_THRESHOLD * 3) ]
+		for t in tasks[1:]:
+			s.cancel_task(t)
+		assert len(s._heap) < Scheduler.COMPACT_THRESHOLD * 2
+		s.run()
+		assert called == [ 0 ]
+	
+	
+	def test_other_thread(self):
+		"""
+		Tests if task scheduled from other thread is executed by main thread.
+		"""
+		s, called = Scheduler(), []
+		t = threading.Thread(target=lambda: s.schedule(-1.0, called.append, 1))
+		t.start()
+		t.join()
+		assert len(s) == 1
+		s.run()
+		assert called == [ 1 ]
+	
+	
+	def test_jitter(self):
+		"""
+		Tests if delay of executed tasks is recorded in histogram.
+		"""
+		_time, now = time.time, time.time()
+		time.time = lambda: now
+		try:
+			s = Scheduler()
+			s.schedule(0.0, lambda: None)
+			s.schedule(-0.0003, lambda: None)
+			s.schedule(-1.0, lambda: None)
+			s.run()
+			hist = dict(s.get_jitter_histogram())
+			assert hist[0.00005] == 1
+			assert hist[0.0005] == 1
+			assert hist[float("inf")] == 1
+			assert sum(hist.values()) == 3
+		finally:
+			time.time = _time
+	
+	
+	def test_precise(self):
+		"""
+		Tests if task is executed by timerfd registered with poller.
+		"""
+		from scc.poller import Poller
+		p, s, called = Poller(), Scheduler(), []
+		assert s.enable_precise(p)
+		task = s.schedule(0.05, called.append, 1)
+		while not called and time.time() < task.time + 1.0:
+			p.poll(None)
+		assert called == [ 1 ]
+		assert time.time() >= task.time
+	
+	
+	def test_reschedule(self):
+		"""
+		Tests if run() returns when callback reschedules itself with delay
+		shorter than time it takes.
+		"""
+		s, called = Scheduler(), []
+		def cb():
+			called.append(1)
+			time.sleep(0.002)
+			if len(called) < 100:
+				s.schedule(0.001, cb)
+		s.schedule(0.0, cb)
+		s.run()
+		assert called == [ 1 ]
+		assert len(s) == 1
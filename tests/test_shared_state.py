@@ -0,0 +1,100 @@
+from scc.shared_state import SharedState, SharedStateReader, remove_stale
+from scc.constants import SCButtons, ControllerFlags
+from scc.native_mapper import ControllerInput
+from collections import namedtuple
+import os, shutil, tempfile, subprocess
+
+SCInput = namedtuple('SCInput', 'buttons ltrig rtrig stick_x stick_y '
+	'lpad_x lpad_y rpad_x rpad_y gpitch groll gyaw q1 q2 q3 q4')
+ZERO = SCInput(*[ 0 ] * len(SCInput._fields))
+
+
+class TestSharedState(object):
+
+	def setup_method(self, method):
+		self.old = os.environ.get("XDG_RUNTIME_DIR")
+		os.environ["XDG_RUNTIME_DIR"] = self.tmp = tempfile.mkdtemp()
+	
+	
+	def teardown_method(self, method):
+		shutil.rmtree(self.tmp)
+		if self.old is None:
+			del os.environ["XDG_RUNTIME_DIR"]
+		else:
+			os.environ["XDG_RUNTIME_DIR"] = self.old
+	
+	
+	def test_read_written(self):
+		"""
+		Tests if reader gets what was written, including values that
+		don't fit and stick split from left pad.
+		"""
+		writer = SharedState("test0", 0)
+		reader = SharedStateReader("test0")
+		writer.write(ZERO._replace(buttons=SCButtons.A | SCButtons.LPADTOUCH,
+			rtrig=255, lpad_x=-32768, rpad_y=32767, q4=40000))
+		state = reader.read()
+		assert state.buttons == SCButtons.A | SCButtons.LPADTOUCH
+		assert state.rtrig == 255
+		assert (state.lpad_x, state.stick_x) == (-32768, 0)
+		assert state.rpad_y == 32767
+		assert state.q4 == 32767
+		assert state.rstick_x == 0
+		
+		writer.write(ZERO._replace(lpad_x=100))
+		state = reader.read()
+		assert (state.lpad_x, state.stick_x) == (0, 100)
+	
+	
+	def test_controller_input(self):
+		"""
+		Tests if ControllerInput structure, which remotepad publishes
+		before inputs handled natively are masked, can be written.
+		"""
+		writer = SharedState("test0", ControllerFlags.SEPARATE_STICK)
+		reader = SharedStateReader("test0")
+		writer.write(ControllerInput(buttons=SCButtons.B, ltrig=255, dpad_x=-5))
+		state = reader.read()
+		assert state.buttons == SCButtons.B
+		assert (state.ltrig, state.dpad_x) == (255, -5)
+	
+	
+	def test_closed(self):
+		"""
+		Tests if reader of replaced file notices that controller was
+		disconnected and if new file is not removed with old one.
+		"""
+		old = SharedState("test0", ControllerFlags.SEPARATE_STICK)
+		reader = SharedStateReader("test0")
+		old.write(ZERO._replace(lpad_x=100))
+		assert reader.read().lpad_x == 100
+		new = SharedState("test0", ControllerFlags.SEPARATE_STICK)
+		old.close()
+		assert reader.read() is None
+		assert os.path.exists(new.path)
+		assert SharedStateReader("test0").read().lpad_x == 0
+		new.close()
+		assert not os.path.exists(new.path)
+	
+	
+	def test_stale(self):
+		"""
+		Tests if state left behind by daemon that is not running anymore
+		is not read as live and if it's removed by remove_stale.
+		"""
+		writer = SharedState("test0", ControllerFlags.SEPARATE_STICK)
+		reader = SharedStateReader("test0")
+		writer.write(ZERO._replace(lpad_x=100))
+		assert reader.read().lpad_x == 100
+		# PID of process that already exited
+		p = subprocess.Popen([ "true" ])
+		p.wait()
+		writer.header.pid = p.pid
+		assert reader.read() is None
+		try:
+			SharedStateReader("test0")
+			assert False, "Stale state opened"
+		except OSError:
+			pass
+		remove_stale()
+		assert not os.path.exists(writer.path)
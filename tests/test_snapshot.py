@@ -0,0 +1,126 @@
+from scc.snapshot import SnapshotEncoder, SnapshotDecoder
+from scc.constants import SCButtons, STICKTILT, ControllerFlags
+from scc.drivers.fake import FakeController
+from scc.sccdaemon import Subscription
+from scc.scheduler import Scheduler
+from collections import namedtuple
+import time
+
+SCInput = namedtuple('SCInput', 'buttons ltrig rtrig stick_x stick_y '
+	'lpad_x lpad_y rpad_x rpad_y gpitch groll gyaw q1 q2 q3 q4')
+ZERO = SCInput(*[ 0 ] * len(SCInput._fields))
+
+
+class TestSnapshot(object):
+
+	def test_only_changes(self):
+		"""
+		Tests if first snapshot carries everything, next ones only what
+		changed and if nothing is sent when state didn't change.
+		"""
+		encoder, decoder = SnapshotEncoder(), SnapshotDecoder()
+		state = ZERO._replace(buttons=SCButtons.A, rpad_x=-300, rpad_y=1200)
+		full = encoder.encode(state)
+		assert len(decoder.decode(full)) == 22
+		assert decoder.state.buttons == SCButtons.A
+		assert decoder.state.rpad_x == -300
+		assert decoder.state.rstick_x == 0
+		
+		assert encoder.encode(state) is None
+		data = encoder.encode(state._replace(rpad_x=100))
+		assert len(data) < len(full)
+		assert decoder.decode(data) == [ "rpad_x" ]
+		assert decoder.state.rpad_x == 100
+		assert decoder.state.rpad_y == 1200
+	
+	
+	def test_shared_stick(self):
+		"""
+		Tests if stick and left pad sharing axes are split
+		when controller doesn't report them separately.
+		"""
+		encoder, decoder = SnapshotEncoder(separate_stick=False), SnapshotDecoder()
+		decoder.decode(encoder.encode(ZERO._replace(lpad_x=1000, lpad_y=2000)))
+		assert decoder.state[3:7] == (1000, 2000, 0, 0)
+		
+		decoder.decode(encoder.encode(ZERO._replace(
+			buttons=SCButtons.LPADTOUCH, lpad_x=5, lpad_y=6)))
+		assert decoder.state[3:7] == (0, 0, 5, 6)
+		
+		decoder.decode(encoder.encode(ZERO._replace(
+			buttons=SCButtons.LPADTOUCH | STICKTILT, lpad_x=7, lpad_y=8)))
+		assert decoder.state[3:7] == (7, 8, 5, 6)
+		assert decoder.state.buttons == SCButtons.LPADTOUCH
+		
+		decoder.decode(encoder.encode(ZERO._replace(buttons=SCButtons.LPAD)))
+		assert decoder.state.buttons == SCButtons.STICKPRESS
+	
+	
+	def test_subscription(self):
+		"""
+		Tests if subscription coalesces inputs to requested rate.
+		"""
+		class FakeMapper(object):
+			state = ZERO
+			def get_controller(self): return controller
+		
+		class FakeClient(object):
+			mapper = FakeMapper()
+			class wfile(object):
+				data = []
+				@staticmethod
+				def write(data): FakeClient.wfile.data.append(data)
+		
+		controller = FakeController(0)
+		controller.flags = ControllerFlags.SEPARATE_STICK
+		scheduler, decoder = Scheduler(), SnapshotDecoder()
+		s = Subscription(FakeClient(), scheduler, 20)
+		end = time.time() + 0.5
+		i = 0
+		while time.time() < end:
+			i += 1
+			FakeClient.mapper.state = ZERO._replace(stick_x=i)
+			scheduler.update_time()
+			scheduler.run()
+			time.sleep(0.001)
+		s.cancel()
+		
+		frames = FakeClient.wfile.data
+		assert 5 < len(frames) <= 12
+		assert all(x.startswith(b"Snapshot: fake0 ") for x in frames)
+		header, data = frames[-1].split(b"\n", 1)
+		assert int(header.split(b" ")[-1]) == len(data)
+		for x in frames:
+			decoder.decode(x.split(b"\n", 1)[1])
+		assert 0 < decoder.state.stick_x <= i
+	
+	
+	def test_unmasked_input(self):
+		"""
+		Tests if subscription sends input read by controller instead of state
+		mapper got, when controller masks out inputs handled natively.
+		"""
+		class FakeMapper(object):
+			state = ZERO
+			def get_controller(self): return controller
+		
+		class FakeClient(object):
+			mapper = FakeMapper()
+			class wfile(object):
+				data = []
+				@staticmethod
+				def write(data): FakeClient.wfile.data.append(data)
+		
+		class NativeController(FakeController):
+			def get_input(self):
+				return ZERO._replace(buttons=SCButtons.A, ltrig=255)
+		
+		controller = NativeController(0)
+		controller.flags = ControllerFlags.SEPARATE_STICK
+		scheduler, decoder = Scheduler(), SnapshotDecoder()
+		s = Subscription(FakeClient(), scheduler, 20)
+		scheduler.run()
+		s.cancel()
+		decoder.decode(FakeClient.wfile.data[0].split(b"\n", 1)[1])
+		assert decoder.state.buttons == SCButtons.A
+		assert decoder.state.ltrig == 255
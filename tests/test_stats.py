@@ -0,0 +1,100 @@
+from scc.drivers.fake import FakeController
+from scc.constants import SCButtons
+from scc.stats import Instrumentation, Histogram, BUCKETS
+from scc.parser import ActionParser
+from scc.scheduler import Scheduler
+from scc.profile import Profile
+from scc.mapper import Mapper
+from collections import namedtuple
+
+FakeControllerInput = namedtuple('FakeControllerInput',
+	'buttons ltrig rtrig stick_x stick_y lpad_x lpad_y rpad_x rpad_y '
+	'gpitch groll gyaw q1 q2 q3 q4 '
+)
+ZERO_STATE = FakeControllerInput( *[0] * len(FakeControllerInput._fields) )
+
+
+def make_mapper():
+	parser = ActionParser()
+	profile = Profile(parser)
+	profile.buttons[SCButtons.A] = parser.restart("button(KEY_A)").parse()
+	profile.stick = parser.restart("XY(axis(ABS_X), axis(ABS_Y))").parse()
+	scheduler = Scheduler()
+	mapper = Mapper(profile, scheduler, keyboard=False, mouse=False, gamepad=False)
+	mapper.set_controller(FakeController(0))
+	return mapper, scheduler
+
+
+class TestStats(object):
+
+	def test_histogram(self):
+		"""
+		Tests if values are sorted into correct buckets.
+		"""
+		h = Histogram()
+		for us in (1, 5, 6, 1000000):
+			h.add(us)
+		assert h.counts[0] == 2
+		assert h.counts[1] == 1
+		assert h.counts[-1] == 1
+		assert h.count == 4
+		assert h.max == 1000000
+		assert len(h.to_dict()['counts']) == len(BUCKETS)
+	
+	
+	def test_measure(self):
+		"""
+		Tests if enabled instrumentation measures stages and actions.
+		"""
+		mapper, scheduler = make_mapper()
+		stats = Instrumentation(scheduler)
+		stats.enable([ mapper ])
+		pressed = ZERO_STATE._replace(buttons=SCButtons.A, lpad_x=1000)
+		mapper.input(mapper.get_controller(), ZERO_STATE, pressed)
+		mapper.input(mapper.get_controller(), pressed, ZERO_STATE)
+		c = stats.dump()['controllers']['fake0']
+		assert c['reports'] == 2
+		for stage in ("input", "scheduler", "generate_events", "sync",
+				"A.button_press", "A.button_release", "STICK.whole"):
+			assert c['stages'][stage]['count'] > 0, stage
+		assert "B.button_press" not in c['stages']
+		assert stats.dump()['scheduler']['run']['count'] == 2
+		
+		stats.reset()
+		mapper.input(mapper.get_controller(), ZERO_STATE, pressed)
+		c = stats.dump()['controllers']['fake0']
+		assert c['reports'] == 1
+		assert c['stages']['input']['count'] == 1
+	
+	
+	def test_disable(self):
+		"""
+		Tests if disabling instrumentation removes every wrapper.
+		"""
+		mapper, scheduler = make_mapper()
+		action = mapper.profile.buttons[SCButtons.A]
+		stats = Instrumentation(scheduler)
+		stats.enable([ mapper ])
+		assert "input" in mapper.__dict__
+		assert "button_press" in action.__dict__
+		stats.disable()
+		for name in ("input", "generate_events", "sync", "generate_feedback"):
+			assert name not in mapper.__dict__
+		assert "run" not in scheduler.__dict__
+		assert "button_press" not in action.__dict__
+		assert stats.dump()['controllers'] == {}
+	
+	
+	def test_profile_change(self):
+		"""
+		Tests if actions are re-wrapped when profile changes.
+		"""
+		mapper, scheduler = make_mapper()
+		old = mapper.profile.buttons[SCButtons.A]
+		stats = Instrumentation(scheduler)
+		stats.enable([ mapper ])
+		profile = Profile(ActionParser())
+		profile.buttons[SCButtons.B] = ActionParser().restart("button(KEY_B)").parse()
+		mapper.set_profile(profile)
+		assert "button_press" not in old.__dict__
+		assert "button_press" in profile.buttons[SCButtons.B].__dict__
@@ -0,0 +1,55 @@
+from scc.uinput import Keyboard, InputEvent, Keys, Scans, EVENT_BUFFER_SIZE
+from scc.uinput import EV_SYN, EV_KEY, EV_MSC
+import ctypes
+
+
+def create_keyboard():
+	""" Creates Keyboard that records what would be written to device """
+	k = Keyboard.__new__(Keyboard)
+	k._lib, k._fd, k._ff = None, -1, None
+	k._events = (InputEvent * EVENT_BUFFER_SIZE)()
+	k._event_count = 0
+	k._dirty = False
+	k._pressed = set()
+	k.writes = []
+	def write_events(fd, events, count):
+		k.writes.append([ (e.type, e.code, e.value) for e in events[0:count] ])
+	k._write_events = write_events
+	return k
+
+
+class TestUInput(object):
+
+	def test_keyboard_sync(self):
+		"""
+		Tests if keyboard events are written only by synEvent,
+		all with one write.
+		"""
+		k = create_keyboard()
+		k.pressEvent([ Keys.KEY_A, Keys.KEY_B ])
+		k.releaseEvent([ Keys.KEY_C ])
+		assert k.writes == []
+		k.synEvent()
+		assert len(k.writes) == 1
+		assert [ e[0] for e in k.writes[0] ] == [ EV_MSC, EV_KEY, EV_MSC, EV_KEY, EV_SYN ]
+		k.synEvent()
+		assert len(k.writes) == 1
+	
+	
+	def test_keyboard_full_buffer(self):
+		"""
+		Tests if report is terminated when buffer fills, but never
+		between scan code and key event.
+		"""
+		k = create_keyboard()
+		keys = [ x for x in Keys if x in Scans ][0:EVENT_BUFFER_SIZE]
+		k.pressEvent(keys)
+		k.synEvent()
+		assert len(k.writes) > 1
+		for events in k.writes:
+			assert events[-1][0] == EV_SYN
+			assert len([ e for e in events if e[0] == EV_MSC ]) == len(events) / 2
+			for i in xrange(0, len(events) - 1, 2):
+				assert events[i][0] == EV_MSC and events[i + 1][0] == EV_KEY
+		pressed = [ e[1] for events in k.writes for e in events if e[0] == EV_KEY ]
+		assert pressed == keys
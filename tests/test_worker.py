@@ -0,0 +1,124 @@
+from scc.worker import InputRing, WorkerMapper, WorkerInput, ZERO_STATE
+from scc.drivers.evdevdrv import EvdevController
+from scc.drivers.fake import FakeController
+from scc.scheduler import Scheduler
+from scc.constants import SCButtons
+from scc.poller import Poller
+from collections import namedtuple
+import os, json, time, tempfile
+
+# Report without fields that only some controllers have
+ShortInput = namedtuple('ShortInput', 'buttons ltrig rtrig stick_x stick_y')
+InputEvent = namedtuple('InputEvent', 'type code value')
+
+
+class FakeDaemon(object):
+	""" Provides just enough for WorkerMapper """
+	def __init__(self):
+		self.poller = Poller()
+		self.scheduler = Scheduler()
+		self.on_exit_cbs = []
+		self.osd = []
+	
+	def get_poller(self):
+		return self.poller
+	
+	def get_scheduler(self):
+		return self.scheduler
+	
+	def add_on_exit(self, fn):
+		self.on_exit_cbs.append(fn)
+	
+	def on_sa_osd(self, mapper, action):
+		self.osd.append(action.text)
+
+
+class TestWorker(object):
+
+	def test_ring(self):
+		"""
+		Tests if reports go through ring unchanged, missing fields are
+		zeroed and reports that don't fit are dropped.
+		"""
+		fd, path = tempfile.mkstemp()
+		os.unlink(path)
+		producer, consumer = InputRing(fd, create=True), InputRing(fd)
+		os.close(fd)
+		state = WorkerInput(*range(1, len(WorkerInput._fields) + 1))
+		assert producer.push(state)
+		assert producer.push(ShortInput(SCButtons.A, 1, 2, -3, 4))
+		assert consumer.pop_all() == [ state,
+			ZERO_STATE._replace(buttons=SCButtons.A, ltrig=1, rtrig=2, stick_x=-3, stick_y=4) ]
+		assert consumer.pop_all() == []
+		
+		for i in xrange(InputRing.SIZE):
+			assert producer.push(ZERO_STATE._replace(stick_x=i))
+		assert not producer.push(ZERO_STATE)
+		assert [ x.stick_x for x in consumer.pop_all() ] == range(InputRing.SIZE)
+	
+	
+	def test_worker_process(self):
+		"""
+		Tests if input reaches mapper in worker process and if special
+		action is sent back to daemon.
+		"""
+		profile = tempfile.mktemp(suffix=".sccprofile")
+		file(profile, "w").write(json.dumps({
+			"buttons" : { "A" : { "action" : "osd('hello')" } } }))
+		daemon = FakeDaemon()
+		mapper = WorkerMapper(daemon)
+		mapper.set_special_actions_handler(daemon)
+		try:
+			controller = FakeController(0)
+			mapper.set_controller(controller)
+			mapper.profile.load(profile).compress()
+			mapper.profile_modified()
+			# Input is not synchronized with profile change, so button
+			# is pressed until worker loads profile and reports OSD action
+			state = ZERO_STATE._replace(buttons=SCButtons.A)
+			start = time.time()
+			while not daemon.osd and time.time() - start < 10:
+				mapper.input(controller, ZERO_STATE, state)
+				mapper.input(controller, state, ZERO_STATE)
+				daemon.poller.poll(0.1)
+			assert daemon.osd[0] == "hello"
+		finally:
+			for fn in daemon.on_exit_cbs:
+				fn(daemon)
+			os.unlink(profile)
+	
+	
+	def test_evdev_controller(self):
+		"""
+		Tests if evdev controller, which schedules and cancels tasks on its
+		mapper to emulate pad touch, works with WorkerMapper.
+		"""
+		class FakeDevice(object):
+			events = []
+			def read(self):
+				rv, FakeDevice.events = FakeDevice.events, []
+				return rv
+		
+		daemon = FakeDaemon()
+		mapper = WorkerMapper(daemon)
+		try:
+			# Without evdev module, ecodes are just their names
+			controller = EvdevController(None, FakeDevice(), None, { "axes" : {
+				"0" : { "axis" : "lpad_x" }, "3" : { "axis" : "rpad_x" } } })
+			controller.set_mapper(mapper)
+			mapper.set_controller(controller)
+			# Touching other pad while emulated touch of first one is
+			# scheduled to be released cancels and reschedules that task
+			for code in (0, 3):
+				FakeDevice.events = [ InputEvent("EV_ABS", code, 100),
+					InputEvent("EV_ABS", code, 0) ]
+				controller.input()
+			touch = SCButtons.LPADTOUCH | SCButtons.RPADTOUCH
+			assert mapper.state.buttons & touch == touch
+			time.sleep(EvdevController.PADPRESS_EMULATION_TIMEOUT + 0.05)
+			daemon.scheduler.update_time()
+			daemon.scheduler.run()
+			assert mapper.state.buttons & touch == 0
+		finally:
+			for fn in daemon.on_exit_cbs:
+				fn(daemon)